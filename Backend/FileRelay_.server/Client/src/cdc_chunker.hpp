@@ -0,0 +1,243 @@
+#pragma once
+
+#include "chunker.hpp"
+#include "compressor.hpp"
+#include "watcher.hpp"
+#include "common/bytes.hpp"
+#include "common/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sv::client {
+
+namespace detail {
+
+// Gear table for the rolling fingerprint. It is derived from a fixed seed so every client build cuts
+// identical content at identical offsets; changing it would defeat deduplication against chunks the
+// server already stores.
+consteval std::array<std::uint64_t, 256> make_gear_table()
+{
+    std::array<std::uint64_t, 256> table{};
+    std::uint64_t state = 0x5356'4344'4331'0001ULL;
+    for (auto& entry : table)
+    {
+        // splitmix64
+        state += 0x9E37'79B9'7F4A'7C15ULL;
+        std::uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58'476D'1CE4'E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D0'49BB'1331'11EBULL;
+        entry = z ^ (z >> 31);
+    }
+    return table;
+}
+
+inline constexpr auto gear_table = make_gear_table();
+
+}  // namespace detail
+
+// One content-defined chunk of the uncompressed file.
+struct ChunkSpan
+{
+    std::uint64_t offset{0};
+    std::size_t length{0};
+    sv::common::protocol::ChunkHash hash{};
+};
+
+struct ChunkRecipe
+{
+    std::vector<ChunkSpan> chunks;
+    std::string sha256_hex;
+
+    [[nodiscard]] std::vector<sv::common::protocol::ChunkHash> hashes() const
+    {
+        std::vector<sv::common::protocol::ChunkHash> result;
+        result.reserve(chunks.size());
+        for (const auto& chunk : chunks)
+        {
+            result.push_back(chunk.hash);
+        }
+        return result;
+    }
+};
+
+// FastCDC-style chunking: a gear hash rolls over the uncompressed bytes and a chunk ends where the
+// fingerprint's top bits are zero. Cut points depend only on nearby content, so an insertion shifts
+// the boundaries around it and leaves every other chunk, and its hash, unchanged. Normalized chunking
+// uses a stricter mask before the average size and a looser one after it, which keeps chunk sizes
+// close to the average. Chunks are at least average/4 and at most average*4 bytes.
+class ContentDefinedChunker
+{
+public:
+    static constexpr std::size_t min_average_size = 64 * 1024;
+    static constexpr std::size_t max_average_size = 16 * 1024 * 1024;
+
+    explicit ContentDefinedChunker(std::size_t average_size = 1024 * 1024)
+        : average_size_(std::bit_floor(std::clamp(average_size, min_average_size, max_average_size)))
+        , min_size_(average_size_ / 4)
+        , max_size_(average_size_ * 4)
+    {
+        const auto bits = std::countr_zero(average_size_);
+        strict_mask_ = top_bits(bits + 2);
+        loose_mask_ = top_bits(bits - 2);
+    }
+
+    [[nodiscard]] std::size_t average_size() const noexcept { return average_size_; }
+    [[nodiscard]] std::size_t min_size() const noexcept { return min_size_; }
+    [[nodiscard]] std::size_t max_size() const noexcept { return max_size_; }
+
+    // Length of the chunk starting at data[0]. `data` must hold max_size() bytes unless the file ends
+    // sooner.
+    [[nodiscard]] std::size_t cut(std::span<const std::uint8_t> data) const noexcept
+    {
+        if (data.size() <= min_size_)
+        {
+            return data.size();
+        }
+        const auto limit = std::min(data.size(), max_size_);
+        const auto normal = std::min(limit, average_size_);
+
+        std::uint64_t fingerprint = 0;
+        std::size_t i = min_size_;
+        for (; i < normal; ++i)
+        {
+            fingerprint = (fingerprint << 1) + detail::gear_table[data[i]];
+            if ((fingerprint & strict_mask_) == 0)
+            {
+                return i + 1;
+            }
+        }
+        for (; i < limit; ++i)
+        {
+            fingerprint = (fingerprint << 1) + detail::gear_table[data[i]];
+            if ((fingerprint & loose_mask_) == 0)
+            {
+                return i + 1;
+            }
+        }
+        return limit;
+    }
+
+    // First pass: splits the file and hashes every chunk and the whole file, without compressing.
+    [[nodiscard]] ChunkRecipe scan(const FileDescriptor& descriptor) const
+    {
+        std::ifstream file(descriptor.path, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file for chunking: " + descriptor.path.string());
+        }
+
+        ChunkRecipe recipe;
+        sv::common::bytes::Sha256 file_sha;
+        // Twice the largest chunk, so the unconsumed tail only moves once per max_size() bytes.
+        std::vector<std::uint8_t> buffer(max_size_ * 2);
+        std::size_t begin = 0;
+        std::size_t end = 0;
+        std::uint64_t offset = 0;
+        bool eof = false;
+
+        while (true)
+        {
+            if (!eof && end - begin < max_size_)
+            {
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+                while (!eof && end < buffer.size())
+                {
+                    file.read(reinterpret_cast<char*>(buffer.data() + end), static_cast<std::streamsize>(buffer.size() - end));
+                    const auto read = static_cast<std::size_t>(file.gcount());
+                    file_sha.update(buffer.data() + end, read);
+                    end += read;
+                    eof = !file;
+                }
+                if (file.bad())
+                {
+                    throw std::runtime_error("Failed while reading file for chunking: " + descriptor.path.string());
+                }
+            }
+            if (begin == end)
+            {
+                break;
+            }
+
+            const auto data = std::span<const std::uint8_t>(buffer.data() + begin, end - begin);
+            const auto length = cut(data);
+            recipe.chunks.push_back(ChunkSpan{offset, length, sv::common::bytes::sha256(data.first(length))});
+            begin += length;
+            offset += length;
+        }
+
+        recipe.sha256_hex = Compressor::to_hex(file_sha.finish());
+        return recipe;
+    }
+
+    // Second pass: compresses each chunk at `indices` into its own zstd frame and hands it to `sink`
+    // as patch `index` of recipe.chunks.size(). Throws when the file no longer matches the recipe.
+    // Returns false when `sink` refused a chunk.
+    template <typename Sink>
+    bool emit(const Compressor& compressor,
+              const std::shared_ptr<const FileMetadata>& metadata,
+              const ChunkRecipe& recipe,
+              const std::vector<std::uint32_t>& indices,
+              Sink&& sink) const
+    {
+        std::ifstream file(metadata->descriptor.path, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file for compression: " + metadata->descriptor.path.string());
+        }
+
+        std::vector<std::uint8_t> content;
+        for (std::size_t position = 0; position < indices.size(); ++position)
+        {
+            const auto& span = recipe.chunks.at(indices[position]);
+            content.resize(span.length);
+            file.seekg(static_cast<std::streamoff>(span.offset));
+            file.read(reinterpret_cast<char*>(content.data()), static_cast<std::streamsize>(content.size()));
+            if (static_cast<std::size_t>(file.gcount()) != content.size() ||
+                sv::common::bytes::sha256(std::span<const std::uint8_t>(content)) != span.hash)
+            {
+                throw std::runtime_error("File changed while uploading: " + metadata->descriptor.path.string());
+            }
+
+            FileChunk chunk{};
+            chunk.file = metadata;
+            chunk.buffer = std::make_shared<const std::vector<std::uint8_t>>(compressor.compress_block(content));
+            chunk.length = chunk.buffer->size();
+            chunk.index = indices[position];
+            chunk.total_chunks = recipe.chunks.size();
+            chunk.final_chunk = position + 1 == indices.size();
+            if (!sink(std::move(chunk)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    static constexpr std::uint64_t top_bits(int count) noexcept
+    {
+        return ~std::uint64_t{0} << (64 - count);
+    }
+
+    std::size_t average_size_;
+    std::size_t min_size_;
+    std::size_t max_size_;
+    std::uint64_t strict_mask_{0};
+    std::uint64_t loose_mask_{0};
+};
+
+}  // namespace sv::client
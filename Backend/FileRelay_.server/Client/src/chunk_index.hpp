@@ -0,0 +1,259 @@
+#pragma once
+
+#include "chunker.hpp"
+#include "common/bytes.hpp"
+#include "common/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <asio.hpp>
+
+namespace sv::client {
+
+struct ChunkIndexOptions
+{
+    std::string host{"data-base0"};
+    std::uint16_t port{9'000};
+    std::chrono::milliseconds timeout{std::chrono::milliseconds{5000}};
+};
+
+// Asks the server what it already holds of a file before its upload starts: which chunks of a
+// content-defined upload it stores, the block signatures of its current copy for a delta upload, or
+// which chunks of an interrupted upload it kept.
+// Queries run over their own data-channel connection: FileMeta and the request frame go out and the
+// server answers with one SystemFrame. The connection is kept for later queries and re-established
+// once when it turns out to be stale. One instance per thread.
+class ChunkIndexClient
+{
+public:
+    explicit ChunkIndexClient(ChunkIndexOptions options) : options_(std::move(options)) {}
+
+    ChunkIndexClient(const ChunkIndexClient&) = delete;
+    ChunkIndexClient& operator=(const ChunkIndexClient&) = delete;
+
+    // Registers the recipe with the server and returns the positions it still needs, in ascending
+    // order. Throws when the server cannot be asked or answers out of turn.
+    std::vector<std::uint32_t> missing_chunks(const FileMetadata& file,
+                                              std::vector<sv::common::protocol::ChunkHash> hashes)
+    {
+        namespace protocol = sv::common::protocol;
+        const auto total = hashes.size();
+        const auto reply = exchange(
+            encode_file_meta_frame(file, total),
+            protocol::SystemMessage{protocol::SystemMessageType::ChunkRecipe,
+                                    protocol::ChunkRecipeMessage{file.file_id, std::move(hashes)}});
+        const auto* missing = std::get_if<protocol::MissingChunksMessage>(&reply.payload);
+        if (!missing || missing->file_id != file.file_id ||
+            std::any_of(missing->indices.begin(), missing->indices.end(), [total](std::uint32_t index) {
+                return index >= total;
+            }))
+        {
+            throw std::runtime_error("Unexpected chunk index reply");
+        }
+        return missing->indices;
+    }
+
+    // Signatures of the server's current copy of the file; no blocks when it has none. A non-empty
+    // answer also tells the server to expect the upload as a delta against that copy.
+    sv::common::protocol::BlockSignaturesMessage block_signatures(const FileMetadata& file, std::uint32_t block_size)
+    {
+        namespace protocol = sv::common::protocol;
+        auto reply = exchange(encode_file_meta_frame(file, 0),
+                              protocol::SystemMessage{protocol::SystemMessageType::SignatureRequest,
+                                                      protocol::SignatureRequestMessage{file.file_id, block_size}});
+        auto* signatures = std::get_if<protocol::BlockSignaturesMessage>(&reply.payload);
+        if (!signatures || signatures->file_id != file.file_id)
+        {
+            throw std::runtime_error("Unexpected block signature reply");
+        }
+        return std::move(*signatures);
+    }
+
+    // Which chunks of `file` the server stores from an earlier, interrupted upload under the same id;
+    // empty when there was none.
+    std::vector<bool> stored_chunks(const FileMetadata& file)
+    {
+        namespace protocol = sv::common::protocol;
+        auto reply = exchange(encode_file_meta_frame(file, 0),
+                              protocol::SystemMessage{protocol::SystemMessageType::ResumeQuery,
+                                                      protocol::ResumeQueryMessage{file.file_id}});
+        auto* stored = std::get_if<protocol::StoredPatchesMessage>(&reply.payload);
+        if (!stored || stored->file_id != file.file_id)
+        {
+            throw std::runtime_error("Unexpected resume reply");
+        }
+        return std::move(stored->stored);
+    }
+
+private:
+    sv::common::protocol::SystemMessage exchange(const std::vector<std::uint8_t>& meta,
+                                                 const sv::common::protocol::SystemMessage& request)
+    {
+        const auto frame = sv::common::protocol::SystemFrame::encode(request);
+        const bool reused = socket_.has_value();
+        auto reply = query(meta, frame);
+        if (!reply && reused)
+        {
+            reply = query(meta, frame);
+        }
+        if (!reply)
+        {
+            throw std::system_error(last_error_, "Query to " + options_.host + ":" + std::to_string(options_.port) +
+                                                     " failed");
+        }
+        return std::move(*reply);
+    }
+
+    std::optional<sv::common::protocol::SystemMessage> query(const std::vector<std::uint8_t>& meta,
+                                                             const std::vector<std::uint8_t>& request)
+    {
+        namespace protocol = sv::common::protocol;
+        if (!socket_ && !connect())
+        {
+            return std::nullopt;
+        }
+
+        const std::array<asio::const_buffer, 2> buffers{asio::buffer(meta), asio::buffer(request)};
+        std::array<std::uint8_t, protocol::SystemFrame::PrefixSize> prefix{};
+        if (!write(buffers) || !read(asio::buffer(prefix)))
+        {
+            return std::nullopt;
+        }
+        const auto body_size = sv::common::bytes::read_u32_le(prefix.data() + 4);
+        if (!protocol::is_magic(prefix, protocol::SystemFrame::Magic) || body_size > protocol::SystemFrame::MaxBodySize)
+        {
+            return fail(asio::error::invalid_argument);
+        }
+        std::vector<std::uint8_t> frame(body_size + protocol::SystemFrame::TrailerSize);
+        if (!read(asio::buffer(frame)))
+        {
+            return std::nullopt;
+        }
+
+        try
+        {
+            return protocol::SystemFrame::decode(frame);
+        }
+        catch (const std::exception&)
+        {
+            return fail(asio::error::invalid_argument);
+        }
+    }
+
+    bool connect()
+    {
+        namespace protocol = sv::common::protocol;
+        asio::error_code ec;
+        asio::ip::tcp::resolver resolver(io_context_);
+        const auto endpoints = resolver.resolve(options_.host, std::to_string(options_.port), ec);
+        if (ec)
+        {
+            fail(ec);
+            return false;
+        }
+
+        socket_.emplace(io_context_);
+        const auto connected = run_with_deadline([&](auto done) {
+            asio::async_connect(*socket_, endpoints, [done](const asio::error_code& error, const auto&) { done(error); });
+        });
+        if (connected)
+        {
+            fail(connected);
+            return false;
+        }
+
+        const auto offer = protocol::VersionHello{}.serialize();
+        std::array<std::uint8_t, protocol::VersionHello::EncodedSize> reply{};
+        if (!write(asio::buffer(offer)) || !read(asio::buffer(reply)))
+        {
+            return false;
+        }
+        const auto answer = protocol::VersionHello::deserialize(reply);
+        if (protocol::VersionHello::negotiate(protocol::VersionHello{}, answer) == 0)
+        {
+            fail(asio::error::no_protocol_option);
+            return false;
+        }
+        return true;
+    }
+
+    template <typename Buffers>
+    bool write(const Buffers& buffers)
+    {
+        const auto ec = run_with_deadline([&](auto done) {
+            asio::async_write(*socket_, buffers, [done](const asio::error_code& error, std::size_t) { done(error); });
+        });
+        if (ec)
+        {
+            fail(ec);
+            return false;
+        }
+        return true;
+    }
+
+    bool read(const asio::mutable_buffer& buffer)
+    {
+        const auto ec = run_with_deadline([&](auto done) {
+            asio::async_read(*socket_, buffer, [done](const asio::error_code& error, std::size_t) { done(error); });
+        });
+        if (ec)
+        {
+            fail(ec);
+            return false;
+        }
+        return true;
+    }
+
+    // Runs one asynchronous operation to completion, closing the socket if it outlives the timeout.
+    template <typename Start>
+    asio::error_code run_with_deadline(Start&& start)
+    {
+        asio::error_code result = asio::error::would_block;
+        asio::steady_timer timer(io_context_);
+        start([&](const asio::error_code& ec) {
+            result = ec;
+            timer.cancel();
+        });
+        timer.expires_after(options_.timeout);
+        timer.async_wait([&](const asio::error_code& ec) {
+            if (!ec)
+            {
+                result = asio::error::timed_out;
+                asio::error_code ignored;
+                socket_->close(ignored);
+            }
+        });
+        io_context_.restart();
+        io_context_.run();
+        return result;
+    }
+
+    std::nullopt_t fail(const asio::error_code& ec)
+    {
+        last_error_ = ec;
+        if (socket_)
+        {
+            asio::error_code ignored;
+            socket_->close(ignored);
+            socket_.reset();
+        }
+        return std::nullopt;
+    }
+
+    ChunkIndexOptions options_;
+    asio::io_context io_context_{};
+    std::optional<asio::ip::tcp::socket> socket_{};
+    asio::error_code last_error_{};
+};
+
+}  // namespace sv::client
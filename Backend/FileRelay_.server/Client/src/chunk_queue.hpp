@@ -0,0 +1,310 @@
+#pragma once
+
+#include "chunker.hpp"
+#include "mpmc_ring.hpp"
+#include "rate_limiter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace sv::client {
+
+enum class ChunkPriority : std::uint8_t
+{
+    Interactive = 0,
+    Normal = 1,
+    Bulk = 2,
+};
+
+struct ChunkQueueOptions
+{
+    // Compressed payload bytes and chunks the queue holds at most; a chunk larger than capacity_bytes
+    // still goes in once the queue is empty.
+    std::size_t capacity_bytes{64 * 1024 * 1024};
+    std::size_t max_chunks{1024};
+    // Chunks of files the classifier deems interactive form the first class; chunks of files of at
+    // least bulk_min_file_size bytes the last one; everything else sits in between.
+    TrafficClassifier classifier{};
+    std::uintmax_t bulk_min_file_size{64ull * 1024 * 1024};
+    // Share of dequeues each class gets while all of them have chunks waiting.
+    std::array<unsigned, 3> weights{8, 4, 1};
+    // While no interactive chunk is waiting, a chunk that waited this long goes out next, whatever its
+    // class.
+    std::chrono::milliseconds max_wait{std::chrono::seconds{2}};
+};
+
+// The send queue. Chunks are sorted into priority classes by their file; classes are served by
+// weighted fair queuing and, within a class, files take turns chunk by chunk, so neither a large file
+// nor a lower class can hold up a small file for long, while a lone large file still gets the whole
+// link. Every class that has chunks waiting gets its weighted share of dequeues, so none starves, and
+// when no interactive chunk is waiting the chunks that waited longer than max_wait go first, oldest
+// first.
+// The queue is bounded by payload bytes as well as by chunks, so its memory stays put whether chunks
+// are a few bytes or megabytes; interactive chunks may exceed both bounds by a quarter so that bulk
+// producers filling the queue do not block them. Producers never take a lock: they reserve their share
+// of the ByteBudget and hand the chunk to their class's MpmcRing. Consumers sort what arrived into the
+// classes under a lock of their own, which only they take. Waiting on either side spins before it
+// parks.
+// Otherwise behaves like BoundedBlockingQueue: push blocks while full, pop blocks while empty, and
+// close() wakes everyone, after which pop drains what is left. size() and capacity() are in bytes.
+class ChunkQueue
+{
+public:
+    explicit ChunkQueue(ChunkQueueOptions options)
+        : options_(std::move(options)),
+          budget_(options_.capacity_bytes, options_.max_chunks),
+          rings_{Ring{budget_.max_reserved_entries()}, Ring{budget_.max_reserved_entries()},
+                 Ring{budget_.max_reserved_entries()}}
+    {
+        for (auto& weight : options_.weights)
+        {
+            weight = std::max(weight, 1u);
+        }
+    }
+
+    ChunkQueue(const ChunkQueue&) = delete;
+    ChunkQueue& operator=(const ChunkQueue&) = delete;
+
+    [[nodiscard]] ChunkPriority classify(const FileChunk& chunk) const
+    {
+        if (options_.classifier.interactive(*chunk.file))
+        {
+            return ChunkPriority::Interactive;
+        }
+        return chunk.file->descriptor.size >= options_.bulk_min_file_size ? ChunkPriority::Bulk : ChunkPriority::Normal;
+    }
+
+    bool push(FileChunk chunk)
+    {
+        const auto priority = classify(chunk);
+        const auto bytes = chunk.length;
+        if (!budget_.acquire(bytes, priority == ChunkPriority::Interactive))
+        {
+            return false;
+        }
+        Entry entry{std::move(chunk), Clock::now(), bytes};
+        auto& ring = rings_[static_cast<std::size_t>(priority)];
+        while (!ring.try_push(entry))
+        {
+            // Cannot last: the budget admits no more chunks than a ring has slots.
+            std::this_thread::yield();
+        }
+        signal_.fetch_add(1, std::memory_order_release);
+        signal_.notify_one();
+        return true;
+    }
+
+    std::optional<FileChunk> pop()
+    {
+        SpinThenPark backoff;
+        for (;;)
+        {
+            const auto seen = signal_.load(std::memory_order_acquire);
+            {
+                std::scoped_lock lock(mutex_);
+                drain_locked();
+                if (staged_ > 0)
+                {
+                    auto entry = take_locked();
+                    budget_.release(entry.bytes);
+                    return std::move(entry.chunk);
+                }
+            }
+            if (take_interrupt())
+            {
+                return std::nullopt;
+            }
+            // A chunk whose push got past the budget before close() is still on its way.
+            if (budget_.closed() && budget_.entries() == 0)
+            {
+                return std::nullopt;
+            }
+            backoff.wait(signal_, seen);
+        }
+    }
+
+    // Makes a pop() waiting on the empty queue, or the next one, return std::nullopt while the queue
+    // stays open, so the consumer can attend to work that arrived elsewhere.
+    void interrupt()
+    {
+        interrupts_.fetch_add(1, std::memory_order_release);
+        wake_all();
+    }
+
+    void close()
+    {
+        budget_.close();
+        wake_all();
+    }
+
+    [[nodiscard]] bool closed() const noexcept { return budget_.closed(); }
+
+    [[nodiscard]] std::size_t size() const noexcept { return budget_.bytes(); }
+
+    [[nodiscard]] std::size_t chunks() const noexcept { return budget_.entries(); }
+
+    [[nodiscard]] std::size_t capacity() const noexcept { return budget_.capacity_bytes(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry
+    {
+        FileChunk chunk;
+        Clock::time_point queued_at;
+        std::size_t bytes{0};
+    };
+
+    using Ring = MpmcRing<Entry>;
+
+    struct Lane
+    {
+        // Each file's chunks in order, and the files in the order they get their next turn.
+        std::unordered_map<std::uint64_t, std::deque<Entry>> files;
+        std::deque<std::uint64_t> turns;
+        std::size_t size{0};
+        // Virtual time of the lane's next turn; advances by its stride on every dequeue.
+        std::uint64_t pass{0};
+    };
+
+    static constexpr std::uint64_t stride_base = 1u << 20;
+    static constexpr std::size_t npos = std::numeric_limits<std::size_t>::max();
+
+    void wake_all()
+    {
+        signal_.fetch_add(1, std::memory_order_release);
+        signal_.notify_all();
+    }
+
+    bool take_interrupt()
+    {
+        auto pending = interrupts_.load(std::memory_order_acquire);
+        while (pending > 0)
+        {
+            if (interrupts_.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Moves the chunks producers handed over into their lanes.
+    void drain_locked()
+    {
+        for (std::size_t index = 0; index < rings_.size(); ++index)
+        {
+            auto& lane = lanes_[index];
+            while (auto entry = rings_[index].try_pop())
+            {
+                if (lane.size == 0)
+                {
+                    // A class that was idle joins at the current virtual time instead of cashing in the
+                    // turns it did not need.
+                    lane.pass = std::max(lane.pass, virtual_time_);
+                }
+                const auto file_id = entry->chunk.file_id();
+                auto& file = lane.files[file_id];
+                if (file.empty())
+                {
+                    lane.turns.push_back(file_id);
+                }
+                file.push_back(std::move(*entry));
+                ++lane.size;
+                ++staged_;
+            }
+        }
+    }
+
+    Entry take_locked()
+    {
+        auto [lane_index, turn] = starving_locked();
+        if (turn == npos)
+        {
+            lane_index = npos;
+            for (std::size_t index = 0; index < lanes_.size(); ++index)
+            {
+                if (lanes_[index].size > 0 && (lane_index == npos || lanes_[index].pass < lanes_[lane_index].pass))
+                {
+                    lane_index = index;
+                }
+            }
+            turn = 0;
+        }
+
+        auto& lane = lanes_[lane_index];
+        const auto file_id = lane.turns[turn];
+        lane.turns.erase(lane.turns.begin() + static_cast<std::ptrdiff_t>(turn));
+        auto& file = lane.files[file_id];
+        auto entry = std::move(file.front());
+        file.pop_front();
+        if (file.empty())
+        {
+            lane.files.erase(file_id);
+        }
+        else
+        {
+            lane.turns.push_back(file_id);
+        }
+
+        virtual_time_ = std::max(virtual_time_, lane.pass);
+        lane.pass += stride_base / options_.weights[lane_index];
+        --lane.size;
+        --staged_;
+        return entry;
+    }
+
+    // The lane and turn of the oldest chunk if it waited max_wait or longer and nothing interactive is
+    // waiting, else {npos, npos}. Only the first chunk of each file can be the oldest, and few files
+    // wait at a time.
+    std::pair<std::size_t, std::size_t> starving_locked() const
+    {
+        if (lanes_[static_cast<std::size_t>(ChunkPriority::Interactive)].size > 0)
+        {
+            return {npos, npos};
+        }
+        const auto deadline = Clock::now() - options_.max_wait;
+        std::pair<std::size_t, std::size_t> oldest{npos, npos};
+        Clock::time_point oldest_at = deadline;
+        for (std::size_t index = 0; index < lanes_.size(); ++index)
+        {
+            const auto& lane = lanes_[index];
+            for (std::size_t turn = 0; turn < lane.turns.size(); ++turn)
+            {
+                const auto queued_at = lane.files.at(lane.turns[turn]).front().queued_at;
+                if (queued_at <= oldest_at)
+                {
+                    oldest = {index, turn};
+                    oldest_at = queued_at;
+                }
+            }
+        }
+        return oldest;
+    }
+
+    ChunkQueueOptions options_;
+    ByteBudget budget_;
+    std::array<Ring, 3> rings_;
+    // Bumped whenever a chunk arrives, the queue closes or a pop is interrupted; pop() waits on it.
+    std::atomic<std::uint32_t> signal_{0};
+    std::atomic<std::size_t> interrupts_{0};
+
+    // Consumers only.
+    std::mutex mutex_;
+    std::array<Lane, 3> lanes_{};
+    std::size_t staged_{0};
+    std::uint64_t virtual_time_{0};
+};
+
+}  // namespace sv::client
@@ -0,0 +1,795 @@
+#pragma once
+
+#include "chunker.hpp"
+#include "common/bytes.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Spool files are written through file descriptors on Linux, so that appends are gathered writes and
+// can be fdatasync'ed; other platforms go through std::fstream, whose sync only reaches the OS.
+#if defined(__linux__)
+#define SV_CLIENT_POSIX_SPOOL 1
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#else
+#define SV_CLIENT_POSIX_SPOOL 0
+#include <fstream>
+#endif
+
+namespace sv::client {
+
+namespace detail {
+
+class SpoolFile
+{
+public:
+    enum class Mode
+    {
+        Read,
+        Append,
+        // Append to a file emptied first.
+        Create,
+    };
+
+    SpoolFile() = default;
+
+#if SV_CLIENT_POSIX_SPOOL
+    SpoolFile(const std::filesystem::path& path, Mode mode)
+    {
+        const int flags = mode == Mode::Read     ? O_RDONLY
+                          : mode == Mode::Append ? O_WRONLY | O_CREAT | O_APPEND
+                                                 : O_WRONLY | O_CREAT | O_TRUNC | O_APPEND;
+        fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    }
+    SpoolFile(SpoolFile&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+    SpoolFile& operator=(SpoolFile&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    [[nodiscard]] bool is_open() const noexcept { return fd_ >= 0; }
+
+    void close() noexcept
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // Writes the parts in order as one gathered write.
+    template <std::size_t N>
+    bool write(const std::array<std::span<const std::uint8_t>, N>& data)
+    {
+        std::array<iovec, N> parts{};
+        for (std::size_t index = 0; index < N; ++index)
+        {
+            parts[index] = iovec{const_cast<std::uint8_t*>(data[index].data()), data[index].size()};
+        }
+        std::size_t first = 0;
+        while (first < N)
+        {
+            const auto written = ::writev(fd_, parts.data() + first, static_cast<int>(N - first));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            auto left = static_cast<std::size_t>(written);
+            while (first < N && left >= parts[first].iov_len)
+            {
+                left -= parts[first].iov_len;
+                ++first;
+            }
+            if (first < N)
+            {
+                parts[first].iov_base = static_cast<std::uint8_t*>(parts[first].iov_base) + left;
+                parts[first].iov_len -= left;
+            }
+        }
+        return true;
+    }
+
+    bool sync() { return ::fdatasync(fd_) == 0; }
+
+    bool read_exact(std::uint8_t* data, std::size_t size, std::uint64_t offset)
+    {
+        while (size > 0)
+        {
+            const auto got = ::pread(fd_, data, size, static_cast<off_t>(offset));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                return false;
+            }
+            data += got;
+            size -= static_cast<std::size_t>(got);
+            offset += static_cast<std::uint64_t>(got);
+        }
+        return true;
+    }
+
+private:
+    int fd_{-1};
+#else
+    SpoolFile(const std::filesystem::path& path, Mode mode)
+    {
+        const auto flags = mode == Mode::Read     ? std::ios::in
+                           : mode == Mode::Append ? std::ios::out | std::ios::app
+                                                  : std::ios::out | std::ios::trunc;
+        stream_.open(path, flags | std::ios::binary);
+    }
+    SpoolFile(SpoolFile&&) noexcept = default;
+    SpoolFile& operator=(SpoolFile&&) noexcept = default;
+
+    [[nodiscard]] bool is_open() const noexcept { return stream_.is_open(); }
+
+    void close() noexcept { stream_.close(); }
+
+    template <std::size_t N>
+    bool write(const std::array<std::span<const std::uint8_t>, N>& data)
+    {
+        for (const auto& part : data)
+        {
+            stream_.write(reinterpret_cast<const char*>(part.data()), static_cast<std::streamsize>(part.size()));
+        }
+        return static_cast<bool>(stream_.flush());
+    }
+
+    bool sync() { return static_cast<bool>(stream_.flush()); }
+
+    bool read_exact(std::uint8_t* data, std::size_t size, std::uint64_t offset)
+    {
+        stream_.clear();
+        stream_.seekg(static_cast<std::streamoff>(offset));
+        stream_.read(reinterpret_cast<char*>(data), static_cast<std::streamsize>(size));
+        return stream_.gcount() == static_cast<std::streamsize>(size);
+    }
+
+private:
+    std::fstream stream_;
+#endif
+
+public:
+    ~SpoolFile() { close(); }
+    SpoolFile(const SpoolFile&) = delete;
+    SpoolFile& operator=(const SpoolFile&) = delete;
+};
+
+// Makes the names of files created in `directory` durable; only Linux offers that.
+inline bool sync_directory(const std::filesystem::path& directory)
+{
+#if SV_CLIENT_POSIX_SPOOL
+    const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    const bool synced = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+    return synced;
+#else
+    (void)directory;
+    return true;
+#endif
+}
+
+}  // namespace detail
+
+struct SpoolOptions
+{
+    std::filesystem::path directory{};
+    // Disk the spool may take; chunks that do not fit are sent without a copy on disk.
+    std::uintmax_t max_bytes{1ull << 30};
+    std::uintmax_t segment_size{64ull << 20};
+    // How long a chunk that ran out of send attempts rests on disk before it is tried again, and how
+    // often it is parked before it is given up on (0: never).
+    std::chrono::milliseconds retry_delay{std::chrono::seconds{10}};
+    std::size_t max_parks{360};
+    // fdatasync every append and ack, so the spool also survives a power cut, not only a crash.
+    bool sync{false};
+};
+
+// Crash-safe copy of the chunks queued for sending and in flight: every chunk is appended to the spool
+// as it is queued and acknowledged once the server stored it. A chunk that runs out of send attempts is
+// parked instead of dropped and offered again after retry_delay, up to max_parks times, and whatever
+// was not acknowledged when the client died is offered again by the next run. Parked chunks take no
+// memory beyond their place in line; they are read back from disk when their turn comes.
+// The spool is a directory of numbered segments, each an append-only log with the SnapshotIndex
+// framing ("SVSP" u32 version, then u32 length | record | u32 crc32(record)), and next to each an
+// ack file listing the offsets of its acknowledged records as u64s. A segment is deleted once all of
+// its records are acknowledged; each run appends to segments of its own, and a torn tail from a
+// crash mid-append is cut off when the spool is opened. Thread-safe.
+class ChunkSpool
+{
+public:
+    // A record's segment number in the top 24 bits and its offset in the segment in the low 40.
+    using RecordId = std::uint64_t;
+    static constexpr RecordId no_record = std::numeric_limits<RecordId>::max();
+    static_assert(std::is_same_v<RecordId, decltype(FileChunk::spool_record)>);
+
+    explicit ChunkSpool(SpoolOptions options) : options_(std::move(options))
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(options_.directory, ec);
+        if (ec)
+        {
+            throw std::runtime_error("Cannot create spool directory " + options_.directory.string() + ": " +
+                                     ec.message());
+        }
+        recover();
+    }
+
+    ~ChunkSpool()
+    {
+        close_active_locked();
+        for (auto& [number, segment] : segments_)
+        {
+            close_ack_file(segment);
+        }
+    }
+
+    ChunkSpool(const ChunkSpool&) = delete;
+    ChunkSpool& operator=(const ChunkSpool&) = delete;
+
+    // Returns no_record when the chunk could not be spooled; it is then sent without a copy on disk.
+    RecordId append(const FileChunk& chunk)
+    {
+        const auto record = encode_metadata(chunk);
+        const auto payload = chunk.payload();
+        const auto length = record.size() + payload.size();
+        const auto framed = length + 8;
+
+        std::scoped_lock lock(mutex_);
+        if (bytes_ + framed > options_.max_bytes)
+        {
+            if (!full_)
+            {
+                std::cerr << "[spool] " << options_.directory << " is full; sending chunks without a copy on disk"
+                          << std::endl;
+                full_ = true;
+            }
+            return no_record;
+        }
+        full_ = false;
+        if (!active_file_.is_open() || segments_.at(active_).size + framed > options_.segment_size)
+        {
+            if (!open_segment_locked())
+            {
+                return no_record;
+            }
+        }
+
+        auto& segment = segments_.at(active_);
+        sv::common::bytes::Crc32 crc;
+        crc.update(std::span<const std::uint8_t>(record));
+        crc.update(payload);
+        std::array<std::uint8_t, 4> length_bytes{};
+        std::array<std::uint8_t, 4> crc_bytes{};
+        sv::common::bytes::write_u32_le(static_cast<std::uint32_t>(length), length_bytes.data());
+        sv::common::bytes::write_u32_le(crc.value(), crc_bytes.data());
+        const std::array<std::span<const std::uint8_t>, 4> parts{length_bytes, record, payload, crc_bytes};
+        if (!active_file_.write(parts) || (options_.sync && !active_file_.sync()))
+        {
+            std::cerr << "[spool] append to " << segment_path(active_) << " failed: " << std::strerror(errno)
+                      << std::endl;
+            // Whatever part of the record made it to disk is a torn tail; later records go elsewhere.
+            close_active_locked();
+            return no_record;
+        }
+
+        const auto id = make_id(active_, segment.size);
+        segment.size += framed;
+        ++segment.live;
+        bytes_ += framed;
+        return id;
+    }
+
+    // The server stored the record; it is never offered again.
+    void ack(RecordId id)
+    {
+        if (id == no_record)
+        {
+            return;
+        }
+        std::scoped_lock lock(mutex_);
+        const auto found = segments_.find(segment_of(id));
+        if (found == segments_.end())
+        {
+            return;
+        }
+        auto& segment = found->second;
+        parks_.erase(id);
+        std::array<std::uint8_t, 8> offset{};
+        sv::common::bytes::write_u64_le(offset_of(id), offset.data());
+        if (!segment.ack_file.is_open())
+        {
+            segment.ack_file = detail::SpoolFile{ack_path(found->first), detail::SpoolFile::Mode::Append};
+            sync_directory();
+        }
+        const std::array<std::span<const std::uint8_t>, 1> parts{offset};
+        if (!segment.ack_file.is_open() || !segment.ack_file.write(parts) ||
+            (options_.sync && !segment.ack_file.sync()))
+        {
+            std::cerr << "[spool] ack for " << segment_path(found->first) << " failed: " << std::strerror(errno)
+                      << std::endl;
+        }
+        if (segment.live > 0)
+        {
+            --segment.live;
+        }
+        if (segment.live == 0 && found->first != active_)
+        {
+            remove_segment_locked(found);
+        }
+    }
+
+    // The record ran out of send attempts; it stays on disk and is offered again after retry_delay.
+    // Returns false, leaving the record to the caller to ack, once it was parked max_parks times.
+    bool park(RecordId id)
+    {
+        if (id == no_record)
+        {
+            return false;
+        }
+        {
+            std::scoped_lock lock(mutex_);
+            if (options_.max_parks > 0 && ++parks_[id] > options_.max_parks)
+            {
+                return false;
+            }
+            parked_.push_back(Parked{id, std::chrono::steady_clock::now() + options_.retry_delay});
+        }
+        parked_cv_.notify_all();
+        return true;
+    }
+
+    // Waits for the next parked record that is due and reads it back. Records that no longer read back
+    // intact are dropped on the way. Returns std::nullopt once stop is requested.
+    std::optional<std::pair<RecordId, FileChunk>> next_due(std::stop_token stop_token)
+    {
+        while (true)
+        {
+            RecordId id = no_record;
+            {
+                std::unique_lock lock(mutex_);
+                while (id == no_record)
+                {
+                    if (stop_token.stop_requested())
+                    {
+                        return std::nullopt;
+                    }
+                    if (parked_.empty())
+                    {
+                        parked_cv_.wait(lock, stop_token, [&] { return !parked_.empty(); });
+                        continue;
+                    }
+                    const auto due = parked_.front().due;
+                    if (due > std::chrono::steady_clock::now())
+                    {
+                        parked_cv_.wait_until(lock, stop_token, due, [] { return false; });
+                        continue;
+                    }
+                    id = parked_.front().id;
+                    parked_.pop_front();
+                }
+            }
+
+            // A parked record keeps its segment alive, so the file is still there to read.
+            if (auto chunk = read(id))
+            {
+                chunk->spool_record = id;
+                return std::pair<RecordId, FileChunk>{id, std::move(*chunk)};
+            }
+            std::cerr << "[spool] dropping unreadable record at " << offset_of(id) << " of "
+                      << segment_path(segment_of(id)) << std::endl;
+            ack(id);
+        }
+    }
+
+    [[nodiscard]] std::size_t parked() const
+    {
+        std::scoped_lock lock(mutex_);
+        return parked_.size();
+    }
+
+    [[nodiscard]] std::uintmax_t bytes() const
+    {
+        std::scoped_lock lock(mutex_);
+        return bytes_;
+    }
+
+private:
+    static constexpr std::array<char, 4> magic{'S', 'V', 'S', 'P'};
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::size_t header_size = 8;
+    static constexpr unsigned offset_bits = 40;
+
+    struct Segment
+    {
+        std::uintmax_t size{0};
+        // Records not yet acknowledged, parked ones included.
+        std::size_t live{0};
+        // Opened with the first ack.
+        detail::SpoolFile ack_file{};
+    };
+
+    struct Parked
+    {
+        RecordId id{no_record};
+        std::chrono::steady_clock::time_point due{};
+    };
+
+    static RecordId make_id(std::uint64_t segment, std::uint64_t offset) noexcept
+    {
+        return (segment << offset_bits) | offset;
+    }
+    static std::uint64_t segment_of(RecordId id) noexcept { return id >> offset_bits; }
+    static std::uint64_t offset_of(RecordId id) noexcept { return id & ((std::uint64_t{1} << offset_bits) - 1); }
+
+    std::filesystem::path segment_path(std::uint64_t number) const
+    {
+        std::array<char, 17> name{};
+        std::snprintf(name.data(), name.size(), "%016llx", static_cast<unsigned long long>(number));
+        return options_.directory / (std::string{name.data()} + ".seg");
+    }
+
+    std::filesystem::path ack_path(std::uint64_t number) const
+    {
+        auto path = segment_path(number);
+        path.replace_extension(".ack");
+        return path;
+    }
+
+    static void write_string(sv::common::bytes::ByteWriter& writer, const std::string& value)
+    {
+        writer.write(static_cast<std::uint32_t>(value.size()));
+        writer.write_bytes(
+            std::span<const std::uint8_t>(reinterpret_cast<const std::uint8_t*>(value.data()), value.size()));
+    }
+
+    static std::string read_string(sv::common::bytes::ByteReader& reader)
+    {
+        const auto size = reader.read<std::uint32_t>();
+        const auto bytes = reader.read_bytes(size);
+        return std::string(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    }
+
+    static void write_descriptor(sv::common::bytes::ByteWriter& writer, const FileDescriptor& descriptor)
+    {
+        write_string(writer, descriptor.path.string());
+        write_string(writer, descriptor.relative_path.string());
+        writer.write(static_cast<std::uint64_t>(descriptor.size));
+        writer.write(static_cast<std::uint64_t>(descriptor.last_write_time.time_since_epoch().count()));
+    }
+
+    static FileDescriptor read_descriptor(sv::common::bytes::ByteReader& reader)
+    {
+        FileDescriptor descriptor{};
+        descriptor.path = read_string(reader);
+        descriptor.relative_path = read_string(reader);
+        descriptor.size = reader.read<std::uint64_t>();
+        descriptor.last_write_time = std::filesystem::file_time_type{
+            std::filesystem::file_time_type::duration{static_cast<std::int64_t>(reader.read<std::uint64_t>())}};
+        return descriptor;
+    }
+
+    // Everything about the chunk but its payload, which follows the encoded fields on disk.
+    static std::vector<std::uint8_t> encode_metadata(const FileChunk& chunk)
+    {
+        const auto& file = *chunk.file;
+        sv::common::bytes::ByteWriter writer;
+        writer.write(file.file_id);
+        writer.write(static_cast<std::uint8_t>(file.codec));
+        writer.write(static_cast<std::uint64_t>(file.outgoing_chunks));
+        write_descriptor(writer, file.descriptor);
+        write_string(writer, file.sha256_hex);
+        writer.write(static_cast<std::uint32_t>(file.packed_files.size()));
+        for (const auto& packed : file.packed_files)
+        {
+            write_descriptor(writer, packed.descriptor);
+            writer.write(packed.offset);
+            write_string(writer, packed.sha256_hex);
+        }
+        writer.write(static_cast<std::uint64_t>(chunk.index));
+        writer.write(static_cast<std::uint64_t>(chunk.total_chunks));
+        writer.write(static_cast<std::uint8_t>(chunk.final_chunk ? 1 : 0));
+        return writer.move_buffer();
+    }
+
+    static FileChunk decode(std::span<const std::uint8_t> record, SharedBuffer buffer)
+    {
+        sv::common::bytes::ByteReader reader(record);
+        auto file = std::make_shared<FileMetadata>();
+        file->file_id = reader.read<std::uint64_t>();
+        file->codec = static_cast<sv::common::protocol::Codec>(reader.read<std::uint8_t>());
+        file->outgoing_chunks = static_cast<std::size_t>(reader.read<std::uint64_t>());
+        file->descriptor = read_descriptor(reader);
+        file->sha256_hex = read_string(reader);
+        const auto packed_count = reader.read<std::uint32_t>();
+        for (std::uint32_t index = 0; index < packed_count; ++index)
+        {
+            PackedFile packed{};
+            packed.descriptor = read_descriptor(reader);
+            packed.offset = reader.read<std::uint64_t>();
+            packed.sha256_hex = read_string(reader);
+            file->packed_files.push_back(std::move(packed));
+        }
+
+        FileChunk chunk{};
+        chunk.index = static_cast<std::size_t>(reader.read<std::uint64_t>());
+        chunk.total_chunks = static_cast<std::size_t>(reader.read<std::uint64_t>());
+        chunk.final_chunk = reader.read<std::uint8_t>() != 0;
+        chunk.offset = reader.offset();
+        chunk.length = reader.remaining();
+        chunk.file = std::move(file);
+        chunk.buffer = std::move(buffer);
+        return chunk;
+    }
+
+    // Reads a record back into a buffer of its own, checking its crc.
+    std::optional<FileChunk> read(RecordId id) const
+    {
+        detail::SpoolFile file{segment_path(segment_of(id)), detail::SpoolFile::Mode::Read};
+        if (!file.is_open())
+        {
+            return std::nullopt;
+        }
+        std::optional<FileChunk> chunk;
+        std::array<std::uint8_t, 4> length_bytes{};
+        if (file.read_exact(length_bytes.data(), length_bytes.size(), offset_of(id)))
+        {
+            const auto length = sv::common::bytes::read_u32_le(length_bytes.data());
+            auto body = std::make_shared<std::vector<std::uint8_t>>(std::size_t{length} + 4);
+            if (file.read_exact(body->data(), body->size(), offset_of(id) + 4) &&
+                sv::common::bytes::crc32(std::span<const std::uint8_t>(body->data(), length)) ==
+                    sv::common::bytes::read_u32_le(body->data() + length))
+            {
+                try
+                {
+                    const std::span<const std::uint8_t> record(body->data(), length);
+                    chunk = decode(record, body);
+                }
+                catch (const std::out_of_range&)
+                {
+                }
+            }
+        }
+        return chunk;
+    }
+
+    // Rebuilds the segment table and parks every record a previous run left unacknowledged.
+    void recover()
+    {
+        std::vector<std::uint64_t> numbers;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(options_.directory, ec))
+        {
+            const auto path = entry.path();
+            if (path.extension() != ".seg")
+            {
+                continue;
+            }
+            try
+            {
+                numbers.push_back(std::stoull(path.stem().string(), nullptr, 16));
+            }
+            catch (const std::exception&)
+            {
+            }
+        }
+        std::sort(numbers.begin(), numbers.end());
+
+        std::size_t replayed = 0;
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto number : numbers)
+        {
+            next_segment_ = number + 1;
+            const auto acked = read_acks(number);
+            auto offsets = scan_segment(number);
+            Segment segment{};
+            segment.size = std::filesystem::file_size(segment_path(number), ec);
+            for (const auto offset : offsets)
+            {
+                if (!std::binary_search(acked.begin(), acked.end(), offset))
+                {
+                    parked_.push_back(Parked{make_id(number, offset), now});
+                    ++segment.live;
+                }
+            }
+            if (segment.live == 0)
+            {
+                std::filesystem::remove(segment_path(number), ec);
+                std::filesystem::remove(ack_path(number), ec);
+                continue;
+            }
+            replayed += segment.live;
+            bytes_ += segment.size;
+            segments_.emplace(number, std::move(segment));
+        }
+        if (replayed > 0)
+        {
+            std::cout << "[spool] replaying " << replayed << " chunk(s) left unacknowledged in "
+                      << options_.directory << std::endl;
+        }
+    }
+
+    std::vector<std::uint64_t> read_acks(std::uint64_t number) const
+    {
+        std::vector<std::uint64_t> acked;
+        detail::SpoolFile file{ack_path(number), detail::SpoolFile::Mode::Read};
+        if (!file.is_open())
+        {
+            return acked;
+        }
+        std::array<std::uint8_t, 8> offset{};
+        for (std::uint64_t position = 0; file.read_exact(offset.data(), offset.size(), position); position += 8)
+        {
+            acked.push_back(sv::common::bytes::read_u64_le(offset.data()));
+        }
+        std::sort(acked.begin(), acked.end());
+        return acked;
+    }
+
+    // The offsets of the segment's complete records; a torn or foreign tail is cut off. Payloads are
+    // skipped rather than read and checked here; their crc is checked when they are read back.
+    std::vector<std::uint64_t> scan_segment(std::uint64_t number) const
+    {
+        std::vector<std::uint64_t> offsets;
+        const auto path = segment_path(number);
+        detail::SpoolFile file{path, detail::SpoolFile::Mode::Read};
+        if (!file.is_open())
+        {
+            return offsets;
+        }
+        std::error_code ec;
+        const auto size = std::filesystem::file_size(path, ec);
+        std::array<std::uint8_t, header_size> header{};
+        std::uint64_t valid_end = 0;
+        if (!ec && file.read_exact(header.data(), header.size(), 0) &&
+            std::equal(magic.begin(), magic.end(), header.begin()) &&
+            sv::common::bytes::read_u32_le(header.data() + magic.size()) == version)
+        {
+            valid_end = header_size;
+            std::array<std::uint8_t, 4> length_bytes{};
+            while (file.read_exact(length_bytes.data(), length_bytes.size(), valid_end))
+            {
+                const auto end = valid_end + 8 + sv::common::bytes::read_u32_le(length_bytes.data());
+                if (end > size)
+                {
+                    break;
+                }
+                offsets.push_back(valid_end);
+                valid_end = end;
+            }
+        }
+        file.close();
+        if (!ec && valid_end != size)
+        {
+            std::filesystem::resize_file(path, valid_end, ec);
+            if (ec)
+            {
+                std::cerr << "[spool] cannot cut the torn tail off " << path << ": " << ec.message() << std::endl;
+            }
+        }
+        return offsets;
+    }
+
+    bool open_segment_locked()
+    {
+        close_active_locked();
+        const auto number = next_segment_++;
+        const auto path = segment_path(number);
+        detail::SpoolFile file{path, detail::SpoolFile::Mode::Create};
+        if (!file.is_open())
+        {
+            std::cerr << "[spool] cannot create " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        std::array<std::uint8_t, header_size> header{};
+        std::copy(magic.begin(), magic.end(), header.begin());
+        sv::common::bytes::write_u32_le(version, header.data() + magic.size());
+        const std::array<std::span<const std::uint8_t>, 1> parts{header};
+        if (!file.write(parts) || (options_.sync && !file.sync()))
+        {
+            std::cerr << "[spool] cannot write " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        // So that the segment's name survives a power cut along with its records.
+        sync_directory();
+        active_file_ = std::move(file);
+        active_ = number;
+        segments_[number] = Segment{header_size, 0};
+        bytes_ += header_size;
+        return true;
+    }
+
+    // Seals the active segment; it goes away with its last acknowledged record.
+    void close_active_locked()
+    {
+        if (!active_file_.is_open())
+        {
+            return;
+        }
+        active_file_.close();
+        const auto found = segments_.find(active_);
+        active_ = no_segment;
+        if (found != segments_.end() && found->second.live == 0)
+        {
+            remove_segment_locked(found);
+        }
+    }
+
+    static void close_ack_file(Segment& segment) noexcept { segment.ack_file.close(); }
+
+    void sync_directory() const
+    {
+        if (!detail::sync_directory(options_.directory))
+        {
+            std::cerr << "[spool] cannot sync " << options_.directory << ": " << std::strerror(errno) << std::endl;
+        }
+    }
+
+    void remove_segment_locked(std::map<std::uint64_t, Segment>::iterator found)
+    {
+        close_ack_file(found->second);
+        std::error_code ec;
+        std::filesystem::remove(segment_path(found->first), ec);
+        std::filesystem::remove(ack_path(found->first), ec);
+        bytes_ -= std::min(bytes_, found->second.size);
+        segments_.erase(found);
+    }
+
+    static constexpr std::uint64_t no_segment = std::numeric_limits<std::uint64_t>::max();
+
+    SpoolOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable_any parked_cv_;
+    std::map<std::uint64_t, Segment> segments_{};
+    std::deque<Parked> parked_{};
+    // Times each record was parked by this run.
+    std::unordered_map<RecordId, std::size_t> parks_{};
+    std::uint64_t next_segment_{0};
+    std::uint64_t active_{no_segment};
+    detail::SpoolFile active_file_{};
+    std::uintmax_t bytes_{0};
+    bool full_{false};
+};
+
+}  // namespace sv::client
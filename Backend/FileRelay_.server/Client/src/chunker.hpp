@@ -1,23 +1,167 @@
 #pragma once
 
 #include "compressor.hpp"
+#include "snapshot_index.hpp"
+#include "common/bytes.hpp"
+#include "common/protocol.hpp"
 
 #include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
 #include <vector>
 
 namespace sv::client {
 
-struct FileChunk
+// One small file inside a pack: its bytes are [offset, offset + descriptor.size) of the pack's
+// uncompressed content.
+struct PackedFile
 {
     FileDescriptor descriptor;
+    std::uint64_t offset{0};
     std::string sha256_hex;
+};
+
+// Per-file data shared by every chunk of a file version instead of being copied into each chunk.
+struct FileMetadata
+{
+    FileDescriptor descriptor;
+    // Identifies this version of the file across all of its chunks, even before its SHA-256 is known.
+    std::uint64_t file_id{0};
+    // Empty on the leading chunks of a streamed file; its final chunk carries a copy with the digest.
+    std::string sha256_hex;
+    // Number of chunks actually sent when the server already holds some of them (content-defined
+    // uploads); zero when every one of total_chunks is sent.
+    std::size_t outgoing_chunks{0};
+    // How every chunk's payload is encoded.
+    sv::common::protocol::Codec codec{sv::common::protocol::Codec::Zstd};
+    // Set when the upload is a pack of small files rather than one file; file_id is then the pack id
+    // and descriptor only describes the pack as a whole.
+    std::vector<PackedFile> packed_files;
+};
+
+using SharedBuffer = std::shared_ptr<const std::vector<std::uint8_t>>;
+
+// A view of `length` bytes at `offset` into an immutable, reference-counted compressed buffer.
+struct FileChunk
+{
+    std::shared_ptr<const FileMetadata> file;
+    SharedBuffer buffer;
+    std::size_t offset{0};
+    std::size_t length{0};
     std::size_t index{0};
+    // Zero on the leading chunks of a streamed file; set on its final chunk.
     std::size_t total_chunks{0};
-    std::vector<std::uint8_t> payload;
+    bool final_chunk{false};
+    // Where the chunk's copy sits in the spool, if it has one (ChunkSpool::RecordId).
+    std::uint64_t spool_record{std::numeric_limits<std::uint64_t>::max()};
+
+    [[nodiscard]] const FileDescriptor& descriptor() const noexcept { return file->descriptor; }
+    [[nodiscard]] std::uint64_t file_id() const noexcept { return file->file_id; }
+    [[nodiscard]] const std::string& sha256_hex() const noexcept { return file->sha256_hex; }
+
+    [[nodiscard]] std::span<const std::uint8_t> payload() const noexcept
+    {
+        if (!buffer)
+        {
+            return {};
+        }
+        return std::span<const std::uint8_t>(buffer->data() + offset, length);
+    }
+
+    // Drops this chunk's reference to the shared buffer once the payload is no longer needed.
+    void release() noexcept
+    {
+        buffer.reset();
+    }
 };
 
+inline std::uint64_t make_file_id(const FileDescriptor& descriptor)
+{
+    const auto identity = descriptor.path.generic_string() + '\n' + std::to_string(descriptor.size) + '\n' +
+                          std::to_string(descriptor.last_write_time.time_since_epoch().count());
+    const auto digest = sv::common::bytes::sha256(identity);
+    return sv::common::bytes::read_u64_le(digest.data());
+}
+
+// Identifies an upload that can be resumed: the same file content under the same path, encoded the
+// same way, gets the same id in every run, so patches stored by an interrupted run still fit.
+inline std::uint64_t make_resume_id(const FileDescriptor& descriptor,
+                                    const std::string& sha256_hex,
+                                    const Compressor& compressor,
+                                    std::size_t payload_size)
+{
+    const auto identity = descriptor.path.generic_string() + '\n' + sha256_hex + '\n' +
+                          std::to_string(static_cast<unsigned>(compressor.codec())) + '\n' +
+                          std::to_string(compressor.level()) + '\n' +
+                          std::to_string(compressor.dictionary() ? compressor.dictionary()->id() : 0) + '\n' +
+                          std::to_string(payload_size);
+    const auto digest = sv::common::bytes::sha256(identity);
+    return sv::common::bytes::read_u64_le(digest.data());
+}
+
+// Where an interrupted upload stands on the server: the chunks it already stores under file_id.
+struct ResumePoint
+{
+    std::uint64_t file_id{0};
+    std::vector<bool> stored;
+
+    [[nodiscard]] bool has(std::size_t index) const noexcept
+    {
+        return index < stored.size() && stored[index];
+    }
+};
+
+// The name a file is published under on the server.
+inline std::string upload_name(const FileDescriptor& descriptor)
+{
+    const auto name = descriptor.relative_path.empty() ? descriptor.path.filename().generic_u8string()
+                                                       : descriptor.relative_path.generic_u8string();
+    return std::string(name.begin(), name.end());
+}
+
+// The FileMeta SystemFrame that names a file version on a data connection ahead of its patches.
+inline std::vector<std::uint8_t> encode_file_meta_frame(const FileMetadata& file, std::size_t total_chunks)
+{
+    namespace protocol = sv::common::protocol;
+    const auto& descriptor = file.descriptor;
+
+    protocol::FileMetaMessage meta{};
+    meta.file_id = file.file_id;
+    meta.utf8_name = upload_name(descriptor);
+    meta.original_size_bytes = static_cast<std::uint64_t>(descriptor.size);
+    meta.total_patches = static_cast<std::uint32_t>(total_chunks);
+    if (!file.sha256_hex.empty())
+    {
+        meta.sha256 = SnapshotIndex::digest_from_hex(file.sha256_hex);
+    }
+    return protocol::SystemFrame::encode(protocol::SystemMessage{protocol::SystemMessageType::FileMeta, meta});
+}
+
+// The PackIndex SystemFrame that announces a pack in place of its files' FileMeta frames.
+inline std::vector<std::uint8_t> encode_pack_index_frame(const FileMetadata& pack)
+{
+    namespace protocol = sv::common::protocol;
+    protocol::PackIndexMessage index{};
+    index.pack_id = pack.file_id;
+    index.entries.reserve(pack.packed_files.size());
+    for (const auto& file : pack.packed_files)
+    {
+        protocol::PackEntry entry{};
+        entry.utf8_name = upload_name(file.descriptor);
+        entry.offset = file.offset;
+        entry.size = static_cast<std::uint64_t>(file.descriptor.size);
+        entry.sha256 = SnapshotIndex::digest_from_hex(file.sha256_hex);
+        index.entries.push_back(std::move(entry));
+    }
+    return protocol::SystemFrame::encode(protocol::SystemMessage{protocol::SystemMessageType::PackIndex, index});
+}
+
 class Chunker
 {
 public:
@@ -25,7 +169,9 @@ public:
 
     [[nodiscard]] std::size_t payload_size() const noexcept { return payload_size_; }
 
-    std::vector<FileChunk> operator()(const CompressedFile& file) const
+    // With `resume`, the file is uploaded under its id and the chunks the server already stores are left
+    // out, except for the final one, which completes the upload.
+    std::vector<FileChunk> operator()(CompressedFile file, const ResumePoint* resume = nullptr) const
     {
         std::vector<FileChunk> chunks;
         if (file.compressed_data.empty())
@@ -33,28 +179,149 @@ public:
             return chunks;
         }
 
-        const auto total_chunks = (file.compressed_data.size() + payload_size_ - 1) / payload_size_;
+        auto metadata = std::make_shared<FileMetadata>();
+        metadata->descriptor = std::move(file.descriptor);
+        metadata->file_id = resume ? resume->file_id : make_file_id(metadata->descriptor);
+        metadata->sha256_hex = std::move(file.sha256_hex);
+        metadata->codec = file.codec;
+        const auto buffer = std::make_shared<const std::vector<std::uint8_t>>(std::move(file.compressed_data));
+
+        const auto total_chunks = (buffer->size() + payload_size_ - 1) / payload_size_;
         chunks.reserve(total_chunks);
         for (std::size_t index = 0; index < total_chunks; ++index)
         {
-            const auto offset = index * payload_size_;
-            const auto size = std::min<std::size_t>(payload_size_, file.compressed_data.size() - offset);
-
+            if (resume && resume->has(index) && index + 1 != total_chunks)
+            {
+                continue;
+            }
             FileChunk chunk{};
-            chunk.descriptor = file.descriptor;
-            chunk.sha256_hex = file.sha256_hex;
+            chunk.file = metadata;
+            chunk.buffer = buffer;
+            chunk.offset = index * payload_size_;
+            chunk.length = std::min<std::size_t>(payload_size_, buffer->size() - chunk.offset);
             chunk.index = index;
             chunk.total_chunks = total_chunks;
-            chunk.payload.insert(chunk.payload.end(),
-                                 file.compressed_data.begin() + static_cast<std::ptrdiff_t>(offset),
-                                 file.compressed_data.begin() + static_cast<std::ptrdiff_t>(offset + size));
-
+            chunk.final_chunk = index + 1 == total_chunks;
             chunks.push_back(std::move(chunk));
         }
+        if (chunks.size() < total_chunks)
+        {
+            metadata->outgoing_chunks = chunks.size();
+        }
 
         return chunks;
     }
 
+    // Compresses the file and hands a chunk to `sink` as soon as payload_size compressed bytes are
+    // available, so memory stays bounded by what the sink buffers. The SHA-256 and the chunk count are
+    // only known at the end and travel on the final chunk. Returns false when `sink` refused a chunk.
+    // `resume` works as for operator(); the file is still compressed in full, since each chunk continues
+    // the compressed stream of the ones before it.
+    template <typename Sink>
+    bool stream(const Compressor& compressor,
+                const FileDescriptor& descriptor,
+                Sink&& sink,
+                const ResumePoint* resume = nullptr) const
+    {
+        return stream_from(
+            descriptor,
+            compressor.codec(),
+            [&](auto& on_output) { return compressor.compress_stream(descriptor, on_output); },
+            std::forward<Sink>(sink),
+            resume);
+    }
+
+    // Like stream(), for any producer of the file's upload payload: `produce(on_output)` hands the
+    // payload, encoded with `codec`, to on_output piece by piece and returns the file's SHA-256, or
+    // std::nullopt when on_output refused a piece.
+    template <typename Produce, typename Sink>
+    bool stream_from(const FileDescriptor& descriptor,
+                     sv::common::protocol::Codec codec,
+                     Produce&& produce,
+                     Sink&& sink,
+                     const ResumePoint* resume = nullptr) const
+    {
+        auto metadata = std::make_shared<FileMetadata>();
+        metadata->descriptor = descriptor;
+        metadata->file_id = resume ? resume->file_id : make_file_id(descriptor);
+        metadata->codec = codec;
+        std::size_t next_index = 0;
+        std::size_t skipped = 0;
+        std::vector<std::uint8_t> window;
+        window.reserve(payload_size_);
+        // A full window is held back until more output arrives, so the final chunk can be flagged.
+        std::optional<FileChunk> held;
+
+        auto make_chunk = [&](std::vector<std::uint8_t>&& payload) {
+            FileChunk chunk{};
+            chunk.file = metadata;
+            chunk.length = payload.size();
+            chunk.buffer = std::make_shared<const std::vector<std::uint8_t>>(std::move(payload));
+            chunk.index = next_index++;
+            return chunk;
+        };
+
+        // Hands over a chunk that is not the final one, unless the server already stores it.
+        auto pass = [&](FileChunk&& chunk) {
+            if (resume && resume->has(chunk.index))
+            {
+                ++skipped;
+                return true;
+            }
+            return sink(std::move(chunk));
+        };
+
+        auto on_output = [&](std::span<const std::uint8_t> output) {
+            while (!output.empty())
+            {
+                if (window.size() == payload_size_)
+                {
+                    if (held && !pass(std::move(*held)))
+                    {
+                        return false;
+                    }
+                    held = make_chunk(std::move(window));
+                    window = {};
+                    window.reserve(payload_size_);
+                }
+                const auto take = std::min(payload_size_ - window.size(), output.size());
+                window.insert(window.end(), output.begin(), output.begin() + static_cast<std::ptrdiff_t>(take));
+                output = output.subspan(take);
+            }
+            return true;
+        };
+
+        auto sha256_hex = produce(on_output);
+        if (!sha256_hex)
+        {
+            return false;
+        }
+
+        if (!window.empty())
+        {
+            if (held && !pass(std::move(*held)))
+            {
+                return false;
+            }
+            held = make_chunk(std::move(window));
+        }
+        if (!held)
+        {
+            return true;
+        }
+
+        auto final_metadata = std::make_shared<FileMetadata>(*metadata);
+        final_metadata->sha256_hex = std::move(*sha256_hex);
+        if (skipped > 0)
+        {
+            final_metadata->outgoing_chunks = next_index - skipped;
+        }
+        held->file = std::move(final_metadata);
+        held->final_chunk = true;
+        held->total_chunks = next_index;
+        return sink(std::move(*held));
+    }
+
 private:
     std::size_t payload_size_;
 };
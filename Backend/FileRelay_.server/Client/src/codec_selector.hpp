@@ -0,0 +1,106 @@
+#pragma once
+
+#include "compressor.hpp"
+#include "watcher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+#include <lz4.h>
+
+namespace sv::client {
+
+struct CodecSelectorOptions
+{
+    // The probe reads up to sample_blocks blocks of sample_block_size bytes from the start of the file.
+    std::size_t sample_blocks{4};
+    std::size_t sample_block_size{64 * 1024};
+    // Files smaller than this are not worth probing and always use zstd.
+    std::uintmax_t min_probe_size{16 * 1024};
+    // Sample entropy in bits per byte at or above which entropy coding gains too little to pay for
+    // zstd; such data goes stored, or LZ4 when LZ4 finds repeats in it.
+    double high_entropy{7.5};
+    // LZ4 size ratio at or above which high-entropy data is sent stored.
+    double stored_ratio{0.97};
+};
+
+// Chooses how a file travels from a sample of its first blocks. Data that is already compressed
+// (video, images, archives) has near-maximal byte entropy and does not shrink under LZ4, so it is
+// sent stored and the server skips decoding it altogether. High-entropy data with repeats in it only
+// shrinks through those repeats, which LZ4 finds at a fraction of zstd's CPU time per byte. Everything
+// else has skewed byte statistics that zstd's entropy coding exploits and gets zstd.
+class CodecSelector
+{
+public:
+    explicit CodecSelector(CodecSelectorOptions options = {}) : options_(options) {}
+
+    [[nodiscard]] Codec choose(const FileDescriptor& descriptor) const
+    {
+        if (descriptor.size < options_.min_probe_size)
+        {
+            return Codec::Zstd;
+        }
+
+        std::ifstream file(descriptor.path, std::ios::binary);
+        std::vector<char> sample(options_.sample_blocks * options_.sample_block_size);
+        file.read(sample.data(), static_cast<std::streamsize>(sample.size()));
+        sample.resize(static_cast<std::size_t>(file.gcount()));
+        if (sample.size() < options_.min_probe_size)
+        {
+            return Codec::Zstd;
+        }
+
+        if (entropy(sample) < options_.high_entropy)
+        {
+            return Codec::Zstd;
+        }
+        return lz4_ratio(sample) >= options_.stored_ratio ? Codec::Stored : Codec::Lz4;
+    }
+
+private:
+    // Order-0 Shannon entropy in bits per byte.
+    static double entropy(const std::vector<char>& sample)
+    {
+        std::array<std::size_t, 256> counts{};
+        for (const auto byte : sample)
+        {
+            ++counts[static_cast<std::uint8_t>(byte)];
+        }
+        const double total = static_cast<double>(sample.size());
+        double bits = 0.0;
+        for (const auto count : counts)
+        {
+            if (count > 0)
+            {
+                const double p = static_cast<double>(count) / total;
+                bits -= p * std::log2(p);
+            }
+        }
+        return bits;
+    }
+
+    // Compressed-to-original size of the sample under LZ4, block by block as the frame format would.
+    double lz4_ratio(const std::vector<char>& sample) const
+    {
+        thread_local std::vector<char> output;
+        output.resize(static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(options_.sample_block_size))));
+        std::size_t compressed = 0;
+        for (std::size_t offset = 0; offset < sample.size(); offset += options_.sample_block_size)
+        {
+            const auto size = std::min(options_.sample_block_size, sample.size() - offset);
+            const int produced = LZ4_compress_default(sample.data() + offset, output.data(), static_cast<int>(size),
+                                                      static_cast<int>(output.size()));
+            compressed += produced > 0 ? static_cast<std::size_t>(produced) : size;
+        }
+        return static_cast<double>(compressed) / static_cast<double>(sample.size());
+    }
+
+    CodecSelectorOptions options_;
+};
+
+}  // namespace sv::client
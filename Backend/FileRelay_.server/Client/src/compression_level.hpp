@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+
+#include <zstd.h>
+
+namespace sv::client {
+
+struct AdaptiveLevelOptions
+{
+    int min_level{1};
+    int max_level{9};
+    int initial_level{ZSTD_CLEVEL_DEFAULT};
+    // Average send-queue occupancy at or above which the network is taken to be the bottleneck, and at
+    // or below which compression is.
+    double high_occupancy{0.75};
+    double low_occupancy{0.25};
+    // A raise is undone when the next window's send rate falls by more than this fraction.
+    double rate_drop_tolerance{0.10};
+    // Windows for which the level a raise was reverted from is not tried again.
+    std::size_t revert_cooldown_windows{12};
+};
+
+// Picks the zstd level for the next file from how the pipeline is doing. A send queue that stays
+// full means compressed data waits for the network, so spending more CPU per byte is free and the
+// level goes up; a queue that stays empty means the sender waits for compression and the level goes
+// down. Occupancy is sampled every time a chunk is queued and averaged over the sender's metrics
+// window; one step is taken per window, when the sender reports its MB/s. A raise that cost send
+// throughput is reverted, and that level is left alone for a cool-down so that a full queue does
+// not raise straight back into it. Thread-safe.
+class AdaptiveCompressionLevel
+{
+public:
+    explicit AdaptiveCompressionLevel(AdaptiveLevelOptions options) : options_(options)
+    {
+        if (options_.min_level > options_.max_level)
+        {
+            std::swap(options_.min_level, options_.max_level);
+        }
+        options_.min_level = std::max(options_.min_level, ZSTD_minCLevel());
+        options_.max_level = std::min(options_.max_level, ZSTD_maxCLevel());
+        level_.store(std::clamp(options_.initial_level, options_.min_level, options_.max_level));
+    }
+
+    AdaptiveCompressionLevel(const AdaptiveCompressionLevel&) = delete;
+    AdaptiveCompressionLevel& operator=(const AdaptiveCompressionLevel&) = delete;
+
+    [[nodiscard]] int level() const noexcept { return level_.load(std::memory_order_relaxed); }
+    [[nodiscard]] int min_level() const noexcept { return options_.min_level; }
+    [[nodiscard]] int max_level() const noexcept { return options_.max_level; }
+
+    void observe_queue(std::size_t size, std::size_t capacity)
+    {
+        if (capacity == 0)
+        {
+            return;
+        }
+        std::scoped_lock lock(mutex_);
+        occupancy_sum_ += static_cast<double>(std::min(size, capacity)) / static_cast<double>(capacity);
+        ++occupancy_samples_;
+    }
+
+    // Called once per sender metrics window with that window's send rate.
+    void observe_send_rate(double mb_per_second)
+    {
+        std::scoped_lock lock(mutex_);
+        if (occupancy_samples_ == 0)
+        {
+            // Nothing was queued in this window; there is nothing to learn from it.
+            return;
+        }
+        const double occupancy = occupancy_sum_ / static_cast<double>(occupancy_samples_);
+        occupancy_sum_ = 0.0;
+        occupancy_samples_ = 0;
+
+        const int current = level_.load(std::memory_order_relaxed);
+        int next = current;
+        if (cooldown_ > 0)
+        {
+            --cooldown_;
+        }
+        if (raised_ && mb_per_second < previous_rate_ * (1.0 - options_.rate_drop_tolerance))
+        {
+            next = current - 1;
+            reverted_level_ = current;
+            cooldown_ = options_.revert_cooldown_windows;
+        }
+        else if (occupancy >= options_.high_occupancy && (cooldown_ == 0 || current + 1 < reverted_level_))
+        {
+            next = current + 1;
+        }
+        else if (occupancy <= options_.low_occupancy)
+        {
+            next = current - 1;
+        }
+        next = std::clamp(next, options_.min_level, options_.max_level);
+
+        raised_ = next > current;
+        previous_rate_ = mb_per_second;
+        if (next != current)
+        {
+            level_.store(next, std::memory_order_relaxed);
+            std::cout << "[level] compression level " << current << " -> " << next << " (queue occupancy "
+                      << static_cast<int>(occupancy * 100.0) << "%, " << mb_per_second << " MB/s)" << std::endl;
+        }
+    }
+
+private:
+    AdaptiveLevelOptions options_;
+    std::atomic<int> level_{ZSTD_CLEVEL_DEFAULT};
+    std::mutex mutex_;
+    double occupancy_sum_{0.0};
+    std::size_t occupancy_samples_{0};
+    double previous_rate_{0.0};
+    bool raised_{false};
+    // The level the last reverted raise went to, held off for cooldown_ more windows.
+    int reverted_level_{0};
+    std::size_t cooldown_{0};
+};
+
+}  // namespace sv::client
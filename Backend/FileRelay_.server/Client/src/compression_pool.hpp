@@ -0,0 +1,547 @@
+#pragma once
+
+#include "cdc_chunker.hpp"
+#include "chunk_index.hpp"
+#include "chunk_queue.hpp"
+#include "chunk_spool.hpp"
+#include "chunker.hpp"
+#include "codec_selector.hpp"
+#include "compression_level.hpp"
+#include "compressor.hpp"
+#include "delta_encoder.hpp"
+#include "file_packer.hpp"
+#include "queue.hpp"
+#include "rate_limiter.hpp"
+#include "system_channels.hpp"
+#include "watcher.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sv::client {
+
+// Compresses and chunks files on a fixed set of worker threads. Each file is handled start to finish
+// by one worker, so its chunks enter the send queue in index order; the bounded send queue provides
+// backpressure to every worker alike. Files of at least stream_threshold bytes (0 disables) are
+// streamed chunk by chunk instead of being compressed into memory first. With delta transfer enabled,
+// large files the server already has a copy of are sent as a streamed delta against that copy. With
+// content-defined chunking enabled, large files are split by content instead; the server is asked
+// which chunks it already stores and only the missing ones are compressed and queued. Delta transfer
+// is tried first; either falls back to the regular path when the server cannot be asked. With an
+// adaptive level attached, each file is compressed at the level it picks when the file starts; with
+// a codec selector attached, each file is sent stored, LZ4 or zstd as the selector decides. With a
+// dictionary enabled, zstd files up to its size limit are compressed against it. With packing
+// enabled, small files skip all of that and are collected into packs instead, which go out when
+// full or when the producer flushes them. With resume enabled, large files taking the regular path
+// are uploaded under an id derived from their path, content and encoding, and the server is asked
+// which of their chunks an interrupted earlier upload already left with it; those are not sent again.
+// With a priority lane enabled, files the classifier deems interactive bypass the other workers'
+// backlog and go to a worker of their own, so they are not stuck behind large files being streamed.
+// With a spool attached, every chunk is copied to it as it is queued.
+class CompressionPool
+{
+public:
+    using FileUploadedCallback = std::function<void(const FileDescriptor&, const std::string& sha256_hex)>;
+
+    CompressionPool(std::size_t threads,
+                    std::uintmax_t stream_threshold,
+                    const Compressor& compressor,
+                    const Chunker& chunker,
+                    ChunkQueue& queue,
+                    SystemChannels& channels)
+        : threads_(std::max<std::size_t>(1, threads))
+        , stream_threshold_(stream_threshold)
+        , compressor_(compressor)
+        , chunker_(chunker)
+        , queue_(queue)
+        , channels_(channels)
+        , work_(threads_ * 2)
+    {
+    }
+
+    ~CompressionPool()
+    {
+        stop();
+    }
+
+    CompressionPool(const CompressionPool&) = delete;
+    CompressionPool& operator=(const CompressionPool&) = delete;
+
+    void start()
+    {
+        if (!workers_.empty())
+        {
+            return;
+        }
+        workers_.reserve(threads_ + 1);
+        for (std::size_t index = 0; index < threads_; ++index)
+        {
+            workers_.emplace_back([this](std::stop_token stop_token) { run(stop_token, work_); });
+        }
+        if (classifier_)
+        {
+            workers_.emplace_back([this](std::stop_token stop_token) { run(stop_token, priority_work_); });
+        }
+    }
+
+    // The enable_* and set_* calls must happen before start(). Both modes query the server through
+    // `index_options`.
+    void set_server_index(ChunkIndexOptions index_options)
+    {
+        index_options_ = std::move(index_options);
+    }
+
+    void enable_content_defined_chunking(const ContentDefinedChunker& cdc, std::uintmax_t min_file_size)
+    {
+        cdc_ = &cdc;
+        cdc_min_file_size_ = min_file_size;
+    }
+
+    void enable_delta_transfer(std::uint32_t block_size, std::uintmax_t min_file_size)
+    {
+        delta_block_size_ = block_size;
+        delta_min_file_size_ = min_file_size;
+    }
+
+    // Lets files of at least min_file_size bytes pick up where an interrupted upload of the same content
+    // stopped. Such files are hashed before they are compressed, and keep the compressor's fixed level
+    // so that every run compresses them the same way.
+    void enable_resume(std::uintmax_t min_file_size)
+    {
+        resume_ = true;
+        resume_min_file_size_ = min_file_size;
+    }
+
+    // Lets `level` choose the zstd level of each file instead of the compressor's fixed level.
+    void enable_adaptive_level(AdaptiveCompressionLevel& level)
+    {
+        adaptive_level_ = &level;
+    }
+
+    // Lets `selector` pick each file's codec by sampling it instead of always using the compressor's.
+    void enable_codec_selection(const CodecSelector& selector)
+    {
+        codec_selector_ = &selector;
+    }
+
+    // Compresses zstd files of at most max_file_size bytes with `dictionary`. The server must have
+    // been sent the dictionary before any of those files.
+    void enable_dictionary(std::shared_ptr<const ZstdDictionary> dictionary, std::uintmax_t max_file_size)
+    {
+        dictionary_ = std::move(dictionary);
+        dictionary_max_file_size_ = max_file_size;
+    }
+
+    // Collects files `packer` accepts into packs, compressed with the compressor's codec and level.
+    void enable_packing(FilePacker& packer)
+    {
+        packer_ = &packer;
+    }
+
+    // Hands files `classifier` deems interactive to a worker reserved for them.
+    void enable_priority_lane(const TrafficClassifier& classifier)
+    {
+        classifier_ = &classifier;
+    }
+
+    // Copies every chunk to `spool` before it is queued, so queued chunks survive a crash.
+    void set_spool(ChunkSpool& spool)
+    {
+        spool_ = &spool;
+    }
+
+    // Invoked for content-defined uploads the server could assemble from chunks it already stored,
+    // which never reach the sender.
+    void set_file_uploaded_callback(FileUploadedCallback callback)
+    {
+        file_uploaded_callback_ = std::move(callback);
+    }
+
+    // Blocks while every worker is busy and the hand-off queue is full. Returns false once stopped.
+    bool submit(FileDescriptor file)
+    {
+        if (classifier_ && classifier_->interactive(file))
+        {
+            return priority_work_.push(std::move(file));
+        }
+        return work_.push(std::move(file));
+    }
+
+    // Seals and queues the pack being collected, full or not, on the calling thread. The producer
+    // calls this after each batch it submits, so small files do not wait for files that may never come.
+    void flush_packs()
+    {
+        if (!packer_)
+        {
+            return;
+        }
+        send_pack(packer_->take());
+    }
+
+    // Finishes the files already handed over, then joins the workers.
+    void stop()
+    {
+        close_work();
+        for (auto& worker : workers_)
+        {
+            if (worker.joinable())
+            {
+                worker.join();
+            }
+        }
+        workers_.clear();
+    }
+
+    [[nodiscard]] std::size_t threads() const noexcept { return threads_; }
+    [[nodiscard]] std::size_t files_processed() const noexcept { return files_processed_.load(); }
+    [[nodiscard]] std::uintmax_t bytes_processed() const noexcept { return bytes_processed_.load(); }
+    [[nodiscard]] bool output_closed() const noexcept { return output_closed_.load(); }
+    [[nodiscard]] std::size_t chunks_deduplicated() const noexcept { return chunks_deduplicated_.load(); }
+    [[nodiscard]] std::size_t chunks_resumed() const noexcept { return chunks_resumed_.load(); }
+    [[nodiscard]] std::uintmax_t delta_bytes_reused() const noexcept { return delta_bytes_reused_.load(); }
+    [[nodiscard]] std::size_t files_with_codec(Codec codec) const noexcept
+    {
+        return files_by_codec_[static_cast<std::size_t>(codec)].load();
+    }
+    [[nodiscard]] std::size_t files_with_dictionary() const noexcept { return files_with_dictionary_.load(); }
+    [[nodiscard]] std::size_t files_packed() const noexcept { return files_packed_.load(); }
+    [[nodiscard]] std::size_t packs_sent() const noexcept { return packs_sent_.load(); }
+
+private:
+    void run(std::stop_token stop_token, BoundedBlockingQueue<FileDescriptor>& work)
+    {
+        std::optional<ChunkIndexClient> index;
+        if (cdc_ || delta_block_size_ > 0 || resume_)
+        {
+            index.emplace(index_options_);
+        }
+
+        auto enqueue = [this](FileChunk&& chunk) { return enqueue_chunk(std::move(chunk)); };
+
+        while (!stop_token.stop_requested())
+        {
+            auto file = work.pop();
+            if (!file)
+            {
+                send_pack(packer_ ? packer_->take() : std::vector<FileDescriptor>{});
+                return;
+            }
+
+            try
+            {
+                if (packer_ && packer_->accepts(*file))
+                {
+                    if (!send_pack(packer_->add(*file)))
+                    {
+                        return;
+                    }
+                    continue;
+                }
+
+                const bool resumable = resume_ && file->size >= resume_min_file_size_;
+                Compressor compressor = adaptive_level_ && !resumable
+                                            ? compressor_.with_level(adaptive_level_->level())
+                                            : compressor_;
+                if (codec_selector_)
+                {
+                    compressor = compressor.with_codec(codec_selector_->choose(*file));
+                }
+                if (dictionary_ && compressor.codec() == Codec::Zstd && file->size <= dictionary_max_file_size_)
+                {
+                    compressor = compressor.with_dictionary(dictionary_);
+                }
+                auto codec = compressor.codec();
+
+                bool accepted = true;
+                std::optional<bool> deduplicated;
+                if (index && delta_block_size_ > 0 && file->size >= delta_min_file_size_)
+                {
+                    deduplicated = upload_delta(*index, compressor, *file, enqueue);
+                }
+                if (!deduplicated && index && cdc_ && file->size >= cdc_min_file_size_)
+                {
+                    // Content-defined chunks are stored by the server as zstd frames.
+                    deduplicated =
+                        upload_content_defined(*index, compressor.with_codec(Codec::Zstd), *file, enqueue);
+                    if (deduplicated)
+                    {
+                        codec = Codec::Zstd;
+                    }
+                }
+
+                if (deduplicated)
+                {
+                    accepted = *deduplicated;
+                }
+                else
+                {
+                    const auto resume = resumable && index ? std::optional{resume_point(*index, compressor, *file)}
+                                                           : std::nullopt;
+                    const ResumePoint* from = resume ? &*resume : nullptr;
+                    if (stream_threshold_ > 0 && file->size >= stream_threshold_)
+                    {
+                        accepted = chunker_.stream(compressor, *file, enqueue, from);
+                    }
+                    else
+                    {
+                        for (auto& chunk : chunker_(compressor(*file), from))
+                        {
+                            if (!enqueue(std::move(chunk)))
+                            {
+                                accepted = false;
+                                break;
+                            }
+                        }
+                    }
+                }
+
+                if (!accepted)
+                {
+                    std::cerr << "Queue closed. Stopping compression worker." << std::endl;
+                    output_closed_.store(true);
+                    close_work();
+                    return;
+                }
+
+                files_processed_.fetch_add(1);
+                bytes_processed_.fetch_add(file->size);
+                files_by_codec_[static_cast<std::size_t>(codec)].fetch_add(1);
+                if (compressor.dictionary() && !deduplicated)
+                {
+                    files_with_dictionary_.fetch_add(1);
+                }
+            }
+            catch (const std::exception& ex)
+            {
+                std::cerr << "Failed to process file '" << file->path << "': " << ex.what() << std::endl;
+            }
+        }
+    }
+
+    void close_work()
+    {
+        work_.close();
+        priority_work_.close();
+    }
+
+    bool enqueue_chunk(FileChunk&& chunk)
+    {
+        const auto queued = queue_.size();
+        channels_.notify_file_chunk_enqueued(chunk, queued);
+        if (adaptive_level_)
+        {
+            adaptive_level_->observe_queue(queued, queue_.capacity());
+        }
+        if (spool_)
+        {
+            chunk.spool_record = spool_->append(chunk);
+        }
+        return queue_.push(std::move(chunk));
+    }
+
+    // Seals and queues a pack of `files`, if there are any. Returns false when the send queue was
+    // closed, after shutting the pool down like a refused chunk does.
+    bool send_pack(std::vector<FileDescriptor> files)
+    {
+        if (files.empty())
+        {
+            return true;
+        }
+        try
+        {
+            Compressor compressor =
+                adaptive_level_ ? compressor_.with_level(adaptive_level_->level()) : compressor_;
+            if (dictionary_ && compressor.codec() == Codec::Zstd)
+            {
+                compressor = compressor.with_dictionary(dictionary_);
+            }
+            auto pack = FilePacker::seal(compressor, files);
+            if (!pack)
+            {
+                return true;
+            }
+            const auto count = pack->file->packed_files.size();
+            const auto bytes = pack->descriptor().size;
+            const auto codec = pack->file->codec;
+            if (!enqueue_chunk(std::move(*pack)))
+            {
+                std::cerr << "Queue closed. Stopping compression worker." << std::endl;
+                output_closed_.store(true);
+                close_work();
+                return false;
+            }
+            files_processed_.fetch_add(count);
+            bytes_processed_.fetch_add(bytes);
+            files_by_codec_[static_cast<std::size_t>(codec)].fetch_add(count);
+            files_packed_.fetch_add(count);
+            packs_sent_.fetch_add(1);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "Failed to pack " << files.size() << " files: " << ex.what() << std::endl;
+        }
+        return true;
+    }
+
+    // Hashes the file and asks the server which of its chunks it kept from an interrupted upload. When
+    // the server cannot be asked, the upload still goes out under its resume id, from the start.
+    ResumePoint resume_point(ChunkIndexClient& index, const Compressor& compressor, const FileDescriptor& file)
+    {
+        FileMetadata metadata{};
+        metadata.descriptor = file;
+        metadata.file_id = make_resume_id(file, Compressor::sha256_file(file, compressor.reader()), compressor, chunker_.payload_size());
+
+        ResumePoint resume{};
+        resume.file_id = metadata.file_id;
+        try
+        {
+            resume.stored = index.stored_chunks(metadata);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "[resume] " << ex.what() << "; sending '" << file.path.string() << "' from the start"
+                      << std::endl;
+            return resume;
+        }
+        const auto stored = static_cast<std::size_t>(std::count(resume.stored.begin(), resume.stored.end(), true));
+        if (stored > 0)
+        {
+            chunks_resumed_.fetch_add(stored);
+            std::cout << "[resume] " << file.path.string() << ": " << stored << " chunks already on the server"
+                      << std::endl;
+        }
+        return resume;
+    }
+
+    // Returns whether `enqueue` accepted every chunk, or std::nullopt when the server has no copy to
+    // diff against or could not be asked, and the file should take another path.
+    template <typename Enqueue>
+    std::optional<bool> upload_delta(ChunkIndexClient& index,
+                                     const Compressor& compressor,
+                                     const FileDescriptor& file,
+                                     Enqueue& enqueue)
+    {
+        FileMetadata metadata{};
+        metadata.descriptor = file;
+        metadata.file_id = make_file_id(file);
+
+        sv::common::protocol::BlockSignaturesMessage signatures;
+        try
+        {
+            signatures = index.block_signatures(metadata, delta_block_size_);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "[delta] " << ex.what() << "; not sending '" << file.path.string() << "' as a delta"
+                      << std::endl;
+            return std::nullopt;
+        }
+        if (signatures.blocks.empty())
+        {
+            return std::nullopt;
+        }
+
+        DeltaEncoder encoder{signatures};
+        const bool accepted = chunker_.stream_from(
+            file,
+            compressor.codec(),
+            [&](auto& on_output) { return encoder.encode(compressor, file, on_output); },
+            enqueue);
+        delta_bytes_reused_.fetch_add(encoder.copied_bytes());
+        std::cout << "[delta] " << file.path.string() << ": " << encoder.copied_bytes() << " bytes from "
+                  << signatures.blocks.size() << " server blocks, " << encoder.literal_bytes() << " literal bytes"
+                  << std::endl;
+        return accepted;
+    }
+
+    // Returns whether `enqueue` accepted every chunk, or std::nullopt when the server could not be
+    // asked and the file should take the regular path.
+    template <typename Enqueue>
+    std::optional<bool> upload_content_defined(ChunkIndexClient& index,
+                                               const Compressor& compressor,
+                                               const FileDescriptor& file,
+                                               Enqueue& enqueue)
+    {
+        auto recipe = cdc_->scan(file);
+        auto metadata = std::make_shared<FileMetadata>();
+        metadata->descriptor = file;
+        metadata->file_id = make_file_id(file);
+        metadata->sha256_hex = recipe.sha256_hex;
+
+        std::vector<std::uint32_t> missing;
+        try
+        {
+            missing = index.missing_chunks(*metadata, recipe.hashes());
+        }
+        catch (const std::exception& ex)
+        {
+            std::cerr << "[cdc] " << ex.what() << "; sending '" << file.path.string() << "' whole" << std::endl;
+            return std::nullopt;
+        }
+
+        chunks_deduplicated_.fetch_add(recipe.chunks.size() - missing.size());
+        std::cout << "[cdc] " << file.path.string() << ": " << recipe.chunks.size() << " chunks, "
+                  << missing.size() << " to send" << std::endl;
+        if (missing.empty())
+        {
+            if (file_uploaded_callback_)
+            {
+                file_uploaded_callback_(file, recipe.sha256_hex);
+            }
+            return true;
+        }
+
+        metadata->outgoing_chunks = missing.size();
+        return cdc_->emit(compressor, std::shared_ptr<const FileMetadata>(std::move(metadata)), recipe, missing, enqueue);
+    }
+
+    std::size_t threads_;
+    std::uintmax_t stream_threshold_;
+    const Compressor& compressor_;
+    const Chunker& chunker_;
+    ChunkQueue& queue_;
+    SystemChannels& channels_;
+    BoundedBlockingQueue<FileDescriptor> work_;
+    BoundedBlockingQueue<FileDescriptor> priority_work_{64};
+    const TrafficClassifier* classifier_{nullptr};
+    ChunkSpool* spool_{nullptr};
+    std::vector<std::jthread> workers_{};
+    std::atomic<std::size_t> files_processed_{0};
+    std::atomic<std::uintmax_t> bytes_processed_{0};
+    std::atomic<bool> output_closed_{false};
+    ChunkIndexOptions index_options_{};
+    const ContentDefinedChunker* cdc_{nullptr};
+    std::uintmax_t cdc_min_file_size_{0};
+    std::uint32_t delta_block_size_{0};
+    std::uintmax_t delta_min_file_size_{0};
+    std::atomic<std::uintmax_t> delta_bytes_reused_{0};
+    AdaptiveCompressionLevel* adaptive_level_{nullptr};
+    const CodecSelector* codec_selector_{nullptr};
+    std::array<std::atomic<std::size_t>, 3> files_by_codec_{};
+    std::shared_ptr<const ZstdDictionary> dictionary_{};
+    std::uintmax_t dictionary_max_file_size_{0};
+    std::atomic<std::size_t> files_with_dictionary_{0};
+    FilePacker* packer_{nullptr};
+    std::atomic<std::size_t> files_packed_{0};
+    std::atomic<std::size_t> packs_sent_{0};
+    FileUploadedCallback file_uploaded_callback_{};
+    std::atomic<std::size_t> chunks_deduplicated_{0};
+    bool resume_{false};
+    std::uintmax_t resume_min_file_size_{0};
+    std::atomic<std::size_t> chunks_resumed_{0};
+};
+
+}  // namespace sv::client
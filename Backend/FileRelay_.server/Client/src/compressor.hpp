@@ -1,300 +1,506 @@
 #pragma once
 
+#include "dictionary.hpp"
+#include "file_reader.hpp"
 #include "watcher.hpp"
+#include "common/bytes.hpp"
+#include "common/protocol.hpp"
 
 #include <algorithm>
 #include <array>
+#include <condition_variable>
 #include <cstdint>
-#include <cstring>
-#include <fstream>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <span>
 #include <stdexcept>
+#include <stop_token>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <lz4frame.h>
 #include <zstd.h>
 
 namespace sv::client {
 
-class Sha256
+using sv::common::protocol::Codec;
+
+struct CompressedFile
+{
+    FileDescriptor descriptor;
+    std::string sha256_hex;
+    std::vector<std::uint8_t> compressed_data;
+    Codec codec{Codec::Zstd};
+};
+
+// zstd compression contexts are costly to set up; each thread keeps the ones it finished with and
+// hands them out again, so a file only pays for resetting one.
+class ZstdContextCache
 {
 public:
-    Sha256()
+    struct Release
     {
-        state_ = {
-            0x6a09e667u,
-            0xbb67ae85u,
-            0x3c6ef372u,
-            0xa54ff53au,
-            0x510e527fu,
-            0x9b05688cu,
-            0x1f83d9abu,
-            0x5be0cd19u,
-        };
+        void operator()(ZSTD_CCtx* context) const noexcept
+        {
+            auto& contexts = idle();
+            if (contexts.size() < max_idle)
+            {
+                contexts.emplace_back(context);
+            }
+            else
+            {
+                ZSTD_freeCCtx(context);
+            }
+        }
+    };
+    using Handle = std::unique_ptr<ZSTD_CCtx, Release>;
+
+    // A context with no parameters or dictionary set.
+    static Handle acquire()
+    {
+        auto& contexts = idle();
+        if (contexts.empty())
+        {
+            Handle context{ZSTD_createCCtx()};
+            if (!context)
+            {
+                throw std::runtime_error("Failed to create ZSTD_CCtx");
+            }
+            return context;
+        }
+        Handle context{contexts.back().release()};
+        contexts.pop_back();
+        ZSTD_CCtx_reset(context.get(), ZSTD_reset_session_and_parameters);
+        return context;
     }
 
-    void update(std::span<const std::uint8_t> data)
+private:
+    struct Free
     {
-        update(data.data(), data.size());
+        void operator()(ZSTD_CCtx* context) const noexcept { ZSTD_freeCCtx(context); }
+    };
+
+    static constexpr std::size_t max_idle = 4;
+
+    static std::vector<std::unique_ptr<ZSTD_CCtx, Free>>& idle()
+    {
+        thread_local std::vector<std::unique_ptr<ZSTD_CCtx, Free>> contexts;
+        return contexts;
+    }
+};
+
+// SHA-256 on a thread of its own, fed the blocks its compressing thread reads, so that a file is
+// hashed while it is compressed rather than in between. Each compressing thread has its own and
+// hashes one file at a time: begin(), push() its blocks in order, then finish() or cancel().
+class HashStage
+{
+public:
+    HashStage() : thread_([this](std::stop_token stop) { run(stop); }) {}
+
+    HashStage(const HashStage&) = delete;
+    HashStage& operator=(const HashStage&) = delete;
+
+    static HashStage& for_this_thread()
+    {
+        thread_local HashStage stage;
+        return stage;
     }
 
-    void update(const void* data, std::size_t size)
+    void begin()
+    {
+        std::scoped_lock lock(mutex_);
+        sha_.reset();
+    }
+
+    void push(ReadBlock block)
     {
-        if (finalized_)
         {
-            throw std::logic_error("Sha256::update called after finalize");
+            std::scoped_lock lock(mutex_);
+            blocks_.push_back(std::move(block));
         }
+        work_.notify_one();
+    }
 
-        const auto* bytes = static_cast<const std::uint8_t*>(data);
-        bit_count_ += static_cast<std::uint64_t>(size) * 8;
+    // The digest of the blocks pushed since begin(), once they are hashed.
+    std::array<std::uint8_t, 32> finish()
+    {
+        std::unique_lock lock(mutex_);
+        idle_.wait(lock, [this] { return blocks_.empty() && !hashing_; });
+        return sha_.finish();
+    }
 
-        std::size_t offset = 0;
-        while (offset < size)
-        {
-            const auto to_copy = std::min<std::size_t>(size - offset, buffer_.size() - buffer_size_);
-            std::memcpy(buffer_.data() + buffer_size_, bytes + offset, to_copy);
-            buffer_size_ += to_copy;
-            offset += to_copy;
+    // Drops the blocks not hashed yet; returns once no block is held any more.
+    void cancel()
+    {
+        std::unique_lock lock(mutex_);
+        blocks_.clear();
+        idle_.wait(lock, [this] { return !hashing_; });
+    }
 
-            if (buffer_size_ == buffer_.size())
+private:
+    void run(std::stop_token stop)
+    {
+        std::unique_lock lock(mutex_);
+        while (work_.wait(lock, stop, [this] { return !blocks_.empty(); }))
+        {
+            auto block = std::move(blocks_.front());
+            blocks_.pop_front();
+            hashing_ = true;
+            lock.unlock();
+            sha_.update(block.data());
+            // Hands the buffer back to the reader.
+            block = ReadBlock{};
+            lock.lock();
+            hashing_ = false;
+            if (blocks_.empty())
             {
-                transform(buffer_.data());
-                buffer_size_ = 0;
+                idle_.notify_all();
             }
         }
     }
 
-    std::array<std::uint8_t, 32> finalize()
+    std::mutex mutex_;
+    std::condition_variable_any work_;
+    std::condition_variable idle_;
+    std::deque<ReadBlock> blocks_;
+    bool hashing_{false};
+    // Touched outside the lock only by the hashing thread, while blocks are pending.
+    sv::common::bytes::Sha256 sha_;
+    std::jthread thread_;
+};
+
+// Push-style compression for input that is produced piecemeal: a zstd or LZ4 frame, or the input
+// itself for Codec::Stored. Each block of output goes to `on_output` as soon as it is produced;
+// `on_output` returns false to abort, which the calls report by returning false.
+class CompressionStream
+{
+public:
+    // A zstd stream with `dictionary` takes its compression level from the dictionary's CDict.
+    explicit CompressionStream(int compression_level,
+                               Codec codec = Codec::Zstd,
+                               const ZstdDictionary* dictionary = nullptr)
+        : codec_(codec), lz4_(nullptr, &LZ4F_freeCompressionContext)
     {
-        if (!finalized_)
+        if (codec_ == Codec::Zstd)
+        {
+            zstd_ = ZstdContextCache::acquire();
+            const size_t init_result =
+                dictionary ? ZSTD_CCtx_refCDict(zstd_.get(), dictionary->cdict(compression_level))
+                           : ZSTD_CCtx_setParameter(zstd_.get(), ZSTD_c_compressionLevel, compression_level);
+            if (ZSTD_isError(init_result))
+            {
+                throw std::runtime_error(std::string{"Setting up zstd stream failed: "} + ZSTD_getErrorName(init_result));
+            }
+            output_buffer_.resize(ZSTD_CStreamOutSize());
+        }
+        else if (codec_ == Codec::Lz4)
         {
-            finalized_ = true;
+            LZ4F_cctx* context = nullptr;
+            const auto created = LZ4F_createCompressionContext(&context, LZ4F_VERSION);
+            if (LZ4F_isError(created))
+            {
+                throw std::runtime_error(std::string{"LZ4F_createCompressionContext failed: "} +
+                                         LZ4F_getErrorName(created));
+            }
+            lz4_.reset(context);
+            lz4_preferences_.frameInfo.blockSizeID = LZ4F_max256KB;
+            output_buffer_.resize(std::max<std::size_t>(LZ4F_compressBound(lz4_input_step, &lz4_preferences_),
+                                                        LZ4F_HEADER_SIZE_MAX));
+        }
+    }
 
-            buffer_[buffer_size_++] = 0x80;
-            if (buffer_size_ > 56)
+    template <typename OutputFn>
+    bool write(std::span<const std::uint8_t> input, OutputFn&& on_output)
+    {
+        switch (codec_)
+        {
+        case Codec::Stored:
+            return input.empty() || on_output(input);
+        case Codec::Lz4:
+            if (!begin_lz4(on_output))
+            {
+                return false;
+            }
+            while (!input.empty())
             {
-                while (buffer_size_ < 64)
+                const auto step = input.first(std::min(input.size(), lz4_input_step));
+                const auto produced = LZ4F_compressUpdate(lz4_.get(), output_buffer_.data(), output_buffer_.size(),
+                                                          step.data(), step.size(), nullptr);
+                if (LZ4F_isError(produced))
+                {
+                    throw std::runtime_error(std::string{"LZ4F_compressUpdate failed: "} + LZ4F_getErrorName(produced));
+                }
+                if (!emit(produced, on_output))
                 {
-                    buffer_[buffer_size_++] = 0;
+                    return false;
                 }
-                transform(buffer_.data());
-                buffer_size_ = 0;
+                input = input.subspan(step.size());
             }
+            return true;
+        default:
+        {
+            ZSTD_inBuffer in{input.data(), input.size(), 0};
+            while (in.pos < in.size)
+            {
+                drive(in, ZSTD_e_continue, on_output);
+                if (aborted_)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        }
+    }
 
-            while (buffer_size_ < 56)
+    // Ends the frame.
+    template <typename OutputFn>
+    bool finish(OutputFn&& on_output)
+    {
+        if (codec_ == Codec::Stored)
+        {
+            return true;
+        }
+        if (codec_ == Codec::Lz4)
+        {
+            if (!begin_lz4(on_output))
             {
-                buffer_[buffer_size_++] = 0;
+                return false;
             }
+            const auto produced = LZ4F_compressEnd(lz4_.get(), output_buffer_.data(), output_buffer_.size(), nullptr);
+            if (LZ4F_isError(produced))
+            {
+                throw std::runtime_error(std::string{"LZ4F_compressEnd failed: "} + LZ4F_getErrorName(produced));
+            }
+            return emit(produced, on_output);
+        }
 
-            for (int i = 7; i >= 0; --i)
+        ZSTD_inBuffer empty_in{nullptr, 0, 0};
+        std::size_t remaining = 0;
+        do
+        {
+            remaining = drive(empty_in, ZSTD_e_end, on_output);
+            if (aborted_)
             {
-                buffer_[buffer_size_++] = static_cast<std::uint8_t>((bit_count_ >> (i * 8)) & 0xffu);
+                return false;
             }
+        } while (remaining != 0);
+        return true;
+    }
 
-            transform(buffer_.data());
-        }
+private:
+    // LZ4 input is fed in steps of this size so one output buffer fits any step's output.
+    static constexpr std::size_t lz4_input_step = std::size_t{1} << 16;
 
-        std::array<std::uint8_t, 32> digest{};
-        for (std::size_t i = 0; i < state_.size(); ++i)
+    // One compression step; returns what zstd reports as still to flush.
+    template <typename OutputFn>
+    std::size_t drive(ZSTD_inBuffer& in, ZSTD_EndDirective directive, OutputFn& on_output)
+    {
+        ZSTD_outBuffer out{output_buffer_.data(), output_buffer_.size(), 0};
+        const auto remaining = ZSTD_compressStream2(zstd_.get(), &out, &in, directive);
+        if (ZSTD_isError(remaining))
         {
-            digest[i * 4 + 0] = static_cast<std::uint8_t>((state_[i] >> 24) & 0xffu);
-            digest[i * 4 + 1] = static_cast<std::uint8_t>((state_[i] >> 16) & 0xffu);
-            digest[i * 4 + 2] = static_cast<std::uint8_t>((state_[i] >> 8) & 0xffu);
-            digest[i * 4 + 3] = static_cast<std::uint8_t>(state_[i] & 0xffu);
+            throw std::runtime_error(std::string{"ZSTD_compressStream2 failed: "} + ZSTD_getErrorName(remaining));
         }
-
-        return digest;
+        emit(out.pos, on_output);
+        return remaining;
     }
 
-private:
-    void transform(const std::uint8_t block[64])
+    // Writes the LZ4 frame header ahead of the first block.
+    template <typename OutputFn>
+    bool begin_lz4(OutputFn& on_output)
     {
-        static constexpr std::uint32_t k[] = {
-            0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
-            0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
-            0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
-            0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
-            0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
-            0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
-            0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
-            0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u,
-        };
-
-        auto right_rotate = [](std::uint32_t value, std::uint32_t bits) {
-            return (value >> bits) | (value << (32u - bits));
-        };
-
-        std::uint32_t w[64];
-        for (std::size_t i = 0; i < 16; ++i)
+        if (lz4_started_)
         {
-            w[i] = (static_cast<std::uint32_t>(block[i * 4]) << 24) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 1]) << 16) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 2]) << 8) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 3]));
+            return true;
         }
-        for (std::size_t i = 16; i < 64; ++i)
+        lz4_started_ = true;
+        const auto produced = LZ4F_compressBegin(lz4_.get(), output_buffer_.data(), output_buffer_.size(), &lz4_preferences_);
+        if (LZ4F_isError(produced))
         {
-            const std::uint32_t s0 = right_rotate(w[i - 15], 7) ^ right_rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
-            const std::uint32_t s1 = right_rotate(w[i - 2], 17) ^ right_rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
-            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            throw std::runtime_error(std::string{"LZ4F_compressBegin failed: "} + LZ4F_getErrorName(produced));
         }
+        return emit(produced, on_output);
+    }
 
-        std::uint32_t a = state_[0];
-        std::uint32_t b = state_[1];
-        std::uint32_t c = state_[2];
-        std::uint32_t d = state_[3];
-        std::uint32_t e = state_[4];
-        std::uint32_t f = state_[5];
-        std::uint32_t g = state_[6];
-        std::uint32_t h = state_[7];
-
-        for (std::size_t i = 0; i < 64; ++i)
+    template <typename OutputFn>
+    bool emit(std::size_t produced, OutputFn& on_output)
+    {
+        if (produced > 0 && !on_output(std::span<const std::uint8_t>(output_buffer_.data(), produced)))
         {
-            const std::uint32_t S1 = right_rotate(e, 6) ^ right_rotate(e, 11) ^ right_rotate(e, 25);
-            const std::uint32_t ch = (e & f) ^ ((~e) & g);
-            const std::uint32_t temp1 = h + S1 + ch + k[i] + w[i];
-            const std::uint32_t S0 = right_rotate(a, 2) ^ right_rotate(a, 13) ^ right_rotate(a, 22);
-            const std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
-            const std::uint32_t temp2 = S0 + maj;
-
-            h = g;
-            g = f;
-            f = e;
-            e = d + temp1;
-            d = c;
-            c = b;
-            b = a;
-            a = temp1 + temp2;
+            aborted_ = true;
         }
-
-        state_[0] += a;
-        state_[1] += b;
-        state_[2] += c;
-        state_[3] += d;
-        state_[4] += e;
-        state_[5] += f;
-        state_[6] += g;
-        state_[7] += h;
+        return !aborted_;
     }
 
-    std::array<std::uint32_t, 8> state_{};
-    std::array<std::uint8_t, 64> buffer_{};
-    std::uint64_t bit_count_{0};
-    std::size_t buffer_size_{0};
-    bool finalized_{false};
-};
-
-struct CompressedFile
-{
-    FileDescriptor descriptor;
-    std::string sha256_hex;
-    std::vector<std::uint8_t> compressed_data;
+    Codec codec_;
+    ZstdContextCache::Handle zstd_;
+    std::unique_ptr<LZ4F_cctx, decltype(&LZ4F_freeCompressionContext)> lz4_;
+    LZ4F_preferences_t lz4_preferences_{};
+    bool lz4_started_{false};
+    std::vector<std::uint8_t> output_buffer_;
+    bool aborted_{false};
 };
 
 class Compressor
 {
 public:
-    explicit Compressor(int compression_level = ZSTD_CLEVEL_DEFAULT) : compression_level_(compression_level) {}
+    explicit Compressor(int compression_level = ZSTD_CLEVEL_DEFAULT, Codec codec = Codec::Zstd)
+        : compression_level_(compression_level), codec_(codec)
+    {
+    }
 
-    CompressedFile operator()(const FileDescriptor& descriptor) const
+    // The zstd level; LZ4 always runs at its fastest setting.
+    [[nodiscard]] int level() const noexcept { return compression_level_; }
+    [[nodiscard]] Codec codec() const noexcept { return codec_; }
+
+    [[nodiscard]] const std::shared_ptr<const ZstdDictionary>& dictionary() const noexcept { return dictionary_; }
+
+    // Same settings at another level, codec or dictionary; cheap enough to make per file.
+    [[nodiscard]] Compressor with_level(int compression_level) const
     {
-        std::ifstream file(descriptor.path, std::ios::binary);
-        if (!file)
-        {
-            throw std::runtime_error("Failed to open file for compression: " + descriptor.path.string());
-        }
+        auto copy = *this;
+        copy.compression_level_ = compression_level;
+        return copy;
+    }
 
-        // Increase the size of the underlying stream buffer to reduce syscalls when reading large files.
-        std::vector<char> file_buffer(1 << 16);
-        file.rdbuf()->pubsetbuf(file_buffer.data(), static_cast<std::streamsize>(file_buffer.size()));
+    [[nodiscard]] Compressor with_codec(Codec codec) const
+    {
+        auto copy = *this;
+        copy.codec_ = codec;
+        return copy;
+    }
 
-        Sha256 sha;
+    // zstd streams are primed with `dictionary`; nullptr compresses without one.
+    [[nodiscard]] Compressor with_dictionary(std::shared_ptr<const ZstdDictionary> dictionary) const
+    {
+        auto copy = *this;
+        copy.dictionary_ = std::move(dictionary);
+        return copy;
+    }
 
-        ZSTD_CStream* stream = ZSTD_createCStream();
-        if (!stream)
-        {
-            throw std::runtime_error("Failed to create ZSTD_CStream");
-        }
+    // How files are read for compression and hashing.
+    [[nodiscard]] const FileReaderOptions& reader() const noexcept { return reader_; }
 
-        const size_t init_result = ZSTD_initCStream(stream, compression_level_);
-        if (ZSTD_isError(init_result))
-        {
-            ZSTD_freeCStream(stream);
-            throw std::runtime_error(std::string{"ZSTD_initCStream failed: "} + ZSTD_getErrorName(init_result));
-        }
+    [[nodiscard]] Compressor with_reader(FileReaderOptions reader) const
+    {
+        auto copy = *this;
+        copy.reader_ = reader;
+        return copy;
+    }
 
-        std::vector<std::uint8_t> compressed;
-        compressed.reserve(static_cast<std::size_t>(descriptor.size / 2 + 1'024));
+    // A second thread only pays off with a second CPU to run it on.
+    static std::uintmax_t default_hash_thread_min_size()
+    {
+        return std::thread::hardware_concurrency() > 1 ? 1024 * 1024 : 0;
+    }
 
-        std::array<char, 1 << 15> input_buffer{};
-        std::array<char, 1 << 15> output_buffer{};
+    // Files of at least `min_size` bytes are hashed on a HashStage while they are compressed; 0 hashes
+    // every file on the compressing thread.
+    [[nodiscard]] Compressor with_hash_thread(std::uintmax_t min_size) const
+    {
+        auto copy = *this;
+        copy.hash_thread_min_size_ = min_size;
+        return copy;
+    }
 
-        while (file.good())
-        {
-            file.read(input_buffer.data(), static_cast<std::streamsize>(input_buffer.size()));
-            const auto read = static_cast<std::size_t>(file.gcount());
+    [[nodiscard]] CompressionStream open_stream() const
+    {
+        return CompressionStream{compression_level_, codec_, dictionary_.get()};
+    }
 
-            if (read > 0)
-            {
-                sha.update(input_buffer.data(), read);
-            }
+    CompressedFile operator()(const FileDescriptor& descriptor) const
+    {
+        std::vector<std::uint8_t> compressed;
+        compressed.reserve(static_cast<std::size_t>((codec_ == Codec::Stored ? descriptor.size : descriptor.size / 2) + 1'024));
 
-            ZSTD_inBuffer in{input_buffer.data(), read, 0};
-            while (in.pos < in.size())
-            {
-                ZSTD_outBuffer out{output_buffer.data(), output_buffer.size(), 0};
-                const auto remaining = ZSTD_compressStream2(stream, &out, &in, ZSTD_e_continue);
-                if (ZSTD_isError(remaining))
-                {
-                    ZSTD_freeCStream(stream);
-                    throw std::runtime_error(std::string{"ZSTD_compressStream2 failed: "} +
-                                             ZSTD_getErrorName(remaining));
-                }
-                const auto* begin = reinterpret_cast<const std::uint8_t*>(output_buffer.data());
-                compressed.insert(compressed.end(), begin, begin + static_cast<std::ptrdiff_t>(out.pos));
-            }
+        auto sha256_hex = compress_stream(descriptor, [&compressed](std::span<const std::uint8_t> output) {
+            compressed.insert(compressed.end(), output.begin(), output.end());
+            return true;
+        });
 
-            if (read == 0)
-            {
-                break;
-            }
-        }
+        CompressedFile output{};
+        output.descriptor = descriptor;
+        output.sha256_hex = std::move(*sha256_hex);
+        output.compressed_data = std::move(compressed);
+        output.codec = codec_;
+        return output;
+    }
 
-        if (!file.eof() && file.fail())
+    // Compresses the file and hands each block of compressed output to `on_output` as soon as zstd
+    // produces it. `on_output` returns false to abort. Returns the SHA-256 of the original file, or
+    // std::nullopt when aborted.
+    template <typename OutputFn>
+    std::optional<std::string> compress_stream(const FileDescriptor& descriptor, OutputFn&& on_output) const
+    {
+        auto stream = open_stream();
+        if (hash_thread_min_size_ == 0 || descriptor.size < hash_thread_min_size_)
         {
-            ZSTD_freeCStream(stream);
-            throw std::runtime_error("Failed while reading file for compression: " + descriptor.path.string());
+            sv::common::bytes::Sha256 sha;
+            const bool complete = read_file(descriptor.path, reader_, [&](std::span<const std::uint8_t> input) {
+                sha.update(input);
+                return stream.write(input, on_output);
+            });
+            if (!complete || !stream.finish(on_output))
+            {
+                return std::nullopt;
+            }
+            return to_hex(sha.finish());
         }
 
-        ZSTD_inBuffer empty_in{nullptr, 0, 0};
-        std::size_t remaining = 0;
-        do
+        // Both stages work on the same read buffers; the reader reuses one once both let go of it.
+        auto& hasher = HashStage::for_this_thread();
+        hasher.begin();
+        try
         {
-            ZSTD_outBuffer out{output_buffer.data(), output_buffer.size(), 0};
-            remaining = ZSTD_compressStream2(stream, &out, &empty_in, ZSTD_e_end);
-            if (ZSTD_isError(remaining))
+            const bool complete = read_file(descriptor.path, reader_, [&](const ReadBlock& block) {
+                hasher.push(block);
+                return stream.write(block.data(), on_output);
+            });
+            if (!complete || !stream.finish(on_output))
             {
-                ZSTD_freeCStream(stream);
-                throw std::runtime_error(std::string{"ZSTD_compressStream2 final flush failed: "} +
-                                         ZSTD_getErrorName(remaining));
+                hasher.cancel();
+                return std::nullopt;
             }
-            const auto* begin = reinterpret_cast<const std::uint8_t*>(output_buffer.data());
-            compressed.insert(compressed.end(), begin, begin + static_cast<std::ptrdiff_t>(out.pos));
-        } while (remaining != 0);
-
-        ZSTD_freeCStream(stream);
+        }
+        catch (...)
+        {
+            hasher.cancel();
+            throw;
+        }
+        return to_hex(hasher.finish());
+    }
 
-        const auto digest = sha.finalize();
+    // SHA-256 of the file's current content, as compress_stream() would report it.
+    static std::string sha256_file(const FileDescriptor& descriptor, const FileReaderOptions& reader = {})
+    {
+        sv::common::bytes::Sha256 sha;
+        read_file(descriptor.path, reader, [&sha](std::span<const std::uint8_t> input) {
+            sha.update(input);
+            return true;
+        });
+        return to_hex(sha.finish());
+    }
 
-        CompressedFile output{};
-        output.descriptor = descriptor;
-        output.sha256_hex = to_hex(digest);
-        output.compressed_data = std::move(compressed);
+    // Compresses `data` into one self-contained zstd frame that records its content size, whatever the
+    // codec and without the dictionary.
+    std::vector<std::uint8_t> compress_block(std::span<const std::uint8_t> data) const
+    {
+        const auto context = ZstdContextCache::acquire();
+        std::vector<std::uint8_t> output(ZSTD_compressBound(data.size()));
+        const auto size =
+            ZSTD_compressCCtx(context.get(), output.data(), output.size(), data.data(), data.size(), compression_level_);
+        if (ZSTD_isError(size))
+        {
+            throw std::runtime_error(std::string{"ZSTD_compressCCtx failed: "} + ZSTD_getErrorName(size));
+        }
+        output.resize(size);
         return output;
     }
 
-private:
     static std::string to_hex(const std::array<std::uint8_t, 32>& digest)
     {
         static constexpr char hex_chars[] = "0123456789abcdef";
@@ -307,7 +513,12 @@ private:
         return result;
     }
 
+private:
     int compression_level_;
+    Codec codec_;
+    std::shared_ptr<const ZstdDictionary> dictionary_{};
+    FileReaderOptions reader_{};
+    std::uintmax_t hash_thread_min_size_{default_hash_thread_min_size()};
 };
 
 }  // namespace sv::client
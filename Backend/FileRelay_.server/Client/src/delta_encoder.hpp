@@ -0,0 +1,248 @@
+#pragma once
+
+#include "compressor.hpp"
+#include "watcher.hpp"
+#include "common/bytes.hpp"
+#include "common/delta.hpp"
+#include "common/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace sv::client {
+
+// Encodes a new version of a file as delta instructions (see common/delta.hpp) against the block
+// signatures of the server's copy, rsync style: a weak checksum rolls over every offset of the new
+// file, and a window whose weak checksum belongs to a base block and whose strong hash matches too
+// becomes a block reference; everything else travels as literal bytes. The instructions are zstd
+// compressed on the fly.
+class DeltaEncoder
+{
+public:
+    explicit DeltaEncoder(const sv::common::protocol::BlockSignaturesMessage& signatures)
+        : signatures_(signatures), block_size_(signatures.block_size), filter_(filter_words, 0)
+    {
+        if (block_size_ < sv::common::delta::MinBlockSize || block_size_ > sv::common::delta::MaxBlockSize)
+        {
+            throw std::invalid_argument("Delta block size out of range");
+        }
+        index_.reserve(signatures_.blocks.size());
+        for (std::uint32_t block = 0; block < signatures_.blocks.size(); ++block)
+        {
+            const auto weak = signatures_.blocks[block].weak;
+            index_[weak].push_back(block);
+            const auto bit = filter_bit(weak);
+            filter_[bit / 64] |= std::uint64_t{1} << (bit % 64);
+        }
+    }
+
+    // Streams the compressed instructions to `on_output`. Returns the new file's SHA-256, or
+    // std::nullopt when `on_output` refused a block.
+    template <typename OutputFn>
+    std::optional<std::string> encode(const Compressor& compressor, const FileDescriptor& descriptor, OutputFn&& on_output)
+    {
+        namespace delta = sv::common::delta;
+        std::ifstream file(descriptor.path, std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Failed to open file for delta encoding: " + descriptor.path.string());
+        }
+
+        auto stream = compressor.open_stream();
+        bool accepted = true;
+        auto emit = [&](std::span<const std::uint8_t> bytes) {
+            accepted = accepted && stream.write(bytes, on_output);
+        };
+
+        std::array<std::uint8_t, delta::HeaderSize> header{};
+        std::memcpy(header.data(), delta::Magic.data(), delta::Magic.size());
+        sv::common::bytes::write_u32_le(block_size_, header.data() + 4);
+        sv::common::bytes::write_u64_le(signatures_.base_size, header.data() + 8);
+        emit(header);
+
+        std::uint32_t copy_first = 0;
+        std::uint32_t copy_count = 0;
+        auto flush_copy = [&] {
+            if (copy_count == 0)
+            {
+                return;
+            }
+            std::array<std::uint8_t, delta::CopySize> op{};
+            op[0] = static_cast<std::uint8_t>(delta::Op::Copy);
+            sv::common::bytes::write_u32_le(copy_first, op.data() + 1);
+            sv::common::bytes::write_u32_le(copy_count, op.data() + 5);
+            emit(op);
+            copied_bytes_ += static_cast<std::uint64_t>(copy_count) * block_size_;
+            copy_count = 0;
+        };
+        auto flush_literal = [&](std::span<const std::uint8_t> literal) {
+            if (literal.empty())
+            {
+                return;
+            }
+            flush_copy();
+            std::array<std::uint8_t, delta::LiteralPrefixSize> op{};
+            op[0] = static_cast<std::uint8_t>(delta::Op::Literal);
+            sv::common::bytes::write_u32_le(static_cast<std::uint32_t>(literal.size()), op.data() + 1);
+            emit(op);
+            emit(literal);
+            literal_bytes_ += literal.size();
+        };
+
+        sv::common::bytes::Sha256 sha;
+        std::vector<std::uint8_t> buffer(std::max<std::size_t>(std::size_t{4} * block_size_, 4 * 1024 * 1024));
+        std::size_t literal_begin = 0;
+        std::size_t position = 0;
+        std::size_t end = 0;
+        bool eof = false;
+        sv::common::delta::RollingChecksum checksum;
+        bool checksum_valid = false;
+
+        while (accepted)
+        {
+            if (!eof && end - position < block_size_)
+            {
+                // Pending literal bytes go out before the buffer is compacted under them.
+                flush_literal(std::span<const std::uint8_t>(buffer.data() + literal_begin, position - literal_begin));
+                std::memmove(buffer.data(), buffer.data() + position, end - position);
+                end -= position;
+                position = 0;
+                literal_begin = 0;
+                while (!eof && end < buffer.size())
+                {
+                    file.read(reinterpret_cast<char*>(buffer.data() + end), static_cast<std::streamsize>(buffer.size() - end));
+                    const auto read = static_cast<std::size_t>(file.gcount());
+                    sha.update(buffer.data() + end, read);
+                    end += read;
+                    eof = !file;
+                }
+                if (file.bad())
+                {
+                    throw std::runtime_error("Failed while reading file for delta encoding: " + descriptor.path.string());
+                }
+            }
+            if (end - position < block_size_)
+            {
+                break;
+            }
+
+            const auto window = std::span<const std::uint8_t>(buffer.data() + position, block_size_);
+            if (!checksum_valid)
+            {
+                checksum.reset(window);
+                checksum_valid = true;
+            }
+
+            const auto weak = checksum.value();
+            const auto preferred = copy_count > 0 ? copy_first + copy_count : std::uint32_t{0xFFFFFFFF};
+            if (const auto block = may_match(weak) ? find_block(weak, window, preferred) : std::nullopt)
+            {
+                flush_literal(std::span<const std::uint8_t>(buffer.data() + literal_begin, position - literal_begin));
+                if (copy_count > 0 && *block == copy_first + copy_count)
+                {
+                    ++copy_count;
+                }
+                else
+                {
+                    flush_copy();
+                    copy_first = *block;
+                    copy_count = 1;
+                }
+                position += block_size_;
+                literal_begin = position;
+                checksum_valid = false;
+                continue;
+            }
+
+            if (position + block_size_ < end)
+            {
+                checksum.roll(buffer[position], buffer[position + block_size_]);
+            }
+            else
+            {
+                checksum_valid = false;
+            }
+            ++position;
+        }
+
+        flush_literal(std::span<const std::uint8_t>(buffer.data() + literal_begin, end - literal_begin));
+        flush_copy();
+
+        const auto digest = sha.finish();
+        std::array<std::uint8_t, delta::EndSize> end_op{};
+        end_op[0] = static_cast<std::uint8_t>(delta::Op::End);
+        std::copy(digest.begin(), digest.end(), end_op.begin() + 1);
+        emit(end_op);
+
+        if (!accepted || !stream.finish(on_output))
+        {
+            return std::nullopt;
+        }
+        return Compressor::to_hex(digest);
+    }
+
+    [[nodiscard]] std::uint64_t literal_bytes() const noexcept { return literal_bytes_; }
+    [[nodiscard]] std::uint64_t copied_bytes() const noexcept { return copied_bytes_; }
+
+private:
+    static constexpr std::size_t filter_words = (std::size_t{1} << 20) / 64;
+
+    static std::size_t filter_bit(std::uint32_t weak) noexcept
+    {
+        return static_cast<std::size_t>((weak * 0x9E3779B1U) >> 12);
+    }
+
+    // Bloom-style prefilter checked at every offset; most offsets of changed data stop here.
+    bool may_match(std::uint32_t weak) const noexcept
+    {
+        const auto bit = filter_bit(weak);
+        return (filter_[bit / 64] & (std::uint64_t{1} << (bit % 64))) != 0;
+    }
+
+    // Base block whose content equals `window`, preferring `preferred` so runs of blocks coalesce.
+    std::optional<std::uint32_t> find_block(std::uint32_t weak, std::span<const std::uint8_t> window, std::uint32_t preferred) const
+    {
+        const auto candidates = index_.find(weak);
+        if (candidates == index_.end())
+        {
+            return std::nullopt;
+        }
+
+        const auto strong = sv::common::delta::strong_hash(window);
+        std::optional<std::uint32_t> match;
+        for (const auto block : candidates->second)
+        {
+            if (signatures_.blocks[block].strong == strong)
+            {
+                if (block == preferred)
+                {
+                    return block;
+                }
+                if (!match)
+                {
+                    match = block;
+                }
+            }
+        }
+        return match;
+    }
+
+    const sv::common::protocol::BlockSignaturesMessage& signatures_;
+    std::uint32_t block_size_;
+    std::unordered_map<std::uint32_t, std::vector<std::uint32_t>> index_;
+    std::vector<std::uint64_t> filter_;
+    std::uint64_t literal_bytes_{0};
+    std::uint64_t copied_bytes_{0};
+};
+
+}  // namespace sv::client
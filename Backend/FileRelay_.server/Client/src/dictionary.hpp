@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <zdict.h>
+#include <zstd.h>
+
+namespace sv::client {
+
+struct DictionaryOptions
+{
+    std::size_t max_size{112 * 1024};
+    // Training samples are the files of at most max_sample_file_size bytes, up to max_samples files
+    // and max_sample_bytes bytes in total.
+    std::uintmax_t max_sample_file_size{128 * 1024};
+    std::size_t max_samples{4'000};
+    std::size_t max_sample_bytes{16 * 1024 * 1024};
+};
+
+// A trained zstd dictionary. Small files compressed on their own leave zstd nothing to refer back
+// to; with a dictionary trained on their siblings they start out knowing the common field names,
+// boilerplate and byte statistics. The digested ZSTD_CDict depends on the compression level, so one
+// is built per level on first use and kept. Thread-safe.
+class ZstdDictionary
+{
+public:
+    explicit ZstdDictionary(std::vector<std::uint8_t> content)
+        : content_(std::move(content)), id_(ZDICT_getDictID(content_.data(), content_.size()))
+    {
+        if (id_ == 0)
+        {
+            throw std::runtime_error("Not a zstd dictionary");
+        }
+    }
+
+    ZstdDictionary(const ZstdDictionary&) = delete;
+    ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+
+    // Trains on a sample of the files below `root`. Returns nullptr when there is too little to learn
+    // from.
+    static std::shared_ptr<const ZstdDictionary> train(const std::filesystem::path& root,
+                                                       const DictionaryOptions& options = {})
+    {
+        std::vector<char> samples;
+        std::vector<std::size_t> sample_sizes;
+        std::error_code ec;
+        for (std::filesystem::recursive_directory_iterator it{root, ec}, end; !ec && it != end; it.increment(ec))
+        {
+            if (sample_sizes.size() >= options.max_samples)
+            {
+                break;
+            }
+            std::error_code entry_ec;
+            if (!it->is_regular_file(entry_ec))
+            {
+                continue;
+            }
+            const auto size = it->file_size(entry_ec);
+            if (entry_ec || size == 0 || size > options.max_sample_file_size ||
+                samples.size() + size > options.max_sample_bytes)
+            {
+                continue;
+            }
+            std::ifstream file(it->path(), std::ios::binary);
+            const auto before = samples.size();
+            samples.insert(samples.end(), std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            if (samples.size() > before)
+            {
+                sample_sizes.push_back(samples.size() - before);
+            }
+        }
+
+        std::vector<std::uint8_t> content(options.max_size);
+        const auto size = sample_sizes.empty()
+                              ? std::size_t{0}
+                              : ZDICT_trainFromBuffer(content.data(), content.size(), samples.data(),
+                                                      sample_sizes.data(), static_cast<unsigned>(sample_sizes.size()));
+        if (sample_sizes.empty() || ZDICT_isError(size))
+        {
+            std::cerr << "[dict] not enough sample data to train on (" << sample_sizes.size() << " files"
+                      << (sample_sizes.empty() ? std::string{} : std::string{", "} + ZDICT_getErrorName(size))
+                      << ')' << std::endl;
+            return nullptr;
+        }
+        content.resize(size);
+        auto dictionary = std::make_shared<const ZstdDictionary>(std::move(content));
+        std::cout << "[dict] trained dictionary " << dictionary->id() << " (" << size << " bytes) on "
+                  << sample_sizes.size() << " files, " << samples.size() << " bytes" << std::endl;
+        return dictionary;
+    }
+
+    // Loads the dictionary kept at `path`, or trains one on `root` and keeps it there, so the same
+    // dictionary and id survive restarts.
+    static std::shared_ptr<const ZstdDictionary> load_or_train(const std::filesystem::path& path,
+                                                               const std::filesystem::path& root,
+                                                               const DictionaryOptions& options = {})
+    {
+        if (std::ifstream in{path, std::ios::binary})
+        {
+            std::vector<std::uint8_t> content{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+            auto dictionary = std::make_shared<const ZstdDictionary>(std::move(content));
+            std::cout << "[dict] loaded dictionary " << dictionary->id() << " from " << path.string() << std::endl;
+            return dictionary;
+        }
+
+        auto dictionary = train(root, options);
+        if (dictionary)
+        {
+            std::ofstream out(path, std::ios::binary | std::ios::trunc);
+            const auto content = dictionary->content();
+            out.write(reinterpret_cast<const char*>(content.data()), static_cast<std::streamsize>(content.size()));
+            if (!out)
+            {
+                std::cerr << "[dict] failed to save dictionary to " << path.string() << std::endl;
+            }
+        }
+        return dictionary;
+    }
+
+    [[nodiscard]] std::uint32_t id() const noexcept { return id_; }
+    [[nodiscard]] std::span<const std::uint8_t> content() const noexcept { return content_; }
+
+    [[nodiscard]] const ZSTD_CDict* cdict(int level) const
+    {
+        std::scoped_lock lock(mutex_);
+        auto& cdict = cdicts_[level];
+        if (!cdict)
+        {
+            cdict.reset(ZSTD_createCDict(content_.data(), content_.size(), level));
+            if (!cdict)
+            {
+                throw std::runtime_error("Failed to create ZSTD_CDict");
+            }
+        }
+        return cdict.get();
+    }
+
+private:
+    struct CDictDeleter
+    {
+        void operator()(ZSTD_CDict* cdict) const noexcept { ZSTD_freeCDict(cdict); }
+    };
+
+    std::vector<std::uint8_t> content_;
+    std::uint32_t id_;
+    mutable std::mutex mutex_;
+    mutable std::map<int, std::unique_ptr<ZSTD_CDict, CDictDeleter>> cdicts_;
+};
+
+}  // namespace sv::client
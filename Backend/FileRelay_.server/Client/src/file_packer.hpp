@@ -0,0 +1,142 @@
+#pragma once
+
+#include "chunker.hpp"
+#include "compressor.hpp"
+#include "watcher.hpp"
+#include "common/bytes.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace sv::client {
+
+struct PackOptions
+{
+    // Files of at most max_file_size bytes are packed.
+    std::uintmax_t max_file_size{64 * 1024};
+    // A pack is sealed once it holds max_pack_bytes bytes or max_pack_files files.
+    std::uintmax_t max_pack_bytes{4 * 1024 * 1024};
+    std::size_t max_pack_files{1'024};
+};
+
+// Collects small files into packs. Sent one by one, every tiny file costs a FileMeta frame, a patch
+// header, a patch file, a manifest and an assembly on the server, each with its own fsync; a pack
+// costs one PackIndex frame and one patch for all of its files, which the server unpacks in one pass
+// behind a single durability barrier. The files share one compressed stream, so zstd also gets to
+// use what they have in common. Thread-safe.
+class FilePacker
+{
+public:
+    explicit FilePacker(PackOptions options) : options_(options) {}
+
+    FilePacker(const FilePacker&) = delete;
+    FilePacker& operator=(const FilePacker&) = delete;
+
+    [[nodiscard]] bool accepts(const FileDescriptor& file) const noexcept
+    {
+        return file.size <= options_.max_file_size;
+    }
+
+    // Adds a file to the pack being collected. Returns the pack's files once it is full.
+    std::vector<FileDescriptor> add(FileDescriptor file)
+    {
+        std::scoped_lock lock(mutex_);
+        pending_bytes_ += file.size;
+        pending_.push_back(std::move(file));
+        if (pending_bytes_ < options_.max_pack_bytes && pending_.size() < options_.max_pack_files)
+        {
+            return {};
+        }
+        return take_locked();
+    }
+
+    // Hands over the files collected so far, full pack or not.
+    std::vector<FileDescriptor> take()
+    {
+        std::scoped_lock lock(mutex_);
+        return take_locked();
+    }
+
+    // Reads and compresses `files` into the single chunk of a pack upload. Files that can no longer
+    // be read are left out and picked up by the watcher when they change again. Returns std::nullopt
+    // when none could be read.
+    static std::optional<FileChunk> seal(const Compressor& compressor, const std::vector<FileDescriptor>& files)
+    {
+        auto metadata = std::make_shared<FileMetadata>();
+        metadata->codec = compressor.codec();
+        metadata->packed_files.reserve(files.size());
+
+        std::vector<std::uint8_t> payload;
+        auto on_output = [&payload](std::span<const std::uint8_t> output) {
+            payload.insert(payload.end(), output.begin(), output.end());
+            return true;
+        };
+        auto stream = compressor.open_stream();
+        sv::common::bytes::Sha256 pack_identity;
+        std::uint64_t offset = 0;
+        std::vector<std::uint8_t> content;
+        for (const auto& file : files)
+        {
+            std::ifstream in(file.path, std::ios::binary);
+            if (!in)
+            {
+                std::cerr << "[pack] failed to open '" << file.path.string() << "'; leaving it out" << std::endl;
+                continue;
+            }
+            content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+
+            PackedFile packed{};
+            packed.descriptor = file;
+            packed.descriptor.size = content.size();
+            packed.offset = offset;
+            packed.sha256_hex = Compressor::to_hex(sv::common::bytes::sha256(content));
+            offset += content.size();
+            stream.write(content, on_output);
+
+            const auto file_id = make_file_id(file);
+            pack_identity.update(&file_id, sizeof(file_id));
+            metadata->packed_files.push_back(std::move(packed));
+        }
+        if (metadata->packed_files.empty())
+        {
+            return std::nullopt;
+        }
+        stream.finish(on_output);
+
+        metadata->file_id = sv::common::bytes::read_u64_le(pack_identity.finish().data());
+        metadata->descriptor.path = "pack of " + std::to_string(metadata->packed_files.size()) + " files";
+        metadata->descriptor.size = offset;
+
+        FileChunk chunk{};
+        chunk.file = std::move(metadata);
+        chunk.length = payload.size();
+        chunk.buffer = std::make_shared<const std::vector<std::uint8_t>>(std::move(payload));
+        chunk.total_chunks = 1;
+        chunk.final_chunk = true;
+        return chunk;
+    }
+
+private:
+    std::vector<FileDescriptor> take_locked()
+    {
+        pending_bytes_ = 0;
+        return std::exchange(pending_, {});
+    }
+
+    PackOptions options_;
+    std::mutex mutex_;
+    std::vector<FileDescriptor> pending_;
+    std::uintmax_t pending_bytes_{0};
+};
+
+}  // namespace sv::client
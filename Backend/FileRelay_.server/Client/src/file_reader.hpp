@@ -0,0 +1,810 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Files are read through file descriptors on Linux, where O_DIRECT and io_uring are to be had; other
+// platforms read them through std::ifstream.
+#if defined(__linux__)
+#define SV_CLIENT_POSIX_READ 1
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define SV_CLIENT_POSIX_READ 0
+#include <fstream>
+#endif
+
+#if SV_CLIENT_POSIX_READ && __has_include(<linux/io_uring.h>)
+#define SV_CLIENT_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#else
+#define SV_CLIENT_IO_URING 0
+#endif
+
+namespace sv::client {
+
+enum class ReadBackend : std::uint8_t
+{
+    Sync = 0,     // one pread at a time
+    IoUring = 1,  // several reads in flight through io_uring; pread where the kernel does not offer it
+};
+
+inline ReadBackend parse_read_backend(std::string_view name)
+{
+    if (name == "sync")
+    {
+        return ReadBackend::Sync;
+    }
+    if (name == "io_uring")
+    {
+        return ReadBackend::IoUring;
+    }
+    throw std::invalid_argument("Unknown read backend: " + std::string{name});
+}
+
+struct FileReaderOptions
+{
+    // Bounds for block_size and depth; a read's length has to fit io_uring's 32-bit field.
+    static constexpr std::size_t max_block_size = std::size_t{1} << 30;
+    static constexpr std::size_t max_depth = 64;
+
+    ReadBackend backend{ReadBackend::IoUring};
+    // Bytes per read, rounded up to whole pages.
+    std::size_t block_size{256 * 1024};
+    // Buffers each reading thread has: the reads io_uring keeps in flight ahead of the block being
+    // processed, and the blocks that stages behind the reader may hold.
+    std::size_t depth{4};
+    // Bypass the page cache (O_DIRECT). Files on file systems that refuse it, and every file off
+    // Linux, are read buffered.
+    bool direct{false};
+};
+
+namespace detail {
+
+inline constexpr std::size_t read_alignment = 4096;
+inline constexpr std::size_t max_read_depth = FileReaderOptions::max_depth;
+
+struct AlignedFree
+{
+    void operator()(std::uint8_t* memory) const noexcept
+    {
+        ::operator delete[](memory, std::align_val_t{read_alignment});
+    }
+};
+using AlignedBuffer = std::unique_ptr<std::uint8_t[], AlignedFree>;
+
+// Page-aligned, as O_DIRECT wants its buffers.
+inline AlignedBuffer allocate_aligned(std::size_t size)
+{
+    return AlignedBuffer{static_cast<std::uint8_t*>(::operator new[](size, std::align_val_t{read_alignment}))};
+}
+
+inline std::size_t aligned_block_size(std::size_t block_size)
+{
+    return std::max<std::size_t>(1, (block_size + read_alignment - 1) / read_alignment) * read_alignment;
+}
+
+struct BlockBuffer;
+
+}  // namespace detail
+
+// A block of a file handed out by read_file(). Copies share the block and may outlive the call that
+// received it, on other threads too, so that several stages work on one read without copying it. The
+// reader reads the next part of the file into the block's memory only once the last copy is gone,
+// and read_file() returns only then.
+class ReadBlock
+{
+public:
+    ReadBlock() = default;
+    ReadBlock(const ReadBlock& other) noexcept : data_(other.data_), holders_(other.holders_)
+    {
+        if (holders_ != nullptr)
+        {
+            holders_->fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    ReadBlock(ReadBlock&& other) noexcept : data_(other.data_), holders_(std::exchange(other.holders_, nullptr)) {}
+    ReadBlock& operator=(ReadBlock other) noexcept
+    {
+        std::swap(data_, other.data_);
+        std::swap(holders_, other.holders_);
+        return *this;
+    }
+    ~ReadBlock()
+    {
+        if (holders_ != nullptr && holders_->fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            holders_->notify_all();
+        }
+    }
+
+    [[nodiscard]] std::span<const std::uint8_t> data() const noexcept { return data_; }
+
+private:
+    friend struct detail::BlockBuffer;
+
+    ReadBlock(std::span<const std::uint8_t> data, std::atomic<std::uint32_t>* holders) noexcept
+        : data_(data), holders_(holders)
+    {
+    }
+
+    std::span<const std::uint8_t> data_{};
+    std::atomic<std::uint32_t>* holders_{nullptr};
+};
+
+namespace detail {
+
+// A buffer the reader reads into, and how many ReadBlocks hold it.
+struct BlockBuffer
+{
+    explicit BlockBuffer(std::size_t size) : memory(allocate_aligned(size)) {}
+
+    BlockBuffer(const BlockBuffer&) = delete;
+    BlockBuffer& operator=(const BlockBuffer&) = delete;
+
+    [[nodiscard]] bool free() const noexcept { return holders.load(std::memory_order_acquire) == 0; }
+
+    void wait_free() const noexcept
+    {
+        for (auto held = holders.load(std::memory_order_acquire); held != 0;
+             held = holders.load(std::memory_order_acquire))
+        {
+            holders.wait(held, std::memory_order_acquire);
+        }
+    }
+
+    ReadBlock hand_out(std::size_t size) noexcept
+    {
+        holders.store(1, std::memory_order_relaxed);
+        return ReadBlock{std::span<const std::uint8_t>(memory.get(), size), &holders};
+    }
+
+    AlignedBuffer memory;
+    std::atomic<std::uint32_t> holders{0};
+};
+
+using BlockBuffers = std::vector<std::unique_ptr<BlockBuffer>>;
+
+inline BlockBuffers make_block_buffers(std::size_t count, std::size_t block_size)
+{
+    BlockBuffers buffers;
+    for (std::size_t index = 0; index < count; ++index)
+    {
+        buffers.push_back(std::make_unique<BlockBuffer>(block_size));
+    }
+    return buffers;
+}
+
+inline void wait_all_free(const BlockBuffers& buffers) noexcept
+{
+    for (const auto& buffer : buffers)
+    {
+        buffer->wait_free();
+    }
+}
+
+// Hands a block to `on_block`, which takes either the ReadBlock or just its bytes.
+template <typename BlockFn>
+bool deliver(BlockBuffer& buffer, std::size_t size, BlockFn& on_block)
+{
+    const auto block = buffer.hand_out(size);
+    if constexpr (std::is_invocable_r_v<bool, BlockFn&, const ReadBlock&>)
+    {
+        return on_block(block);
+    }
+    else
+    {
+        return on_block(block.data());
+    }
+}
+
+inline std::runtime_error read_error(const std::filesystem::path& path, int error)
+{
+    return std::runtime_error("Failed while reading " + path.string() + ": " + std::strerror(error));
+}
+
+// The thread's `depth` buffers of `block_size` bytes for the synchronous readers.
+inline BlockBuffers& thread_block_buffers(std::size_t block_size, std::size_t depth)
+{
+    thread_local BlockBuffers buffers;
+    thread_local std::size_t buffers_block_size = 0;
+    if (buffers.size() != depth || buffers_block_size != block_size)
+    {
+        buffers = make_block_buffers(depth, block_size);
+        buffers_block_size = block_size;
+    }
+    return buffers;
+}
+
+#if SV_CLIENT_POSIX_READ
+
+class FileHandle
+{
+public:
+    explicit FileHandle(int fd) noexcept : fd_(fd) {}
+    ~FileHandle()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+        }
+    }
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    [[nodiscard]] int get() const noexcept { return fd_; }
+
+private:
+    int fd_;
+};
+
+inline int open_for_reading(const std::filesystem::path& path, bool direct)
+{
+    int fd = -1;
+    if (direct)
+    {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    }
+    if (fd < 0)
+    {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open " + path.string() + ": " + std::strerror(errno));
+    }
+    if ((::fcntl(fd, F_GETFL) & O_DIRECT) == 0)
+    {
+        // Doubles the kernel's readahead window for the file.
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+}
+
+// O_DIRECT refuses reads at offsets or of lengths that are not aligned, which the tail of a file can
+// leave behind; those files carry on buffered. False when the file was not read direct to begin with.
+inline bool drop_direct(int fd) noexcept
+{
+    const int flags = ::fcntl(fd, F_GETFL);
+    return flags >= 0 && (flags & O_DIRECT) != 0 && ::fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
+
+// Reads with pread into the thread's `depth` buffers in turn, so that blocks still held by
+// stages behind the caller need not be waited for.
+template <typename BlockFn>
+bool read_with_pread(int fd, const std::filesystem::path& path, std::size_t block_size, std::size_t depth,
+                     BlockFn& on_block)
+{
+    depth = std::clamp<std::size_t>(depth, 1, max_read_depth);
+    const auto& buffers = thread_block_buffers(block_size, depth);
+    struct Finish
+    {
+        const BlockBuffers& buffers;
+        ~Finish() { wait_all_free(buffers); }
+    } finish{buffers};
+
+    std::uint64_t offset = 0;
+    for (std::size_t block = 0;; ++block)
+    {
+        auto& buffer = *buffers[block % depth];
+        buffer.wait_free();
+        std::size_t filled = 0;
+        while (filled < block_size)
+        {
+            const auto got =
+                ::pread(fd, buffer.memory.get() + filled, block_size - filled, static_cast<off_t>(offset + filled));
+            if (got < 0)
+            {
+                if (errno == EINTR || (errno == EINVAL && drop_direct(fd)))
+                {
+                    continue;
+                }
+                throw read_error(path, errno);
+            }
+            if (got == 0)
+            {
+                break;
+            }
+            filled += static_cast<std::size_t>(got);
+        }
+        if (filled > 0 && !deliver(buffer, filled, on_block))
+        {
+            return false;
+        }
+        if (filled < block_size)
+        {
+            return true;
+        }
+        offset += filled;
+    }
+}
+
+#else
+
+// Reads through std::ifstream into the thread's `depth` buffers in turn, as read_with_pread does.
+template <typename BlockFn>
+bool read_with_stream(const std::filesystem::path& path, std::size_t block_size, std::size_t depth,
+                      BlockFn& on_block)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        throw std::runtime_error("Failed to open " + path.string());
+    }
+    depth = std::clamp<std::size_t>(depth, 1, max_read_depth);
+    const auto& buffers = thread_block_buffers(block_size, depth);
+    struct Finish
+    {
+        const BlockBuffers& buffers;
+        ~Finish() { wait_all_free(buffers); }
+    } finish{buffers};
+
+    for (std::size_t block = 0;; ++block)
+    {
+        auto& buffer = *buffers[block % depth];
+        buffer.wait_free();
+        in.read(reinterpret_cast<char*>(buffer.memory.get()), static_cast<std::streamsize>(block_size));
+        if (in.bad())
+        {
+            throw read_error(path, errno);
+        }
+        const auto filled = static_cast<std::size_t>(in.gcount());
+        if (filled > 0 && !deliver(buffer, filled, on_block))
+        {
+            return false;
+        }
+        if (filled < block_size)
+        {
+            return true;
+        }
+    }
+}
+
+#endif
+
+#if SV_CLIENT_IO_URING
+
+// An io_uring instance of a compression thread, spoken to through the raw system calls. It owns
+// `depth` page-aligned buffers, registered with the kernel where it allows so that reads skip
+// mapping them each time, and keeps a read in flight in each buffer nobody holds: block n+1.. are on
+// their way while the caller compresses block n. Blocks reach the caller in file order.
+class IoUringReader
+{
+public:
+    IoUringReader(std::size_t block_size, std::size_t depth) : block_size_(block_size), depth_(depth)
+    {
+        buffers_ = make_block_buffers(depth_, block_size_);
+        std::vector<iovec> vectors;
+        for (const auto& buffer : buffers_)
+        {
+            vectors.push_back(iovec{buffer->memory.get(), block_size_});
+        }
+        slots_.resize(depth_);
+
+        io_uring_params params{};
+        ring_fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, static_cast<unsigned>(depth_), &params));
+        if (ring_fd_ < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+        }
+        try
+        {
+            map_rings(params);
+        }
+        catch (...)
+        {
+            ::close(ring_fd_);
+            throw;
+        }
+
+        // Fails where the locked-memory limit is too low for the buffers; reads then map them per call.
+        registered_ = ::syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS, vectors.data(),
+                                static_cast<unsigned>(vectors.size())) == 0;
+    }
+
+    ~IoUringReader()
+    {
+        ::close(ring_fd_);
+        if (broken_)
+        {
+            // Reads may still land in the buffers.
+            for (auto& buffer : buffers_)
+            {
+                static_cast<void>(buffer->memory.release());
+            }
+        }
+    }
+
+    IoUringReader(const IoUringReader&) = delete;
+    IoUringReader& operator=(const IoUringReader&) = delete;
+
+    // The calling thread's reader, or nullptr where io_uring is not available (kernels before 5.6,
+    // containers whose seccomp profile blocks it) or the thread is already reading through it.
+    static IoUringReader* for_this_thread(std::size_t block_size, std::size_t depth)
+    {
+        static std::atomic<bool> unavailable{false};
+        thread_local std::unique_ptr<IoUringReader> reader;
+        if (unavailable.load(std::memory_order_relaxed))
+        {
+            return nullptr;
+        }
+        depth = std::clamp<std::size_t>(depth, 1, max_read_depth);
+        if (reader && (reader->broken_ || reader->block_size_ != block_size || reader->depth_ != depth))
+        {
+            if (reader->busy_)
+            {
+                return nullptr;
+            }
+            reader.reset();
+        }
+        if (!reader)
+        {
+            try
+            {
+                reader = std::make_unique<IoUringReader>(block_size, depth);
+            }
+            catch (const std::system_error& error)
+            {
+                if (!unavailable.exchange(true))
+                {
+                    std::cerr << "[reader] io_uring unavailable (" << error.what() << "), reading with pread"
+                              << std::endl;
+                }
+                return nullptr;
+            }
+        }
+        return reader->busy_ ? nullptr : reader.get();
+    }
+
+    // Reads the file to its end, handing each block to `on_block`; false when `on_block` aborted.
+    template <typename BlockFn>
+    bool read(int fd, const std::filesystem::path& path, BlockFn& on_block)
+    {
+        struct stat status{};
+        const std::uint64_t size = ::fstat(fd, &status) == 0 ? static_cast<std::uint64_t>(status.st_size) : 0;
+
+        // Whatever way the read ends, no read of this file may still be running and no block of it may
+        // still be held once it returned.
+        struct Session
+        {
+            IoUringReader& reader;
+            explicit Session(IoUringReader& owner) : reader(owner) { reader.busy_ = true; }
+            ~Session()
+            {
+                reader.drain();
+                wait_all_free(reader.buffers_);
+                reader.busy_ = false;
+            }
+        } session{*this};
+
+        fd_ = fd;
+        const int flags = ::fcntl(fd, F_GETFL);
+        direct_ = flags >= 0 && (flags & O_DIRECT) != 0;
+        std::uint64_t next_offset = 0;
+        std::uint64_t submitted = 0;
+        std::uint64_t delivered = 0;
+        // Starts reads into the buffers that are free, in file order. Past the size the file had when
+        // opened, one read at a time looks for what was appended. When not even the next block to
+        // deliver is on its way, waits for its buffer.
+        const auto top_up = [&] {
+            while (submitted - delivered < depth_ && (next_offset < size || submitted == delivered))
+            {
+                const auto index = static_cast<std::size_t>(submitted % depth_);
+                if (!buffers_[index]->free())
+                {
+                    if (submitted != delivered)
+                    {
+                        break;
+                    }
+                    buffers_[index]->wait_free();
+                }
+                slots_[index] = Slot{next_offset, 0, false};
+                queue_read(index);
+                next_offset += block_size_;
+                ++submitted;
+            }
+            submit();
+        };
+
+        for (;;)
+        {
+            top_up();
+            const auto index = static_cast<std::size_t>(delivered % depth_);
+            auto& slot = slots_[index];
+            while (!slot.ready)
+            {
+                reap(path);
+            }
+            if (slot.filled > 0 && !deliver(*buffers_[index], slot.filled, on_block))
+            {
+                return false;
+            }
+            if (slot.filled < block_size_)
+            {
+                return true;
+            }
+            ++delivered;
+        }
+    }
+
+private:
+    struct Slot
+    {
+        std::uint64_t offset{0};
+        std::size_t filled{0};
+        bool ready{false};
+        // Whether the read in flight was queued while the file was still open with O_DIRECT.
+        bool direct{false};
+    };
+
+    class Mapping
+    {
+    public:
+        Mapping() = default;
+        Mapping(int fd, std::size_t length, off_t offset)
+            : address_(::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset)),
+              length_(length)
+        {
+            if (address_ == MAP_FAILED)
+            {
+                throw std::system_error(errno, std::generic_category(), "io_uring mmap");
+            }
+        }
+        ~Mapping()
+        {
+            if (address_ != MAP_FAILED)
+            {
+                ::munmap(address_, length_);
+            }
+        }
+        Mapping(Mapping&& other) noexcept
+            : address_(std::exchange(other.address_, MAP_FAILED)), length_(other.length_)
+        {
+        }
+        Mapping& operator=(Mapping&& other) noexcept
+        {
+            std::swap(address_, other.address_);
+            std::swap(length_, other.length_);
+            return *this;
+        }
+
+        template <typename T>
+        T* at(std::uint32_t offset) const noexcept
+        {
+            return reinterpret_cast<T*>(static_cast<char*>(address_) + offset);
+        }
+
+    private:
+        void* address_{MAP_FAILED};
+        std::size_t length_{0};
+    };
+
+    void map_rings(const io_uring_params& params)
+    {
+        // IORING_OP_READ came with 5.6, as did this flag.
+        if ((params.features & IORING_FEAT_RW_CUR_POS) == 0)
+        {
+            throw std::system_error(ENOSYS, std::generic_category(), "io_uring without IORING_OP_READ");
+        }
+        auto sq_bytes = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+        auto cq_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        const bool single_mapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mapping)
+        {
+            sq_bytes = cq_bytes = std::max(sq_bytes, cq_bytes);
+        }
+        sq_ring_ = Mapping{ring_fd_, sq_bytes, IORING_OFF_SQ_RING};
+        if (!single_mapping)
+        {
+            cq_ring_ = Mapping{ring_fd_, cq_bytes, IORING_OFF_CQ_RING};
+        }
+        const auto& cq_ring = single_mapping ? sq_ring_ : cq_ring_;
+        sqe_array_ = Mapping{ring_fd_, params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES};
+
+        sq_tail_ = sq_ring_.at<std::uint32_t>(params.sq_off.tail);
+        sq_mask_ = *sq_ring_.at<std::uint32_t>(params.sq_off.ring_mask);
+        sq_indices_ = sq_ring_.at<std::uint32_t>(params.sq_off.array);
+        sqes_ = sqe_array_.at<io_uring_sqe>(0);
+        cq_head_ = cq_ring.at<std::uint32_t>(params.cq_off.head);
+        cq_tail_ = cq_ring.at<std::uint32_t>(params.cq_off.tail);
+        cq_mask_ = *cq_ring.at<std::uint32_t>(params.cq_off.ring_mask);
+        cqes_ = cq_ring.at<io_uring_cqe>(params.cq_off.cqes);
+    }
+
+    // Queues a read of what the slot still lacks; submit() hands it to the kernel.
+    void queue_read(std::size_t index)
+    {
+        auto& slot = slots_[index];
+        slot.direct = direct_;
+        std::atomic_ref<std::uint32_t> tail{*sq_tail_};
+        const auto position = tail.load(std::memory_order_relaxed);
+        auto& sqe = sqes_[position & sq_mask_];
+        sqe = io_uring_sqe{};
+        sqe.opcode = registered_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe.fd = fd_;
+        sqe.off = slot.offset + slot.filled;
+        sqe.addr = reinterpret_cast<std::uintptr_t>(buffers_[index]->memory.get() + slot.filled);
+        sqe.len = static_cast<std::uint32_t>(block_size_ - slot.filled);
+        sqe.buf_index = static_cast<std::uint16_t>(index);
+        sqe.user_data = index;
+        sq_indices_[position & sq_mask_] = position & sq_mask_;
+        tail.store(position + 1, std::memory_order_release);
+        ++queued_;
+        ++in_flight_;
+    }
+
+    void submit() { enter(0, 0); }
+
+    // Submits what is queued and, with `flags` set to IORING_ENTER_GETEVENTS, waits for `wait_for`
+    // completions.
+    void enter(unsigned wait_for, unsigned flags)
+    {
+        if (queued_ == 0 && wait_for == 0)
+        {
+            return;
+        }
+        const auto result = ::syscall(__NR_io_uring_enter, ring_fd_, queued_, wait_for, flags, nullptr, 0);
+        if (result < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                return;
+            }
+            broken_ = true;
+            throw std::system_error(errno, std::generic_category(), "io_uring_enter");
+        }
+        queued_ -= static_cast<unsigned>(result);
+    }
+
+    io_uring_cqe next_completion()
+    {
+        std::atomic_ref<std::uint32_t> head{*cq_head_};
+        std::atomic_ref<std::uint32_t> tail{*cq_tail_};
+        for (;;)
+        {
+            const auto position = head.load(std::memory_order_relaxed);
+            if (position != tail.load(std::memory_order_acquire))
+            {
+                const auto completion = cqes_[position & cq_mask_];
+                head.store(position + 1, std::memory_order_release);
+                --in_flight_;
+                return completion;
+            }
+            enter(1, IORING_ENTER_GETEVENTS);
+        }
+    }
+
+    // Takes one completed read. A short read asks for the rest, since only a read that returns
+    // nothing marks the end of the file.
+    void reap(const std::filesystem::path& path)
+    {
+        const auto completion = next_completion();
+        const auto index = static_cast<std::size_t>(completion.user_data);
+        auto& slot = slots_[index];
+        if (completion.res < 0)
+        {
+            // Every read queued with O_DIRECT may fail over its alignment, not only the first to come
+            // back; those after it retry without O_DIRECT rather than finding nothing left to drop.
+            const int error = -completion.res;
+            if (error == EINVAL && slot.direct && direct_ && drop_direct(fd_))
+            {
+                direct_ = false;
+            }
+            if (error != EINTR && error != EAGAIN && !(error == EINVAL && slot.direct && !direct_))
+            {
+                throw read_error(path, error);
+            }
+            queue_read(index);
+        }
+        else if (completion.res == 0)
+        {
+            slot.ready = true;
+        }
+        else
+        {
+            slot.filled += static_cast<std::size_t>(completion.res);
+            if (slot.filled < block_size_)
+            {
+                queue_read(index);
+            }
+            else
+            {
+                slot.ready = true;
+            }
+        }
+        submit();
+    }
+
+    void drain() noexcept
+    {
+        try
+        {
+            while (in_flight_ > 0)
+            {
+                next_completion();
+            }
+        }
+        catch (...)
+        {
+            broken_ = true;
+        }
+        queued_ = 0;
+    }
+
+    const std::size_t block_size_;
+    const std::size_t depth_;
+    int ring_fd_{-1};
+    Mapping sq_ring_;
+    Mapping cq_ring_;
+    Mapping sqe_array_;
+    std::uint32_t* sq_tail_{nullptr};
+    std::uint32_t sq_mask_{0};
+    std::uint32_t* sq_indices_{nullptr};
+    io_uring_sqe* sqes_{nullptr};
+    std::uint32_t* cq_head_{nullptr};
+    std::uint32_t* cq_tail_{nullptr};
+    std::uint32_t cq_mask_{0};
+    io_uring_cqe* cqes_{nullptr};
+
+    BlockBuffers buffers_;
+    bool registered_{false};
+    std::vector<Slot> slots_;
+    int fd_{-1};
+    bool direct_{false};
+    unsigned queued_{0};
+    std::size_t in_flight_{0};
+    bool busy_{false};
+    bool broken_{false};
+};
+
+#endif
+
+}  // namespace detail
+
+// Reads a file from start to end in blocks of options.block_size bytes (the last may be shorter)
+// and hands each to `on_block`, in order; `on_block` returns false to stop, which read_file reports
+// by returning false. `on_block` takes either the block's bytes, whose memory is reused once it
+// returns, or a ReadBlock it may keep. Throws when the file cannot be opened or read.
+template <typename BlockFn>
+bool read_file(const std::filesystem::path& path, const FileReaderOptions& options, BlockFn&& on_block)
+{
+    const auto block_size = detail::aligned_block_size(options.block_size);
+#if SV_CLIENT_POSIX_READ
+    const detail::FileHandle file{detail::open_for_reading(path, options.direct)};
+#if SV_CLIENT_IO_URING
+    if (options.backend == ReadBackend::IoUring)
+    {
+        if (auto* reader = detail::IoUringReader::for_this_thread(block_size, options.depth))
+        {
+            return reader->read(file.get(), path, on_block);
+        }
+    }
+#endif
+    return detail::read_with_pread(file.get(), path, block_size, options.depth, on_block);
+#else
+    return detail::read_with_stream(path, block_size, options.depth, on_block);
+#endif
+}
+
+}  // namespace sv::client
@@ -1,19 +1,33 @@
+#include "cdc_chunker.hpp"
+#include "chunk_queue.hpp"
+#include "chunk_spool.hpp"
 #include "chunker.hpp"
+#include "codec_selector.hpp"
+#include "compression_level.hpp"
+#include "compression_pool.hpp"
 #include "compressor.hpp"
-#include "queue.hpp"
+#include "dictionary.hpp"
+#include "file_packer.hpp"
+#include "rate_limiter.hpp"
 #include "sender.hpp"
 #include "system_channels.hpp"
 #include "watcher.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <csignal>
 #include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <string_view>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 namespace {
 std::atomic<bool> g_stop_requested{false};
@@ -27,10 +41,56 @@ struct ClientConfig
 {
     std::filesystem::path watch_dir = sv::client::WatcherOptions{}.root;
     std::chrono::milliseconds scan_interval = sv::client::WatcherOptions{}.poll_interval;
-    std::size_t queue_capacity{32};
+    sv::client::WatchMode watch_mode = sv::client::WatcherOptions{}.mode;
+    std::filesystem::path snapshot_file{};
+    std::size_t queue_capacity{sv::client::ChunkQueueOptions{}.max_chunks};
+    std::size_t queue_bytes{sv::client::ChunkQueueOptions{}.capacity_bytes};
     std::size_t chunk_payload_size{2'500'000};
     int compression_level{ZSTD_CLEVEL_DEFAULT};
+    // Unset means auto: chosen per file by sampling.
+    std::optional<sv::client::Codec> codec{};
+    bool adaptive_compression{false};
+    int min_compression_level{sv::client::AdaptiveLevelOptions{}.min_level};
+    int max_compression_level{sv::client::AdaptiveLevelOptions{}.max_level};
+    bool dictionary{false};
+    std::filesystem::path dictionary_file{};
+    std::size_t dictionary_size{sv::client::DictionaryOptions{}.max_size};
+    std::uintmax_t dictionary_max_file_size{256 * 1024};
+    bool pack{false};
+    std::uintmax_t pack_max_file_size{sv::client::PackOptions{}.max_file_size};
+    std::uintmax_t pack_size{sv::client::PackOptions{}.max_pack_bytes};
+    std::size_t compress_threads{std::max<std::size_t>(1, std::thread::hardware_concurrency() / 2)};
+    std::uintmax_t stream_threshold{64ull * 1024 * 1024};
+    sv::client::ReadBackend read_backend{sv::client::FileReaderOptions{}.backend};
+    std::size_t read_block_size{sv::client::FileReaderOptions{}.block_size};
+    std::size_t read_depth{sv::client::FileReaderOptions{}.depth};
+    bool direct_io{false};
+    std::uintmax_t hash_thread_min_size{sv::client::Compressor::default_hash_thread_min_size()};
+    bool content_defined_chunking{false};
+    std::size_t cdc_average_size{1024 * 1024};
+    std::uintmax_t cdc_min_file_size{8ull * 1024 * 1024};
+    bool delta_transfer{false};
+    std::uint32_t delta_block_size{64 * 1024};
+    std::uintmax_t delta_min_file_size{8ull * 1024 * 1024};
+    bool resume{false};
+    std::uintmax_t resume_min_file_size{64ull * 1024 * 1024};
+    std::filesystem::path spool_dir{};
+    std::uintmax_t spool_max_bytes{sv::client::SpoolOptions{}.max_bytes};
+    std::uintmax_t spool_segment_size{sv::client::SpoolOptions{}.segment_size};
+    std::chrono::milliseconds spool_retry_delay{sv::client::SpoolOptions{}.retry_delay};
+    std::size_t spool_max_parks{sv::client::SpoolOptions{}.max_parks};
+    bool spool_sync{false};
     std::size_t connections{2};
+    std::size_t window{8};
+    std::chrono::milliseconds ack_timeout{std::chrono::seconds{30}};
+    std::size_t io_threads{2};
+    double rate_limit{0.0};
+    double connection_rate_limit{0.0};
+    sv::client::RateSchedule rate_schedule{};
+    std::uintmax_t interactive_max_file_size{256 * 1024};
+    std::vector<std::filesystem::path> hot_paths{};
+    std::uintmax_t bulk_min_file_size{sv::client::ChunkQueueOptions{}.bulk_min_file_size};
+    std::chrono::milliseconds queue_max_wait{sv::client::ChunkQueueOptions{}.max_wait};
     std::string host_prefix{"data-base"};
     std::uint16_t base_port{9'000};
     std::size_t max_send_retries{3};
@@ -51,10 +111,59 @@ void print_usage(std::string_view executable)
               << "  -h, --help                 Show this help message\n"
               << "  --watch-dir PATH           Directory to monitor\n"
               << "  --scan-interval-ms N       Scan interval in milliseconds\n"
+              << "  --watch-mode MODE          Change detection: poll or inotify (Linux only)\n"
+              << "  --snapshot-file PATH       Persist uploaded-file snapshot across restarts\n"
               << "  --queue-capacity N         Maximum number of chunks buffered\n"
+              << "  --queue-bytes N            Maximum compressed bytes buffered\n"
               << "  --chunk-size N             Chunk payload size in bytes\n"
-              << "  --compression-level N      Zstd compression level\n"
+              << "  --compression-level N      Zstd compression level (starting level when adaptive)\n"
+              << "  --codec NAME               auto (sample each file), zstd, lz4 or stored\n"
+              << "  --adaptive-compression     Tune the level per file to the send queue and rate\n"
+              << "  --min-compression-level N  Lowest level adaptive compression may pick\n"
+              << "  --max-compression-level N  Highest level adaptive compression may pick\n"
+              << "  --dictionary               Train a zstd dictionary on the watch directory for small files\n"
+              << "  --dictionary-file PATH     Load the dictionary from PATH, or train and save it there\n"
+              << "  --dictionary-size N        Maximum trained dictionary size in bytes\n"
+              << "  --dictionary-max-file-size N Largest file compressed with the dictionary\n"
+              << "  --pack                     Send small files in packs of many files each\n"
+              << "  --pack-max-file-size N     Largest file that is packed\n"
+              << "  --pack-size N              Uncompressed bytes at which a pack is sent\n"
+              << "  --compress-threads N       Number of compression worker threads\n"
+              << "  --stream-threshold N       Stream files of at least N bytes chunk by chunk (0 disables)\n"
+              << "  --read-backend NAME        io_uring (falls back to sync where unavailable) or sync\n"
+              << "  --read-block-size N        Bytes per file read\n"
+              << "  --read-depth N             File reads io_uring keeps in flight\n"
+              << "  --direct-io                Read files with O_DIRECT, bypassing the page cache\n"
+              << "  --hash-thread-min-size N   Hash files of at least N bytes on a second thread while they\n"
+              << "                             are compressed (0 disables; default 1 MiB with 2+ CPUs)\n"
+              << "  --chunking MODE            fixed, or cdc for deduplicated content-defined chunks\n"
+              << "  --cdc-average-size N       Average content-defined chunk size in bytes\n"
+              << "  --cdc-min-file-size N      Smallest file uploaded with content-defined chunks\n"
+              << "  --delta                    Send changed files as a delta against the server's copy\n"
+              << "  --delta-block-size N       Block size in bytes for delta matching\n"
+              << "  --delta-min-file-size N    Smallest file sent as a delta\n"
+              << "  --resume                   Resume interrupted uploads of large files where they stopped\n"
+              << "  --resume-min-file-size N   Smallest file whose upload can be resumed\n"
+              << "  --spool-dir PATH           Keep sent chunks on disk until acknowledged; replay them after\n"
+              << "                             a crash and keep retrying them through server outages\n"
+              << "  --spool-max-bytes N        Disk space the spool may use\n"
+              << "  --spool-segment-size N     Size of each spool segment file\n"
+              << "  --spool-retry-ms N         Delay before a chunk that ran out of attempts is retried\n"
+              << "  --spool-max-parks N        Times a chunk is retried that way before it is dropped (0 = no limit)\n"
+              << "  --spool-fsync              Sync the spool to disk on every write\n"
               << "  --connections N            Number of parallel connections\n"
+              << "  --window N                 Unacknowledged chunks in flight per connection\n"
+              << "  --ack-timeout-ms N         Reconnect when a chunk waits this long for its ack\n"
+              << "  --io-threads N             Threads driving the data connections\n"
+              << "  --rate-limit RATE          Cap on egress in bytes/s over all connections, e.g. 20M (0 = none)\n"
+              << "  --connection-rate-limit RATE Cap on egress in bytes/s per connection\n"
+              << "  --rate-schedule SPEC       Rate limit by local time, e.g. 08:00-18:00=4M,18:00-08:00=0;\n"
+              << "                             --rate-limit applies outside the listed windows\n"
+              << "  --interactive-max-file-size N Send files of at most N bytes ahead of other traffic (0 = none)\n"
+              << "  --hot-path PATH            Send files below PATH (relative to the watch dir) ahead of\n"
+              << "                             other traffic; may be repeated\n"
+              << "  --bulk-min-file-size N     Send files of at least N bytes behind other traffic\n"
+              << "  --queue-max-wait-ms N      Let a chunk queued this long overtake non-interactive ones\n"
               << "  --host-prefix NAME         Host prefix for data channels (e.g. data-base)\n"
               << "  --base-port PORT           Base port for data channels\n"
               << "  --max-send-retries N       Chunk send retry attempts\n"
@@ -100,10 +209,34 @@ bool parse_arguments(int argc, char** argv, ClientConfig& config)
             {
                 config.scan_interval = std::chrono::milliseconds{std::stoll(require_value(arg))};
             }
+            else if (arg == "--watch-mode")
+            {
+                const auto mode = require_value(arg);
+                if (mode == "poll")
+                {
+                    config.watch_mode = sv::client::WatchMode::Poll;
+                }
+                else if (mode == "inotify")
+                {
+                    config.watch_mode = sv::client::WatchMode::Inotify;
+                }
+                else
+                {
+                    throw std::runtime_error("Unknown watch mode: " + mode);
+                }
+            }
+            else if (arg == "--snapshot-file")
+            {
+                config.snapshot_file = require_value(arg);
+            }
             else if (arg == "--queue-capacity")
             {
                 config.queue_capacity = static_cast<std::size_t>(std::stoull(require_value(arg)));
             }
+            else if (arg == "--queue-bytes")
+            {
+                config.queue_bytes = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
             else if (arg == "--chunk-size")
             {
                 config.chunk_payload_size = static_cast<std::size_t>(std::stoull(require_value(arg)));
@@ -112,10 +245,229 @@ bool parse_arguments(int argc, char** argv, ClientConfig& config)
             {
                 config.compression_level = std::stoi(require_value(arg));
             }
+            else if (arg == "--codec")
+            {
+                const auto name = require_value(arg);
+                if (name == "auto")
+                {
+                    config.codec.reset();
+                }
+                else if (name == "zstd")
+                {
+                    config.codec = sv::client::Codec::Zstd;
+                }
+                else if (name == "lz4")
+                {
+                    config.codec = sv::client::Codec::Lz4;
+                }
+                else if (name == "stored")
+                {
+                    config.codec = sv::client::Codec::Stored;
+                }
+                else
+                {
+                    throw std::runtime_error("Unknown codec: " + name);
+                }
+            }
+            else if (arg == "--adaptive-compression")
+            {
+                config.adaptive_compression = true;
+            }
+            else if (arg == "--min-compression-level")
+            {
+                config.min_compression_level = std::stoi(require_value(arg));
+            }
+            else if (arg == "--max-compression-level")
+            {
+                config.max_compression_level = std::stoi(require_value(arg));
+            }
+            else if (arg == "--dictionary")
+            {
+                config.dictionary = true;
+            }
+            else if (arg == "--dictionary-file")
+            {
+                config.dictionary = true;
+                config.dictionary_file = require_value(arg);
+            }
+            else if (arg == "--dictionary-size")
+            {
+                config.dictionary_size = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--dictionary-max-file-size")
+            {
+                config.dictionary_max_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--pack")
+            {
+                config.pack = true;
+            }
+            else if (arg == "--pack-max-file-size")
+            {
+                config.pack_max_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--pack-size")
+            {
+                config.pack_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--compress-threads")
+            {
+                config.compress_threads = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--stream-threshold")
+            {
+                config.stream_threshold = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--read-backend")
+            {
+                config.read_backend = sv::client::parse_read_backend(require_value(arg));
+            }
+            else if (arg == "--read-block-size")
+            {
+                const auto value = std::stoull(require_value(arg));
+                if (value == 0 || value > sv::client::FileReaderOptions::max_block_size)
+                {
+                    throw std::runtime_error("--read-block-size must be between 1 and " +
+                                             std::to_string(sv::client::FileReaderOptions::max_block_size));
+                }
+                config.read_block_size = static_cast<std::size_t>(value);
+            }
+            else if (arg == "--read-depth")
+            {
+                const auto value = std::stoull(require_value(arg));
+                if (value == 0 || value > sv::client::FileReaderOptions::max_depth)
+                {
+                    throw std::runtime_error("--read-depth must be between 1 and " +
+                                             std::to_string(sv::client::FileReaderOptions::max_depth));
+                }
+                config.read_depth = static_cast<std::size_t>(value);
+            }
+            else if (arg == "--direct-io")
+            {
+                config.direct_io = true;
+            }
+            else if (arg == "--hash-thread-min-size")
+            {
+                config.hash_thread_min_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--chunking")
+            {
+                const auto mode = require_value(arg);
+                if (mode == "fixed")
+                {
+                    config.content_defined_chunking = false;
+                }
+                else if (mode == "cdc")
+                {
+                    config.content_defined_chunking = true;
+                }
+                else
+                {
+                    throw std::runtime_error("Unknown chunking mode: " + mode);
+                }
+            }
+            else if (arg == "--cdc-average-size")
+            {
+                config.cdc_average_size = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--cdc-min-file-size")
+            {
+                config.cdc_min_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--delta")
+            {
+                config.delta_transfer = true;
+            }
+            else if (arg == "--delta-block-size")
+            {
+                config.delta_block_size = static_cast<std::uint32_t>(std::stoul(require_value(arg)));
+            }
+            else if (arg == "--delta-min-file-size")
+            {
+                config.delta_min_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--resume")
+            {
+                config.resume = true;
+            }
+            else if (arg == "--resume-min-file-size")
+            {
+                config.resume_min_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--spool-dir")
+            {
+                config.spool_dir = require_value(arg);
+            }
+            else if (arg == "--spool-max-bytes")
+            {
+                config.spool_max_bytes = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--spool-segment-size")
+            {
+                config.spool_segment_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--spool-retry-ms")
+            {
+                config.spool_retry_delay = std::chrono::milliseconds{std::stoll(require_value(arg))};
+            }
+            else if (arg == "--spool-max-parks")
+            {
+                config.spool_max_parks = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--spool-fsync")
+            {
+                config.spool_sync = true;
+            }
             else if (arg == "--connections")
             {
                 config.connections = static_cast<std::size_t>(std::stoull(require_value(arg)));
             }
+            else if (arg == "--window")
+            {
+                config.window = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--ack-timeout-ms")
+            {
+                config.ack_timeout = std::chrono::milliseconds{std::stoll(require_value(arg))};
+            }
+            else if (arg == "--io-threads")
+            {
+                config.io_threads = static_cast<std::size_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--rate-limit")
+            {
+                config.rate_limit = sv::client::parse_rate(require_value(arg));
+            }
+            else if (arg == "--connection-rate-limit")
+            {
+                config.connection_rate_limit = sv::client::parse_rate(require_value(arg));
+            }
+            else if (arg == "--rate-schedule")
+            {
+                config.rate_schedule = sv::client::RateSchedule::parse(require_value(arg));
+            }
+            else if (arg == "--interactive-max-file-size")
+            {
+                config.interactive_max_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--hot-path")
+            {
+                // An empty path, or one naming the watch root itself, would make every file hot.
+                const std::filesystem::path hot{require_value(arg)};
+                if (hot.empty() || hot.lexically_normal() == ".")
+                {
+                    throw std::runtime_error("--hot-path must name a path below the watch dir");
+                }
+                config.hot_paths.push_back(hot);
+            }
+            else if (arg == "--bulk-min-file-size")
+            {
+                config.bulk_min_file_size = static_cast<std::uintmax_t>(std::stoull(require_value(arg)));
+            }
+            else if (arg == "--queue-max-wait-ms")
+            {
+                config.queue_max_wait = std::chrono::milliseconds{std::stoll(require_value(arg))};
+            }
             else if (arg == "--host-prefix")
             {
                 config.host_prefix = require_value(arg);
@@ -170,6 +522,25 @@ bool parse_arguments(int argc, char** argv, ClientConfig& config)
         }
     }
 
+    // A pack is sealed once it reaches --pack-size, so its last file may take it past that by up to
+    // --pack-max-file-size; the server refuses packs that come out larger than it takes.
+    constexpr auto max_pack_content = sv::common::protocol::PackIndexMessage::MaxContentSize;
+    if (config.pack && (config.pack_size > max_pack_content ||
+                        config.pack_max_file_size > max_pack_content - config.pack_size))
+    {
+        std::cerr << "Error parsing arguments: --pack-size plus --pack-max-file-size exceeds the "
+                  << max_pack_content << " bytes a pack may hold\n";
+        return false;
+    }
+
+    // A dictionary trained at startup is gone after a restart, and with it the means to decode the
+    // spooled chunks compressed with it.
+    if (!config.spool_dir.empty() && config.dictionary && config.dictionary_file.empty())
+    {
+        std::cerr << "Error parsing arguments: --spool-dir with --dictionary needs --dictionary-file\n";
+        return false;
+    }
+
     return true;
 }
 
@@ -189,11 +560,26 @@ int main(int argc, char** argv)
     sv::client::WatcherOptions watcher_options{};
     watcher_options.root = config.watch_dir;
     watcher_options.poll_interval = config.scan_interval;
+    watcher_options.mode = config.watch_mode;
+    watcher_options.snapshot_path = config.snapshot_file;
 
     sv::client::DirectoryWatcher watcher{watcher_options};
-    sv::client::Compressor compressor{config.compression_level};
+    sv::client::Compressor compressor{config.compression_level, config.codec.value_or(sv::client::Codec::Zstd)};
+    sv::client::FileReaderOptions reader_options{};
+    reader_options.backend = config.read_backend;
+    reader_options.block_size = config.read_block_size;
+    reader_options.depth = config.read_depth;
+    reader_options.direct = config.direct_io;
+    compressor = compressor.with_reader(reader_options).with_hash_thread(config.hash_thread_min_size);
     sv::client::Chunker chunker{config.chunk_payload_size};
-    BoundedBlockingQueue<sv::client::FileChunk> queue{config.queue_capacity};
+    const sv::client::TrafficClassifier classifier{config.interactive_max_file_size, config.hot_paths};
+    sv::client::ChunkQueueOptions queue_options{};
+    queue_options.capacity_bytes = config.queue_bytes;
+    queue_options.max_chunks = config.queue_capacity;
+    queue_options.classifier = classifier;
+    queue_options.bulk_min_file_size = config.bulk_min_file_size;
+    queue_options.max_wait = config.queue_max_wait;
+    sv::client::ChunkQueue queue{queue_options};
 
     sv::client::SystemChannelOptions system_options{};
     system_options.host = config.control_host;
@@ -214,50 +600,167 @@ int main(int argc, char** argv)
     sender_options.connect_timeout = config.connect_timeout;
     sender_options.reconnect_delay = config.connect_retry_delay;
     sender_options.tcp_no_delay = config.tcp_no_delay;
+    sender_options.window = config.window;
+    sender_options.ack_timeout = config.ack_timeout;
+    sender_options.io_threads = config.io_threads;
+    sender_options.rate_limit = config.rate_limit;
+    sender_options.connection_rate_limit = config.connection_rate_limit;
+    sender_options.classifier = classifier;
+
+    const auto mark_uploaded = [&watcher](const sv::client::FileDescriptor& descriptor, const std::string& sha256_hex) {
+        watcher.mark_uploaded(descriptor, sha256_hex);
+    };
+
+    sv::client::AdaptiveLevelOptions level_options{};
+    level_options.min_level = config.min_compression_level;
+    level_options.max_level = config.max_compression_level;
+    level_options.initial_level = config.compression_level;
+    sv::client::AdaptiveCompressionLevel adaptive_level{level_options};
+    const auto current_level = [&] {
+        return config.adaptive_compression ? adaptive_level.level() : compressor.level();
+    };
+
+    std::shared_ptr<const sv::client::ZstdDictionary> dictionary;
+    if (config.dictionary && config.codec.value_or(sv::client::Codec::Zstd) == sv::client::Codec::Zstd)
+    {
+        sv::client::DictionaryOptions dictionary_options{};
+        dictionary_options.max_size = config.dictionary_size;
+        dictionary_options.max_sample_file_size = config.dictionary_max_file_size;
+        dictionary = config.dictionary_file.empty()
+                         ? sv::client::ZstdDictionary::train(config.watch_dir, dictionary_options)
+                         : sv::client::ZstdDictionary::load_or_train(config.dictionary_file, config.watch_dir,
+                                                                     dictionary_options);
+    }
+
+    std::optional<sv::client::ChunkSpool> spool;
+    if (!config.spool_dir.empty())
+    {
+        sv::client::SpoolOptions spool_options{};
+        spool_options.directory = config.spool_dir;
+        spool_options.max_bytes = config.spool_max_bytes;
+        spool_options.segment_size = config.spool_segment_size;
+        spool_options.retry_delay = config.spool_retry_delay;
+        spool_options.max_parks = config.spool_max_parks;
+        spool_options.sync = config.spool_sync;
+        spool.emplace(spool_options);
+    }
 
     sv::client::Sender sender{sender_options, queue, system_channels};
+    if (spool)
+    {
+        sender.set_spool(*spool);
+    }
+    if (dictionary)
+    {
+        namespace protocol = sv::common::protocol;
+        const auto content = dictionary->content();
+        sender.set_connection_preamble(protocol::SystemFrame::encode(protocol::SystemMessage{
+            protocol::SystemMessageType::Dictionary,
+            protocol::DictionaryMessage{dictionary->id(), std::vector<std::uint8_t>(content.begin(), content.end())}}));
+    }
+    sender.set_file_uploaded_callback(mark_uploaded);
+    sender.set_metrics_annotation([&] { return "level=" + std::to_string(current_level()); });
+    if (config.adaptive_compression)
+    {
+        sender.set_throughput_observer([&adaptive_level](double mb_per_second) {
+            adaptive_level.observe_send_rate(mb_per_second);
+        });
+    }
     sender.start();
 
+    sv::client::ContentDefinedChunker cdc{config.cdc_average_size};
+    sv::client::PackOptions pack_options{};
+    pack_options.max_file_size = config.pack_max_file_size;
+    pack_options.max_pack_bytes = config.pack_size;
+    sv::client::FilePacker packer{pack_options};
+    sv::client::CompressionPool compression_pool{
+        config.compress_threads, config.stream_threshold, compressor, chunker, queue, system_channels};
+    if (spool)
+    {
+        compression_pool.set_spool(*spool);
+    }
+    sv::client::ChunkIndexOptions index_options{};
+    index_options.host = config.host_prefix + "0";
+    index_options.port = config.base_port;
+    index_options.timeout = config.connect_timeout;
+    compression_pool.set_server_index(index_options);
+    compression_pool.set_file_uploaded_callback(mark_uploaded);
+    if (config.content_defined_chunking)
+    {
+        compression_pool.enable_content_defined_chunking(cdc, config.cdc_min_file_size);
+    }
+    if (config.delta_transfer)
+    {
+        compression_pool.enable_delta_transfer(config.delta_block_size, config.delta_min_file_size);
+    }
+    if (config.resume)
+    {
+        compression_pool.enable_resume(config.resume_min_file_size);
+    }
+    if (config.adaptive_compression)
+    {
+        compression_pool.enable_adaptive_level(adaptive_level);
+    }
+    const sv::client::CodecSelector codec_selector{};
+    if (!config.codec)
+    {
+        compression_pool.enable_codec_selection(codec_selector);
+    }
+    if (dictionary)
+    {
+        compression_pool.enable_dictionary(dictionary, config.dictionary_max_file_size);
+    }
+    if (config.pack)
+    {
+        compression_pool.enable_packing(packer);
+    }
+    compression_pool.enable_priority_lane(classifier);
+    compression_pool.start();
+
     auto last_metrics = std::chrono::steady_clock::now();
-    std::size_t files_processed = 0;
-    std::uintmax_t bytes_processed = 0;
+    double applied_rate_limit = config.rate_limit;
 
     while (!g_stop_requested.load())
     {
-        const auto updated_files = watcher.scan();
-        for (const auto& file : updated_files)
+        if (!config.rate_schedule.empty())
         {
-            try
+            const auto rate_limit =
+                config.rate_schedule.rate_at(std::chrono::system_clock::now()).value_or(config.rate_limit);
+            if (rate_limit != applied_rate_limit)
             {
-                const auto compressed = compressor(file);
-                auto chunks = chunker(compressed);
-
-                for (auto& chunk : chunks)
+                sender.set_rate_limits(rate_limit, config.connection_rate_limit);
+                applied_rate_limit = rate_limit;
+                std::ostringstream oss;
+                oss << "[sender] rate limit now ";
+                if (rate_limit > 0.0)
                 {
-                    system_channels.notify_file_chunk_enqueued(chunk, queue.size());
-                    if (!queue.push(std::move(chunk)))
-                    {
-                        std::cerr << "Queue closed. Stopping producer." << std::endl;
-                        g_stop_requested.store(true);
-                        break;
-                    }
+                    oss << std::fixed << std::setprecision(1) << rate_limit / (1024.0 * 1024.0) << " MB/s";
                 }
-
-                ++files_processed;
-                bytes_processed += file.size;
-
-                const auto now = std::chrono::steady_clock::now();
-                const auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - last_metrics);
-                if (elapsed >= std::chrono::seconds{5})
+                else
                 {
-                    std::cout << "[metrics] files=" << files_processed << ", bytes=" << bytes_processed
-                              << ", queue_size=" << queue.size() << std::endl;
-                    last_metrics = now;
+                    oss << "off";
                 }
+                std::cout << oss.str() << std::endl;
             }
-            catch (const std::exception& ex)
+        }
+
+        const auto updated_files = watcher.scan();
+        for (const auto& file : updated_files)
+        {
+            if (!compression_pool.submit(file) || compression_pool.output_closed())
+            {
+                std::cerr << "Queue closed. Stopping producer." << std::endl;
+                g_stop_requested.store(true);
+            }
+
+            const auto now = std::chrono::steady_clock::now();
+            const auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - last_metrics);
+            if (elapsed >= std::chrono::seconds{5})
             {
-                std::cerr << "Failed to process file '" << file.path << "': " << ex.what() << std::endl;
+                std::cout << "[metrics] files=" << compression_pool.files_processed()
+                          << ", bytes=" << compression_pool.bytes_processed() << ", queue_size=" << queue.chunks()
+                          << ", compression_level=" << current_level() << std::endl;
+                last_metrics = now;
             }
 
             if (g_stop_requested.load())
@@ -266,19 +769,36 @@ int main(int argc, char** argv)
             }
         }
 
+        compression_pool.flush_packs();
+
         if (g_stop_requested.load())
         {
             break;
         }
 
-        std::this_thread::sleep_for(config.scan_interval);
+        if (!watcher.event_driven())
+        {
+            std::this_thread::sleep_for(config.scan_interval);
+        }
     }
 
+    compression_pool.stop();
     queue.close();
     sender.stop();
     system_channels.stop();
 
-    std::cout << "[metrics] total_files=" << files_processed << ", total_bytes=" << bytes_processed << std::endl;
+    std::cout << "[metrics] total_files=" << compression_pool.files_processed()
+              << ", total_bytes=" << compression_pool.bytes_processed()
+              << ", chunks_deduplicated=" << compression_pool.chunks_deduplicated()
+              << ", delta_bytes_reused=" << compression_pool.delta_bytes_reused()
+              << ", chunks_resumed=" << compression_pool.chunks_resumed()
+              << ", compression_level=" << current_level()
+              << ", files_zstd=" << compression_pool.files_with_codec(sv::client::Codec::Zstd)
+              << ", files_lz4=" << compression_pool.files_with_codec(sv::client::Codec::Lz4)
+              << ", files_stored=" << compression_pool.files_with_codec(sv::client::Codec::Stored)
+              << ", files_dictionary=" << compression_pool.files_with_dictionary()
+              << ", files_packed=" << compression_pool.files_packed()
+              << ", packs=" << compression_pool.packs_sent() << std::endl;
 
     return EXIT_SUCCESS;
 }
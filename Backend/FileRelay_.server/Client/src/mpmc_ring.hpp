@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace sv::client {
+
+inline void cpu_relax() noexcept
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Waits for an atomic word to move on: spins first, since the other side usually answers within
+// microseconds, then yields, then parks on the word until it is notified. On a single CPU the other
+// side cannot run while we spin, so it goes straight to yielding. Callers read the word, check their
+// condition, and pass the value they read to wait(), so a change that happens between the check and
+// the wait is never slept through.
+class SpinThenPark
+{
+public:
+    template <typename Word>
+    void wait(const std::atomic<Word>& word, Word seen) noexcept
+    {
+        static const bool may_spin = std::thread::hardware_concurrency() > 1;
+        if (rounds_ < spin_rounds && may_spin)
+        {
+            ++rounds_;
+            for (int index = 0; index < 16 && word.load(std::memory_order_relaxed) == seen; ++index)
+            {
+                cpu_relax();
+            }
+            return;
+        }
+        if (rounds_ < spin_rounds + yield_rounds)
+        {
+            ++rounds_;
+            std::this_thread::yield();
+            return;
+        }
+        word.wait(seen, std::memory_order_acquire);
+    }
+
+private:
+    static constexpr int spin_rounds = 32;
+    static constexpr int yield_rounds = 8;
+
+    int rounds_{0};
+};
+
+// Bounded lock-free multi-producer/multi-consumer ring (Vyukov's sequence-numbered slots). Every
+// slot carries a sequence number telling producers and consumers whose turn it is, so a push or pop
+// is one compare-and-swap on the shared position plus a store to the slot. Elements pushed by one
+// thread come out in the order it pushed them. Never blocks: try_push fails while the ring is full
+// and try_pop while it is empty.
+template <typename T>
+class MpmcRing
+{
+public:
+    // Rounds `slots` up to a power of two.
+    explicit MpmcRing(std::size_t slots)
+        : mask_(std::bit_ceil(std::max<std::size_t>(slots, 2)) - 1), slots_(std::make_unique<Slot[]>(mask_ + 1))
+    {
+        for (std::size_t index = 0; index <= mask_; ++index)
+        {
+            slots_[index].sequence.store(index, std::memory_order_relaxed);
+        }
+    }
+
+    MpmcRing(const MpmcRing&) = delete;
+    MpmcRing& operator=(const MpmcRing&) = delete;
+
+    // Moves from `value` only when it succeeds.
+    bool try_push(T& value)
+    {
+        auto position = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& slot = slots_[position & mask_];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+            if (lag == 0)
+            {
+                if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    slot.value.emplace(std::move(value));
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (lag < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::optional<T> try_pop()
+    {
+        auto position = head_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            auto& slot = slots_[position & mask_];
+            const auto sequence = slot.sequence.load(std::memory_order_acquire);
+            const auto lag = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+            if (lag == 0)
+            {
+                if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                {
+                    std::optional<T> value{std::move(slot.value)};
+                    slot.value.reset();
+                    slot.sequence.store(position + mask_ + 1, std::memory_order_release);
+                    return value;
+                }
+            }
+            else if (lag < 0)
+            {
+                return std::nullopt;
+            }
+            else
+            {
+                position = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    [[nodiscard]] std::size_t capacity() const noexcept { return mask_ + 1; }
+
+private:
+    static constexpr std::size_t cache_line = 64;
+
+    struct alignas(cache_line) Slot
+    {
+        std::atomic<std::size_t> sequence{0};
+        std::optional<T> value;
+    };
+
+    const std::size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    alignas(cache_line) std::atomic<std::size_t> tail_{0};
+    alignas(cache_line) std::atomic<std::size_t> head_{0};
+};
+
+// Admits entries while the bytes and the number of entries held stay within the budget, blocking
+// (spin, then park) otherwise. An entry larger than the whole budget is admitted once nothing else
+// is held, so it still goes through. acquire() may be told to use the reserve, a further quarter of
+// the budget kept for traffic that must not wait behind the rest. close() fails all acquires, now
+// and later, while release() keeps working. Lock-free; both counts and the closed flag share one
+// atomic word, so every change wakes the waiters.
+class ByteBudget
+{
+public:
+    ByteBudget(std::size_t capacity_bytes, std::size_t max_entries)
+        : capacity_bytes_(capacity_bytes), max_entries_(max_entries)
+    {
+        if (capacity_bytes_ == 0 || max_entries_ == 0)
+        {
+            throw std::invalid_argument("Queue capacity must be greater than zero");
+        }
+        if (capacity_bytes_ + reserve(capacity_bytes_) > bytes_mask ||
+            max_entries_ + reserve(max_entries_) > entries_mask)
+        {
+            throw std::invalid_argument("Queue capacity is too large");
+        }
+    }
+
+    ByteBudget(const ByteBudget&) = delete;
+    ByteBudget& operator=(const ByteBudget&) = delete;
+
+    // Returns false once closed.
+    bool acquire(std::size_t bytes, bool use_reserve = false)
+    {
+        const auto byte_limit = capacity_bytes_ + (use_reserve ? reserve(capacity_bytes_) : 0);
+        const auto entry_limit = max_entries_ + (use_reserve ? reserve(max_entries_) : 0);
+        const auto charge = (std::uint64_t{1} << entries_shift) + std::min<std::uint64_t>(bytes, bytes_mask);
+        SpinThenPark backoff;
+        auto state = state_.load(std::memory_order_acquire);
+        for (;;)
+        {
+            if ((state & closed_bit) != 0)
+            {
+                return false;
+            }
+            const auto held = entries_of(state);
+            const auto used = bytes_of(state);
+            const bool fits = held < entry_limit && (held == 0 || used + bytes <= byte_limit);
+            if (fits)
+            {
+                if (state_.compare_exchange_weak(state, state + charge, std::memory_order_acq_rel,
+                                                 std::memory_order_acquire))
+                {
+                    return true;
+                }
+                continue;
+            }
+            backoff.wait(state_, state);
+            state = state_.load(std::memory_order_acquire);
+        }
+    }
+
+    void release(std::size_t bytes) noexcept
+    {
+        const auto charge = (std::uint64_t{1} << entries_shift) + std::min<std::uint64_t>(bytes, bytes_mask);
+        state_.fetch_sub(charge, std::memory_order_acq_rel);
+        state_.notify_all();
+    }
+
+    void close() noexcept
+    {
+        state_.fetch_or(closed_bit, std::memory_order_acq_rel);
+        state_.notify_all();
+    }
+
+    [[nodiscard]] bool closed() const noexcept { return (state_.load(std::memory_order_acquire) & closed_bit) != 0; }
+    [[nodiscard]] std::size_t bytes() const noexcept { return bytes_of(state_.load(std::memory_order_acquire)); }
+    [[nodiscard]] std::size_t entries() const noexcept { return entries_of(state_.load(std::memory_order_acquire)); }
+    [[nodiscard]] std::size_t capacity_bytes() const noexcept { return capacity_bytes_; }
+    [[nodiscard]] std::size_t max_entries() const noexcept { return max_entries_; }
+    // The most entries held at once, counting the reserve.
+    [[nodiscard]] std::size_t max_reserved_entries() const noexcept { return max_entries_ + reserve(max_entries_); }
+
+private:
+    // Bits 0-39 hold the bytes, 40-62 the entries and 63 the closed flag.
+    static constexpr unsigned entries_shift = 40;
+    static constexpr std::uint64_t bytes_mask = (std::uint64_t{1} << entries_shift) - 1;
+    static constexpr std::uint64_t entries_mask = (std::uint64_t{1} << (63 - entries_shift)) - 1;
+    static constexpr std::uint64_t closed_bit = std::uint64_t{1} << 63;
+
+    static std::size_t reserve(std::size_t amount) noexcept { return std::max<std::size_t>(1, amount / 4); }
+    static std::size_t bytes_of(std::uint64_t state) noexcept { return static_cast<std::size_t>(state & bytes_mask); }
+    static std::size_t entries_of(std::uint64_t state) noexcept
+    {
+        return static_cast<std::size_t>((state >> entries_shift) & entries_mask);
+    }
+
+    const std::size_t capacity_bytes_;
+    const std::size_t max_entries_;
+    std::atomic<std::uint64_t> state_{0};
+};
+
+}  // namespace sv::client
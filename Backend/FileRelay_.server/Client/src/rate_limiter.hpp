@@ -0,0 +1,288 @@
+#pragma once
+
+#include "chunker.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace sv::client {
+
+// Bytes per second, with an optional K, M or G suffix (powers of 1024); 0 means unlimited.
+inline double parse_rate(std::string_view text)
+{
+    double multiplier = 1.0;
+    if (!text.empty())
+    {
+        switch (text.back())
+        {
+        case 'k':
+        case 'K':
+            multiplier = 1024.0;
+            break;
+        case 'm':
+        case 'M':
+            multiplier = 1024.0 * 1024.0;
+            break;
+        case 'g':
+        case 'G':
+            multiplier = 1024.0 * 1024.0 * 1024.0;
+            break;
+        default:
+            break;
+        }
+        if (multiplier > 1.0)
+        {
+            text.remove_suffix(1);
+        }
+    }
+    double value = 0.0;
+    const auto [end, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (ec != std::errc{} || end != text.data() + text.size() || value < 0.0)
+    {
+        throw std::invalid_argument("Bad rate: " + std::string{text});
+    }
+    return value * multiplier;
+}
+
+// Shapes traffic to a rate in bytes per second. A send may start whenever the bucket is not in debt
+// and then takes its whole size, so a chunk larger than the burst still goes out and the long-run
+// rate holds; the next send waits until the debt is paid off. An idle bucket saves up at most
+// burst_window worth of traffic. Thread-safe.
+class TokenBucket
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit TokenBucket(double bytes_per_second = 0.0)
+    {
+        set_rate(bytes_per_second);
+    }
+
+    TokenBucket(const TokenBucket&) = delete;
+    TokenBucket& operator=(const TokenBucket&) = delete;
+
+    // 0 lifts the limit. Takes effect for the next send.
+    void set_rate(double bytes_per_second)
+    {
+        std::scoped_lock lock(mutex_);
+        refill_locked(Clock::now());
+        rate_ = std::max(0.0, bytes_per_second);
+        burst_ = rate_ * burst_window;
+        tokens_ = std::min(tokens_, burst_);
+    }
+
+    [[nodiscard]] double rate() const
+    {
+        std::scoped_lock lock(mutex_);
+        return rate_;
+    }
+
+    // How long until a send may start; zero when it may start now.
+    [[nodiscard]] Clock::duration delay()
+    {
+        std::scoped_lock lock(mutex_);
+        if (rate_ <= 0.0)
+        {
+            return Clock::duration::zero();
+        }
+        refill_locked(Clock::now());
+        if (tokens_ >= 0.0)
+        {
+            return Clock::duration::zero();
+        }
+        return std::chrono::ceil<Clock::duration>(std::chrono::duration<double>(-tokens_ / rate_));
+    }
+
+    // Charges a send of `bytes`, whether or not it waited for delay() first.
+    void take(std::size_t bytes)
+    {
+        std::scoped_lock lock(mutex_);
+        if (rate_ <= 0.0)
+        {
+            return;
+        }
+        refill_locked(Clock::now());
+        tokens_ -= static_cast<double>(bytes);
+    }
+
+private:
+    static constexpr double burst_window = 0.1;  // seconds
+
+    void refill_locked(Clock::time_point now)
+    {
+        if (rate_ > 0.0)
+        {
+            tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_refill_).count());
+        }
+        last_refill_ = now;
+    }
+
+    mutable std::mutex mutex_;
+    double rate_{0.0};
+    double burst_{0.0};
+    double tokens_{0.0};
+    Clock::time_point last_refill_{Clock::now()};
+};
+
+// Global rates by local time of day, e.g. "08:00-18:00=4M,18:00-08:00=0". A window whose end is not
+// after its start wraps past midnight; the first window containing the current minute wins.
+class RateSchedule
+{
+public:
+    RateSchedule() = default;
+
+    static RateSchedule parse(std::string_view spec)
+    {
+        RateSchedule schedule;
+        while (!spec.empty())
+        {
+            const auto comma = spec.find(',');
+            const auto entry = spec.substr(0, comma);
+            spec = comma == std::string_view::npos ? std::string_view{} : spec.substr(comma + 1);
+
+            const auto equals = entry.find('=');
+            const auto dash = entry.find('-');
+            if (equals == std::string_view::npos || dash == std::string_view::npos || dash > equals)
+            {
+                throw std::invalid_argument("Bad rate schedule entry: " + std::string{entry});
+            }
+            Window window{};
+            window.start = parse_minute(entry.substr(0, dash));
+            window.end = parse_minute(entry.substr(dash + 1, equals - dash - 1));
+            window.rate = parse_rate(entry.substr(equals + 1));
+            schedule.windows_.push_back(window);
+        }
+        return schedule;
+    }
+
+    [[nodiscard]] bool empty() const noexcept { return windows_.empty(); }
+
+    // The rate the schedule sets at `now`, or std::nullopt outside all of its windows.
+    [[nodiscard]] std::optional<double> rate_at(std::chrono::system_clock::time_point now) const
+    {
+        const auto seconds = std::chrono::system_clock::to_time_t(now);
+        const std::tm local = local_time(seconds);
+        const int minute = local.tm_hour * 60 + local.tm_min;
+        for (const auto& window : windows_)
+        {
+            const bool inside = window.start < window.end ? minute >= window.start && minute < window.end
+                                                          : minute >= window.start || minute < window.end;
+            if (inside)
+            {
+                return window.rate;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    struct Window
+    {
+        int start{0};  // minutes past midnight
+        int end{0};
+        double rate{0.0};
+    };
+
+    // Thread-safe std::localtime.
+    static std::tm local_time(std::time_t seconds)
+    {
+        std::tm local{};
+#ifdef _MSC_VER
+        localtime_s(&local, &seconds);
+#else
+        localtime_r(&seconds, &local);
+#endif
+        return local;
+    }
+
+    // "HH:MM", each part all digits; "24:00" stands for the end of the day.
+    static int parse_minute(std::string_view text)
+    {
+        const auto parse_part = [](std::string_view part) {
+            int value = -1;
+            const auto [end, ec] = std::from_chars(part.data(), part.data() + part.size(), value);
+            return !part.empty() && ec == std::errc{} && end == part.data() + part.size() ? value : -1;
+        };
+        int hours = -1;
+        int minutes = -1;
+        const auto colon = text.find(':');
+        if (colon != std::string_view::npos)
+        {
+            hours = parse_part(text.substr(0, colon));
+            minutes = parse_part(text.substr(colon + 1));
+        }
+        if (hours < 0 || hours > 24 || minutes < 0 || minutes > 59 || hours * 60 + minutes > 24 * 60)
+        {
+            throw std::invalid_argument("Bad time of day: " + std::string{text});
+        }
+        return hours * 60 + minutes;
+    }
+
+    std::vector<Window> windows_;
+};
+
+// Which chunks are interactive. A file is interactive when it has at most max_small_file_size
+// bytes (0 disables the size rule) or lies below one of the hot paths, given relative to the watch
+// root; a pack is interactive when any of its files is. Interactive chunks go out ahead of other
+// traffic and do not wait for the rate limit, though they still count against it.
+class TrafficClassifier
+{
+public:
+    TrafficClassifier() = default;
+
+    TrafficClassifier(std::uintmax_t max_small_file_size, std::vector<std::filesystem::path> hot_paths)
+        : max_small_file_size_(max_small_file_size), hot_paths_(std::move(hot_paths))
+    {
+        for (auto& path : hot_paths_)
+        {
+            path = path.lexically_normal();
+            if (!path.has_filename())
+            {
+                path = path.parent_path();
+            }
+        }
+    }
+
+    [[nodiscard]] bool interactive(const FileMetadata& file) const
+    {
+        if (file.packed_files.empty())
+        {
+            return interactive(file.descriptor);
+        }
+        return std::any_of(file.packed_files.begin(), file.packed_files.end(),
+                           [this](const PackedFile& packed) { return interactive(packed.descriptor); });
+    }
+
+    [[nodiscard]] bool interactive(const FileDescriptor& file) const
+    {
+        if (max_small_file_size_ > 0 && file.size <= max_small_file_size_)
+        {
+            return true;
+        }
+        const auto relative = file.relative_path.lexically_normal();
+        const auto below = [&relative](const std::filesystem::path& hot) {
+            const auto [hot_end, ignored] =
+                std::mismatch(hot.begin(), hot.end(), relative.begin(), relative.end());
+            return hot_end == hot.end();
+        };
+        return std::any_of(hot_paths_.begin(), hot_paths_.end(), below);
+    }
+
+private:
+    std::uintmax_t max_small_file_size_{0};
+    std::vector<std::filesystem::path> hot_paths_;
+};
+
+}  // namespace sv::client
@@ -1,14 +1,20 @@
 #pragma once
 
+#include "chunk_queue.hpp"
+#include "chunk_spool.hpp"
 #include "chunker.hpp"
-#include "queue.hpp"
+#include "rate_limiter.hpp"
 #include "system_channels.hpp"
+#include "common/protocol.hpp"
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <iomanip>
 #include <iostream>
 #include <memory>
@@ -20,7 +26,10 @@
 #include <stop_token>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
+#include <variant>
 #include <vector>
 
 #include <asio.hpp>
@@ -37,22 +46,57 @@ struct SenderOptions
     std::chrono::milliseconds connect_timeout{std::chrono::milliseconds{5000}};
     std::chrono::milliseconds reconnect_delay{std::chrono::milliseconds{200}};
     bool tcp_no_delay{true};
+    // Chunks each connection may have sent but not yet acknowledged by the server.
+    std::size_t window{8};
+    // A connection whose oldest unacknowledged chunk waited this long is closed and its chunks resent.
+    std::chrono::milliseconds ack_timeout{std::chrono::seconds{30}};
+    // Threads running the io_context shared by every connection.
+    std::size_t io_threads{2};
+    // Egress caps in bytes per second over all connections and for each one; 0 is unlimited.
+    double rate_limit{0.0};
+    double connection_rate_limit{0.0};
+    // Decides which chunks are interactive rather than bulk traffic.
+    TrafficClassifier classifier{};
 };
 
+// Sends queued chunks over a fixed set of data connections. Each connection keeps up to `window`
+// chunks in flight; a chunk only counts as delivered once the server acknowledges storing it, and is
+// sent again when the server rejects it, the connection drops or the ack does not come in time.
+// Servers older than protocol version 3 do not acknowledge patches; there a completed write counts
+// as delivery. All connections share one io_context run by a small pool of threads; connecting,
+// sending and reading acks are asynchronous, so a slow or dead link never holds up dispatch.
+// Egress can be capped by token buckets, one over all connections and one per connection. Bulk
+// chunks wait for their buckets on the connection; interactive chunks are sent ahead of them and
+// without waiting, and have a few slots of their own so a backlog of bulk chunks cannot crowd them
+// out. With a spool, which holds a copy of every queued chunk, a chunk's copy is released once the
+// server acknowledges it; a chunk that runs out of attempts on failing links is parked there rather
+// than dropped and comes back through the retry queue, as do the chunks a previous run left
+// unacknowledged. A chunk the server refused is dropped from the spool instead.
 class Sender
 {
 public:
-    Sender(SenderOptions options, BoundedBlockingQueue<FileChunk>& queue, SystemChannels& channels)
+    using FileUploadedCallback = std::function<void(const FileDescriptor&, const std::string& sha256_hex)>;
+
+    Sender(SenderOptions options, ChunkQueue& queue, SystemChannels& channels)
         : options_(std::move(options)), queue_(queue), channels_(channels)
     {
         if (options_.connections == 0)
         {
             options_.connections = 1;
         }
+        if (options_.window == 0)
+        {
+            options_.window = 1;
+        }
+        if (options_.io_threads == 0)
+        {
+            options_.io_threads = 1;
+        }
+        global_bucket_.set_rate(options_.rate_limit);
         connections_.reserve(options_.connections);
         for (std::size_t index = 0; index < options_.connections; ++index)
         {
-            auto connection = std::make_unique<Connection>();
+            auto connection = std::make_unique<Connection>(io_context_);
             connection->index = index;
             connection->host = options_.host_prefix + std::to_string(index);
             connection->port = static_cast<std::uint16_t>(options_.base_port + index);
@@ -61,6 +105,10 @@ public:
             connection->connect_timeout = options_.connect_timeout;
             connection->reconnect_delay = options_.reconnect_delay;
             connection->tcp_no_delay = options_.tcp_no_delay;
+            connection->window = options_.window;
+            connection->ack_timeout = options_.ack_timeout;
+            connection->bucket.set_rate(options_.connection_rate_limit);
+            connection->shared_bucket = &global_bucket_;
             connections_.push_back(std::move(connection));
         }
     }
@@ -76,12 +124,27 @@ public:
         {
             return;
         }
+        io_work_.emplace(asio::make_work_guard(io_context_));
+        for (std::size_t index = 0; index < options_.io_threads; ++index)
+        {
+            io_threads_.emplace_back([this] { io_context_.run(); });
+        }
         worker_ = std::jthread([this](std::stop_token stop_token) { run(stop_token); });
+        if (spool_)
+        {
+            spool_thread_ = std::jthread([this](std::stop_token stop_token) { replay_spool(stop_token); });
+        }
     }
 
     void stop()
     {
         queue_.close();
+        // Parked chunks stay in the spool for the next run.
+        if (spool_thread_.joinable())
+        {
+            spool_thread_.request_stop();
+            spool_thread_.join();
+        }
         if (worker_.joinable())
         {
             worker_.request_stop();
@@ -103,12 +166,76 @@ public:
                 connection->stop();
             }
         }
+        // The io threads run out of work once every connection has closed.
+        io_work_.reset();
+        for (auto& thread : io_threads_)
+        {
+            thread.join();
+        }
+        io_threads_.clear();
+    }
+
+    // Keeps every chunk in `spool` until the server acknowledges it. Must be set before start().
+    void set_spool(ChunkSpool& spool)
+    {
+        spool_ = &spool;
+    }
+
+    // Frames sent on every data connection ahead of its first patch, e.g. the compression dictionary.
+    // Must be set before start().
+    void set_connection_preamble(std::vector<std::uint8_t> frames)
+    {
+        auto shared = std::make_shared<const std::vector<std::uint8_t>>(std::move(frames));
+        for (auto& connection : connections_)
+        {
+            connection->preamble = shared;
+        }
+    }
+
+    // Changes the egress caps in bytes per second while running; 0 lifts a cap. Sends already waiting
+    // for the old rate are looked at again.
+    void set_rate_limits(double bytes_per_second, double connection_bytes_per_second)
+    {
+        global_bucket_.set_rate(bytes_per_second);
+        for (auto& connection : connections_)
+        {
+            connection->bucket.set_rate(connection_bytes_per_second);
+            connection->reshape_later();
+        }
+    }
+
+    // Invoked with the send rate in MB/s each time a metrics window closes.
+    void set_throughput_observer(std::function<void(double mb_per_second)> observer)
+    {
+        throughput_observer_ = std::move(observer);
+    }
+
+    // Appended to every [metrics] line, e.g. to show the current compression level.
+    void set_metrics_annotation(std::function<std::string()> annotation)
+    {
+        metrics_annotation_ = std::move(annotation);
+    }
+
+    // Invoked once every chunk of a file version has been sent; for a pack, once for each of its files.
+    void set_file_uploaded_callback(FileUploadedCallback callback)
+    {
+        file_uploaded_callback_ = std::move(callback);
     }
 
 private:
+    // The patch header is encoded once when a chunk is first dequeued and reused by every retry; it is
+    // only re-encoded for a connection that negotiated an older header version.
+    struct WireHeader
+    {
+        sv::common::protocol::PatchHeader fields;
+        std::array<std::uint8_t, sv::common::protocol::PatchHeader::EncodedSize> bytes{};
+    };
+    using EncodedHeader = std::shared_ptr<const WireHeader>;
+
     struct PendingChunk
     {
         std::shared_ptr<FileChunk> chunk;
+        EncodedHeader header;
         std::size_t attempt{1};
     };
 
@@ -122,6 +249,10 @@ private:
 
     struct Connection
     {
+        using SuccessFn = std::function<void(std::size_t attempts)>;
+        // `rejected` when the server refused the chunk rather than the link failing.
+        using FailureFn = std::function<void(std::size_t attempts, const std::string& error, bool rejected)>;
+
         std::size_t index{0};
         std::string host;
         std::uint16_t port{0};
@@ -130,14 +261,31 @@ private:
         std::chrono::milliseconds connect_timeout{std::chrono::milliseconds{5000}};
         std::chrono::milliseconds reconnect_delay{std::chrono::milliseconds{200}};
         bool tcp_no_delay{true};
-        asio::io_context io_context{};
-        asio::strand<asio::io_context::executor_type> strand{asio::make_strand(io_context)};
-        std::optional<asio::executor_work_guard<asio::io_context::executor_type>> work_guard{};
-        std::jthread runner_{};
-        std::atomic<bool> runner_cleanup_pending_{false};
-
+        std::size_t window{8};
+        std::chrono::milliseconds ack_timeout{std::chrono::seconds{30}};
+        std::shared_ptr<const std::vector<std::uint8_t>> preamble{};
+        // Chunks handed to this connection that have not succeeded or failed yet, and their bytes.
+        std::atomic<std::size_t> outstanding{0};
+        std::atomic<std::size_t> outstanding_bytes{0};
+        // This connection's egress cap, and the one it shares with every other connection.
+        TokenBucket bucket{};
+        TokenBucket* shared_bucket{nullptr};
+        // Everything that touches the socket runs on this strand of the sender's shared io_context.
+        asio::strand<asio::io_context::executor_type> strand;
+
+        explicit Connection(asio::io_context& io_context) : strand(asio::make_strand(io_context)) {}
+
+        // Runs on the strand.
         void close()
         {
+            // Handlers still pending for the old socket see the new generation and do nothing.
+            generation_.fetch_add(1);
+            ack_timer_.cancel();
+            shaping_timer_.cancel();
+            shaping_ = false;
+            connect_timer_.cancel();
+            connect_deadline_.cancel();
+            resolver_.cancel();
             if (socket_ && socket_->is_open())
             {
                 asio::error_code ec;
@@ -145,217 +293,764 @@ private:
                 socket_->close(ec);
             }
             socket_.reset();
-            stop_runner(false);
+            state_ = LinkState::Closed;
+            open_.store(false);
+            disconnect_reason_ = "connection closed";
+            announced_files_.clear();
+            preamble_sent_ = false;
+            fail_unacknowledged("connection closed");
+            // Sends queued behind a connect that will no longer happen fail now.
+            start_next_send();
         }
 
+        // Closes the link from any thread; done once the io_context has run the posted close.
         void stop()
         {
-            close();
-            stop_runner(true);
+            asio::post(strand, [this] { close(); });
+        }
+
+        // Has a send waiting for the rate limit look at it again, from any thread.
+        void reshape_later()
+        {
+            asio::post(strand, [this] { reshape(); });
+        }
+
+        // Drops a file that is done with from the ones announced on this socket, from any thread.
+        void forget_file_later(std::uint64_t file_id)
+        {
+            asio::post(strand, [this, file_id] { announced_files_.erase(file_id); });
         }
 
-        template <typename SuccessHandler, typename FailureHandler>
         void async_send_chunk(const std::shared_ptr<FileChunk>& chunk,
+                              const EncodedHeader& header,
                               std::size_t attempt,
-                              SuccessHandler&& on_success,
-                              FailureHandler&& on_failure)
+                              bool interactive,
+                              SuccessFn on_success,
+                              FailureFn on_failure)
         {
-            auto payload = std::make_shared<std::vector<std::uint8_t>>(serialize(*chunk));
+            const auto bytes = chunk->length;
+            const auto queued_at = std::chrono::steady_clock::now();
+            outstanding.fetch_add(1);
+            const bool idle = outstanding_bytes.fetch_add(bytes) == 0;
+            auto success = [this, bytes, queued_at, idle, on_success = std::move(on_success)](std::size_t attempts) {
+                outstanding.fetch_sub(1);
+                outstanding_bytes.fetch_sub(bytes);
+                record_delivery(bytes, queued_at, idle);
+                on_success(attempts);
+            };
+            auto failure = [this, bytes, on_failure = std::move(on_failure)](
+                               std::size_t attempts, const std::string& error, bool rejected = false) {
+                outstanding.fetch_sub(1);
+                outstanding_bytes.fetch_sub(bytes);
+                on_failure(attempts, error, rejected);
+            };
 
             auto send_op = [this,
                             chunk,
-                            payload,
+                            header = EncodedHeader{header},
                             attempt,
-                            success = std::forward<SuccessHandler>(on_success),
-                            failure = std::forward<FailureHandler>(on_failure)]() mutable {
+                            success = std::move(success),
+                            failure = std::move(failure)]() mutable {
                 if (!socket_ || !socket_->is_open())
                 {
-                    failure(*chunk, attempt, "socket closed");
+                    failure(attempt, disconnect_reason_);
+                    write_finished();
                     return;
                 }
 
-                asio::async_write(*socket_, asio::buffer(*payload),
+                if (header->fields.version != protocol_version_)
+                {
+                    header = reencode_header(*header, protocol_version_);
+                }
+                if (header->fields.version < 2 && header->fields.codec != sv::common::protocol::Codec::Zstd)
+                {
+                    failure(attempt,
+                            std::string{"server cannot take "} +
+                                std::string{sv::common::protocol::codec_name(header->fields.codec)} + " payloads",
+                            true);
+                    write_finished();
+                    return;
+                }
+
+                std::shared_ptr<const std::vector<std::uint8_t>> lead{};
+                if (!preamble_sent_ && preamble && !preamble->empty())
+                {
+                    lead = preamble;
+                }
+                preamble_sent_ = true;
+
+                // The server learns a file's name from a FileMeta frame sent ahead of its first patch on
+                // each connection, and a pack's contents from its PackIndex frame.
+                std::shared_ptr<const std::vector<std::uint8_t>> meta{};
+                if (announced_files_.insert(chunk->file_id()).second)
+                {
+                    meta = std::make_shared<const std::vector<std::uint8_t>>(
+                        chunk->file->packed_files.empty() ? encode_file_meta_frame(*chunk->file, chunk->total_chunks)
+                                                          : encode_pack_index_frame(*chunk->file));
+                }
+
+                // With acks the chunk waits for its PatchAck from here on; the write completing says
+                // nothing about whether the server stored it.
+                const bool acknowledged = header->fields.version >= sv::common::protocol::PatchHeader::AckVersion;
+                if (acknowledged)
+                {
+                    await_ack(Unacknowledged{header->fields.file_id, header->fields.patch_index, attempt,
+                                             std::chrono::steady_clock::now(), std::move(success), std::move(failure)});
+                }
+
+                // Frames and payload go out as one gathered write straight from the shared chunk buffer.
+                const auto payload = chunk->payload();
+                const std::array<asio::const_buffer, 4> buffers{lead ? asio::buffer(*lead) : asio::const_buffer{},
+                                                                meta ? asio::buffer(*meta) : asio::const_buffer{},
+                                                                asio::buffer(header->bytes.data(), header->fields.size()),
+                                                                asio::buffer(payload.data(), payload.size())};
+                asio::async_write(*socket_, buffers,
                                   asio::bind_executor(
                                       strand,
-                                      [this, chunk, payload, attempt, success = std::move(success),
+                                      [this, chunk, header, lead, meta, attempt, acknowledged,
+                                       success = std::move(success),
                                        failure = std::move(failure)](const asio::error_code& ec, std::size_t) mutable {
                                           if (!ec)
                                           {
-                                              payload->clear();
-                                              payload->shrink_to_fit();
-                                              success(*chunk, attempt);
+                                              if (!acknowledged)
+                                              {
+                                                  success(attempt);
+                                              }
                                           }
                                           else
                                           {
                                               const std::string message = ec.message();
+                                              record_failure();
+                                              // Fails every chunk awaiting an ack, this one included.
                                               close();
-                                              payload->clear();
-                                              payload->shrink_to_fit();
-                                              failure(*chunk, attempt, message);
+                                              if (!acknowledged)
+                                              {
+                                                  failure(attempt, message);
+                                              }
                                           }
+                                          write_finished();
                                       }));
             };
 
-            asio::dispatch(strand, std::move(send_op));
+            // A slot freed on another connection can route a chunk here while a write is still in
+            // flight; frames must not interleave on the socket, so later sends wait their turn. A link
+            // without a socket connects in the background and takes the waiting sends once it is up;
+            // the caller never waits for it.
+            asio::dispatch(strand, [this, bytes, interactive, send_op = std::move(send_op)]() mutable {
+                // Interactive sends queue up behind each other but ahead of every bulk send.
+                auto position = send_backlog_.end();
+                if (interactive)
+                {
+                    position = std::find_if(send_backlog_.begin(), send_backlog_.end(),
+                                            [](const QueuedSend& queued) { return !queued.interactive; });
+                }
+                send_backlog_.insert(position, QueuedSend{std::move(send_op), bytes, interactive});
+                if (state_ == LinkState::Closed)
+                {
+                    state_ = LinkState::Connecting;
+                    asio::co_spawn(strand, connect(generation_.load()), asio::detached);
+                    return;
+                }
+                if (state_ == LinkState::Open)
+                {
+                    if (interactive)
+                    {
+                        reshape();
+                    }
+                    else
+                    {
+                        start_next_send();
+                    }
+                }
+            });
         }
 
-        asio::ip::tcp::socket& ensure_connected()
+        static EncodedHeader encode_header(const FileChunk& chunk)
         {
-            if (socket_ && socket_->is_open())
+            auto header = std::make_shared<WireHeader>();
+            header->fields.file_id = chunk.file_id();
+            header->fields.total_patches = static_cast<std::uint32_t>(chunk.total_chunks);
+            header->fields.patch_index = static_cast<std::uint32_t>(chunk.index);
+            header->fields.payload_size = static_cast<std::uint32_t>(chunk.length);
+            header->fields.payload_crc32 = sv::common::bytes::crc32(chunk.payload());
+            header->fields.codec = chunk.file->codec;
+            header->fields.finalize_header_crc();
+            header->bytes = header->fields.serialize();
+            return header;
+        }
+
+        static EncodedHeader reencode_header(const WireHeader& original, std::uint32_t version)
+        {
+            auto header = std::make_shared<WireHeader>(original);
+            header->fields.set_version(version);
+            header->fields.finalize_header_crc();
+            header->bytes = header->fields.serialize();
+            return header;
+        }
+
+        bool is_open() const
+        {
+            return open_.load();
+        }
+
+        // Whether the scheduler may hand the link chunks: it has not failed lately, or its time out of
+        // rotation is over and it gets to prove itself again.
+        bool in_rotation(std::chrono::steady_clock::time_point now) const
+        {
+            std::scoped_lock lock(stats_mutex_);
+            return stats_.failures == 0 || now >= stats_.retry_at;
+        }
+
+        std::chrono::steady_clock::time_point retry_at() const
+        {
+            std::scoped_lock lock(stats_mutex_);
+            return stats_.retry_at;
+        }
+
+        // Seconds until a chunk handed over now would be through: what is already outstanding drains at
+        // the link's recent bandwidth, then the chunk takes its usual round trip. std::nullopt until a
+        // delivery has been measured.
+        std::optional<double> expected_seconds() const
+        {
+            std::scoped_lock lock(stats_mutex_);
+            if (stats_.bandwidth <= 0.0)
             {
-                return *socket_;
+                return std::nullopt;
             }
-            socket_.reset();
-
-            asio::ip::tcp::resolver resolver(io_context);
-            auto endpoints = resolver.resolve(host, std::to_string(port));
-            asio::error_code last_error = asio::error::host_not_found;
+            return stats_.rtt + static_cast<double>(outstanding_bytes.load()) / stats_.bandwidth;
+        }
 
-            for (std::size_t attempt = 0; attempt < std::max<std::size_t>(1, max_connect_attempts); ++attempt)
+        // e.g. "data-base0:9000 41.2MB/s rtt=3.1ms" or "data-base1:9001 out of rotation".
+        std::string describe() const
+        {
+            std::ostringstream oss;
+            oss << host << ':' << port;
+            std::scoped_lock lock(stats_mutex_);
+            if (stats_.failures > 0)
+            {
+                oss << " out of rotation";
+            }
+            else
             {
-                socket_.emplace(io_context);
-                asio::error_code connect_error{};
-                bool timed_out = false;
+                oss << std::fixed << std::setprecision(1) << ' ' << stats_.bandwidth / (1024.0 * 1024.0)
+                    << "MB/s rtt=" << stats_.rtt * 1000.0 << "ms";
+            }
+            return oss.str();
+        }
 
-                asio::steady_timer timer(io_context);
-                asio::async_connect(*socket_, endpoints, [&](const asio::error_code& ec, const auto&) {
-                    connect_error = ec;
-                    timer.cancel();
-                });
+    private:
+        // Exponentially weighted recent link performance. A chunk's service time runs from when it was
+        // handed over, or from the previous delivery if that came later, so chunks pipelined behind
+        // each other measure the link's throughput rather than their time in its queue.
+        struct LinkStats
+        {
+            double bandwidth{0.0};  // bytes per second
+            double rtt{0.0};        // seconds from hand-over to delivery, on an idle link
+            std::chrono::steady_clock::time_point last_delivery{};
+            std::size_t failures{0};
+            std::chrono::steady_clock::time_point retry_at{};
+        };
 
-                if (connect_timeout.count() > 0)
-                {
-                    timer.expires_after(connect_timeout);
-                    timer.async_wait([&](const asio::error_code& ec) {
-                        if (!ec)
-                        {
-                            timed_out = true;
-                            connect_error = asio::error::timed_out;
-                            socket_->close();
-                        }
-                    });
-                }
+        static constexpr double ewma_weight = 0.2;
+        static constexpr std::chrono::seconds max_time_out_of_rotation{30};
 
-                io_context.restart();
-                io_context.run();
-                last_error = connect_error;
+        bool failing() const
+        {
+            std::scoped_lock lock(stats_mutex_);
+            return stats_.failures > 0;
+        }
 
-                if (!connect_error && !timed_out)
-                {
-                    if (tcp_no_delay)
+        void record_delivery(std::size_t bytes, std::chrono::steady_clock::time_point queued_at, bool idle)
+        {
+            const auto now = std::chrono::steady_clock::now();
+            std::scoped_lock lock(stats_mutex_);
+            const auto service_start = std::max(queued_at, stats_.last_delivery);
+            const auto service = std::max(std::chrono::duration<double>(now - service_start).count(), 1e-6);
+            const auto sample = static_cast<double>(bytes) / service;
+            stats_.bandwidth =
+                stats_.bandwidth <= 0.0 ? sample : stats_.bandwidth + ewma_weight * (sample - stats_.bandwidth);
+            if (idle)
+            {
+                const auto round_trip = std::chrono::duration<double>(now - queued_at).count();
+                stats_.rtt = stats_.rtt <= 0.0 ? round_trip : stats_.rtt + ewma_weight * (round_trip - stats_.rtt);
+            }
+            stats_.last_delivery = now;
+            if (stats_.failures > 0)
+            {
+                std::cout << "[sender] " << host << ':' << port << " back in rotation" << std::endl;
+                stats_.failures = 0;
+            }
+        }
+
+        // Takes the link out of rotation for a while that doubles with each failure in a row.
+        void record_failure()
+        {
+            std::scoped_lock lock(stats_mutex_);
+            ++stats_.failures;
+            const auto backoff = std::min<std::chrono::milliseconds>(
+                reconnect_delay * (std::size_t{1} << std::min<std::size_t>(stats_.failures - 1, 16)),
+                max_time_out_of_rotation);
+            stats_.retry_at = std::chrono::steady_clock::now() + backoff;
+            std::cerr << "[sender] " << host << ':' << port << " out of rotation for " << backoff.count()
+                      << " ms after " << stats_.failures << " failure(s)" << std::endl;
+        }
+
+        // A chunk written to the socket whose PatchAck has not arrived yet.
+        struct Unacknowledged
+        {
+            std::uint64_t file_id{0};
+            std::uint32_t patch_index{0};
+            std::size_t attempt{1};
+            std::chrono::steady_clock::time_point sent_at{};
+            SuccessFn on_stored{};
+            FailureFn on_failed{};
+        };
+
+        // Runs on the strand, before the chunk's bytes are written.
+        void await_ack(Unacknowledged entry)
+        {
+            bool first = false;
+            {
+                std::scoped_lock lock(unacked_mutex_);
+                first = unacked_.empty();
+                unacked_.push_back(std::move(entry));
+            }
+            if (first)
+            {
+                arm_ack_timer(generation_.load());
+            }
+        }
+
+        // Reads the PatchAck frames of the current socket, one at a time, for as long as it stays open.
+        void read_ack(std::uint64_t generation)
+        {
+            namespace protocol = sv::common::protocol;
+            if (generation != generation_.load() || !socket_ || !socket_->is_open())
+            {
+                return;
+            }
+            asio::async_read(
+                *socket_, asio::buffer(ack_prefix_),
+                asio::bind_executor(strand, [this, generation](const asio::error_code& ec, std::size_t) {
+                    if (generation != generation_.load())
+                    {
+                        return;
+                    }
+                    const auto body_size = sv::common::bytes::read_u32_le(ack_prefix_.data() + 4);
+                    if (ec || !protocol::is_magic(ack_prefix_, protocol::SystemFrame::Magic) ||
+                        body_size > protocol::SystemFrame::MaxBodySize)
                     {
-                        socket_->set_option(asio::ip::tcp::no_delay{true});
+                        std::cerr << "[sender] " << host << ':' << port << " ack stream broken: "
+                                  << (ec ? ec.message() : std::string{"bad frame"}) << std::endl;
+                        record_failure();
+                        close();
+                        return;
                     }
-                    ensure_runner();
-                    return *socket_;
+                    ack_body_.resize(body_size + protocol::SystemFrame::TrailerSize);
+                    asio::async_read(
+                        *socket_, asio::buffer(ack_body_),
+                        asio::bind_executor(strand, [this, generation](const asio::error_code& body_ec, std::size_t) {
+                            if (generation != generation_.load())
+                            {
+                                return;
+                            }
+                            if (body_ec || !handle_ack())
+                            {
+                                if (body_ec)
+                                {
+                                    std::cerr << "[sender] " << host << ':' << port
+                                              << " ack stream broken: " << body_ec.message() << std::endl;
+                                }
+                                record_failure();
+                                close();
+                                return;
+                            }
+                            read_ack(generation);
+                        }));
+                }));
+        }
+
+        // Settles the oldest unacknowledged chunk from the frame in ack_body_. Returns false when the
+        // frame is not the ack that chunk is owed.
+        bool handle_ack()
+        {
+            namespace protocol = sv::common::protocol;
+            protocol::PatchAckMessage ack{};
+            try
+            {
+                const auto message = protocol::SystemFrame::decode(ack_body_);
+                const auto* payload = std::get_if<protocol::PatchAckMessage>(&message.payload);
+                if (!payload)
+                {
+                    std::cerr << "[sender] " << host << ':' << port << " sent an unexpected system frame" << std::endl;
+                    return false;
                 }
+                ack = *payload;
+            }
+            catch (const std::exception& ex)
+            {
+                std::cerr << "[sender] bad ack from " << host << ':' << port << ": " << ex.what() << std::endl;
+                return false;
+            }
 
-                close();
-                std::this_thread::sleep_for(reconnect_delay * (attempt + 1));
+            Unacknowledged entry{};
+            bool more = false;
+            {
+                std::scoped_lock lock(unacked_mutex_);
+                if (unacked_.empty() || unacked_.front().file_id != ack.file_id ||
+                    unacked_.front().patch_index != ack.patch_index)
+                {
+                    std::cerr << "[sender] " << host << ':' << port << " acked patch #" << ack.patch_index
+                              << " out of order" << std::endl;
+                    return false;
+                }
+                entry = std::move(unacked_.front());
+                unacked_.pop_front();
+                more = !unacked_.empty();
+            }
+            if (more)
+            {
+                arm_ack_timer(generation_.load());
+            }
+            else
+            {
+                ack_timer_.cancel();
             }
 
-            throw std::system_error(last_error ? last_error : asio::error::operation_aborted,
-                                    "Failed to connect to " + host + ":" + std::to_string(port));
+            if (ack.status == protocol::PatchStatus::Stored)
+            {
+                entry.on_stored(entry.attempt);
+            }
+            else
+            {
+                entry.on_failed(entry.attempt, "rejected by server", true);
+            }
+            return true;
         }
 
-        static std::vector<std::uint8_t> serialize(const FileChunk& chunk)
+        // Fires once the oldest unacknowledged chunk is due; a connection that stays silent that long is
+        // given up on and its chunks go to another one.
+        void arm_ack_timer(std::uint64_t generation)
         {
-            std::ostringstream oss;
-            oss << "FILE " << chunk.descriptor.path.generic_string() << '\n';
-            oss << "SHA256 " << chunk.sha256_hex << '\n';
-            oss << "ORIGINAL_SIZE " << chunk.descriptor.size << '\n';
-            oss << "CHUNK " << chunk.index << '/' << chunk.total_chunks << '\n';
-            oss << "PAYLOAD_SIZE " << chunk.payload.size() << "\n\n";
+            std::chrono::steady_clock::time_point due{};
+            {
+                std::scoped_lock lock(unacked_mutex_);
+                if (unacked_.empty())
+                {
+                    return;
+                }
+                due = unacked_.front().sent_at + ack_timeout;
+            }
+            ack_timer_.expires_at(due);
+            ack_timer_.async_wait(asio::bind_executor(strand, [this, generation](const asio::error_code& ec) {
+                if (ec || generation != generation_.load())
+                {
+                    return;
+                }
+                bool expired = false;
+                {
+                    std::scoped_lock lock(unacked_mutex_);
+                    expired = !unacked_.empty() &&
+                              std::chrono::steady_clock::now() - unacked_.front().sent_at >= ack_timeout;
+                }
+                if (!expired)
+                {
+                    arm_ack_timer(generation);
+                    return;
+                }
+                std::cerr << "[sender] " << host << ':' << port << " did not ack within " << ack_timeout.count()
+                          << " ms; reconnecting" << std::endl;
+                record_failure();
+                close();
+            }));
+        }
 
-            const auto header = oss.str();
-            std::vector<std::uint8_t> buffer(header.begin(), header.end());
-            buffer.insert(buffer.end(), chunk.payload.begin(), chunk.payload.end());
-            return buffer;
+        void fail_unacknowledged(const std::string& error)
+        {
+            std::deque<Unacknowledged> failed;
+            {
+                std::scoped_lock lock(unacked_mutex_);
+                failed.swap(unacked_);
+            }
+            for (auto& entry : failed)
+            {
+                entry.on_failed(entry.attempt, error, false);
+            }
         }
 
-        bool is_open() const
+        // Runs on the strand once a send completes and starts the next queued one, if any.
+        void write_finished()
         {
-            return socket_ && socket_->is_open();
+            writing_ = false;
+            start_next_send();
         }
 
-    private:
-        void ensure_runner()
+        // Runs on the strand. A bulk send first waits for both token buckets; interactive sends only
+        // pay into them. Without a socket, the queued sends fail one after the other.
+        void start_next_send()
         {
-            if (runner_cleanup_pending_ && runner_.joinable() && std::this_thread::get_id() != runner_.get_id())
+            if (writing_ || shaping_ || send_backlog_.empty())
+            {
+                return;
+            }
+            auto& front = send_backlog_.front();
+            if (state_ == LinkState::Open)
             {
-                runner_.join();
-                runner_ = std::jthread{};
-                runner_cleanup_pending_ = false;
-                io_context.restart();
+                if (!front.interactive)
+                {
+                    auto wait = bucket.delay();
+                    if (shared_bucket)
+                    {
+                        wait = std::max(wait, shared_bucket->delay());
+                    }
+                    if (wait > TokenBucket::Clock::duration::zero())
+                    {
+                        shaping_ = true;
+                        shaping_timer_.expires_after(wait);
+                        shaping_timer_.async_wait(
+                            asio::bind_executor(strand, [this, round = ++shaping_round_](const asio::error_code& ec) {
+                                if (ec || round != shaping_round_ || !shaping_)
+                                {
+                                    return;
+                                }
+                                shaping_ = false;
+                                start_next_send();
+                            }));
+                        return;
+                    }
+                }
+                bucket.take(front.bytes);
+                if (shared_bucket)
+                {
+                    shared_bucket->take(front.bytes);
+                }
             }
+            auto next = std::move(front.run);
+            send_backlog_.pop_front();
+            writing_ = true;
+            next();
+        }
 
-            if (!work_guard_)
+        // Runs on the strand. Gives up a pending wait for the rate limit so that the backlog is looked
+        // at again, e.g. because an interactive send arrived or the rate changed.
+        void reshape()
+        {
+            if (shaping_)
             {
-                work_guard_.emplace(asio::make_work_guard(io_context.get_executor()));
+                shaping_ = false;
+                ++shaping_round_;
+                shaping_timer_.cancel();
             }
+            start_next_send();
+        }
 
-            if (!runner_.joinable())
+        // Brings the link up on the strand: resolves, connects and negotiates the protocol version,
+        // retrying with a growing delay. The sends queued meanwhile go out once it is up, or fail if
+        // it does not come up. Gives up quietly as soon as close() moves the link to a new generation.
+        asio::awaitable<void> connect(std::uint64_t generation)
+        {
+            // A link coming back from a failure gets one probe, so a dead server does not hold up its
+            // chunks for a whole series of attempts each time its turn comes.
+            const auto attempts = failing() ? std::size_t{1} : std::max<std::size_t>(1, max_connect_attempts);
+            asio::error_code ec = asio::error::host_not_found;
+            for (std::size_t attempt = 0; attempt < attempts; ++attempt)
             {
-                io_context.restart();
-                runner_ = std::jthread([this](std::stop_token stop_token) {
-                    while (!stop_token.stop_requested())
+                if (attempt > 0)
+                {
+                    asio::error_code ignored;
+                    connect_timer_.expires_after(reconnect_delay * attempt);
+                    co_await connect_timer_.async_wait(asio::redirect_error(asio::use_awaitable, ignored));
+                    if (generation != generation_.load())
                     {
-                        io_context.run();
-                        if (stop_token.stop_requested())
-                        {
-                            break;
-                        }
-                        if (work_guard_)
+                        co_return;
+                    }
+                }
+                ec = co_await connect_once(generation);
+                if (generation != generation_.load())
+                {
+                    co_return;
+                }
+                if (!ec)
+                {
+                    break;
+                }
+                if (socket_)
+                {
+                    asio::error_code ignored;
+                    socket_->close(ignored);
+                    socket_.reset();
+                }
+            }
+
+            if (ec)
+            {
+                std::cerr << "[sender] failed to connect to " << host << ':' << port << ": " << ec.message()
+                          << std::endl;
+                record_failure();
+                state_ = LinkState::Closed;
+                disconnect_reason_ = "failed to connect to " + host + ':' + std::to_string(port) + ": " + ec.message();
+                start_next_send();
+                co_return;
+            }
+
+            state_ = LinkState::Open;
+            open_.store(true);
+            if (protocol_version_ >= sv::common::protocol::PatchHeader::AckVersion)
+            {
+                read_ack(generation);
+            }
+            start_next_send();
+        }
+
+        // One attempt at resolving, connecting and the version handshake, bounded as a whole by
+        // connect_timeout: the deadline cancels whichever step is pending.
+        asio::awaitable<asio::error_code> connect_once(std::uint64_t generation)
+        {
+            namespace protocol = sv::common::protocol;
+            const auto attempt = ++connect_attempt_;
+            bool timed_out = false;
+            if (connect_timeout.count() > 0)
+            {
+                connect_deadline_.expires_after(connect_timeout);
+                connect_deadline_.async_wait(
+                    asio::bind_executor(strand, [this, generation, attempt, &timed_out](const asio::error_code& ec) {
+                        // The deadline may have expired just as the attempt finished; only a pending
+                        // attempt of the current socket is cut short.
+                        if (ec || generation != generation_.load() || attempt != connect_attempt_ ||
+                            state_ != LinkState::Connecting)
                         {
-                            io_context.restart();
+                            return;
                         }
-                        else
+                        timed_out = true;
+                        resolver_.cancel();
+                        if (socket_)
                         {
-                            break;
+                            asio::error_code ignored;
+                            socket_->close(ignored);
                         }
-                    }
-                });
+                    }));
             }
-        }
+            // Ends the attempt so that a deadline expiring late leaves the socket alone. A stale attempt,
+            // overtaken by a reconnect, leaves the counter and the deadline to the newer one.
+            auto finish = [this, attempt, &timed_out](asio::error_code ec) {
+                if (attempt == connect_attempt_)
+                {
+                    ++connect_attempt_;
+                    connect_deadline_.cancel();
+                }
+                return timed_out ? asio::error_code{asio::error::timed_out} : ec;
+            };
 
-        void stop_runner(bool wait)
-        {
-            if (work_guard_)
+            asio::error_code ec;
+            const auto endpoints = co_await resolver_.async_resolve(host, std::to_string(port),
+                                                                    asio::redirect_error(asio::use_awaitable, ec));
+            if (ec || generation != generation_.load())
             {
-                work_guard_->reset();
-                work_guard_.reset();
+                co_return finish(ec);
+            }
+            socket_.emplace(strand);
+            co_await asio::async_connect(*socket_, endpoints, asio::redirect_error(asio::use_awaitable, ec));
+            if (ec || generation != generation_.load())
+            {
+                co_return finish(ec);
             }
 
-            io_context.stop();
+            // Offers every patch header version this build speaks and adopts the one the server picks.
+            const auto offer = protocol::VersionHello{}.serialize();
+            std::array<std::uint8_t, protocol::VersionHello::EncodedSize> reply{};
+            co_await asio::async_write(*socket_, asio::buffer(offer), asio::redirect_error(asio::use_awaitable, ec));
+            if (!ec && generation == generation_.load())
+            {
+                co_await asio::async_read(*socket_, asio::buffer(reply), asio::redirect_error(asio::use_awaitable, ec));
+            }
+            ec = finish(ec);
+            if (ec || generation != generation_.load())
+            {
+                co_return ec;
+            }
 
-            if (runner_.joinable())
+            try
             {
-                runner_.request_stop();
-                if (wait && std::this_thread::get_id() != runner_.get_id())
-                {
-                    runner_.join();
-                    runner_ = std::jthread{};
-                    runner_cleanup_pending_ = false;
-                }
-                else if (!wait)
+                const auto answer = protocol::VersionHello::deserialize(reply);
+                const auto version = protocol::VersionHello::negotiate(protocol::VersionHello{}, answer);
+                if (version == 0 || answer.min_version != answer.max_version)
                 {
-                    runner_cleanup_pending_ = true;
+                    std::cerr << "[sender] " << host << ':' << port << " speaks no common protocol version" << std::endl;
+                    co_return asio::error::no_protocol_option;
                 }
+                protocol_version_ = version;
+            }
+            catch (const std::exception& ex)
+            {
+                std::cerr << "[sender] bad handshake from " << host << ':' << port << ": " << ex.what() << std::endl;
+                co_return asio::error::no_protocol_option;
             }
 
-            if (wait || !runner_.joinable())
+            if (tcp_no_delay)
             {
-                io_context.restart();
-                if (!runner_.joinable())
-                {
-                    runner_cleanup_pending_ = false;
-                }
+                asio::error_code ignored;
+                socket_->set_option(asio::ip::tcp::no_delay{true}, ignored);
             }
+            co_return asio::error_code{};
         }
 
+        struct QueuedSend
+        {
+            std::function<void()> run;
+            std::size_t bytes{0};
+            bool interactive{false};
+        };
+
+        enum class LinkState
+        {
+            Closed,
+            Connecting,
+            Open,
+        };
+
+        asio::steady_timer ack_timer_{strand};
+        // Holds back a bulk send until the token buckets allow it; only touched on the strand.
+        asio::steady_timer shaping_timer_{strand};
+        bool shaping_{false};
+        std::uint64_t shaping_round_{0};
+        // Spaces out connect attempts, and bounds each one.
+        asio::steady_timer connect_timer_{strand};
+        asio::steady_timer connect_deadline_{strand};
+        asio::ip::tcp::resolver resolver_{strand};
+        // Only touched on the strand; open_ mirrors state_ for the dispatch thread.
+        LinkState state_{LinkState::Closed};
+        std::atomic<bool> open_{false};
+        std::uint64_t connect_attempt_{0};
+        // Why sends fail while there is no socket.
+        std::string disconnect_reason_{"connection closed"};
         std::optional<asio::ip::tcp::socket> socket_{};
+        std::uint32_t protocol_version_{sv::common::protocol::PatchHeader::Version};
+        // Files whose FileMeta frame went out on the current socket, until every chunk of the file
+        // was delivered or dropped; only touched on the strand.
+        std::unordered_set<std::uint64_t> announced_files_{};
+        // Whether the preamble went out on the current socket; only touched on the strand.
+        bool preamble_sent_{false};
+        // Sends waiting for the in-flight write; both only touched on the strand.
+        std::deque<QueuedSend> send_backlog_{};
+        bool writing_{false};
+        // Bumped whenever the socket goes away, so handlers of an old socket can tell they are stale.
+        std::atomic<std::uint64_t> generation_{0};
+        // Chunks waiting for their PatchAck, oldest first; the server acks in patch order.
+        std::mutex unacked_mutex_{};
+        std::deque<Unacknowledged> unacked_{};
+        // Ack frame being read; only touched on the strand.
+        std::array<std::uint8_t, sv::common::protocol::SystemFrame::PrefixSize> ack_prefix_{};
+        std::vector<std::uint8_t> ack_body_{};
+        mutable std::mutex stats_mutex_{};
+        LinkStats stats_{};
     };
 
+    // Picks the link a chunk gets through soonest. Links out of rotation are skipped and links with a
+    // full window are only used when every link in rotation is full. An idle link that has not been
+    // measured yet is tried first so that it gets measured; otherwise the link with the shortest
+    // expected wait wins, and links still being measured are compared by outstanding bytes. Ties go to
+    // the link after the last one picked. When every link is out of rotation, returns the one due back
+    // first.
     Connection& next_connection()
     {
         std::scoped_lock lock(connection_mutex_);
@@ -363,9 +1058,53 @@ private:
         {
             throw std::runtime_error("No connections available");
         }
-        auto& connection = *connections_[next_connection_index_];
-        next_connection_index_ = (next_connection_index_ + 1) % connections_.size();
-        return connection;
+        const auto now = std::chrono::steady_clock::now();
+        const auto count = connections_.size();
+        Connection* fastest = nullptr;
+        double fastest_seconds = 0.0;
+        Connection* least_loaded = nullptr;
+        Connection* least_loaded_full = nullptr;
+        Connection* due_first = nullptr;
+        for (std::size_t probe = 0; probe < count; ++probe)
+        {
+            auto& candidate = *connections_[(next_connection_index_ + probe) % count];
+            if (!candidate.in_rotation(now))
+            {
+                if (!due_first || candidate.retry_at() < due_first->retry_at())
+                {
+                    due_first = &candidate;
+                }
+                continue;
+            }
+            const auto load = candidate.outstanding_bytes.load();
+            if (candidate.outstanding.load() >= candidate.window)
+            {
+                if (!least_loaded_full || load < least_loaded_full->outstanding_bytes.load())
+                {
+                    least_loaded_full = &candidate;
+                }
+                continue;
+            }
+            const auto expected = candidate.expected_seconds();
+            if (!expected && load == 0)
+            {
+                fastest = &candidate;
+                break;
+            }
+            if (expected && (!fastest || *expected < fastest_seconds))
+            {
+                fastest = &candidate;
+                fastest_seconds = *expected;
+            }
+            if (!least_loaded || load < least_loaded->outstanding_bytes.load())
+            {
+                least_loaded = &candidate;
+            }
+        }
+
+        auto* chosen = fastest ? fastest : least_loaded ? least_loaded : least_loaded_full ? least_loaded_full : due_first;
+        next_connection_index_ = (chosen->index + 1) % count;
+        return *chosen;
     }
 
     std::size_t active_connections()
@@ -395,6 +1134,7 @@ private:
         while (!stop_token.stop_requested())
         {
             std::shared_ptr<FileChunk> chunk{};
+            EncodedHeader header{};
             std::size_t attempt = 1;
 
             {
@@ -404,6 +1144,7 @@ private:
                     auto pending = std::move(retry_queue_.front());
                     retry_queue_.pop();
                     chunk = std::move(pending.chunk);
+                    header = std::move(pending.header);
                     attempt = pending.attempt;
                 }
             }
@@ -457,41 +1198,81 @@ private:
                 }
 
                 chunk = std::make_shared<FileChunk>(std::move(*chunk_opt));
+                header = Connection::encode_header(*chunk);
                 attempt = 1;
             }
 
-            if (!acquire_slot(stop_token))
+            const bool interactive = options_.classifier.interactive(*chunk->file);
+            if (!acquire_slot(stop_token, interactive))
             {
                 break;
             }
 
             Connection& connection = next_connection();
-            try
+            // Every link is out of rotation; wait for the first one due back rather than burn the
+            // chunk's attempts on it.
+            while (!connection.in_rotation(std::chrono::steady_clock::now()) && !stop_token.stop_requested())
             {
-                auto& socket = connection.ensure_connected();
-                (void)socket;
-            }
-            catch (const std::exception& ex)
-            {
-                on_chunk_failure(chunk, attempt, ex.what());
-                continue;
+                std::this_thread::sleep_until(
+                    std::min(connection.retry_at(), std::chrono::steady_clock::now() + std::chrono::milliseconds{100}));
             }
-
             connection.async_send_chunk(
                 chunk,
+                header,
                 attempt,
-                [this, chunk](const FileChunk&, std::size_t used_attempts) {
+                interactive,
+                [this, chunk](std::size_t used_attempts) {
                     on_chunk_success(chunk, used_attempts);
                 },
-                [this, chunk](const FileChunk&, std::size_t used_attempts, const std::string& error) {
-                    on_chunk_failure(chunk, used_attempts, error);
+                [this, chunk, header](std::size_t used_attempts, const std::string& error, bool rejected) {
+                    on_chunk_failure(chunk, header, used_attempts, error, rejected);
                 });
         }
     }
 
+    // Feeds parked chunks back through the retry queue as they come due, a few at a time so that they
+    // never take more memory than the chunks in flight.
+    void replay_spool(std::stop_token stop_token)
+    {
+        const auto backlog_limit = std::max<std::size_t>(1, options_.connections * options_.window);
+        while (!stop_token.stop_requested())
+        {
+            {
+                std::unique_lock retry_lock(retry_mutex_);
+                if (retry_queue_.size() >= backlog_limit)
+                {
+                    retry_lock.unlock();
+                    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+                    continue;
+                }
+            }
+
+            auto due = spool_->next_due(stop_token);
+            if (!due)
+            {
+                break;
+            }
+            auto chunk = std::make_shared<FileChunk>(std::move(due->second));
+            auto header = Connection::encode_header(*chunk);
+            {
+                std::lock_guard retry_lock(retry_mutex_);
+                retry_queue_.push(PendingChunk{std::move(chunk), std::move(header), 1});
+            }
+            queue_.interrupt();
+            retry_cv_.notify_one();
+        }
+    }
+
     SenderOptions options_;
-    BoundedBlockingQueue<FileChunk>& queue_;
+    ChunkQueue& queue_;
     SystemChannels& channels_;
+    // Declared ahead of the connections, whose sockets and timers live on it.
+    asio::io_context io_context_{};
+    TokenBucket global_bucket_{};
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> io_work_{};
+    std::vector<std::jthread> io_threads_{};
+    ChunkSpool* spool_{nullptr};
+    std::jthread spool_thread_{};
     std::vector<std::unique_ptr<Connection>> connections_;
     std::mutex connection_mutex_;
     std::size_t next_connection_index_{0};
@@ -506,16 +1287,66 @@ private:
     std::size_t inflight_{0};
     std::atomic<bool> finishing_{false};
 
+    std::function<void(double)> throughput_observer_{};
+    std::function<std::string()> metrics_annotation_{};
     std::mutex metrics_mutex_;
     MetricsWindow metrics_window_{};
     const std::chrono::seconds metrics_interval_{5};
 
-    bool acquire_slot(const std::stop_token& stop_token)
+    struct FileProgress
     {
+        std::size_t delivered{0};
+        std::size_t dropped{0};
+        // Zero until the final chunk of a streamed file has been delivered.
+        std::size_t total_chunks{0};
+        std::string sha256_hex;
+    };
+
+    FileUploadedCallback file_uploaded_callback_{};
+    std::mutex progress_mutex_;
+    std::unordered_map<std::uint64_t, FileProgress> delivered_chunks_{};
+
+    // Returns the file's SHA-256 once this delivery completes it.
+    std::optional<std::string> record_delivery(const FileChunk& chunk) { return settle_chunk(chunk, true); }
+
+    // A file with a dropped chunk never completes; its entry goes once each of its chunks was
+    // delivered or dropped, and so does its announcement on every connection.
+    void record_drop(const FileChunk& chunk) { settle_chunk(chunk, false); }
+
+    std::optional<std::string> settle_chunk(const FileChunk& chunk, bool delivered)
+    {
+        std::scoped_lock lock(progress_mutex_);
+        auto& progress = delivered_chunks_[chunk.file_id()];
+        ++(delivered ? progress.delivered : progress.dropped);
+        if (chunk.total_chunks > 0)
+        {
+            progress.total_chunks = chunk.file->outgoing_chunks > 0 ? chunk.file->outgoing_chunks : chunk.total_chunks;
+            progress.sha256_hex = chunk.sha256_hex();
+        }
+        if (progress.total_chunks == 0 || progress.delivered + progress.dropped < progress.total_chunks)
+        {
+            return std::nullopt;
+        }
+        auto sha256_hex = std::move(progress.sha256_hex);
+        const bool complete = progress.dropped == 0;
+        delivered_chunks_.erase(chunk.file_id());
+        for (auto& connection : connections_)
+        {
+            connection->forget_file_later(chunk.file_id());
+        }
+        if (!complete)
+        {
+            return std::nullopt;
+        }
+        return sha256_hex;
+    }
+
+    // Interactive chunks may also take one slot per connection beyond the windows.
+    bool acquire_slot(const std::stop_token& stop_token, bool interactive)
+    {
+        const auto limit = options_.connections * options_.window + (interactive ? options_.connections : 0);
         std::unique_lock lock(inflight_mutex_);
-        inflight_cv_.wait(lock, [&] {
-            return inflight_ < options_.connections || stop_token.stop_requested();
-        });
+        inflight_cv_.wait(lock, [&] { return inflight_ < limit || stop_token.stop_requested(); });
 
         if (stop_token.stop_requested())
         {
@@ -561,8 +1392,13 @@ private:
 
     void on_chunk_success(const std::shared_ptr<FileChunk>& chunk, std::size_t attempt)
     {
+        if (spool_)
+        {
+            spool_->ack(chunk->spool_record);
+        }
+
         const auto retries = attempt > 0 ? attempt - 1 : 0;
-        const auto payload_size = chunk->payload.size();
+        const auto payload_size = chunk->length;
 
         {
             std::scoped_lock metrics_lock(metrics_mutex_);
@@ -574,18 +1410,31 @@ private:
 
         channels_.notify_control(options_.connections, active_connections());
 
-        std::cout << "[sender] chunk sent: " << chunk->descriptor.path << " (#" << chunk->index << "/"
+        std::cout << "[sender] chunk sent: " << chunk->descriptor().path << " (#" << chunk->index << "/"
                   << chunk->total_chunks << ") attempts=" << attempt << std::endl;
 
-        chunk->payload.clear();
-        chunk->payload.shrink_to_fit();
+        if (auto sha256_hex = record_delivery(*chunk); sha256_hex && file_uploaded_callback_)
+        {
+            if (chunk->file->packed_files.empty())
+            {
+                file_uploaded_callback_(chunk->descriptor(), *sha256_hex);
+            }
+            for (const auto& packed : chunk->file->packed_files)
+            {
+                file_uploaded_callback_(packed.descriptor, packed.sha256_hex);
+            }
+        }
+
+        chunk->release();
 
         release_slot();
     }
 
     void on_chunk_failure(const std::shared_ptr<FileChunk>& chunk,
+                          const EncodedHeader& header,
                           std::size_t attempt,
-                          const std::string& error)
+                          const std::string& error,
+                          bool rejected)
     {
         const auto attempts_limit = max_attempts();
         if (attempt >= attempts_limit)
@@ -596,15 +1445,29 @@ private:
                 maybe_report_metrics_locked(std::chrono::steady_clock::now(), false);
             }
 
-            std::cerr << "[sender] dropping chunk for " << chunk->descriptor.path << " after retries";
+            // A chunk the server refused would be refused again; only a failing link is waited out.
+            bool parked = false;
+            if (spool_)
+            {
+                parked = !rejected && spool_->park(chunk->spool_record);
+                if (!parked)
+                {
+                    spool_->ack(chunk->spool_record);
+                }
+            }
+            std::cerr << "[sender] " << (parked ? "parking" : "dropping") << " chunk for " << chunk->descriptor().path
+                      << " after retries";
             if (!error.empty())
             {
                 std::cerr << " reason=" << error;
             }
             std::cerr << std::endl;
 
-            chunk->payload.clear();
-            chunk->payload.shrink_to_fit();
+            if (!parked)
+            {
+                record_drop(*chunk);
+            }
+            chunk->release();
 
             release_slot();
             return;
@@ -612,9 +1475,11 @@ private:
 
         {
             std::lock_guard retry_lock(retry_mutex_);
-            retry_queue_.push(PendingChunk{chunk, attempt + 1});
+            retry_queue_.push(PendingChunk{chunk, header, attempt + 1});
         }
 
+        // Failures arrive on the io threads; the worker may be waiting for new chunks meanwhile.
+        queue_.interrupt();
         retry_cv_.notify_one();
         release_slot();
     }
@@ -643,13 +1508,30 @@ private:
 
         std::ostringstream oss;
         oss << std::fixed << std::setprecision(2);
-        oss << "[metrics] queue=" << queue_.size() << '/' << queue_.capacity() << " chunk_rate=" << chunk_rate
+        oss << "[metrics] queue=" << queue_.chunks() << " chunks/"
+            << static_cast<double>(queue_.size()) / (1024.0 * 1024.0) << "MB chunk_rate=" << chunk_rate
             << "/s mb_rate=" << mb_rate << " retries=" << metrics_window_.retries;
+        if (const auto limit = global_bucket_.rate(); limit > 0.0)
+        {
+            oss << " limit=" << limit / (1024.0 * 1024.0) << "MB/s";
+        }
+        for (const auto& connection : connections_)
+        {
+            oss << " [" << connection->describe() << ']';
+        }
+        if (metrics_annotation_)
+        {
+            oss << ' ' << metrics_annotation_();
+        }
         if (force)
         {
             oss << " (final)";
         }
         std::cout << oss.str() << std::endl;
+        if (throughput_observer_ && !force)
+        {
+            throughput_observer_(mb_rate);
+        }
 
         reset_metrics_window_locked(now);
     }
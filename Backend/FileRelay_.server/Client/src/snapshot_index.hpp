@@ -0,0 +1,385 @@
+#pragma once
+
+#include "common/bytes.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+namespace sv::client {
+
+enum class UploadState : std::uint8_t
+{
+    Pending = 0,
+    Uploaded = 1,
+};
+
+struct SnapshotEntry
+{
+    std::string path;
+    std::uint64_t size{0};
+    std::int64_t mtime_ticks{0};
+    std::array<std::uint8_t, 32> sha256{};
+    UploadState state{UploadState::Pending};
+};
+
+// Append-only on-disk log of watcher snapshot entries. The latest record for a path wins; the log is
+// rewritten without superseded records once it grows past twice the number of live entries.
+// Layout: "SVSI" u32 version, then records of u32 length | payload | u32 crc32(payload).
+class SnapshotIndex
+{
+public:
+    explicit SnapshotIndex(std::filesystem::path path) : path_(std::move(path))
+    {
+        load();
+        if (records_in_log_ > 2 * entries_.size() + compaction_slack)
+        {
+            compact_locked();
+        }
+        else
+        {
+            open_for_append();
+        }
+    }
+
+    SnapshotIndex(const SnapshotIndex&) = delete;
+    SnapshotIndex& operator=(const SnapshotIndex&) = delete;
+
+    [[nodiscard]] std::vector<SnapshotEntry> entries() const
+    {
+        std::scoped_lock lock(mutex_);
+        std::vector<SnapshotEntry> result;
+        result.reserve(entries_.size());
+        for (const auto& [_, entry] : entries_)
+        {
+            result.push_back(entry);
+        }
+        return result;
+    }
+
+    void record(const SnapshotEntry& entry)
+    {
+        std::scoped_lock lock(mutex_);
+        entries_[entry.path] = entry;
+        append_locked(entry);
+        if (records_in_log_ > 2 * entries_.size() + compaction_slack)
+        {
+            compact_locked();
+        }
+    }
+
+    void flush()
+    {
+        std::scoped_lock lock(mutex_);
+        if (out_)
+        {
+            out_.flush();
+        }
+    }
+
+    static std::array<std::uint8_t, 32> digest_from_hex(std::string_view hex)
+    {
+        std::array<std::uint8_t, 32> digest{};
+        auto nibble = [](char ch) -> std::uint8_t {
+            if (ch >= '0' && ch <= '9')
+            {
+                return static_cast<std::uint8_t>(ch - '0');
+            }
+            if (ch >= 'a' && ch <= 'f')
+            {
+                return static_cast<std::uint8_t>(ch - 'a' + 10);
+            }
+            if (ch >= 'A' && ch <= 'F')
+            {
+                return static_cast<std::uint8_t>(ch - 'A' + 10);
+            }
+            return 0;
+        };
+        for (std::size_t i = 0; i < digest.size() && i * 2 + 1 < hex.size(); ++i)
+        {
+            digest[i] = static_cast<std::uint8_t>((nibble(hex[i * 2]) << 4) | nibble(hex[i * 2 + 1]));
+        }
+        return digest;
+    }
+
+private:
+    static constexpr std::array<char, 4> magic{'S', 'V', 'S', 'I'};
+    static constexpr std::uint32_t version = 1;
+    static constexpr std::size_t header_size = 8;
+    static constexpr std::size_t compaction_slack = 1'024;
+    static constexpr std::size_t max_record_size = 64 * 1'024;
+
+    static std::vector<std::uint8_t> encode(const SnapshotEntry& entry)
+    {
+        sv::common::bytes::ByteWriter writer;
+        writer.write(static_cast<std::uint8_t>(entry.state));
+        writer.write(entry.size);
+        writer.write(static_cast<std::uint64_t>(entry.mtime_ticks));
+        writer.write_bytes(entry.sha256);
+        writer.write(static_cast<std::uint32_t>(entry.path.size()));
+        writer.write_bytes(std::span<const std::uint8_t>(reinterpret_cast<const std::uint8_t*>(entry.path.data()),
+                                                         entry.path.size()));
+        return writer.move_buffer();
+    }
+
+    static SnapshotEntry decode(std::span<const std::uint8_t> payload)
+    {
+        sv::common::bytes::ByteReader reader(payload);
+        SnapshotEntry entry{};
+        entry.state = static_cast<UploadState>(reader.read<std::uint8_t>());
+        entry.size = reader.read<std::uint64_t>();
+        entry.mtime_ticks = static_cast<std::int64_t>(reader.read<std::uint64_t>());
+        const auto digest = reader.read_bytes(entry.sha256.size());
+        std::copy(digest.begin(), digest.end(), entry.sha256.begin());
+        const auto path_size = reader.read<std::uint32_t>();
+        const auto path = reader.read_bytes(path_size);
+        entry.path.assign(reinterpret_cast<const char*>(path.data()), path.size());
+        return entry;
+    }
+
+    void load()
+    {
+        std::ifstream in(path_, std::ios::binary);
+        if (!in)
+        {
+            return;
+        }
+
+        std::array<std::uint8_t, header_size> header{};
+        if (!in.read(reinterpret_cast<char*>(header.data()), static_cast<std::streamsize>(header.size())) ||
+            !std::equal(magic.begin(), magic.end(), header.begin()) ||
+            sv::common::bytes::read_u32_le(header.data() + magic.size()) != version)
+        {
+            std::cerr << "[snapshot] discarding unreadable index " << path_ << std::endl;
+            in.close();
+            std::error_code ec;
+            std::filesystem::remove(path_, ec);
+            return;
+        }
+
+        std::uint64_t valid_end = header_size;
+        std::vector<std::uint8_t> payload;
+        while (true)
+        {
+            std::array<std::uint8_t, 4> length_bytes{};
+            if (!in.read(reinterpret_cast<char*>(length_bytes.data()), 4))
+            {
+                break;
+            }
+            const auto length = sv::common::bytes::read_u32_le(length_bytes.data());
+            if (length == 0 || length > max_record_size)
+            {
+                break;
+            }
+            payload.resize(length + 4);
+            if (!in.read(reinterpret_cast<char*>(payload.data()), static_cast<std::streamsize>(payload.size())))
+            {
+                break;
+            }
+            const std::span<const std::uint8_t> body(payload.data(), length);
+            if (sv::common::bytes::crc32(body) != sv::common::bytes::read_u32_le(payload.data() + length))
+            {
+                break;
+            }
+
+            try
+            {
+                auto entry = decode(body);
+                auto key = entry.path;
+                entries_[std::move(key)] = std::move(entry);
+            }
+            catch (const std::out_of_range&)
+            {
+                break;
+            }
+            ++records_in_log_;
+            valid_end += 4 + payload.size();
+        }
+        in.close();
+
+        // A torn tail from a crash mid-append is cut off so new records follow the last good one.
+        std::error_code ec;
+        if (std::filesystem::file_size(path_, ec) != valid_end && !ec)
+        {
+            std::filesystem::resize_file(path_, valid_end, ec);
+        }
+    }
+
+    void open_for_append()
+    {
+        std::error_code ec;
+        const bool fresh = !std::filesystem::exists(path_, ec) || std::filesystem::file_size(path_, ec) == 0;
+        if (!path_.parent_path().empty())
+        {
+            std::filesystem::create_directories(path_.parent_path(), ec);
+        }
+        out_.open(path_, std::ios::binary | std::ios::app);
+        if (!out_)
+        {
+            std::cerr << "[snapshot] failed to open index " << path_ << " for writing" << std::endl;
+            return;
+        }
+        if (fresh)
+        {
+            write_header(out_);
+        }
+    }
+
+    static void write_header(std::ofstream& out)
+    {
+        std::array<std::uint8_t, header_size> header{};
+        std::copy(magic.begin(), magic.end(), header.begin());
+        sv::common::bytes::write_u32_le(version, header.data() + magic.size());
+        out.write(reinterpret_cast<const char*>(header.data()), static_cast<std::streamsize>(header.size()));
+    }
+
+    static void write_record(std::ofstream& out, const SnapshotEntry& entry)
+    {
+        const auto payload = encode(entry);
+        std::array<std::uint8_t, 4> length{};
+        std::array<std::uint8_t, 4> crc{};
+        sv::common::bytes::write_u32_le(static_cast<std::uint32_t>(payload.size()), length.data());
+        sv::common::bytes::write_u32_le(sv::common::bytes::crc32(std::span<const std::uint8_t>(payload)), crc.data());
+        out.write(reinterpret_cast<const char*>(length.data()), static_cast<std::streamsize>(length.size()));
+        out.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+        out.write(reinterpret_cast<const char*>(crc.data()), static_cast<std::streamsize>(crc.size()));
+    }
+
+    void append_locked(const SnapshotEntry& entry)
+    {
+        if (!out_)
+        {
+            return;
+        }
+        write_record(out_, entry);
+        ++records_in_log_;
+    }
+
+    void compact_locked()
+    {
+        if (out_.is_open())
+        {
+            out_.close();
+        }
+
+        for (auto it = entries_.begin(); it != entries_.end();)
+        {
+            std::error_code ec;
+            if (!std::filesystem::exists(std::filesystem::path{it->first}, ec) && !ec)
+            {
+                it = entries_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        const auto tmp_path = std::filesystem::path{path_.string() + ".tmp"};
+        {
+            std::ofstream tmp(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!tmp)
+            {
+                std::cerr << "[snapshot] failed to compact index " << path_ << std::endl;
+                open_for_append();
+                return;
+            }
+            write_header(tmp);
+            for (const auto& [_, entry] : entries_)
+            {
+                write_record(tmp, entry);
+            }
+        }
+
+        // The compacted index has to be on disk before it replaces the log, and the rename has to be
+        // before the log is appended to again; otherwise a crash can leave an empty or stale index.
+        std::error_code ec;
+        if (!sync_file(tmp_path))
+        {
+            std::filesystem::remove(tmp_path, ec);
+            open_for_append();
+            return;
+        }
+        std::filesystem::rename(tmp_path, path_, ec);
+        if (ec)
+        {
+            std::cerr << "[snapshot] rename failed during compaction: " << ec.message() << std::endl;
+        }
+        else
+        {
+            const auto directory = path_.parent_path();
+            sync_directory(directory.empty() ? std::filesystem::path{"."} : directory);
+        }
+        records_in_log_ = entries_.size();
+        open_for_append();
+    }
+
+    static bool sync_file(const std::filesystem::path& path)
+    {
+#ifndef _WIN32
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        const bool synced = fd >= 0 && ::fsync(fd) == 0;
+#else
+        const int fd = ::_wopen(path.c_str(), _O_RDWR | _O_BINARY);
+        const bool synced = fd >= 0 && ::_commit(fd) == 0;
+#endif
+        if (!synced)
+        {
+            std::cerr << "[snapshot] cannot sync " << path << ": " << std::strerror(errno) << std::endl;
+        }
+        if (fd >= 0)
+        {
+#ifndef _WIN32
+            ::close(fd);
+#else
+            ::_close(fd);
+#endif
+        }
+        return synced;
+    }
+
+    // Makes the rename durable; Windows has no way to sync a directory, and NTFS journals renames anyway.
+    static void sync_directory(const std::filesystem::path& directory)
+    {
+#ifndef _WIN32
+        const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || ::fsync(fd) != 0)
+        {
+            std::cerr << "[snapshot] cannot sync " << directory << ": " << std::strerror(errno) << std::endl;
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+#else
+        (void)directory;
+#endif
+    }
+
+    std::filesystem::path path_;
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, SnapshotEntry> entries_{};
+    std::ofstream out_{};
+    std::size_t records_in_log_{0};
+};
+
+}  // namespace sv::client
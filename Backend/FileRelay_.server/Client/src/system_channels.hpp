@@ -148,9 +148,16 @@ private:
         }
     }
 
+    // Streamed files only learn their SHA-256 and chunk count at the end, so their FILE_META trails
+    // the data and goes out with the final chunk.
     void send_file_meta(const FileChunk& chunk)
     {
-        const auto key = chunk.descriptor.path.generic_string() + ':' + chunk.sha256_hex;
+        if (chunk.sha256_hex().empty())
+        {
+            return;
+        }
+
+        const auto key = chunk.descriptor().path.generic_string() + ':' + chunk.sha256_hex();
         {
             std::scoped_lock lock(meta_mutex_);
             if (!published_meta_.insert(key).second)
@@ -160,8 +167,8 @@ private:
         }
 
         std::ostringstream oss;
-        oss << R"({"type":"FILE_META","path":")" << escape_json(chunk.descriptor.path.generic_string())
-            << R"(","sha256":")" << chunk.sha256_hex << R"(","size":)" << chunk.descriptor.size
+        oss << R"({"type":"FILE_META","path":")" << escape_json(chunk.descriptor().path.generic_string())
+            << R"(","sha256":")" << chunk.sha256_hex() << R"(","size":)" << chunk.descriptor().size
             << R"(,"chunks":)" << chunk.total_chunks << '}';
         send_message(oss.str());
     }
@@ -169,9 +176,9 @@ private:
     void send_file_patch_map(const FileChunk& chunk)
     {
         std::ostringstream oss;
-        oss << R"({"type":"FILE_PATCH_MAP","path":")" << escape_json(chunk.descriptor.path.generic_string())
-            << R"(","sha256":")" << chunk.sha256_hex << R"(","chunk_index":)" << chunk.index
-            << R"(,"total_chunks":)" << chunk.total_chunks << R"(,"payload_size":)" << chunk.payload.size() << '}';
+        oss << R"({"type":"FILE_PATCH_MAP","path":")" << escape_json(chunk.descriptor().path.generic_string())
+            << R"(","sha256":")" << chunk.sha256_hex() << R"(","chunk_index":)" << chunk.index
+            << R"(,"total_chunks":)" << chunk.total_chunks << R"(,"payload_size":)" << chunk.length << '}';
         send_message(oss.str());
     }
 
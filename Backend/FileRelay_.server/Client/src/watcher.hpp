@@ -1,77 +1,210 @@
 #pragma once
 
+#include "snapshot_index.hpp"
+
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <iostream>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if defined(__linux__)
+#include <cerrno>
+#include <cstring>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 namespace sv::client {
 
 struct FileDescriptor
 {
     std::filesystem::path path{};
+    // Path below the watch root; this is the name the file is published under on the server.
+    std::filesystem::path relative_path{};
     std::uintmax_t size{0};
     std::filesystem::file_time_type last_write_time{};
 };
 
+enum class WatchMode
+{
+    Poll,
+    Inotify,
+};
+
 struct WatcherOptions
 {
     std::filesystem::path root{std::filesystem::path{"C:\\Super_Voise\\Lokal AI Model\\client\\files"}};
     std::chrono::milliseconds poll_interval{std::chrono::milliseconds{2000}};
     bool recursive{true};
+    WatchMode mode{WatchMode::Poll};
+    // Persists the snapshot across restarts so unchanged, already uploaded files are not resent.
+    // Empty disables persistence.
+    std::filesystem::path snapshot_path{};
 };
 
 class DirectoryWatcher
 {
 public:
-    explicit DirectoryWatcher(WatcherOptions options = {}) : options_(std::move(options)) {}
+    explicit DirectoryWatcher(WatcherOptions options = {}) : options_(std::move(options))
+    {
+        if (options_.snapshot_path.empty())
+        {
+            return;
+        }
+
+        index_ = std::make_unique<SnapshotIndex>(options_.snapshot_path);
+        std::size_t restored = 0;
+        for (const auto& entry : index_->entries())
+        {
+            // Only completed uploads seed the snapshot; anything still pending is detected and sent again.
+            if (entry.state != UploadState::Uploaded)
+            {
+                continue;
+            }
+            FileDescriptor descriptor{};
+            descriptor.path = std::filesystem::path{entry.path};
+            descriptor.size = entry.size;
+            descriptor.last_write_time =
+                std::filesystem::file_time_type{std::filesystem::file_time_type::duration{entry.mtime_ticks}};
+            known_files_[entry.path] = std::move(descriptor);
+            ++restored;
+        }
+        std::cout << "[watcher] restored " << restored << " uploaded files from " << options_.snapshot_path
+                  << std::endl;
+    }
+
+    ~DirectoryWatcher()
+    {
+#if defined(__linux__)
+        if (inotify_fd_ >= 0)
+        {
+            ::close(inotify_fd_);
+        }
+#endif
+    }
+
+    DirectoryWatcher(const DirectoryWatcher&) = delete;
+    DirectoryWatcher& operator=(const DirectoryWatcher&) = delete;
 
     [[nodiscard]] const WatcherOptions& options() const noexcept { return options_; }
 
+    // True while scan() blocks on kernel events for up to poll_interval, so callers must not sleep
+    // between scans. Falls back to false when the event backend is unavailable or the root is missing.
+    [[nodiscard]] bool event_driven() const
+    {
+        std::scoped_lock lock(mutex_);
+#if defined(__linux__)
+        return options_.mode == WatchMode::Inotify && inotify_fd_ >= 0 && root_wd_ >= 0;
+#else
+        return false;
+#endif
+    }
+
     std::vector<FileDescriptor> scan()
     {
-        std::vector<FileDescriptor> updated;
         std::scoped_lock lock(mutex_);
+        std::vector<FileDescriptor> updated;
+#if defined(__linux__)
+        if (options_.mode == WatchMode::Inotify)
+        {
+            updated = scan_events_locked();
+        }
+        else
+#endif
+        {
+            updated = full_scan_locked();
+        }
 
-        try
+        if (index_ && !updated.empty())
         {
-            auto process_entry = [&](const auto& entry) {
-                if (!entry.is_regular_file())
-                {
-                    return;
-                }
+            index_->flush();
+        }
+        return updated;
+    }
 
-                FileDescriptor descriptor{};
-                descriptor.path = entry.path();
-                descriptor.size = entry.file_size();
-                descriptor.last_write_time = entry.last_write_time();
+    // Records that every chunk of this version of the file reached the server.
+    void mark_uploaded(const FileDescriptor& descriptor, const std::string& sha256_hex)
+    {
+        if (!index_)
+        {
+            return;
+        }
+        auto entry = make_entry(descriptor, UploadState::Uploaded);
+        entry.sha256 = SnapshotIndex::digest_from_hex(sha256_hex);
+        index_->record(entry);
+        index_->flush();
+    }
 
-                const auto key = make_key(descriptor.path);
-                auto known = known_files_.find(key);
-                if (known == known_files_.end() || known->second.size != descriptor.size ||
-                    known->second.last_write_time != descriptor.last_write_time)
-                {
-                    known_files_[key] = descriptor;
-                    updated.push_back(std::move(descriptor));
-                }
-            };
+private:
+    using SnapshotKey = std::string;
+
+    static SnapshotKey make_key(const std::filesystem::path& path)
+    {
+        return path.generic_string();
+    }
+
+    static SnapshotEntry make_entry(const FileDescriptor& descriptor, UploadState state)
+    {
+        SnapshotEntry entry{};
+        entry.path = make_key(descriptor.path);
+        entry.size = static_cast<std::uint64_t>(descriptor.size);
+        entry.mtime_ticks = static_cast<std::int64_t>(descriptor.last_write_time.time_since_epoch().count());
+        entry.state = state;
+        return entry;
+    }
+
+    void consider_entry(const std::filesystem::directory_entry& entry, std::vector<FileDescriptor>& updated)
+    {
+        if (!entry.is_regular_file())
+        {
+            return;
+        }
+
+        FileDescriptor descriptor{};
+        descriptor.path = entry.path();
+        descriptor.relative_path = descriptor.path.lexically_relative(options_.root);
+        descriptor.size = entry.file_size();
+        descriptor.last_write_time = entry.last_write_time();
+
+        const auto key = make_key(descriptor.path);
+        auto known = known_files_.find(key);
+        if (known == known_files_.end() || known->second.size != descriptor.size ||
+            known->second.last_write_time != descriptor.last_write_time)
+        {
+            known_files_[key] = descriptor;
+            if (index_)
+            {
+                index_->record(make_entry(descriptor, UploadState::Pending));
+            }
+            updated.push_back(std::move(descriptor));
+        }
+    }
 
-            if (options_.recursive)
+    void walk_locked(const std::filesystem::path& directory, bool recursive, std::vector<FileDescriptor>& updated)
+    {
+        try
+        {
+            if (recursive)
             {
-                for (const auto& entry : std::filesystem::recursive_directory_iterator(options_.root))
+                for (const auto& entry : std::filesystem::recursive_directory_iterator(directory))
                 {
-                    process_entry(entry);
+                    consider_entry(entry, updated);
                 }
             }
             else
             {
-                for (const auto& entry : std::filesystem::directory_iterator(options_.root))
+                for (const auto& entry : std::filesystem::directory_iterator(directory))
                 {
-                    process_entry(entry);
+                    consider_entry(entry, updated);
                 }
             }
         }
@@ -79,21 +212,233 @@ public:
         {
             // Ignore transient errors such as the directory not existing yet.
         }
+    }
 
+    std::vector<FileDescriptor> full_scan_locked()
+    {
+        std::vector<FileDescriptor> updated;
+        walk_locked(options_.root, options_.recursive, updated);
         return updated;
     }
 
-private:
-    using SnapshotKey = std::string;
+#if defined(__linux__)
+    static constexpr std::uint32_t directory_mask =
+        IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ONLYDIR;
 
-    static SnapshotKey make_key(const std::filesystem::path& path)
+    void fall_back_to_polling(const std::string& reason)
     {
-        return path.generic_string();
+        std::cerr << "[watcher] inotify unavailable (" << reason << "), falling back to polling" << std::endl;
+        if (inotify_fd_ >= 0)
+        {
+            ::close(inotify_fd_);
+            inotify_fd_ = -1;
+        }
+        watches_.clear();
+        root_wd_ = -1;
+        options_.mode = WatchMode::Poll;
     }
 
+    // Adds a watch for the directory and, in recursive mode, every directory below it. Returns false
+    // when the kernel refuses further watches; the caller then degrades to polling.
+    bool register_tree(const std::filesystem::path& directory)
+    {
+        if (!add_watch(directory))
+        {
+            return errno != ENOSPC && errno != ENOMEM;
+        }
+        if (!options_.recursive)
+        {
+            return true;
+        }
+
+        std::error_code ec;
+        std::filesystem::recursive_directory_iterator it{
+            directory, std::filesystem::directory_options::skip_permission_denied, ec};
+        for (; !ec && it != std::filesystem::recursive_directory_iterator{}; it.increment(ec))
+        {
+            std::error_code type_ec;
+            if (it->is_directory(type_ec) && !it->is_symlink(type_ec))
+            {
+                if (!add_watch(it->path()) && (errno == ENOSPC || errno == ENOMEM))
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool add_watch(const std::filesystem::path& directory)
+    {
+        const int wd = ::inotify_add_watch(inotify_fd_, directory.c_str(), directory_mask);
+        if (wd < 0)
+        {
+            return false;
+        }
+        watches_[wd] = directory;
+        if (directory == options_.root)
+        {
+            root_wd_ = wd;
+        }
+        return true;
+    }
+
+    // Re-registers every watch and walks the whole tree. Used on start-up, after the root appears and
+    // when the kernel event queue overflowed and individual events were lost.
+    std::vector<FileDescriptor> resync_locked()
+    {
+        std::vector<FileDescriptor> updated;
+        if (!register_tree(options_.root))
+        {
+            fall_back_to_polling(std::strerror(errno));
+            return full_scan_locked();
+        }
+        if (root_wd_ < 0)
+        {
+            return updated;
+        }
+        walk_locked(options_.root, options_.recursive, updated);
+        return updated;
+    }
+
+    std::vector<FileDescriptor> scan_events_locked()
+    {
+        if (inotify_fd_ < 0)
+        {
+            inotify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotify_fd_ < 0)
+            {
+                fall_back_to_polling(std::strerror(errno));
+                return full_scan_locked();
+            }
+        }
+
+        if (root_wd_ < 0)
+        {
+            return resync_locked();
+        }
+
+        pollfd descriptor{inotify_fd_, POLLIN, 0};
+        const int ready = ::poll(&descriptor, 1, static_cast<int>(options_.poll_interval.count()));
+        if (ready <= 0)
+        {
+            return {};
+        }
+
+        std::vector<FileDescriptor> updated;
+        std::unordered_set<SnapshotKey> touched_files;
+        std::vector<std::filesystem::path> new_directories;
+        bool overflow = false;
+
+        alignas(inotify_event) char buffer[64 * 1024];
+        while (true)
+        {
+            const ssize_t length = ::read(inotify_fd_, buffer, sizeof(buffer));
+            if (length <= 0)
+            {
+                break;
+            }
+
+            for (ssize_t offset = 0; offset < length;)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+                offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+                if (event->mask & IN_Q_OVERFLOW)
+                {
+                    overflow = true;
+                    continue;
+                }
+
+                if (event->mask & IN_IGNORED)
+                {
+                    watches_.erase(event->wd);
+                    if (event->wd == root_wd_)
+                    {
+                        root_wd_ = -1;
+                    }
+                    continue;
+                }
+
+                const auto watch = watches_.find(event->wd);
+                if (watch == watches_.end())
+                {
+                    continue;
+                }
+
+                if (event->mask & IN_MOVE_SELF)
+                {
+                    // The directory now lives under a different name; its new parent reports it
+                    // through IN_MOVED_TO, so drop the stale watch and let that event re-add it.
+                    ::inotify_rm_watch(inotify_fd_, event->wd);
+                    continue;
+                }
+
+                if (event->len == 0)
+                {
+                    continue;
+                }
+
+                const auto path = watch->second / event->name;
+                if (event->mask & IN_ISDIR)
+                {
+                    if (options_.recursive && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                    {
+                        new_directories.push_back(path);
+                    }
+                }
+                else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                {
+                    touched_files.insert(path.string());
+                }
+            }
+        }
+
+        if (overflow || root_wd_ < 0)
+        {
+            return resync_locked();
+        }
+
+        for (const auto& directory : new_directories)
+        {
+            // Files may land in a new directory before its watch exists, so walk it once after registering.
+            if (!register_tree(directory))
+            {
+                fall_back_to_polling(std::strerror(errno));
+                return full_scan_locked();
+            }
+            walk_locked(directory, true, updated);
+        }
+
+        for (const auto& file : touched_files)
+        {
+            std::error_code ec;
+            const std::filesystem::directory_entry entry{std::filesystem::path{file}, ec};
+            if (!ec)
+            {
+                try
+                {
+                    consider_entry(entry, updated);
+                }
+                catch (const std::filesystem::filesystem_error&)
+                {
+                    // The file vanished between the event and the stat; nothing to report.
+                }
+            }
+        }
+
+        return updated;
+    }
+
+    int inotify_fd_{-1};
+    int root_wd_{-1};
+    std::unordered_map<int, std::filesystem::path> watches_{};
+#endif
+
     WatcherOptions options_{};
-    std::mutex mutex_;
+    mutable std::mutex mutex_;
     std::unordered_map<SnapshotKey, FileDescriptor> known_files_{};
+    std::unique_ptr<SnapshotIndex> index_{};
 };
 
 }  // namespace sv::client
@@ -1,25 +1,147 @@
 #pragma once
 
+#include "delta.hpp"
 #include "storage.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cerrno>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
 #include <system_error>
 #include <vector>
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <lz4frame.h>
 #include <zstd.h>
 
 namespace server
 {
 
+// Decodes a file's patch payloads, fed in order and in pieces of any size, back into the uploaded
+// bytes according to the codec the file was sent with. Decompression contexts belong to the thread
+// and are reset rather than recreated for each file.
+class PayloadDecoder
+{
+public:
+    PayloadDecoder(sv::common::protocol::Codec codec, const ZSTD_DDict* dictionary)
+        : codec_{codec}
+    {
+        if (codec_ == sv::common::protocol::Codec::Zstd)
+        {
+            thread_local std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> context{ZSTD_createDCtx(),
+                                                                                     &ZSTD_freeDCtx};
+            zstd_ = context.get();
+            if (zstd_)
+            {
+                ZSTD_DCtx_reset(zstd_, ZSTD_reset_session_and_parameters);
+                if (ZSTD_isError(ZSTD_DCtx_refDDict(zstd_, dictionary)))
+                {
+                    zstd_ = nullptr;
+                }
+            }
+            output_.resize(ZSTD_DStreamOutSize());
+        }
+        else if (codec_ == sv::common::protocol::Codec::Lz4)
+        {
+            thread_local std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)> context{
+                create_lz4_context(), &LZ4F_freeDecompressionContext};
+            lz4_ = context.get();
+            if (lz4_)
+            {
+                LZ4F_resetDecompressionContext(lz4_);
+            }
+            output_.resize(std::size_t{1} << 17);
+        }
+    }
+
+    PayloadDecoder(const PayloadDecoder&) = delete;
+    PayloadDecoder& operator=(const PayloadDecoder&) = delete;
+
+    [[nodiscard]] bool valid() const noexcept
+    {
+        return codec_ == sv::common::protocol::Codec::Stored || zstd_ != nullptr || lz4_ != nullptr;
+    }
+
+    // Hands each piece of decoded output to `sink`, which returns false to stop. Returns false on a
+    // corrupt stream or when the sink stopped.
+    template <typename Sink>
+    bool feed(std::span<const char> input, Sink&& sink)
+    {
+        switch (codec_)
+        {
+        case sv::common::protocol::Codec::Stored:
+            return sink(std::span<const char>(input));
+        case sv::common::protocol::Codec::Lz4:
+            while (!input.empty())
+            {
+                std::size_t produced = output_.size();
+                std::size_t consumed = input.size();
+                const auto hint = LZ4F_decompress(lz4_, output_.data(), &produced, input.data(), &consumed, nullptr);
+                if (LZ4F_isError(hint))
+                {
+                    std::clog << "[assembler] LZ4 error: " << LZ4F_getErrorName(hint) << '\n';
+                    return false;
+                }
+                pending_ = hint;
+                input = input.subspan(consumed);
+                if (produced > 0 && !sink(std::span<const char>(output_.data(), produced)))
+                {
+                    return false;
+                }
+            }
+            return true;
+        default:
+        {
+            ZSTD_inBuffer zin{input.data(), input.size(), 0};
+            while (zin.pos < zin.size)
+            {
+                ZSTD_outBuffer zout{output_.data(), output_.size(), 0};
+                const auto ret = ZSTD_decompressStream(zstd_, &zout, &zin);
+                if (ZSTD_isError(ret))
+                {
+                    std::clog << "[assembler] ZSTD error: " << ZSTD_getErrorName(ret) << '\n';
+                    return false;
+                }
+                pending_ = ret;
+                if (zout.pos > 0 && !sink(std::span<const char>(output_.data(), zout.pos)))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+        }
+    }
+
+    // True when the input ended on a frame boundary.
+    [[nodiscard]] bool complete() const noexcept { return pending_ == 0; }
+
+private:
+    static LZ4F_dctx* create_lz4_context()
+    {
+        LZ4F_dctx* context = nullptr;
+        return LZ4F_isError(LZ4F_createDecompressionContext(&context, LZ4F_VERSION)) ? nullptr : context;
+    }
+
+    sv::common::protocol::Codec codec_;
+    ZSTD_DCtx* zstd_{nullptr};
+    LZ4F_dctx* lz4_{nullptr};
+    std::size_t pending_{0};
+    std::vector<char> output_;
+};
+
 class Assembler
 {
 public:
@@ -45,7 +167,9 @@ public:
             return std::nullopt;
         }
 
-        const auto part_path = files_root_ / (record.original_name + ".part");
+        const auto part_path = unique_part_path(record.original_name);
+        std::error_code dir_ec;
+        std::filesystem::create_directories(part_path.parent_path(), dir_ec);
         const int out_fd = ::open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
         if (out_fd < 0)
         {
@@ -54,20 +178,48 @@ public:
             return std::nullopt;
         }
 
-        ZSTD_DStream* stream = ZSTD_createDStream();
-        if (!stream)
+        // A delta upload decompresses to instructions that rebuild the file from its current copy.
+        int base_fd = -1;
+        std::optional<DeltaApplier> delta;
+        if (!record.delta_base.empty())
+        {
+            base_fd = ::open(record.delta_base.c_str(), O_RDONLY | O_CLOEXEC);
+            if (base_fd < 0)
+            {
+                std::clog << "[assembler] delta base " << record.delta_base << " unavailable: "
+                          << std::strerror(errno) << '\n';
+                ::close(out_fd);
+                ::unlink(part_path.c_str());
+                return std::nullopt;
+            }
+            delta.emplace(base_fd, out_fd);
+        }
+
+        PayloadDecoder decoder{record.codec, record.dictionary.get()};
+        if (!decoder.valid())
         {
-            std::clog << "[assembler] failed to allocate ZSTD stream\n";
+            std::clog << "[assembler] failed to allocate " << sv::common::protocol::codec_name(record.codec)
+                      << " decoder\n";
+            if (base_fd >= 0)
+            {
+                ::close(base_fd);
+            }
             ::close(out_fd);
             ::unlink(part_path.c_str());
             return std::nullopt;
         }
-        ZSTD_initDStream(stream);
+
+        auto sink = [&](std::span<const char> output) {
+            return delta ? delta->feed(std::span<const std::uint8_t>(
+                               reinterpret_cast<const std::uint8_t*>(output.data()), output.size()))
+                         : flush_buffer(out_fd, output.data(), output.size());
+        };
+        // Stored patches already are the file's bytes; they are copied over without passing through
+        // user space.
+        const bool copy_through = record.codec == sv::common::protocol::Codec::Stored && !delta;
 
         bool success = true;
-        size_t pending = 0;
         std::vector<char> input_buffer;
-        std::vector<char> output_buffer(ZSTD_DStreamOutSize());
 
         for (std::size_t idx = 0; idx < record.total_chunks && success; ++idx)
         {
@@ -80,6 +232,12 @@ public:
                 break;
             }
 
+            if (copy_through)
+            {
+                success = append_file(out_fd, chunk_path);
+                continue;
+            }
+
             std::ifstream in(chunk_path, std::ios::binary);
             if (!in)
             {
@@ -88,33 +246,22 @@ public:
                 break;
             }
             input_buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
-
-            ZSTD_inBuffer zin{input_buffer.data(), input_buffer.size(), 0};
-            while (zin.pos < zin.size && success)
-            {
-                ZSTD_outBuffer zout{output_buffer.data(), output_buffer.size(), 0};
-                const auto ret = ZSTD_decompressStream(stream, &zout, &zin);
-                if (ZSTD_isError(ret))
-                {
-                    std::clog << "[assembler] ZSTD error: " << ZSTD_getErrorName(ret) << '\n';
-                    success = false;
-                    break;
-                }
-                pending = ret;
-
-                if (!flush_buffer(out_fd, output_buffer.data(), zout.pos))
-                {
-                    success = false;
-                    break;
-                }
-            }
+            success = decoder.feed(input_buffer, sink);
         }
 
-        if (pending != 0)
+        if (success && !decoder.complete())
         {
             std::clog << "[assembler] stream not complete, expected more data" << '\n';
             success = false;
         }
+        if (success && delta && !delta->finish())
+        {
+            success = false;
+        }
+        if (base_fd >= 0)
+        {
+            ::close(base_fd);
+        }
 
         if (::fsync(out_fd) != 0)
         {
@@ -123,7 +270,16 @@ public:
             success = false;
         }
         ::close(out_fd);
-        ZSTD_freeDStream(stream);
+
+        // The client's digest, when it sent one, has to match what was put together before the file
+        // replaces whatever copy is in place.
+        const bool digest_known =
+            std::any_of(record.sha256.begin(), record.sha256.end(), [](std::uint8_t byte) { return byte != 0; });
+        if (success && digest_known && file_sha256(part_path) != record.sha256)
+        {
+            std::clog << "[assembler] hash mismatch for " << record.original_name << '\n';
+            success = false;
+        }
 
         if (!success)
         {
@@ -137,6 +293,7 @@ public:
         if (ec)
         {
             std::clog << "[assembler] rename failed: " << ec.message() << '\n';
+            ::unlink(part_path.c_str());
             return std::nullopt;
         }
 
@@ -150,7 +307,213 @@ public:
         return final_path;
     }
 
+    // Publishes every file of a pack from its decoded `payload` in one pass: each file is checked
+    // against its hash and written next to its final name, one syncfs() makes them all durable, and
+    // only then are they renamed into place. The pack fails as a whole when any file fails its check
+    // or cannot be renamed into place. Returns the published paths.
+    std::optional<std::vector<std::filesystem::path>> unpack(const sv::common::protocol::PackIndexMessage& pack,
+                                                             sv::common::protocol::Codec codec,
+                                                             const ZSTD_DDict* dictionary,
+                                                             std::span<const std::byte> payload)
+    {
+        std::uint64_t total = 0;
+        for (const auto& entry : pack.entries)
+        {
+            if (entry.offset != total || entry.size > sv::common::protocol::PackIndexMessage::MaxContentSize - total)
+            {
+                std::clog << "[assembler] pack " << pack.pack_id << " has a malformed index" << '\n';
+                return std::nullopt;
+            }
+            total += entry.size;
+        }
+
+        std::vector<char> content;
+        content.reserve(static_cast<std::size_t>(total));
+        PayloadDecoder decoder{codec, dictionary};
+        const bool decoded =
+            decoder.valid() &&
+            decoder.feed(std::span<const char>(reinterpret_cast<const char*>(payload.data()), payload.size()),
+                         [&](std::span<const char> output) {
+                             if (output.size() > total - content.size())
+                             {
+                                 return false;
+                             }
+                             content.insert(content.end(), output.begin(), output.end());
+                             return true;
+                         }) &&
+            decoder.complete() && content.size() == total;
+        if (!decoded)
+        {
+            std::clog << "[assembler] pack " << pack.pack_id << " does not decode to its index" << '\n';
+            return std::nullopt;
+        }
+
+        std::vector<std::filesystem::path> part_paths;
+        part_paths.reserve(pack.entries.size());
+        std::filesystem::path created_dir;
+        auto discard = [&part_paths] {
+            for (const auto& path : part_paths)
+            {
+                ::unlink(path.c_str());
+            }
+            return std::nullopt;
+        };
+        for (const auto& entry : pack.entries)
+        {
+            const auto bytes = std::span<const std::uint8_t>(
+                reinterpret_cast<const std::uint8_t*>(content.data()) + entry.offset, entry.size);
+            if (sv::common::bytes::sha256(bytes) != entry.sha256)
+            {
+                std::clog << "[assembler] hash mismatch for " << entry.utf8_name << " in pack " << pack.pack_id
+                          << '\n';
+                return discard();
+            }
+
+            auto part_path = unique_part_path(entry.utf8_name);
+            if (part_path.parent_path() != created_dir)
+            {
+                created_dir = part_path.parent_path();
+                std::error_code dir_ec;
+                std::filesystem::create_directories(created_dir, dir_ec);
+            }
+            const int out_fd = ::open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (out_fd < 0)
+            {
+                std::clog << "[assembler] open failed for " << part_path << ": " << std::strerror(errno)
+                          << '\n';
+                return discard();
+            }
+            part_paths.push_back(std::move(part_path));
+            const bool written = flush_buffer(out_fd, content.data() + entry.offset, entry.size);
+            ::close(out_fd);
+            if (!written)
+            {
+                return discard();
+            }
+        }
+
+        const int root_fd = ::open(files_root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        const bool synced = root_fd >= 0 && ::syncfs(root_fd) == 0;
+        if (!synced)
+        {
+            std::clog << "[assembler] syncfs failed for " << files_root_ << ": " << std::strerror(errno) << '\n';
+        }
+        if (root_fd >= 0)
+        {
+            ::close(root_fd);
+        }
+        if (!synced)
+        {
+            return discard();
+        }
+
+        std::vector<std::filesystem::path> published;
+        published.reserve(pack.entries.size());
+        for (std::size_t index = 0; index < pack.entries.size(); ++index)
+        {
+            auto final_path = files_root_ / pack.entries[index].utf8_name;
+            std::error_code ec;
+            std::filesystem::rename(part_paths[index], final_path, ec);
+            if (ec)
+            {
+                // The pack is refused as a whole and sent again; files renamed so far are rewritten
+                // with the same content then.
+                std::clog << "[assembler] rename failed: " << ec.message() << '\n';
+                for (; index < part_paths.size(); ++index)
+                {
+                    ::unlink(part_paths[index].c_str());
+                }
+                return std::nullopt;
+            }
+            published.push_back(std::move(final_path));
+        }
+        return published;
+    }
+
 private:
+    // Where a file is written before it is renamed into place. Each assembly gets a name of its own,
+    // so that two assemblies of the same file, say of a pack sent twice, never write into one.
+    std::filesystem::path unique_part_path(const std::string& name)
+    {
+        const auto id = next_part_.fetch_add(1, std::memory_order_relaxed);
+        return files_root_ / (name + '.' + std::to_string(id) + ".part");
+    }
+
+    static std::optional<ContentHash> file_sha256(const std::filesystem::path& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            return std::nullopt;
+        }
+        sv::common::bytes::Sha256 hash;
+        std::vector<char> buffer(std::size_t{1} << 20);
+        while (in)
+        {
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            hash.update(std::span<const std::uint8_t>(reinterpret_cast<const std::uint8_t*>(buffer.data()),
+                                                      static_cast<std::size_t>(in.gcount())));
+        }
+        if (in.bad())
+        {
+            return std::nullopt;
+        }
+        return hash.finish();
+    }
+
+    // Appends the whole of `path` to `out_fd` with copy_file_range, falling back to read/write where
+    // the kernel or filesystem cannot copy between the two.
+    static bool append_file(int out_fd, const std::filesystem::path& path)
+    {
+        const int in_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0)
+        {
+            std::clog << "[assembler] failed to open chunk " << path << '\n';
+            return false;
+        }
+        struct stat info{};
+        if (::fstat(in_fd, &info) != 0)
+        {
+            std::clog << "[assembler] stat failed for " << path << ": " << std::strerror(errno) << '\n';
+            ::close(in_fd);
+            return false;
+        }
+
+        auto remaining = static_cast<std::size_t>(info.st_size);
+        while (remaining > 0)
+        {
+            const auto copied = ::copy_file_range(in_fd, nullptr, out_fd, nullptr, remaining, 0);
+            if (copied < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (copied <= 0)
+            {
+                break;
+            }
+            remaining -= static_cast<std::size_t>(copied);
+        }
+
+        std::vector<char> buffer(remaining > 0 ? std::size_t{1} << 16 : 0);
+        while (remaining > 0)
+        {
+            const auto got = ::read(in_fd, buffer.data(), std::min(buffer.size(), remaining));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0 || !flush_buffer(out_fd, buffer.data(), static_cast<std::size_t>(got)))
+            {
+                std::clog << "[assembler] failed to copy chunk " << path << '\n';
+                ::close(in_fd);
+                return false;
+            }
+            remaining -= static_cast<std::size_t>(got);
+        }
+        ::close(in_fd);
+        return true;
+    }
+
     static bool flush_buffer(int fd, const char* data, std::size_t size)
     {
         std::size_t written_total = 0;
@@ -172,6 +535,7 @@ private:
     }
 
     std::filesystem::path files_root_;
+    std::atomic<std::uint64_t> next_part_{0};
 };
 
 } // namespace server
@@ -0,0 +1,271 @@
+#pragma once
+
+#include "common/bytes.hpp"
+#include "common/delta.hpp"
+#include "common/protocol.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace server
+{
+
+namespace delta = sv::common::delta;
+
+// Signatures of every full block of `base`; std::nullopt when there is no readable base.
+inline std::optional<sv::common::protocol::BlockSignaturesMessage> compute_signatures(
+    const std::filesystem::path& base,
+    std::uint32_t requested_block_size)
+{
+    const int fd = ::open(base.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return std::nullopt;
+    }
+    struct stat info{};
+    if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    sv::common::protocol::BlockSignaturesMessage signatures;
+    signatures.base_size = static_cast<std::uint64_t>(info.st_size);
+    signatures.block_size = delta::effective_block_size(requested_block_size, signatures.base_size);
+    signatures.blocks.reserve(static_cast<std::size_t>(signatures.base_size / signatures.block_size));
+
+    std::vector<std::uint8_t> block(signatures.block_size);
+    for (std::uint64_t offset = 0; offset + signatures.block_size <= signatures.base_size;
+         offset += signatures.block_size)
+    {
+        std::size_t filled = 0;
+        while (filled < block.size())
+        {
+            const auto got = ::pread(fd, block.data() + filled, block.size() - filled,
+                                     static_cast<off_t>(offset + filled));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                std::clog << "[delta] read failed for " << base << '\n';
+                ::close(fd);
+                return std::nullopt;
+            }
+            filled += static_cast<std::size_t>(got);
+        }
+        signatures.blocks.push_back({delta::weak_checksum(block), delta::strong_hash(block)});
+    }
+    ::close(fd);
+    return signatures;
+}
+
+// Rebuilds a file from its base and a delta instruction stream (see common/delta.hpp) fed in pieces
+// of any size, writing the result to `out_fd` as it goes.
+class DeltaApplier
+{
+public:
+    DeltaApplier(int base_fd, int out_fd)
+        : base_fd_{base_fd}
+        , out_fd_{out_fd}
+    {
+    }
+
+    // Returns false on a malformed stream, an out-of-range copy or an I/O error.
+    bool feed(std::span<const std::uint8_t> input)
+    {
+        while (!input.empty() && !failed_)
+        {
+            if (literal_remaining_ > 0)
+            {
+                const auto take = static_cast<std::size_t>(std::min<std::uint64_t>(literal_remaining_, input.size()));
+                if (!write_out(input.first(take)))
+                {
+                    return false;
+                }
+                literal_remaining_ -= take;
+                input = input.subspan(take);
+                continue;
+            }
+            if (done_)
+            {
+                return fail("data after end of delta");
+            }
+
+            const auto needed = pending_need();
+            const auto take = std::min(needed - pending_.size(), input.size());
+            pending_.insert(pending_.end(), input.begin(), input.begin() + static_cast<std::ptrdiff_t>(take));
+            input = input.subspan(take);
+            if (pending_.size() == needed && pending_need() == needed)
+            {
+                execute();
+                pending_.clear();
+            }
+        }
+        return !failed_;
+    }
+
+    // True once the End instruction arrived and the rebuilt bytes matched its digest.
+    bool finish()
+    {
+        if (!failed_ && !done_)
+        {
+            fail("delta ended early");
+        }
+        return !failed_;
+    }
+
+private:
+    // Bytes of the element being collected in pending_; grows once the opcode is known.
+    std::size_t pending_need() const
+    {
+        if (!have_header_)
+        {
+            return delta::HeaderSize;
+        }
+        if (pending_.empty())
+        {
+            return 1;
+        }
+        switch (static_cast<delta::Op>(pending_[0]))
+        {
+        case delta::Op::Literal:
+            return delta::LiteralPrefixSize;
+        case delta::Op::Copy:
+            return delta::CopySize;
+        default:
+            return delta::EndSize;
+        }
+    }
+
+    void execute()
+    {
+        using sv::common::bytes::read_u32_le;
+        using sv::common::bytes::read_u64_le;
+        if (!have_header_)
+        {
+            if (!std::equal(delta::Magic.begin(), delta::Magic.end(), pending_.begin()))
+            {
+                fail("bad delta magic");
+                return;
+            }
+            block_size_ = read_u32_le(pending_.data() + 4);
+            base_size_ = read_u64_le(pending_.data() + 8);
+            have_header_ = true;
+            if (block_size_ < delta::MinBlockSize || block_size_ > delta::MaxBlockSize)
+            {
+                fail("bad delta block size");
+            }
+            return;
+        }
+
+        switch (static_cast<delta::Op>(pending_[0]))
+        {
+        case delta::Op::Literal:
+            literal_remaining_ = read_u32_le(pending_.data() + 1);
+            break;
+        case delta::Op::Copy:
+            copy_blocks(read_u32_le(pending_.data() + 1), read_u32_le(pending_.data() + 5));
+            break;
+        case delta::Op::End:
+        {
+            std::array<std::uint8_t, 32> expected{};
+            std::copy_n(pending_.begin() + 1, expected.size(), expected.begin());
+            if (sha_.finish() != expected)
+            {
+                fail("rebuilt file does not match its digest");
+            }
+            done_ = true;
+            break;
+        }
+        default:
+            fail("unknown delta instruction");
+        }
+    }
+
+    void copy_blocks(std::uint32_t first, std::uint32_t count)
+    {
+        const auto begin = static_cast<std::uint64_t>(first) * block_size_;
+        const auto length = static_cast<std::uint64_t>(count) * block_size_;
+        if (count == 0 || begin + length > base_size_)
+        {
+            fail("delta copy beyond base");
+            return;
+        }
+        buffer_.resize(std::min<std::uint64_t>(length, 4ULL * 1024 * 1024));
+        for (std::uint64_t done = 0; done < length && !failed_;)
+        {
+            const auto want = static_cast<std::size_t>(std::min<std::uint64_t>(buffer_.size(), length - done));
+            const auto got = ::pread(base_fd_, buffer_.data(), want, static_cast<off_t>(begin + done));
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                fail("base read failed");
+                return;
+            }
+            write_out(std::span<const std::uint8_t>(buffer_.data(), static_cast<std::size_t>(got)));
+            done += static_cast<std::uint64_t>(got);
+        }
+    }
+
+    bool write_out(std::span<const std::uint8_t> data)
+    {
+        sha_.update(data);
+        std::size_t written_total = 0;
+        while (written_total < data.size())
+        {
+            const ssize_t written = ::write(out_fd_, data.data() + written_total, data.size() - written_total);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return fail(std::string{"write failed: "} + std::strerror(errno));
+            }
+            written_total += static_cast<std::size_t>(written);
+        }
+        return true;
+    }
+
+    bool fail(const std::string& reason)
+    {
+        if (!failed_)
+        {
+            std::clog << "[delta] " << reason << '\n';
+        }
+        failed_ = true;
+        return false;
+    }
+
+    int base_fd_;
+    int out_fd_;
+    bool have_header_{false};
+    bool done_{false};
+    bool failed_{false};
+    std::uint32_t block_size_{0};
+    std::uint64_t base_size_{0};
+    std::uint64_t literal_remaining_{0};
+    std::vector<std::uint8_t> pending_;
+    std::vector<std::uint8_t> buffer_;
+    sv::common::bytes::Sha256 sha_;
+};
+
+} // namespace server
@@ -1,14 +1,18 @@
 #include "assembler.hpp"
 #include "control.hpp"
+#include "delta.hpp"
 #include "listeners.hpp"
 #include "storage.hpp"
+#include "common/protocol.hpp"
 
 #include <asio.hpp>
 
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <csignal>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <iomanip>
 #include <iostream>
@@ -17,8 +21,10 @@
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <span>
 #include <system_error>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 namespace
@@ -31,6 +37,7 @@ struct Config
     std::uint16_t data_base = 7100;
     std::size_t data_listeners = 4;
     std::chrono::seconds ttl{3600};
+    std::chrono::seconds chunk_ttl{std::chrono::hours{24 * 7}};
     std::filesystem::path root_dir{"server_data"};
 };
 
@@ -46,6 +53,7 @@ struct Metrics
     std::atomic<std::uint64_t> chunk_errors{0};
     std::atomic<std::uint64_t> assemblies{0};
     std::atomic<std::uint64_t> assembly_errors{0};
+    std::atomic<std::uint64_t> packs{0};
 };
 
 std::atomic<bool> g_running{true};
@@ -65,7 +73,7 @@ Config parse_arguments(int argc, char** argv)
         {
             std::cout << "Usage: " << argv[0]
                       << " [--address 0.0.0.0] [--sys-base 7000] [--data-base 7100] [--x 4]"
-                         " [--ttl 3600] [--root server_data]\n";
+                         " [--ttl 3600] [--chunk-ttl 604800] [--root server_data]\n";
             std::exit(EXIT_SUCCESS);
         }
         if (arg == "--address" && i + 1 < argc)
@@ -93,6 +101,11 @@ Config parse_arguments(int argc, char** argv)
             config.ttl = std::chrono::seconds{std::stoll(argv[++i])};
             continue;
         }
+        if (arg == "--chunk-ttl" && i + 1 < argc)
+        {
+            config.chunk_ttl = std::chrono::seconds{std::stoll(argv[++i])};
+            continue;
+        }
         if (arg == "--root" && i + 1 < argc)
         {
             config.root_dir = argv[++i];
@@ -115,34 +128,405 @@ std::string metrics_snapshot(const Metrics& metrics)
         << " chunks=" << metrics.chunks.load()
         << " chunk_errors=" << metrics.chunk_errors.load()
         << " assemblies=" << metrics.assemblies.load()
-        << " assembly_errors=" << metrics.assembly_errors.load();
+        << " assembly_errors=" << metrics.assembly_errors.load()
+        << " packs=" << metrics.packs.load();
     return oss.str();
 }
 
-std::vector<std::byte> to_bytes(const std::string& value)
+namespace protocol = sv::common::protocol;
+
+// Upper bound for a single patch payload; the client ships 2.5 MB chunks.
+constexpr std::uint32_t max_payload_size = 64U * 1024U * 1024U;
+
+std::vector<std::byte> to_bytes(std::span<const std::uint8_t> value)
 {
-    std::vector<std::byte> bytes;
-    bytes.reserve(value.size());
-    for (unsigned char ch : value)
-    {
-        bytes.push_back(static_cast<std::byte>(ch));
-    }
+    std::vector<std::byte> bytes(value.size());
+    std::memcpy(bytes.data(), value.data(), value.size());
     return bytes;
 }
 
-bool read_line(asio::ip::tcp::socket& socket, asio::streambuf& buffer, std::string& line)
+std::string file_id_hex(std::uint64_t file_id)
 {
-    std::error_code ec;
-    asio::read_until(socket, buffer, '\n', ec);
-    if (ec)
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << file_id;
+    return oss.str();
+}
+
+// Client-supplied names are relative paths below the files directory; anything that could escape it
+// is refused.
+bool is_safe_relative_name(const std::string& name)
+{
+    if (name.empty() || name.find('\0') != std::string::npos)
     {
         return false;
     }
-    std::istream is(&buffer);
-    std::getline(is, line);
+    const std::filesystem::path path{name};
+    if (path.is_absolute() || path.has_root_name() || path.has_root_directory())
+    {
+        return false;
+    }
+    for (const auto& part : path)
+    {
+        if (part == ".." || part == ".")
+        {
+            return false;
+        }
+    }
     return true;
 }
 
+// Assembles a complete payload into files/ and retires its patches; a failed assembly leaves them for
+// another attempt.
+void publish_payload(const server::PayloadRecord& record,
+                     server::Storage& storage,
+                     server::Assembler& assembler,
+                     Metrics& metrics)
+{
+    if (auto final_path = assembler.assemble(record))
+    {
+        metrics.assemblies.fetch_add(1);
+        storage.mark_published(record.file_id);
+        std::clog << "[assembler] published " << final_path->string() << '\n';
+    }
+    else
+    {
+        metrics.assembly_errors.fetch_add(1);
+        storage.mark_assembly_failed(record.file_id);
+    }
+}
+
+// Data channel: a VersionHello exchange, then any number of frames until the client closes the
+// connection. A frame is either a SystemFrame or a PatchHeader followed by exactly payload_size bytes;
+// every patch, chunk recipe, signature request and resume query must be preceded by its file's
+// FileMeta on the same connection, except that a patch of a file already being assembled or published
+// is acknowledged without one. The server answers a ChunkRecipe with MissingChunks, a
+// SignatureRequest with BlockSignatures, a ResumeQuery with StoredPatches and, from protocol version 3
+// on, every patch with a PatchAck once it is stored or refused; no other frame gets a reply. A
+// Dictionary frame registers a zstd dictionary that patches sent after it, on any connection, may be
+// compressed with. A PackIndex frame stands in for the FileMeta frames of a pack's files; the pack's
+// single patch is unpacked straight from memory without going through patch storage.
+void handle_data_connection(asio::ip::tcp::socket& socket,
+                            server::Storage& storage,
+                            server::Assembler& assembler,
+                            Metrics& metrics)
+{
+    auto fail = [&](std::string_view reason) {
+        metrics.chunk_errors.fetch_add(1);
+        std::clog << "[data] " << reason << '\n';
+    };
+
+    asio::error_code ec;
+    std::array<std::uint8_t, protocol::VersionHello::EncodedSize> hello_bytes{};
+    asio::read(socket, asio::buffer(hello_bytes), ec);
+    if (ec)
+    {
+        fail("handshake read failed: " + ec.message());
+        return;
+    }
+    const auto offer = protocol::VersionHello::deserialize(hello_bytes);
+    const auto version = protocol::VersionHello::negotiate(protocol::VersionHello{}, offer);
+    asio::write(socket, asio::buffer(protocol::VersionHello::accept(version).serialize()), ec);
+    if (version == 0)
+    {
+        fail("no common protocol version, client offers " + std::to_string(offer.min_version) + '-' +
+             std::to_string(offer.max_version));
+        return;
+    }
+    if (ec)
+    {
+        fail("handshake write failed: " + ec.message());
+        return;
+    }
+
+    auto publish = [&](const server::PayloadRecord& record) {
+        publish_payload(record, storage, assembler, metrics);
+    };
+
+    auto send_ack = [&](const protocol::PatchHeader& header, bool stored) {
+        if (version < protocol::PatchHeader::AckVersion)
+        {
+            return true;
+        }
+        protocol::SystemMessage ack;
+        ack.type = protocol::SystemMessageType::PatchAck;
+        ack.payload = protocol::PatchAckMessage{
+            header.file_id, header.patch_index, stored ? protocol::PatchStatus::Stored : protocol::PatchStatus::Rejected};
+        asio::write(socket, asio::buffer(protocol::SystemFrame::encode(ack)), ec);
+        if (ec)
+        {
+            fail("patch ack failed: " + ec.message());
+            return false;
+        }
+        return true;
+    };
+
+    std::unordered_map<std::uint64_t, protocol::FileMetaMessage> announced;
+    std::unordered_map<std::uint64_t, protocol::PackIndexMessage> packs;
+    std::array<std::uint8_t, protocol::PatchHeader::EncodedSize> header_bytes{};
+    std::vector<std::uint8_t> frame;
+    std::uint64_t published_seen = storage.published_count();
+    while (true)
+    {
+        // Files published since the last frame, through any connection, need no FileMeta here any more.
+        if (const auto published = storage.published_count(); published != published_seen)
+        {
+            published_seen = published;
+            std::erase_if(announced, [&](const auto& item) { return storage.finished(file_id_hex(item.first)); });
+        }
+
+        asio::read(socket, asio::buffer(header_bytes.data(), protocol::PatchHeader::Magic.size()), ec);
+        if (ec == asio::error::eof)
+        {
+            return;
+        }
+        if (ec)
+        {
+            fail("read failed: " + ec.message());
+            return;
+        }
+
+        if (protocol::is_magic(header_bytes, protocol::SystemFrame::Magic))
+        {
+            std::array<std::uint8_t, 4> size_bytes{};
+            asio::read(socket, asio::buffer(size_bytes), ec);
+            const auto body_size = sv::common::bytes::read_u32_le(size_bytes.data());
+            if (ec || body_size > protocol::SystemFrame::MaxBodySize)
+            {
+                fail("malformed system frame");
+                return;
+            }
+            frame.resize(body_size + protocol::SystemFrame::TrailerSize);
+            asio::read(socket, asio::buffer(frame), ec);
+            if (ec)
+            {
+                fail("read failed: " + ec.message());
+                return;
+            }
+            const auto message = protocol::SystemFrame::decode(frame);
+            if (const auto* meta = std::get_if<protocol::FileMetaMessage>(&message.payload))
+            {
+                if (!is_safe_relative_name(meta->utf8_name))
+                {
+                    fail("rejecting unsafe file name '" + meta->utf8_name + "'");
+                    return;
+                }
+                announced[meta->file_id] = *meta;
+            }
+            else if (const auto* recipe = std::get_if<protocol::ChunkRecipeMessage>(&message.payload))
+            {
+                const auto meta = announced.find(recipe->file_id);
+                if (meta == announced.end())
+                {
+                    fail("recipe for unannounced file " + file_id_hex(recipe->file_id));
+                    return;
+                }
+                auto result =
+                    storage.register_recipe(file_id_hex(recipe->file_id), meta->second.utf8_name, recipe->chunk_hashes);
+                announced.erase(meta);
+                if (result.complete)
+                {
+                    publish(*result.complete);
+                }
+                protocol::SystemMessage reply;
+                reply.type = protocol::SystemMessageType::MissingChunks;
+                reply.payload = protocol::MissingChunksMessage{recipe->file_id, std::move(result.missing)};
+                asio::write(socket, asio::buffer(protocol::SystemFrame::encode(reply)), ec);
+                if (ec)
+                {
+                    fail("recipe reply failed: " + ec.message());
+                    return;
+                }
+            }
+            else if (const auto* request = std::get_if<protocol::SignatureRequestMessage>(&message.payload))
+            {
+                const auto meta = announced.find(request->file_id);
+                if (meta == announced.end())
+                {
+                    fail("signature request for unannounced file " + file_id_hex(request->file_id));
+                    return;
+                }
+                const auto base = storage.files_dir() / meta->second.utf8_name;
+                auto signatures = server::compute_signatures(base, request->block_size)
+                                      .value_or(protocol::BlockSignaturesMessage{});
+                signatures.file_id = request->file_id;
+                if (!signatures.blocks.empty())
+                {
+                    storage.register_delta(file_id_hex(request->file_id), meta->second.utf8_name, base);
+                }
+                announced.erase(meta);
+                protocol::SystemMessage reply;
+                reply.type = protocol::SystemMessageType::BlockSignatures;
+                reply.payload = std::move(signatures);
+                asio::write(socket, asio::buffer(protocol::SystemFrame::encode(reply)), ec);
+                if (ec)
+                {
+                    fail("signature reply failed: " + ec.message());
+                    return;
+                }
+            }
+            else if (const auto* query = std::get_if<protocol::ResumeQueryMessage>(&message.payload))
+            {
+                const auto meta = announced.find(query->file_id);
+                if (meta == announced.end())
+                {
+                    fail("resume query for unannounced file " + file_id_hex(query->file_id));
+                    return;
+                }
+                protocol::SystemMessage reply;
+                reply.type = protocol::SystemMessageType::StoredPatches;
+                reply.payload = protocol::StoredPatchesMessage{
+                    query->file_id, storage.stored_patches(file_id_hex(query->file_id), meta->second.utf8_name)};
+                announced.erase(meta);
+                asio::write(socket, asio::buffer(protocol::SystemFrame::encode(reply)), ec);
+                if (ec)
+                {
+                    fail("resume reply failed: " + ec.message());
+                    return;
+                }
+            }
+            else if (auto* pack = std::get_if<protocol::PackIndexMessage>(&message.payload))
+            {
+                for (const auto& entry : pack->entries)
+                {
+                    if (!is_safe_relative_name(entry.utf8_name))
+                    {
+                        fail("rejecting unsafe file name '" + entry.utf8_name + "' in pack");
+                        return;
+                    }
+                }
+                packs[pack->pack_id] = std::move(*pack);
+            }
+            else if (const auto* dictionary = std::get_if<protocol::DictionaryMessage>(&message.payload))
+            {
+                if (!storage.add_dictionary(dictionary->dict_id, dictionary->content))
+                {
+                    fail("rejecting dictionary " + std::to_string(dictionary->dict_id));
+                    return;
+                }
+            }
+            continue;
+        }
+
+        const auto magic_size = protocol::PatchHeader::Magic.size();
+        const auto header_size = protocol::PatchHeader::encoded_size(version);
+        asio::read(socket, asio::buffer(header_bytes.data() + magic_size, header_size - magic_size), ec);
+        if (ec)
+        {
+            fail("read failed: " + ec.message());
+            return;
+        }
+        const auto header =
+            protocol::PatchHeader::deserialize(std::span<const std::uint8_t>(header_bytes.data(), header_size));
+        if (header.version != version)
+        {
+            fail("patch header version " + std::to_string(header.version) + " differs from negotiated " +
+                 std::to_string(version));
+            return;
+        }
+        // A zero total marks a leading chunk of a streamed upload.
+        if ((header.total_patches != 0 && header.patch_index >= header.total_patches) ||
+            header.payload_size > max_payload_size)
+        {
+            fail("patch header out of range");
+            return;
+        }
+        const auto meta = announced.find(header.file_id);
+        const auto pack = meta == announced.end() ? packs.find(header.file_id) : packs.end();
+        if (meta == announced.end() && pack == packs.end())
+        {
+            if (!storage.finished(file_id_hex(header.file_id)))
+            {
+                fail("patch for unannounced file " + file_id_hex(header.file_id));
+                return;
+            }
+            // A late copy of a patch of a file that is done with, whose FileMeta was dropped above.
+            frame.resize(header.payload_size);
+            asio::read(socket, asio::buffer(frame), ec);
+            if (ec)
+            {
+                fail("payload read failed: " + ec.message());
+                return;
+            }
+            if (!send_ack(header, true))
+            {
+                return;
+            }
+            continue;
+        }
+        if (pack != packs.end() && (header.patch_index != 0 || header.total_patches != 1))
+        {
+            fail("pack " + file_id_hex(header.file_id) + " sent as more than one patch");
+            return;
+        }
+
+        server::ChunkData chunk;
+        chunk.file_id = file_id_hex(header.file_id);
+        chunk.original_name = pack == packs.end() ? meta->second.utf8_name : std::string{};
+        if (pack == packs.end())
+        {
+            chunk.sha256 = meta->second.sha256;
+        }
+        chunk.index = header.patch_index;
+        chunk.total_chunks = header.total_patches;
+        chunk.timestamp = std::chrono::system_clock::now();
+        const auto unsigned_header = header.serialize(false);
+        chunk.header_bytes = to_bytes(std::span<const std::uint8_t>(unsigned_header.data(), header.size()));
+        chunk.codec = header.codec;
+        chunk.header_crc = header.header_crc32;
+        chunk.payload_crc = header.payload_crc32;
+        chunk.payload.resize(header.payload_size);
+        asio::read(socket, asio::buffer(chunk.payload), ec);
+        if (ec)
+        {
+            fail("payload read failed: " + ec.message());
+            return;
+        }
+
+        std::clog << "[data] patch received file=" << chunk.file_id << " index=" << chunk.index << '/'
+                  << chunk.total_chunks << " size=" << header.payload_size << "B" << '\n';
+
+        metrics.chunks.fetch_add(1);
+        if (pack != packs.end())
+        {
+            const auto dictionary = storage.verify_unstored(chunk);
+            const auto published = dictionary ? assembler.unpack(pack->second, chunk.codec, dictionary->get(), chunk.payload)
+                                              : std::nullopt;
+            if (published)
+            {
+                metrics.packs.fetch_add(1);
+                metrics.assemblies.fetch_add(published->size());
+                std::clog << "[assembler] published " << published->size() << " files from pack "
+                          << chunk.file_id << '\n';
+            }
+            else
+            {
+                metrics.assembly_errors.fetch_add(1);
+            }
+            packs.erase(pack);
+            if (!send_ack(header, published.has_value()))
+            {
+                return;
+            }
+        }
+        else
+        {
+            auto result = storage.store_chunk(chunk);
+            // Acked before the file is assembled: assembly decodes and syncs the whole file, which on a
+            // large one would hold the ack past the client's ack timeout.
+            if (!send_ack(header, result.stored))
+            {
+                return;
+            }
+            if (result.complete)
+            {
+                // Every patch of the file is in; no further frames for it are expected on this connection.
+                announced.erase(header.file_id);
+                publish(*result.complete);
+            }
+        }
+    }
+}
+
 void cleanup_completed_files(const std::filesystem::path& files_dir, std::chrono::seconds ttl)
 {
     if (ttl <= std::chrono::seconds::zero())
@@ -152,7 +536,7 @@ void cleanup_completed_files(const std::filesystem::path& files_dir, std::chrono
 
     const auto now = std::chrono::system_clock::now();
     std::error_code ec;
-    std::filesystem::directory_iterator it{files_dir, ec};
+    std::filesystem::recursive_directory_iterator it{files_dir, ec};
     if (ec)
     {
         std::clog << "[cleanup] directory iteration error: " << ec.message() << '\n';
@@ -204,8 +588,14 @@ int main(int argc, char** argv)
     const auto config = parse_arguments(argc, argv);
     Metrics metrics;
 
-    server::Storage storage(config.root_dir, config.ttl);
+    server::Storage storage(config.root_dir, config.ttl, config.chunk_ttl);
     server::Assembler assembler(storage.files_dir());
+    // Files a previous run acknowledged in full but stopped before assembling; their clients count them
+    // as uploaded, so they are assembled before any connection is taken.
+    for (const auto& record : storage.ready_payloads())
+    {
+        publish_payload(record, storage, assembler, metrics);
+    }
     std::atomic<std::size_t> data_listener_count{config.data_listeners};
     std::atomic<std::chrono::seconds::rep> ttl_seconds{config.ttl.count()};
 
@@ -273,127 +663,7 @@ int main(int argc, char** argv)
                                               std::thread([socket = std::move(socket), &storage, &assembler, &metrics]() mutable {
                                                   try
                                                   {
-                                                      asio::streambuf buffer;
-                                                      std::string line;
-                                                      server::ChunkData chunk;
-                                                      chunk.timestamp = std::chrono::system_clock::now();
-
-                                                      auto fail = [&]() {
-                                                          metrics.chunk_errors.fetch_add(1);
-                                                      };
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.file_id = line;
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.original_name = line;
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.index = static_cast<std::size_t>(std::stoul(line));
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.total_chunks = static_cast<std::size_t>(std::stoul(line));
-
-                                                      if (chunk.total_chunks == 0 || chunk.index >= chunk.total_chunks)
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.ttl = std::chrono::seconds{std::stoll(line)};
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      const auto payload_size = static_cast<std::size_t>(std::stoull(line));
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.header_crc = static_cast<std::uint32_t>(std::stoul(line));
-
-                                                      if (!read_line(socket, buffer, line))
-                                                      {
-                                                          fail();
-                                                          return;
-                                                      }
-                                                      chunk.payload_crc = static_cast<std::uint32_t>(std::stoul(line));
-
-                                                      const std::string header_blob = chunk.file_id + '\n' + chunk.original_name + '\n' +
-                                                                                       std::to_string(chunk.index) + '\n' +
-                                                                                       std::to_string(chunk.total_chunks) + '\n' +
-                                                                                       std::to_string(chunk.ttl.count()) + '\n' +
-                                                                                       std::to_string(payload_size) + '\n';
-                                                      chunk.header_bytes = to_bytes(header_blob);
-
-                                                      chunk.payload.resize(payload_size);
-                                                      std::size_t received = 0;
-                                                      while (received < payload_size)
-                                                      {
-                                                          std::error_code ec;
-                                                          const auto bytes = socket.read_some(
-                                                              asio::buffer(chunk.payload.data() + received, payload_size - received), ec);
-                                                          if (ec)
-                                                          {
-                                                              fail();
-                                                              return;
-                                                          }
-                                                          received += bytes;
-                                                      }
-
-                                                      std::clog << "[data] patch received file=" << chunk.file_id << " index="
-                                                                << chunk.index << '/' << chunk.total_chunks
-                                                                << " size=" << payload_size << "B" << '\n';
-
-                                                      metrics.chunks.fetch_add(1);
-                                                      if (auto record = storage.store_chunk(chunk))
-                                                      {
-                                                          if (auto final_path = assembler.assemble(*record))
-                                                          {
-                                                              metrics.assemblies.fetch_add(1);
-                                                              storage.mark_published(record->file_id);
-                                                              std::clog << "[assembler] published " << final_path->string() << '\n';
-                                                          }
-                                                          else
-                                                          {
-                                                              metrics.assembly_errors.fetch_add(1);
-                                                          }
-                                                      }
-
-                                                      try
-                                                      {
-                                                          const std::string response = "STORED\n";
-                                                          asio::write(socket, asio::buffer(response));
-                                                      }
-                                                      catch (const std::exception& ex)
-                                                      {
-                                                          std::clog << "[data] response error: " << ex.what() << '\n';
-                                                      }
+                                                      handle_data_connection(socket, storage, assembler, metrics);
                                                   }
                                                   catch (const std::exception& ex)
                                                   {
@@ -1,16 +1,23 @@
 #pragma once
 
+#include "common/bytes.hpp"
+#include "common/protocol.hpp"
+
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
 #include <cstdint>
 #include <cstring>
 #include <cerrno>
+#include <charconv>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <set>
@@ -28,6 +35,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <zstd.h>
+
 namespace server
 {
 
@@ -43,8 +52,14 @@ struct ChunkData
     std::vector<std::byte> payload;
     std::uint32_t header_crc{};
     std::uint32_t payload_crc{};
+    sv::common::protocol::Codec codec{sv::common::protocol::Codec::Zstd};
+    // SHA-256 of the whole file as the client announced it; all zero when it did not know it yet.
+    std::array<std::uint8_t, 32> sha256{};
 };
 
+// SHA-256 of a content-defined chunk's uncompressed bytes; names the chunk in the chunk store.
+using ContentHash = std::array<std::uint8_t, 32>;
+
 struct PayloadRecord
 {
     std::string file_id;
@@ -53,16 +68,45 @@ struct PayloadRecord
     std::filesystem::path patches_dir;
     std::filesystem::path files_dir;
     std::vector<std::filesystem::path> chunk_files;
+    // Set for delta uploads: the file the decompressed delta instructions are applied to.
+    std::filesystem::path delta_base;
+    sv::common::protocol::Codec codec{sv::common::protocol::Codec::Zstd};
+    // The trained dictionary a zstd payload was compressed with, if any.
+    std::shared_ptr<const ZSTD_DDict> dictionary;
+    // What the assembled file has to hash to; all zero when no patch carried the digest.
+    ContentHash sha256{};
+};
+
+struct StoreResult
+{
+    bool stored{false};
+    std::optional<PayloadRecord> complete;
 };
 
+struct RecipeResult
+{
+    std::vector<std::uint32_t> missing;
+    std::optional<PayloadRecord> complete;
+};
+
+// Patches of fixed-size uploads live under patches/<file_id>/ until the file is assembled; the ones a
+// previous run left partial are reloaded on start, so their clients can resume them. Chunks of
+// content-defined uploads are stored once under chunks/<hh>/<hash>.zst, shared by every file whose
+// recipe references them, and expire after chunk_ttl without being referenced. Compression dictionaries
+// clients announce are kept under dicts/<id>.zdict and reloaded on start.
 class Storage
 {
 public:
-    Storage(std::filesystem::path root, std::chrono::seconds default_ttl)
+    Storage(std::filesystem::path root,
+            std::chrono::seconds default_ttl,
+            std::chrono::seconds chunk_ttl = std::chrono::hours{24 * 7})
         : root_{std::move(root)}
         , patches_dir_{root_ / "patches"}
         , files_dir_{root_ / "files"}
+        , chunks_dir_{root_ / "chunks"}
+        , dicts_dir_{root_ / "dicts"}
         , default_ttl_rep_{default_ttl.count()}
+        , chunk_ttl_{chunk_ttl}
     {
         std::error_code ec;
         std::filesystem::create_directories(patches_dir_, ec);
@@ -75,18 +119,52 @@ public:
         {
             std::clog << "[storage] failed to create files directory: " << ec.message() << '\n';
         }
+        std::filesystem::create_directories(chunks_dir_, ec);
+        if (ec)
+        {
+            std::clog << "[storage] failed to create chunks directory: " << ec.message() << '\n';
+        }
+        std::filesystem::create_directories(dicts_dir_, ec);
+        if (ec)
+        {
+            std::clog << "[storage] failed to create dicts directory: " << ec.message() << '\n';
+        }
+        load_dictionaries();
+        load_payloads();
     }
 
     Storage(const Storage&) = delete;
     Storage& operator=(const Storage&) = delete;
 
-    std::optional<PayloadRecord> store_chunk(const ChunkData& chunk)
+    // Stores a patch durably. The result says whether it was stored, and carries the file's record once
+    // this patch completed it.
+    StoreResult store_chunk(const ChunkData& chunk)
     {
         if (!verify_crc(chunk))
         {
             std::clog << "[storage] CRC mismatch for chunk " << chunk.file_id << '#' << chunk.index
                       << '\n';
-            return std::nullopt;
+            return {};
+        }
+
+        std::optional<ContentHash> content_hash;
+        {
+            std::lock_guard lock{mutex_};
+            const auto it = payloads_.find(chunk.file_id);
+            if (it != payloads_.end() && settled(it->second))
+            {
+                return duplicate_of_settled(chunk);
+            }
+            if (it != payloads_.end() && !it->second.recipe.empty())
+            {
+                if (chunk.index >= it->second.recipe.size())
+                {
+                    std::clog << "[storage] chunk index " << chunk.index << " beyond recipe of "
+                              << chunk.file_id << '\n';
+                    return {};
+                }
+                content_hash = it->second.recipe[chunk.index];
+            }
         }
 
         auto manifest_dir = patches_dir_ / chunk.file_id;
@@ -96,35 +174,115 @@ public:
         {
             std::clog << "[storage] failed to create directory " << manifest_dir << ": "
                       << ec.message() << '\n';
-            return std::nullopt;
+            return {};
         }
 
-        const auto patch_path = manifest_dir / patch_file_name(chunk.index);
-        if (!write_binary_file(patch_path, chunk.payload))
+        std::filesystem::path patch_path;
+        if (content_hash)
         {
-            std::clog << "[storage] failed to write patch file " << patch_path << '\n';
-            return std::nullopt;
+            if (!verify_content(chunk.payload, *content_hash))
+            {
+                std::clog << "[storage] content hash mismatch for chunk " << chunk.file_id << '#'
+                          << chunk.index << '\n';
+                return {};
+            }
+            patch_path = chunk_path(*content_hash);
+            std::filesystem::create_directories(patch_path.parent_path(), ec);
+            // Another connection may store the same chunk at the same time; whichever lands, the
+            // content is the same.
+            if (!std::filesystem::exists(patch_path) && !write_binary_file(patch_path, chunk.payload) &&
+                !std::filesystem::exists(patch_path))
+            {
+                std::clog << "[storage] failed to write chunk file " << patch_path << '\n';
+                return {};
+            }
+        }
+        else
+        {
+            patch_path = manifest_dir / patch_file_name(chunk.index);
+            if (!write_binary_file(patch_path, chunk.payload))
+            {
+                std::clog << "[storage] failed to write patch file " << patch_path << '\n';
+                return {};
+            }
         }
 
         const auto now = std::chrono::system_clock::now();
 
         std::lock_guard lock{mutex_};
         auto& entry = payloads_[chunk.file_id];
-        if (entry.record.chunk_files.empty())
+        if (settled(entry))
+        {
+            // Another connection completed the file while this copy of a patch was being written.
+            return duplicate_of_settled(chunk);
+        }
+        if (entry.record.file_id.empty())
         {
             entry.record.file_id = chunk.file_id;
             entry.record.original_name = chunk.original_name;
-            entry.record.total_chunks = chunk.total_chunks;
             entry.record.patches_dir = manifest_dir;
             entry.record.files_dir = files_dir_;
         }
-        entry.record.chunk_files.resize(std::max(entry.record.chunk_files.size(), chunk.total_chunks));
+        // The first patch fixes the file's codec; content-defined chunks are always zstd.
+        if (entry.received.empty() && entry.recipe.empty())
+        {
+            entry.record.codec = chunk.codec;
+        }
+        else if (chunk.codec != entry.record.codec)
+        {
+            std::clog << "[storage] chunk " << chunk.file_id << '#' << chunk.index << " uses codec "
+                      << sv::common::protocol::codec_name(chunk.codec) << ", file uses "
+                      << sv::common::protocol::codec_name(entry.record.codec) << '\n';
+            return {};
+        }
+        if (chunk.index == 0)
+        {
+            auto dictionary = frame_dictionary_locked(chunk);
+            if (!dictionary)
+            {
+                return {};
+            }
+            entry.record.dictionary = std::move(*dictionary);
+        }
+        // Streamed uploads only announce the chunk count on their final chunk; until then the record
+        // grows with the highest index seen.
+        if (chunk.total_chunks > 0)
+        {
+            entry.record.total_chunks = chunk.total_chunks;
+        }
+        if (entry.record.total_chunks > 0 && chunk.index >= entry.record.total_chunks)
+        {
+            std::clog << "[storage] chunk index " << chunk.index << " beyond announced total "
+                      << entry.record.total_chunks << " for " << chunk.file_id << '\n';
+            return {};
+        }
+        entry.record.chunk_files.resize(entry.record.total_chunks > 0
+                                            ? entry.record.total_chunks
+                                            : std::max(entry.record.chunk_files.size(), chunk.index + 1));
         entry.record.chunk_files[chunk.index] = patch_path;
         entry.received.insert(chunk.index);
+        if (content_hash)
+        {
+            const auto awaited = entry.awaited.find(*content_hash);
+            if (awaited != entry.awaited.end())
+            {
+                for (const auto position : awaited->second)
+                {
+                    entry.record.chunk_files[position] = patch_path;
+                    entry.received.insert(position);
+                }
+                entry.awaited.erase(awaited);
+            }
+        }
+        if (std::any_of(chunk.sha256.begin(), chunk.sha256.end(), [](std::uint8_t byte) { return byte != 0; }))
+        {
+            entry.record.sha256 = chunk.sha256;
+        }
         entry.last_update = now;
         entry.ttl = chunk.ttl.count() > 0 ? chunk.ttl
                                           : std::chrono::seconds{default_ttl_rep_.load()};
-        entry.state = entry.received.size() == entry.record.total_chunks ? "complete" : "partial";
+        const bool complete = is_complete(entry);
+        entry.state = complete ? "complete" : "partial";
 
         const auto received_chunks = entry.received.size();
         const auto total_chunks = entry.record.total_chunks;
@@ -134,35 +292,190 @@ public:
                                          : 0.0;
         std::ostringstream completeness_stream;
         completeness_stream << std::fixed << std::setprecision(1) << completeness;
-        std::clog << "[storage] chunk stored file=" << chunk.file_id << " index=" << chunk.index << '/' << total_chunks
+        const auto total_label = total_chunks > 0 ? std::to_string(total_chunks) : std::string{"?"};
+        std::clog << "[storage] chunk stored file=" << chunk.file_id << " index=" << chunk.index << '/' << total_label
                   << " size=" << chunk.payload.size() << "B completeness=" << received_chunks << '/'
-                  << total_chunks << " (" << completeness_stream.str() << "%)" << '\n';
+                  << total_label << " (" << completeness_stream.str() << "%)" << '\n';
+
+        persist_manifest(entry.record, entry);
+
+        StoreResult result;
+        result.stored = true;
+        if (complete)
+        {
+            // Only this caller assembles the file; copies of its patches that arrive meanwhile are
+            // acknowledged without being stored again.
+            entry.state = "assembling";
+            result.complete = entry.record;
+        }
+        return result;
+    }
+
+    // Starts (or restarts) a content-defined upload: positions whose chunk is already in the chunk store
+    // count as received right away, the rest are reported missing and arrive as ordinary patches.
+    RecipeResult register_recipe(const std::string& file_id,
+                                 const std::string& original_name,
+                                 const std::vector<ContentHash>& recipe)
+    {
+        RecipeResult result;
+        if (recipe.empty())
+        {
+            return result;
+        }
+
+        const auto manifest_dir = patches_dir_ / file_id;
+        std::error_code ec;
+        std::filesystem::create_directories(manifest_dir, ec);
+
+        std::lock_guard lock{mutex_};
+        auto& entry = payloads_[file_id];
+        if (settled(entry))
+        {
+            // Being assembled or already published: nothing is missing.
+            return result;
+        }
+        entry = PayloadEntry{};
+        entry.record.file_id = file_id;
+        entry.record.original_name = original_name;
+        entry.record.total_chunks = recipe.size();
+        entry.record.patches_dir = manifest_dir;
+        entry.record.files_dir = files_dir_;
+        entry.record.chunk_files.resize(recipe.size());
+        entry.recipe = recipe;
+        entry.last_update = std::chrono::system_clock::now();
+        entry.ttl = std::chrono::seconds{default_ttl_rep_.load()};
 
+        for (std::size_t index = 0; index < recipe.size(); ++index)
+        {
+            auto path = chunk_path(recipe[index]);
+            // Refreshing the mtime keeps a referenced chunk clear of the chunk store sweep.
+            if (::utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0)
+            {
+                entry.record.chunk_files[index] = std::move(path);
+                entry.received.insert(index);
+                continue;
+            }
+            // A chunk repeated within the file is requested once, at its first position.
+            auto& positions = entry.awaited[recipe[index]];
+            if (positions.empty())
+            {
+                result.missing.push_back(static_cast<std::uint32_t>(index));
+            }
+            positions.push_back(index);
+        }
+
+        const bool complete = is_complete(entry);
+        entry.state = complete ? "complete" : "partial";
+        std::clog << "[storage] recipe registered file=" << file_id << " chunks=" << recipe.size()
+                  << " stored=" << entry.received.size() << " missing=" << result.missing.size() << '\n';
         persist_manifest(entry.record, entry);
+        if (complete)
+        {
+            entry.state = "assembling";
+            result.complete = entry.record;
+        }
+        return result;
+    }
 
-        if (entry.received.size() == entry.record.total_chunks)
+    // Starts a delta upload whose patches, once complete, rebuild the file from `base`.
+    void register_delta(const std::string& file_id,
+                        const std::string& original_name,
+                        const std::filesystem::path& base)
+    {
+        const auto manifest_dir = patches_dir_ / file_id;
+        std::error_code ec;
+        std::filesystem::create_directories(manifest_dir, ec);
+
+        std::lock_guard lock{mutex_};
+        auto& entry = payloads_[file_id];
+        if (settled(entry))
         {
-            return entry.record;
+            return;
         }
+        entry = PayloadEntry{};
+        entry.record.file_id = file_id;
+        entry.record.original_name = original_name;
+        entry.record.patches_dir = manifest_dir;
+        entry.record.files_dir = files_dir_;
+        entry.record.delta_base = base;
+        entry.last_update = std::chrono::system_clock::now();
+        entry.ttl = std::chrono::seconds{default_ttl_rep_.load()};
+        std::clog << "[storage] delta registered file=" << file_id << " base=" << base << '\n';
+        persist_manifest(entry.record, entry);
+    }
 
-        return std::nullopt;
+    // Which patches of a fixed-size upload of `original_name` are already stored, for a client resuming
+    // it. Empty when there is no such upload in progress.
+    std::vector<bool> stored_patches(const std::string& file_id, const std::string& original_name) const
+    {
+        std::lock_guard lock{mutex_};
+        const auto it = payloads_.find(file_id);
+        if (it == payloads_.end() || it->second.record.original_name != original_name ||
+            !it->second.recipe.empty() || !it->second.record.delta_base.empty() || settled(it->second))
+        {
+            return {};
+        }
+        std::vector<bool> stored(it->second.record.chunk_files.size(), false);
+        for (const auto index : it->second.received)
+        {
+            stored[index] = true;
+        }
+        return stored;
     }
 
+    // The entry of a published file stays until its TTL runs out, so that late copies of its patches
+    // are acknowledged rather than taken for the start of a new upload.
     void mark_published(const std::string& file_id)
     {
         std::lock_guard lock{mutex_};
-        payloads_.erase(file_id);
+        const auto it = payloads_.find(file_id);
+        if (it != payloads_.end())
+        {
+            it->second.state = "published";
+            it->second.record.chunk_files.clear();
+            it->second.received.clear();
+            it->second.recipe.clear();
+            it->second.awaited.clear();
+            it->second.last_update = std::chrono::system_clock::now();
+        }
+        published_count_.fetch_add(1, std::memory_order_release);
     }
 
-    std::vector<PayloadRecord> ready_payloads() const
+    // Grows with every published file; a connection holding per-file state compares it with the count
+    // it last saw to know when to look for files that are done with.
+    std::uint64_t published_count() const noexcept { return published_count_.load(std::memory_order_acquire); }
+
+    // Whether the file is being assembled or already published, so that no more of its patches are needed.
+    bool finished(const std::string& file_id) const
+    {
+        std::lock_guard lock{mutex_};
+        const auto it = payloads_.find(file_id);
+        return it != payloads_.end() && settled(it->second);
+    }
+
+    // Lets a later copy of the file's patches try the assembly again.
+    void mark_assembly_failed(const std::string& file_id)
+    {
+        std::lock_guard lock{mutex_};
+        const auto it = payloads_.find(file_id);
+        if (it != payloads_.end() && it->second.state == "assembling")
+        {
+            it->second.state = "complete";
+        }
+    }
+
+    // Claims the complete payloads nobody is assembling, such as those a previous run acknowledged in
+    // full but stopped before assembling; the caller assembles them.
+    std::vector<PayloadRecord> ready_payloads()
     {
         std::lock_guard lock{mutex_};
         std::vector<PayloadRecord> ready;
         ready.reserve(payloads_.size());
-        for (const auto& [id, entry] : payloads_)
+        for (auto& [id, entry] : payloads_)
         {
-            if (entry.received.size() == entry.record.total_chunks)
+            if (!settled(entry) && is_complete(entry))
             {
+                entry.state = "assembling";
                 ready.push_back(entry.record);
             }
         }
@@ -176,13 +489,341 @@ public:
         for (auto& [_, entry] : payloads_)
         {
             entry.ttl = new_ttl;
-            persist_manifest(entry.record, entry);
+            // A published file's patches directory is gone.
+            if (entry.state != "published")
+            {
+                persist_manifest(entry.record, entry);
+            }
         }
     }
 
     void cleanup_expired(std::chrono::system_clock::time_point now)
     {
+        {
+            std::lock_guard lock{mutex_};
+            remove_expired_payloads_locked(now);
+        }
+        sweep_chunk_store(now);
+    }
+
+    const std::filesystem::path& patches_dir() const noexcept { return patches_dir_; }
+    const std::filesystem::path& files_dir() const noexcept { return files_dir_; }
+    const std::filesystem::path& chunks_dir() const noexcept { return chunks_dir_; }
+
+    // Keeps a trained zstd dictionary for decoding the uploads compressed with it. Returns false when
+    // `content` is not a dictionary with that id.
+    bool add_dictionary(std::uint32_t dict_id, std::span<const std::uint8_t> content)
+    {
+        if (dict_id == 0 || ZSTD_getDictID_fromDict(content.data(), content.size()) != dict_id)
+        {
+            std::clog << "[storage] rejecting dictionary " << dict_id << ": id does not match its content\n";
+            return false;
+        }
+        // Every data connection sends the dictionary; the first one to arrive writes the file.
+        std::lock_guard write_lock{dictionary_write_mutex_};
+        {
+            std::lock_guard lock{mutex_};
+            if (dictionaries_.contains(dict_id))
+            {
+                return true;
+            }
+        }
+
+        std::shared_ptr<const ZSTD_DDict> dictionary{ZSTD_createDDict(content.data(), content.size()), &ZSTD_freeDDict};
+        if (!dictionary)
+        {
+            std::clog << "[storage] failed to load dictionary " << dict_id << '\n';
+            return false;
+        }
+        const auto path = dicts_dir_ / (std::to_string(dict_id) + ".zdict");
+        if (!write_binary_file(path, std::as_bytes(content)))
+        {
+            std::clog << "[storage] failed to write dictionary " << path << '\n';
+            return false;
+        }
+
+        std::lock_guard lock{mutex_};
+        dictionaries_.emplace(dict_id, std::move(dictionary));
+        std::clog << "[storage] dictionary " << dict_id << " stored (" << content.size() << "B)" << '\n';
+        return true;
+    }
+
+    // Checks a patch that is consumed as it arrives instead of being stored, such as a pack, the way
+    // store_chunk checks the ones it stores. Returns the dictionary to decode it with, null for none,
+    // or std::nullopt when the patch is corrupt or needs a dictionary this server does not have.
+    std::optional<std::shared_ptr<const ZSTD_DDict>> verify_unstored(const ChunkData& chunk) const
+    {
+        if (!verify_crc(chunk))
+        {
+            std::clog << "[storage] CRC mismatch for chunk " << chunk.file_id << '#' << chunk.index
+                      << '\n';
+            return std::nullopt;
+        }
         std::lock_guard lock{mutex_};
+        return frame_dictionary_locked(chunk);
+    }
+
+private:
+    // zstd names the dictionary a frame needs in the frame header, at the start of patch 0.
+    std::optional<std::shared_ptr<const ZSTD_DDict>> frame_dictionary_locked(const ChunkData& chunk) const
+    {
+        if (chunk.codec != sv::common::protocol::Codec::Zstd)
+        {
+            return nullptr;
+        }
+        const auto dict_id = ZSTD_getDictID_fromFrame(chunk.payload.data(), chunk.payload.size());
+        if (dict_id == 0)
+        {
+            return nullptr;
+        }
+        const auto dictionary = dictionaries_.find(dict_id);
+        if (dictionary == dictionaries_.end())
+        {
+            std::clog << "[storage] chunk " << chunk.file_id << '#' << chunk.index << " needs unknown dictionary "
+                      << dict_id << '\n';
+            return std::nullopt;
+        }
+        return dictionary->second;
+    }
+
+    // ZSTD_FRAMEHEADERSIZE_MAX, which zstd.h only exposes to static linking.
+    static constexpr std::size_t max_frame_header_size = 18;
+
+    // Matches the client's upper bound for a content-defined chunk with plenty of headroom.
+    static constexpr std::uint64_t max_chunk_content_size = 64ULL * 1024ULL * 1024ULL;
+
+    struct PayloadEntry
+    {
+        PayloadRecord record;
+        std::set<std::size_t> received;
+        std::chrono::system_clock::time_point last_update{};
+        std::chrono::seconds ttl{0};
+        std::string state{"partial"};
+        std::vector<ContentHash> recipe;
+        // Recipe positions of each chunk not stored yet.
+        std::map<ContentHash, std::vector<std::size_t>> awaited;
+    };
+
+    // Being assembled or already published; its patches are not stored again.
+    static bool settled(const PayloadEntry& entry)
+    {
+        return entry.state == "assembling" || entry.state == "published";
+    }
+
+    static StoreResult duplicate_of_settled(const ChunkData& chunk)
+    {
+        std::clog << "[storage] chunk " << chunk.file_id << '#' << chunk.index
+                  << " belongs to a finished file, not stored again" << '\n';
+        StoreResult result;
+        result.stored = true;
+        return result;
+    }
+
+    static bool is_complete(const PayloadEntry& entry)
+    {
+        return entry.record.total_chunks > 0 && entry.received.size() == entry.record.total_chunks;
+    }
+
+    static std::string patch_file_name(std::size_t index)
+    {
+        return "patch_" + std::to_string(index) + ".bin";
+    }
+
+    std::filesystem::path chunk_path(const ContentHash& hash) const
+    {
+        static constexpr char digits[] = "0123456789abcdef";
+        std::string name;
+        name.reserve(hash.size() * 2 + 4);
+        for (const auto byte : hash)
+        {
+            name.push_back(digits[byte >> 4]);
+            name.push_back(digits[byte & 0x0F]);
+        }
+        auto fanout = name.substr(0, 2);
+        name += ".zst";
+        return chunks_dir_ / fanout / name;
+    }
+
+    // A content-defined chunk is a single zstd frame whose decompressed bytes must hash to its name;
+    // anything else would poison every later file that references the hash.
+    static bool verify_content(std::span<const std::byte> payload, const ContentHash& expected)
+    {
+        const auto content_size = ZSTD_getFrameContentSize(payload.data(), payload.size());
+        if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR ||
+            content_size > max_chunk_content_size ||
+            ZSTD_findFrameCompressedSize(payload.data(), payload.size()) != payload.size())
+        {
+            return false;
+        }
+        std::vector<std::uint8_t> content(static_cast<std::size_t>(content_size));
+        const auto size = ZSTD_decompress(content.data(), content.size(), payload.data(), payload.size());
+        if (ZSTD_isError(size) || size != content.size())
+        {
+            return false;
+        }
+        return sv::common::bytes::sha256(std::span<const std::uint8_t>(content)) == expected;
+    }
+
+    void load_dictionaries()
+    {
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it{dicts_dir_, ec}, end; !ec && it != end; it.increment(ec))
+        {
+            if (it->path().extension() != ".zdict")
+            {
+                continue;
+            }
+            std::ifstream in(it->path(), std::ios::binary);
+            const std::vector<char> content{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+            const auto dict_id = ZSTD_getDictID_fromDict(content.data(), content.size());
+            std::shared_ptr<const ZSTD_DDict> dictionary{ZSTD_createDDict(content.data(), content.size()),
+                                                         &ZSTD_freeDDict};
+            if (dict_id == 0 || !dictionary)
+            {
+                std::clog << "[storage] ignoring unreadable dictionary " << it->path() << '\n';
+                continue;
+            }
+            dictionaries_.emplace(dict_id, std::move(dictionary));
+        }
+        if (!dictionaries_.empty())
+        {
+            std::clog << "[storage] loaded " << dictionaries_.size() << " dictionaries" << '\n';
+        }
+    }
+
+    // Reloads the fixed-size uploads found under patches/ from their manifests and patch files. Content-
+    // defined and delta uploads depend on state that is not persisted and are discarded; their clients
+    // register them again.
+    void load_payloads()
+    {
+        std::error_code ec;
+        std::vector<std::filesystem::path> discarded;
+        for (std::filesystem::directory_iterator it{patches_dir_, ec}, end; !ec && it != end; it.increment(ec))
+        {
+            if (!it->is_directory())
+            {
+                continue;
+            }
+            auto entry = load_payload(it->path());
+            if (!entry)
+            {
+                discarded.push_back(it->path());
+                continue;
+            }
+            const auto file_id = entry->record.file_id;
+            payloads_.emplace(file_id, std::move(*entry));
+        }
+        for (const auto& path : discarded)
+        {
+            std::clog << "[storage] discarding unresumable payload " << path.filename() << '\n';
+            std::filesystem::remove_all(path, ec);
+        }
+        if (!payloads_.empty())
+        {
+            std::clog << "[storage] resumed " << payloads_.size() << " partial payloads" << '\n';
+        }
+    }
+
+    std::optional<PayloadEntry> load_payload(const std::filesystem::path& dir) const
+    {
+        std::ifstream in(dir / "ids.list", std::ios::binary);
+        std::string line;
+        if (!std::getline(in, line))
+        {
+            return std::nullopt;
+        }
+        // file_id,name,timestamp,ttl,state,total_chunks,codec,kind; the name may itself hold commas.
+        std::array<std::string, 6> tail;
+        for (auto field = tail.rbegin(); field != tail.rend(); ++field)
+        {
+            const auto comma = line.rfind(',');
+            if (comma == std::string::npos)
+            {
+                return std::nullopt;
+            }
+            *field = line.substr(comma + 1);
+            line.resize(comma);
+        }
+        const auto comma = line.find(',');
+        if (comma == std::string::npos || tail[5] != "patches" || line.substr(0, comma) != dir.filename().string())
+        {
+            return std::nullopt;
+        }
+
+        PayloadEntry entry;
+        entry.record.file_id = line.substr(0, comma);
+        entry.record.original_name = line.substr(comma + 1);
+        entry.record.patches_dir = dir;
+        entry.record.files_dir = files_dir_;
+        try
+        {
+            entry.last_update = std::chrono::system_clock::time_point{std::chrono::seconds{std::stoll(tail[0])}};
+            entry.ttl = std::chrono::seconds{std::stoll(tail[1])};
+            entry.record.total_chunks = static_cast<std::size_t>(std::stoull(tail[3]));
+            const auto codec = std::stoul(tail[4]);
+            if (codec > static_cast<unsigned long>(sv::common::protocol::Codec::Lz4))
+            {
+                return std::nullopt;
+            }
+            entry.record.codec = static_cast<sv::common::protocol::Codec>(codec);
+        }
+        catch (const std::exception&)
+        {
+            return std::nullopt;
+        }
+
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it{dir, ec}, end; !ec && it != end; it.increment(ec))
+        {
+            const auto name = it->path().filename().string();
+            if (!name.starts_with("patch_") || !name.ends_with(".bin"))
+            {
+                continue;
+            }
+            std::size_t index = 0;
+            const auto digits = std::string_view{name}.substr(6, name.size() - 10);
+            const auto parsed = std::from_chars(digits.data(), digits.data() + digits.size(), index);
+            if (parsed.ec != std::errc{} || parsed.ptr != digits.data() + digits.size() ||
+                (entry.record.total_chunks > 0 && index >= entry.record.total_chunks))
+            {
+                continue;
+            }
+            if (entry.record.chunk_files.size() <= index)
+            {
+                entry.record.chunk_files.resize(index + 1);
+            }
+            entry.record.chunk_files[index] = it->path();
+            entry.received.insert(index);
+        }
+        if (entry.record.total_chunks > 0)
+        {
+            entry.record.chunk_files.resize(entry.record.total_chunks);
+        }
+
+        // Patch 0 names the dictionary the file was compressed with.
+        if (entry.received.contains(0) && entry.record.codec == sv::common::protocol::Codec::Zstd)
+        {
+            std::array<char, max_frame_header_size> frame_header{};
+            std::ifstream patch(entry.record.chunk_files[0], std::ios::binary);
+            patch.read(frame_header.data(), static_cast<std::streamsize>(frame_header.size()));
+            const auto dict_id =
+                ZSTD_getDictID_fromFrame(frame_header.data(), static_cast<std::size_t>(patch.gcount()));
+            if (dict_id != 0)
+            {
+                const auto dictionary = dictionaries_.find(dict_id);
+                if (dictionary == dictionaries_.end())
+                {
+                    return std::nullopt;
+                }
+                entry.record.dictionary = dictionary->second;
+            }
+        }
+        entry.state = is_complete(entry) ? "complete" : "partial";
+        return entry;
+    }
+
+    void remove_expired_payloads_locked(std::chrono::system_clock::time_point now)
+    {
         for (auto it = payloads_.begin(); it != payloads_.end();)
         {
             const auto age = now - it->second.last_update;
@@ -205,42 +846,57 @@ public:
         }
     }
 
-    const std::filesystem::path& patches_dir() const noexcept { return patches_dir_; }
-    const std::filesystem::path& files_dir() const noexcept { return files_dir_; }
-
-private:
-    struct PayloadEntry
+    // Removes chunk store entries that no live recipe references and that have not been referenced
+    // for chunk_ttl. The store is walked without mutex_ held; each candidate is checked again under
+    // the lock before it is unlinked, since register_recipe refreshes the mtime of every chunk a
+    // recipe registered after the snapshot references.
+    void sweep_chunk_store(std::chrono::system_clock::time_point now)
     {
-        PayloadRecord record;
-        std::set<std::size_t> received;
-        std::chrono::system_clock::time_point last_update{};
-        std::chrono::seconds ttl{0};
-        std::string state{"partial"};
-    };
-
-    static std::string patch_file_name(std::size_t index)
-    {
-        return "patch_" + std::to_string(index) + ".bin";
-    }
+        std::set<std::filesystem::path> referenced;
+        {
+            std::lock_guard lock{mutex_};
+            for (const auto& [_, entry] : payloads_)
+            {
+                for (const auto& hash : entry.recipe)
+                {
+                    referenced.insert(chunk_path(hash));
+                }
+            }
+        }
 
-    static std::uint32_t crc32(std::span<const std::byte> data)
-    {
-        static constexpr std::uint32_t polynomial = 0xEDB88320u;
-        std::uint32_t crc = 0xFFFFFFFFu;
-        for (auto byte : data)
+        const auto cutoff = std::chrono::duration_cast<std::chrono::seconds>((now - chunk_ttl_).time_since_epoch());
+        const auto stale = [&](const std::filesystem::path& path) {
+            struct stat info{};
+            return ::stat(path.c_str(), &info) == 0 && info.st_mtime < cutoff.count();
+        };
+        std::error_code ec;
+        std::filesystem::recursive_directory_iterator it{chunks_dir_, ec};
+        for (; !ec && it != std::filesystem::recursive_directory_iterator{}; it.increment(ec))
         {
-            crc ^= static_cast<std::uint32_t>(byte);
-            for (int i = 0; i < 8; ++i)
+            const auto& path = it->path();
+            if (!it->is_regular_file() || referenced.contains(path) || !stale(path))
+            {
+                continue;
+            }
+            std::error_code remove_ec;
             {
-                const bool bit = crc & 1u;
-                crc >>= 1u;
-                if (bit)
+                std::lock_guard lock{mutex_};
+                if (!stale(path))
                 {
-                    crc ^= polynomial;
+                    continue;
                 }
+                std::filesystem::remove(path, remove_ec);
+            }
+            if (!remove_ec)
+            {
+                std::clog << "[storage] removed unreferenced chunk " << path.filename() << '\n';
             }
         }
-        return crc ^ 0xFFFFFFFFu;
+    }
+
+    static std::uint32_t crc32(std::span<const std::byte> data)
+    {
+        return sv::common::bytes::crc32(data.data(), data.size());
     }
 
     bool verify_crc(const ChunkData& chunk) const
@@ -264,7 +920,10 @@ private:
 
     static bool write_binary_file(const std::filesystem::path& path, std::span<const std::byte> data)
     {
-        const auto tmp_path = path.string() + ".tmp";
+        // A per-writer suffix keeps concurrent writers of the same path off each other's tmp file.
+        static std::atomic<std::uint64_t> next_tmp_id{0};
+        const auto tmp_path = path.string() + "." + std::to_string(::getpid()) + "." +
+                              std::to_string(next_tmp_id.fetch_add(1, std::memory_order_relaxed)) + ".tmp";
         const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
         if (fd < 0)
         {
@@ -309,6 +968,7 @@ private:
         {
             std::clog << "[storage] rename failed from " << tmp_path << " to " << path << ": "
                       << ec.message() << '\n';
+            ::unlink(tmp_path.c_str());
             return false;
         }
         return true;
@@ -331,8 +991,13 @@ private:
                              .count();
         const auto ttl = entry.ttl.count();
 
+        // The last three fields let a restarted server reload the upload; only fixed-size uploads are
+        // reloaded.
+        const auto kind = !entry.recipe.empty() ? "recipe" : !record.delta_base.empty() ? "delta" : "patches";
         const std::string line = record.file_id + ',' + record.original_name + ',' + std::to_string(ts) +
-                                 ',' + std::to_string(ttl) + ',' + entry.state + '\n';
+                                 ',' + std::to_string(ttl) + ',' + entry.state + ',' +
+                                 std::to_string(record.total_chunks) + ',' +
+                                 std::to_string(static_cast<unsigned>(record.codec)) + ',' + kind + '\n';
 
         const auto* raw = line.data();
         std::size_t remaining = line.size();
@@ -376,9 +1041,15 @@ private:
     std::filesystem::path root_;
     std::filesystem::path patches_dir_;
     std::filesystem::path files_dir_;
+    std::filesystem::path chunks_dir_;
+    std::filesystem::path dicts_dir_;
     std::unordered_map<std::string, PayloadEntry> payloads_;
+    std::mutex dictionary_write_mutex_;
+    std::map<std::uint32_t, std::shared_ptr<const ZSTD_DDict>> dictionaries_;
     mutable std::mutex mutex_;
     std::atomic<std::chrono::seconds::rep> default_ttl_rep_;
+    std::chrono::seconds chunk_ttl_;
+    std::atomic<std::uint64_t> published_count_{0};
 };
 
 } // namespace server
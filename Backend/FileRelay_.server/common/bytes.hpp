@@ -1,13 +1,31 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <bit>
 #include <cstdint>
+#include <cstring>
 #include <span>
 #include <stdexcept>
 #include <string_view>
 #include <type_traits>
 #include <vector>
 
+// x86 builds compile SIMD kernels for specific instruction sets and pick one at run time.
+#if defined(__x86_64__) || defined(_M_X64)
+#define SV_BYTES_X86_SIMD 1
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define SV_BYTES_TARGET(isa)
+#else
+#include <cpuid.h>
+#define SV_BYTES_TARGET(isa) __attribute__((target(isa)))
+#endif
+#include <immintrin.h>
+#else
+#define SV_BYTES_X86_SIMD 0
+#endif
+
 namespace sv::common::bytes {
 
 namespace detail {
@@ -27,17 +45,27 @@ constexpr std::uint32_t crc32_table_entry(std::uint32_t index) {
     return crc;
 }
 
-constexpr auto build_crc32_table() {
-    std::array<std::uint32_t, 256> table{};
-    for (std::uint32_t i = 0; i < table.size(); ++i) {
-        table[i] = crc32_table_entry(i);
+// tables[0] is the classic byte table; tables[k] advances a byte through k further zero bytes, which
+// lets slice-by-16 fold 16 input bytes per step.
+using Crc32Tables = std::array<std::array<std::uint32_t, 256>, 16>;
+
+constexpr Crc32Tables build_crc32_tables() {
+    Crc32Tables tables{};
+    for (std::uint32_t i = 0; i < 256; ++i) {
+        tables[0][i] = crc32_table_entry(i);
+    }
+    for (std::size_t k = 1; k < tables.size(); ++k) {
+        for (std::size_t i = 0; i < 256; ++i) {
+            const auto previous = tables[k - 1][i];
+            tables[k][i] = (previous >> 8) ^ tables[0][previous & 0xFFU];
+        }
     }
-    return table;
+    return tables;
 }
 
-inline const std::array<std::uint32_t, 256>& crc32_table() {
-    static const auto table = build_crc32_table();
-    return table;
+inline const Crc32Tables& crc32_tables() {
+    static const auto tables = build_crc32_tables();
+    return tables;
 }
 
 inline constexpr std::uint32_t rotr(std::uint32_t value, int bits) {
@@ -198,8 +226,174 @@ class ByteWriter {
     std::vector<std::uint8_t> buffer_{};
 };
 
+// --- CPU features -----------------------------------------------------------
+
+namespace detail {
+
+#if SV_BYTES_X86_SIMD
+
+struct CpuFeatures {
+    bool ssse3{false};
+    bool sse41{false};
+    bool pclmul{false};
+    bool avx2{false};
+    bool sha{false};
+};
+
+inline CpuFeatures detect_cpu_features() noexcept {
+    CpuFeatures features;
+    unsigned int regs1[4] = {};
+    unsigned int regs7[4] = {};
+#if defined(_MSC_VER)
+    int info[4] = {};
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    __cpuid(info, 1);
+    std::memcpy(regs1, info, sizeof(info));
+    if (max_leaf >= 7) {
+        __cpuidex(info, 7, 0);
+        std::memcpy(regs7, info, sizeof(info));
+    }
+#else
+    const unsigned int max_leaf = __get_cpuid_max(0, nullptr);
+    __get_cpuid(1, &regs1[0], &regs1[1], &regs1[2], &regs1[3]);
+    if (max_leaf >= 7) {
+        __cpuid_count(7, 0, regs7[0], regs7[1], regs7[2], regs7[3]);
+    }
+#endif
+    features.ssse3 = (regs1[2] & (1U << 9)) != 0;
+    features.sse41 = (regs1[2] & (1U << 19)) != 0;
+    features.pclmul = (regs1[2] & (1U << 1)) != 0;
+    features.avx2 = (regs7[1] & (1U << 5)) != 0;
+    features.sha = (regs7[1] & (1U << 29)) != 0;
+    return features;
+}
+
+inline const CpuFeatures& cpu_features() noexcept {
+    static const CpuFeatures features = detect_cpu_features();
+    return features;
+}
+
+#endif
+
+}  // namespace detail
+
 // --- CRC32 -----------------------------------------------------------------
 
+namespace detail {
+
+// Advances the pre-inverted CRC register over `size` bytes.
+using Crc32UpdateFn = std::uint32_t (*)(std::uint32_t crc, const std::uint8_t* data, std::size_t size) noexcept;
+
+inline std::uint32_t crc32_update_slice16(std::uint32_t crc, const std::uint8_t* data, std::size_t size) noexcept {
+    const auto& t = crc32_tables();
+    if constexpr (std::endian::native == std::endian::little) {
+        while (size >= 16) {
+            std::uint32_t words[4];
+            std::memcpy(words, data, sizeof(words));
+            words[0] ^= crc;
+            crc = t[15][words[0] & 0xFFU] ^ t[14][(words[0] >> 8) & 0xFFU] ^
+                  t[13][(words[0] >> 16) & 0xFFU] ^ t[12][words[0] >> 24] ^
+                  t[11][words[1] & 0xFFU] ^ t[10][(words[1] >> 8) & 0xFFU] ^
+                  t[9][(words[1] >> 16) & 0xFFU] ^ t[8][words[1] >> 24] ^
+                  t[7][words[2] & 0xFFU] ^ t[6][(words[2] >> 8) & 0xFFU] ^
+                  t[5][(words[2] >> 16) & 0xFFU] ^ t[4][words[2] >> 24] ^
+                  t[3][words[3] & 0xFFU] ^ t[2][(words[3] >> 8) & 0xFFU] ^
+                  t[1][(words[3] >> 16) & 0xFFU] ^ t[0][words[3] >> 24];
+            data += 16;
+            size -= 16;
+        }
+    }
+    for (; size > 0; --size, ++data) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFFU];
+    }
+    return crc;
+}
+
+#if SV_BYTES_X86_SIMD
+
+// Folds `lane` forward by the distance encoded in `k` and adds the next 16 input bytes.
+SV_BYTES_TARGET("pclmul,sse4.1")
+inline __m128i crc32_fold_lane(__m128i lane, __m128i k, __m128i next) noexcept {
+    const __m128i low = _mm_clmulepi64_si128(lane, k, 0x00);
+    const __m128i high = _mm_clmulepi64_si128(lane, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(high, low), next);
+}
+
+// Carry-less multiply folding (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ"):
+// four 128-bit lanes are folded 64 bytes at a time, reduced to one lane, then Barrett-reduced to
+// 32 bits. Constants are the bit-reflected ones for the IEEE polynomial.
+SV_BYTES_TARGET("pclmul,sse4.1")
+inline std::uint32_t crc32_update_pclmul(std::uint32_t crc, const std::uint8_t* data, std::size_t size) noexcept {
+    if (size < 64) {
+        return crc32_update_slice16(crc, data, size);
+    }
+
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596LL, 0x0154442bd4LL);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009eLL, 0x01751997d0LL);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124LL);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641LL, 0x01db710641LL);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    auto load = [](const std::uint8_t* at) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(at)); };
+
+    __m128i x1 = _mm_xor_si128(load(data), _mm_cvtsi32_si128(static_cast<int>(crc)));
+    __m128i x2 = load(data + 16);
+    __m128i x3 = load(data + 32);
+    __m128i x4 = load(data + 48);
+    data += 64;
+    size -= 64;
+
+    while (size >= 64) {
+        x1 = crc32_fold_lane(x1, k1k2, load(data));
+        x2 = crc32_fold_lane(x2, k1k2, load(data + 16));
+        x3 = crc32_fold_lane(x3, k1k2, load(data + 32));
+        x4 = crc32_fold_lane(x4, k1k2, load(data + 48));
+        data += 64;
+        size -= 64;
+    }
+
+    x1 = crc32_fold_lane(x1, k3k4, x2);
+    x1 = crc32_fold_lane(x1, k3k4, x3);
+    x1 = crc32_fold_lane(x1, k3k4, x4);
+
+    while (size >= 16) {
+        x1 = crc32_fold_lane(x1, k3k4, load(data));
+        data += 16;
+        size -= 16;
+    }
+
+    // 128 -> 64 bits.
+    __m128i x = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, k3k4, 0x10));
+    x = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x, low32), k5k0, 0x00), _mm_srli_si128(x, 4));
+
+    // Barrett reduction to 32 bits.
+    __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x, low32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), poly, 0x00);
+    crc = static_cast<std::uint32_t>(_mm_extract_epi32(_mm_xor_si128(x, t), 1));
+
+    return crc32_update_slice16(crc, data, size);
+}
+
+#endif
+
+inline Crc32UpdateFn select_crc32_update() noexcept {
+#if SV_BYTES_X86_SIMD
+    const auto& features = cpu_features();
+    if (features.pclmul && features.sse41) {
+        return &crc32_update_pclmul;
+    }
+#endif
+    return &crc32_update_slice16;
+}
+
+inline Crc32UpdateFn crc32_update() noexcept {
+    static const Crc32UpdateFn update = select_crc32_update();
+    return update;
+}
+
+}  // namespace detail
+
 class Crc32 {
   public:
     Crc32() { reset(); }
@@ -207,11 +401,7 @@ class Crc32 {
     void reset() noexcept { crc_ = 0xFFFFFFFFU; }
 
     void update(std::span<const std::uint8_t> data) noexcept {
-        const auto& table = detail::crc32_table();
-        for (auto byte : data) {
-            std::uint32_t idx = (crc_ ^ static_cast<std::uint32_t>(byte)) & 0xFFU;
-            crc_ = (crc_ >> 8) ^ table[idx];
-        }
+        crc_ = detail::crc32_update()(crc_, data.data(), data.size());
     }
 
     [[nodiscard]] std::uint32_t value() const noexcept { return crc_ ^ 0xFFFFFFFFU; }
@@ -237,6 +427,144 @@ inline std::uint32_t crc32(const std::string_view& sv) noexcept {
 
 // --- SHA-256 ----------------------------------------------------------------
 
+namespace detail {
+
+inline constexpr std::uint32_t sha256_k[64] = {
+    0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
+    0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
+    0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
+    0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
+    0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
+    0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
+    0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
+    0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u};
+
+// Compresses `blocks` consecutive 64-byte blocks into `state`.
+using Sha256CompressFn = void (*)(std::uint32_t* state, const std::uint8_t* data, std::size_t blocks) noexcept;
+
+inline void sha256_compress_scalar(std::uint32_t* state, const std::uint8_t* data, std::size_t blocks) noexcept {
+    for (; blocks > 0; --blocks, data += 64) {
+        std::uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (static_cast<std::uint32_t>(data[i * 4]) << 24) |
+                   (static_cast<std::uint32_t>(data[i * 4 + 1]) << 16) |
+                   (static_cast<std::uint32_t>(data[i * 4 + 2]) << 8) |
+                   (static_cast<std::uint32_t>(data[i * 4 + 3]));
+        }
+        for (int i = 16; i < 64; ++i) {
+            w[i] = small_sigma1(w[i - 2]) + w[i - 7] + small_sigma0(w[i - 15]) + w[i - 16];
+        }
+
+        std::uint32_t a = state[0];
+        std::uint32_t b = state[1];
+        std::uint32_t c = state[2];
+        std::uint32_t d = state[3];
+        std::uint32_t e = state[4];
+        std::uint32_t f = state[5];
+        std::uint32_t g = state[6];
+        std::uint32_t h = state[7];
+
+        for (int i = 0; i < 64; ++i) {
+            std::uint32_t temp1 = h + big_sigma1(e) + ch(e, f, g) + sha256_k[i] + w[i];
+            std::uint32_t temp2 = big_sigma0(a) + maj(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if SV_BYTES_X86_SIMD
+
+// SHA extensions (Intel Goldmont / Ice Lake and later, AMD Zen): two rounds per sha256rnds2 with
+// the message schedule computed by sha256msg1/msg2. The state is kept as ABEF/CDGH register pairs.
+SV_BYTES_TARGET("sha,sse4.1,ssse3")
+inline void sha256_compress_shani(std::uint32_t* state, const std::uint8_t* data, std::size_t blocks) noexcept {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state)), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4)), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += 64) {
+        const __m128i abef_save = abef;
+        const __m128i cdgh_save = cdgh;
+        __m128i w[4];
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC unroll 16
+#endif
+        for (int group = 0; group < 16; ++group) {
+            if (group < 4) {
+                w[group] = _mm_shuffle_epi8(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + group * 16)), byte_swap);
+            } else {
+                __m128i next = _mm_sha256msg1_epu32(w[group & 3], w[(group + 1) & 3]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(group + 3) & 3], w[(group + 2) & 3], 4));
+                w[group & 3] = _mm_sha256msg2_epu32(next, w[(group + 3) & 3]);
+            }
+
+            __m128i message = _mm_add_epi32(
+                w[group & 3], _mm_loadu_si128(reinterpret_cast<const __m128i*>(sha256_k + group * 4)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            message = _mm_shuffle_epi32(message, 0x0E);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, message);
+        }
+
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#endif
+
+struct Sha256Backend {
+    Sha256CompressFn compress;
+    const char* name;
+};
+
+inline Sha256Backend select_sha256_backend() noexcept {
+#if SV_BYTES_X86_SIMD
+    const auto& features = cpu_features();
+    if (features.sha && features.sse41 && features.ssse3) {
+        return {&sha256_compress_shani, "sha-ni"};
+    }
+#endif
+    return {&sha256_compress_scalar, "scalar"};
+}
+
+inline const Sha256Backend& sha256_backend() noexcept {
+    static const Sha256Backend backend = select_sha256_backend();
+    return backend;
+}
+
+}  // namespace detail
+
+// Name of the block function picked for this CPU, for start-up logs.
+inline const char* sha256_backend_name() noexcept {
+    return detail::sha256_backend().name;
+}
+
 class Sha256 {
   public:
     Sha256() { reset(); }
@@ -251,23 +579,49 @@ class Sha256 {
 
     void update(std::span<const std::uint8_t> data) noexcept {
         bit_length_ += static_cast<std::uint64_t>(data.size()) << 3U;
-        for (std::size_t i = 0; i < data.size(); ++i) {
-            buffer_[buffer_length_++] = data[i];
-            if (buffer_length_ == 64) {
-                process_block(buffer_.data());
-                buffer_length_ = 0;
+        const auto compress = detail::sha256_backend().compress;
+        const auto* ptr = data.data();
+        std::size_t remaining = data.size();
+
+        if (buffer_length_ > 0) {
+            const auto take = std::min(remaining, buffer_.size() - buffer_length_);
+            std::memcpy(buffer_.data() + buffer_length_, ptr, take);
+            buffer_length_ += take;
+            ptr += take;
+            remaining -= take;
+            if (buffer_length_ < buffer_.size()) {
+                return;
             }
+            compress(state_.data(), buffer_.data(), 1);
+            buffer_length_ = 0;
+        }
+
+        // Whole blocks are hashed straight from the caller's buffer.
+        if (const auto blocks = remaining / 64; blocks > 0) {
+            compress(state_.data(), ptr, blocks);
+            ptr += blocks * 64;
+            remaining -= blocks * 64;
+        }
+
+        if (remaining > 0) {
+            std::memcpy(buffer_.data(), ptr, remaining);
+            buffer_length_ = remaining;
         }
     }
 
+    void update(const void* data, std::size_t size) noexcept {
+        update(std::span<const std::uint8_t>(static_cast<const std::uint8_t*>(data), size));
+    }
+
     std::array<std::uint8_t, 32> finish() noexcept {
+        const auto compress = detail::sha256_backend().compress;
         const auto total_bits = bit_length_;
         buffer_[buffer_length_++] = 0x80U;
         if (buffer_length_ > 56) {
             while (buffer_length_ < 64) {
                 buffer_[buffer_length_++] = 0;
             }
-            process_block(buffer_.data());
+            compress(state_.data(), buffer_.data(), 1);
             buffer_length_ = 0;
         }
 
@@ -279,7 +633,7 @@ class Sha256 {
             buffer_[buffer_length_++] = static_cast<std::uint8_t>((total_bits >> shift) & 0xFFU);
         }
 
-        process_block(buffer_.data());
+        compress(state_.data(), buffer_.data(), 1);
 
         std::array<std::uint8_t, 32> digest{};
         for (std::size_t i = 0; i < state_.size(); ++i) {
@@ -300,60 +654,6 @@ class Sha256 {
     }
 
   private:
-    void process_block(const std::uint8_t* block) noexcept {
-        std::uint32_t w[64];
-        for (int i = 0; i < 16; ++i) {
-            w[i] = (static_cast<std::uint32_t>(block[i * 4]) << 24) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 1]) << 16) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 2]) << 8) |
-                   (static_cast<std::uint32_t>(block[i * 4 + 3]));
-        }
-        for (int i = 16; i < 64; ++i) {
-            w[i] = detail::small_sigma1(w[i - 2]) + w[i - 7] + detail::small_sigma0(w[i - 15]) + w[i - 16];
-        }
-
-        std::uint32_t a = state_[0];
-        std::uint32_t b = state_[1];
-        std::uint32_t c = state_[2];
-        std::uint32_t d = state_[3];
-        std::uint32_t e = state_[4];
-        std::uint32_t f = state_[5];
-        std::uint32_t g = state_[6];
-        std::uint32_t h = state_[7];
-
-        static constexpr std::uint32_t k[64] = {
-            0x428a2f98u, 0x71374491u, 0xb5c0fbcfu, 0xe9b5dba5u, 0x3956c25bu, 0x59f111f1u, 0x923f82a4u, 0xab1c5ed5u,
-            0xd807aa98u, 0x12835b01u, 0x243185beu, 0x550c7dc3u, 0x72be5d74u, 0x80deb1feu, 0x9bdc06a7u, 0xc19bf174u,
-            0xe49b69c1u, 0xefbe4786u, 0x0fc19dc6u, 0x240ca1ccu, 0x2de92c6fu, 0x4a7484aau, 0x5cb0a9dcu, 0x76f988dau,
-            0x983e5152u, 0xa831c66du, 0xb00327c8u, 0xbf597fc7u, 0xc6e00bf3u, 0xd5a79147u, 0x06ca6351u, 0x14292967u,
-            0x27b70a85u, 0x2e1b2138u, 0x4d2c6dfcu, 0x53380d13u, 0x650a7354u, 0x766a0abbu, 0x81c2c92eu, 0x92722c85u,
-            0xa2bfe8a1u, 0xa81a664bu, 0xc24b8b70u, 0xc76c51a3u, 0xd192e819u, 0xd6990624u, 0xf40e3585u, 0x106aa070u,
-            0x19a4c116u, 0x1e376c08u, 0x2748774cu, 0x34b0bcb5u, 0x391c0cb3u, 0x4ed8aa4au, 0x5b9cca4fu, 0x682e6ff3u,
-            0x748f82eeu, 0x78a5636fu, 0x84c87814u, 0x8cc70208u, 0x90befffau, 0xa4506cebu, 0xbef9a3f7u, 0xc67178f2u};
-
-        for (int i = 0; i < 64; ++i) {
-            std::uint32_t temp1 = h + detail::big_sigma1(e) + detail::ch(e, f, g) + k[i] + w[i];
-            std::uint32_t temp2 = detail::big_sigma0(a) + detail::maj(a, b, c);
-            h = g;
-            g = f;
-            f = e;
-            e = d + temp1;
-            d = c;
-            c = b;
-            b = a;
-            a = temp1 + temp2;
-        }
-
-        state_[0] += a;
-        state_[1] += b;
-        state_[2] += c;
-        state_[3] += d;
-        state_[4] += e;
-        state_[5] += f;
-        state_[6] += g;
-        state_[7] += h;
-    }
-
     std::array<std::uint32_t, 8> state_{};
     std::uint64_t bit_length_{};
     std::array<std::uint8_t, 64> buffer_{};
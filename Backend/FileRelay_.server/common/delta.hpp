@@ -0,0 +1,90 @@
+#pragma once
+
+#include "common/bytes.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace sv::common::delta {
+
+// A delta upload's payload, before compression, is an instruction stream that rebuilds the new file
+// from the server's current copy (the base):
+//
+//   header  : magic "SVD1" | u32 block_size | u64 base_size
+//   Literal : u8 1 | u32 length | length bytes
+//   Copy    : u8 2 | u32 first_block | u32 block_count   (base bytes [first_block * block_size, ...))
+//   End     : u8 0 | 32-byte SHA-256 of the rebuilt file
+//
+// All integers are little-endian. The server checks the rebuilt file against the End digest, so a base
+// that changed since its signatures were taken is detected rather than silently mixed in.
+inline constexpr std::array<char, 4> Magic = {'S', 'V', 'D', '1'};
+inline constexpr std::size_t HeaderSize = 16;
+inline constexpr std::size_t LiteralPrefixSize = 5;
+inline constexpr std::size_t CopySize = 9;
+inline constexpr std::size_t EndSize = 33;
+
+enum class Op : std::uint8_t {
+    End = 0,
+    Literal = 1,
+    Copy = 2,
+};
+
+inline constexpr std::uint32_t MinBlockSize = 4 * 1024;
+inline constexpr std::uint32_t MaxBlockSize = 16 * 1024 * 1024;
+// Keeps a signature list inside one SystemFrame.
+inline constexpr std::uint64_t MaxBlocks = 256 * 1024;
+
+// Block size the server uses for a base of `base_size` bytes when `requested` is asked for.
+inline std::uint32_t effective_block_size(std::uint32_t requested, std::uint64_t base_size) {
+    std::uint64_t block_size = std::clamp(requested, MinBlockSize, MaxBlockSize);
+    while (base_size / block_size > MaxBlocks && block_size < MaxBlockSize) {
+        block_size *= 2;
+    }
+    return static_cast<std::uint32_t>(std::min<std::uint64_t>(block_size, MaxBlockSize));
+}
+
+// rsync's weak checksum: two 16-bit sums over a fixed window that can slide by one byte in O(1).
+class RollingChecksum {
+  public:
+    void reset(std::span<const std::uint8_t> window) noexcept {
+        a_ = 0;
+        b_ = 0;
+        length_ = static_cast<std::uint32_t>(window.size());
+        for (std::size_t i = 0; i < window.size(); ++i) {
+            a_ += window[i];
+            b_ += static_cast<std::uint32_t>(window.size() - i) * window[i];
+        }
+    }
+
+    // Slides the window one byte: `out` leaves at the front, `in` enters at the back.
+    void roll(std::uint8_t out, std::uint8_t in) noexcept {
+        a_ += static_cast<std::uint32_t>(in) - out;
+        b_ += a_ - length_ * out;
+    }
+
+    std::uint32_t value() const noexcept { return (a_ & 0xFFFFU) | (b_ << 16); }
+
+  private:
+    std::uint32_t a_{0};
+    std::uint32_t b_{0};
+    std::uint32_t length_{0};
+};
+
+inline std::uint32_t weak_checksum(std::span<const std::uint8_t> block) noexcept {
+    RollingChecksum checksum;
+    checksum.reset(block);
+    return checksum.value();
+}
+
+// Truncated SHA-256; only consulted after the weak checksum matched.
+inline std::array<std::uint8_t, 16> strong_hash(std::span<const std::uint8_t> block) {
+    const auto digest = bytes::sha256(block);
+    std::array<std::uint8_t, 16> strong{};
+    std::copy_n(digest.begin(), strong.size(), strong.begin());
+    return strong;
+}
+
+}  // namespace sv::common::delta
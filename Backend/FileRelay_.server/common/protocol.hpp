@@ -19,10 +19,43 @@ namespace sv::common::protocol {
 using bytes::ByteReader;
 using bytes::ByteWriter;
 
+// How a file's upload payload is encoded. Every patch of a file carries the same codec.
+enum class Codec : std::uint8_t {
+    Zstd = 0,
+    // Raw file bytes; the server writes them out without decoding.
+    Stored = 1,
+    // LZ4 frame format.
+    Lz4 = 2,
+};
+
+[[nodiscard]] constexpr bool is_known_codec(std::uint8_t value) noexcept {
+    return value <= static_cast<std::uint8_t>(Codec::Lz4);
+}
+
+[[nodiscard]] constexpr std::string_view codec_name(Codec codec) noexcept {
+    switch (codec) {
+    case Codec::Stored:
+        return "stored";
+    case Codec::Lz4:
+        return "lz4";
+    default:
+        return "zstd";
+    }
+}
+
+// Version 2 appends the payload codec (u8 codec | 3 reserved zero bytes) to the 40-byte version 1
+// layout; version 1 payloads are always zstd. Version 3 keeps the version 2 layout; a server that
+// negotiated it answers every patch with a PatchAck system frame.
 struct PatchHeader {
     static constexpr std::array<char, 4> Magic = {'S', 'V', 'P', '1'};
-    static constexpr std::uint32_t Version = 1;
-    static constexpr std::size_t EncodedSize = 40;
+    static constexpr std::uint32_t Version = 3;
+    // First version whose patches are acknowledged.
+    static constexpr std::uint32_t AckVersion = 3;
+    // Oldest header version this build still accepts; the data channel handshake settles on one
+    // version in [MinVersion, Version] per connection.
+    static constexpr std::uint32_t MinVersion = 1;
+    static constexpr std::size_t EncodedSize = 44;
+    static constexpr std::size_t V1EncodedSize = 40;
 
     std::uint32_t version{Version};
     std::uint32_t header_size{static_cast<std::uint32_t>(EncodedSize)};
@@ -32,6 +65,20 @@ struct PatchHeader {
     std::uint32_t payload_size{};
     std::uint32_t header_crc32{};
     std::uint32_t payload_crc32{};
+    Codec codec{Codec::Zstd};
+
+    [[nodiscard]] static constexpr std::size_t encoded_size(std::uint32_t version) noexcept {
+        return version >= 2 ? EncodedSize : V1EncodedSize;
+    }
+
+    // Bytes this header occupies on the wire; the tail of serialize()'s array beyond it is unused.
+    [[nodiscard]] std::size_t size() const noexcept { return encoded_size(version); }
+
+    // Moves the header to another version, e.g. the one a connection negotiated.
+    void set_version(std::uint32_t new_version) noexcept {
+        version = new_version;
+        header_size = static_cast<std::uint32_t>(encoded_size(new_version));
+    }
 
     [[nodiscard]] std::array<std::uint8_t, EncodedSize> serialize(bool include_header_crc = true) const {
         std::array<std::uint8_t, EncodedSize> out{};
@@ -54,12 +101,16 @@ struct PatchHeader {
         bytes::write_u32_le(header_crc, out.data() + offset);
         offset += 4;
         bytes::write_u32_le(payload_crc32, out.data() + offset);
+        offset += 4;
+        if (version >= 2) {
+            out[offset] = static_cast<std::uint8_t>(codec);
+        }
         return out;
     }
 
     [[nodiscard]] std::uint32_t compute_header_crc32() const {
         auto buffer = serialize(false);
-        return bytes::crc32(std::span<const std::uint8_t>(buffer));
+        return bytes::crc32(std::span<const std::uint8_t>(buffer.data(), size()));
     }
 
     void finalize_header_crc() {
@@ -67,16 +118,16 @@ struct PatchHeader {
     }
 
     void validate() const {
-        if (version != Version) {
+        if (version < MinVersion || version > Version) {
             throw std::runtime_error("Unsupported patch header version");
         }
-        if (header_size != EncodedSize) {
+        if (header_size != encoded_size(version)) {
             throw std::runtime_error("Unexpected patch header size");
         }
     }
 
     static PatchHeader deserialize(std::span<const std::uint8_t> data) {
-        if (data.size() < EncodedSize) {
+        if (data.size() < V1EncodedSize) {
             throw std::runtime_error("PatchHeader::deserialize: insufficient data");
         }
         PatchHeader header;
@@ -99,8 +150,22 @@ struct PatchHeader {
         header.header_crc32 = bytes::read_le<std::uint32_t>(data, offset);
         offset += 4;
         header.payload_crc32 = bytes::read_le<std::uint32_t>(data, offset);
+        offset += 4;
 
         header.validate();
+        if (data.size() < header.size()) {
+            throw std::runtime_error("PatchHeader::deserialize: insufficient data");
+        }
+        if (header.version >= 2) {
+            if (!is_known_codec(data[offset])) {
+                throw std::runtime_error("Unknown patch payload codec");
+            }
+            header.codec = static_cast<Codec>(data[offset]);
+            // A sender that sets the reserved bytes speaks a layout this build does not know.
+            if (data[offset + 1] != 0 || data[offset + 2] != 0 || data[offset + 3] != 0) {
+                throw std::runtime_error("Patch header reserved bytes are not zero");
+            }
+        }
         auto expected_crc = header.compute_header_crc32();
         if (expected_crc != header.header_crc32) {
             throw std::runtime_error("Patch header CRC mismatch");
@@ -120,11 +185,63 @@ inline std::array<std::uint8_t, PatchHeader::EncodedSize> encode_patch_header(co
     return out;
 }
 
+// First frame on every data connection, sent by the client and echoed by the server. The client
+// offers its supported [min_version, max_version]; the server answers with min == max == the chosen
+// version, or with zeros when the ranges do not overlap and the connection is about to be closed.
+struct VersionHello {
+    static constexpr std::array<char, 4> Magic = {'S', 'V', 'H', '1'};
+    static constexpr std::size_t EncodedSize = 12;
+
+    std::uint32_t min_version{PatchHeader::MinVersion};
+    std::uint32_t max_version{PatchHeader::Version};
+
+    [[nodiscard]] std::array<std::uint8_t, EncodedSize> serialize() const {
+        std::array<std::uint8_t, EncodedSize> out{};
+        std::memcpy(out.data(), Magic.data(), Magic.size());
+        bytes::write_u32_le(min_version, out.data() + 4);
+        bytes::write_u32_le(max_version, out.data() + 8);
+        return out;
+    }
+
+    static VersionHello deserialize(std::span<const std::uint8_t> data) {
+        if (data.size() < EncodedSize) {
+            throw std::runtime_error("VersionHello::deserialize: insufficient data");
+        }
+        if (!std::equal(Magic.begin(), Magic.end(), data.begin())) {
+            throw std::runtime_error("Invalid version hello magic");
+        }
+        VersionHello hello;
+        hello.min_version = bytes::read_le<std::uint32_t>(data, 4);
+        hello.max_version = bytes::read_le<std::uint32_t>(data, 8);
+        return hello;
+    }
+
+    // Highest version both sides support, or 0 when there is none.
+    [[nodiscard]] static std::uint32_t negotiate(const VersionHello& local, const VersionHello& remote) noexcept {
+        const auto low = std::max(local.min_version, remote.min_version);
+        const auto high = std::min(local.max_version, remote.max_version);
+        return low <= high ? high : 0U;
+    }
+
+    [[nodiscard]] static VersionHello accept(std::uint32_t version) noexcept {
+        return VersionHello{version, version};
+    }
+};
+
 enum class SystemMessageType : std::uint16_t {
     QueueSizeUpdate = 1,
     FileMeta = 2,
     FilePatchMap = 3,
     Control = 4,
+    ChunkRecipe = 5,
+    MissingChunks = 6,
+    SignatureRequest = 7,
+    BlockSignatures = 8,
+    Dictionary = 9,
+    PackIndex = 10,
+    PatchAck = 11,
+    ResumeQuery = 12,
+    StoredPatches = 13,
 };
 
 struct QueueSizeUpdateMessage {
@@ -149,7 +266,96 @@ struct ControlMessage {
     std::uint32_t value_seconds{};
 };
 
-using SystemPayload = std::variant<QueueSizeUpdateMessage, FileMetaMessage, FilePatchMapMessage, ControlMessage>;
+using ChunkHash = std::array<std::uint8_t, 32>;
+
+// Content-defined upload: the ordered SHA-256 ids of a file's uncompressed chunks. Patch N of the file
+// carries the compressed bytes of chunk_hashes[N]; the server answers with MissingChunksMessage.
+struct ChunkRecipeMessage {
+    std::uint64_t file_id{};
+    std::vector<ChunkHash> chunk_hashes;
+};
+
+// Recipe positions whose chunk the server does not store yet, in ascending order.
+struct MissingChunksMessage {
+    std::uint64_t file_id{};
+    std::vector<std::uint32_t> indices;
+};
+
+// Delta upload: asks for the signatures of the server's current copy of the announced file.
+struct SignatureRequestMessage {
+    std::uint64_t file_id{};
+    std::uint32_t block_size{};
+};
+
+struct BlockSignature {
+    std::uint32_t weak{};
+    std::array<std::uint8_t, 16> strong{};
+};
+
+// One signature per full block of the server's copy; empty when it has no copy. The server may pick a
+// larger block size than requested to keep the list bounded.
+struct BlockSignaturesMessage {
+    std::uint64_t file_id{};
+    std::uint32_t block_size{};
+    std::uint64_t base_size{};
+    std::vector<BlockSignature> blocks;
+};
+
+// A trained zstd dictionary, sent on each data connection before any patch compressed with it. zstd
+// frames name the dictionary they need by dict_id, which is the id ZDICT stored in the content.
+struct DictionaryMessage {
+    std::uint32_t dict_id{};
+    std::vector<std::uint8_t> content;
+};
+
+struct PackEntry {
+    std::string utf8_name;
+    std::uint64_t offset{};
+    std::uint64_t size{};
+    std::array<std::uint8_t, 32> sha256{};
+};
+
+// Announces a pack: many small files sent as one single-patch upload under pack_id, in place of a
+// FileMeta per file. The patch payload decodes to the files' contents; each entry names the range
+// [offset, offset + size) of it that holds one file.
+struct PackIndexMessage {
+    // Upper bound on the decoded contents of one pack; the server refuses larger packs.
+    static constexpr std::uint64_t MaxContentSize = 256ULL * 1024ULL * 1024ULL;
+
+    std::uint64_t pack_id{};
+    std::vector<PackEntry> entries;
+};
+
+enum class PatchStatus : std::uint8_t {
+    Stored = 0,
+    Rejected = 1,
+};
+
+// The server's answer to one patch, sent once the patch is durably stored or has been refused (bad
+// CRC, unknown dictionary, ...). A rejected patch may be sent again. Acks follow patch order.
+struct PatchAckMessage {
+    std::uint64_t file_id{};
+    std::uint32_t patch_index{};
+    PatchStatus status{PatchStatus::Stored};
+};
+
+// Resumable upload: asks which patches of the announced file the server already stores from an
+// earlier, interrupted upload of the same file version.
+struct ResumeQueryMessage {
+    std::uint64_t file_id{};
+};
+
+// stored[N] says whether patch N is stored; patches past the end are not. On the wire: u32 bit count,
+// then the bits LSB first, padded to whole bytes.
+struct StoredPatchesMessage {
+    std::uint64_t file_id{};
+    std::vector<bool> stored;
+};
+
+using SystemPayload = std::variant<QueueSizeUpdateMessage, FileMetaMessage, FilePatchMapMessage, ControlMessage,
+                                   ChunkRecipeMessage, MissingChunksMessage, SignatureRequestMessage,
+                                   BlockSignaturesMessage, DictionaryMessage, PackIndexMessage, PatchAckMessage,
+                                   ResumeQueryMessage, StoredPatchesMessage>;
 
 struct SystemMessage {
     SystemMessageType type{};
@@ -178,6 +384,61 @@ inline std::vector<std::uint8_t> encode_system_message(const SystemMessage& mess
                 const std::uint8_t command_byte = static_cast<std::uint8_t>(payload.command);
                 writer.write_bytes(std::span<const std::uint8_t>(&command_byte, 1));
                 writer.write(payload.value_seconds);
+            } else if constexpr (std::is_same_v<T, ChunkRecipeMessage>) {
+                writer.write(payload.file_id);
+                writer.write(static_cast<std::uint32_t>(payload.chunk_hashes.size()));
+                for (const auto& hash : payload.chunk_hashes) {
+                    writer.write_bytes(std::span<const std::uint8_t>(hash.data(), hash.size()));
+                }
+            } else if constexpr (std::is_same_v<T, MissingChunksMessage>) {
+                writer.write(payload.file_id);
+                writer.write(static_cast<std::uint32_t>(payload.indices.size()));
+                for (const auto index : payload.indices) {
+                    writer.write(index);
+                }
+            } else if constexpr (std::is_same_v<T, SignatureRequestMessage>) {
+                writer.write(payload.file_id);
+                writer.write(payload.block_size);
+            } else if constexpr (std::is_same_v<T, BlockSignaturesMessage>) {
+                writer.write(payload.file_id);
+                writer.write(payload.block_size);
+                writer.write(payload.base_size);
+                writer.write(static_cast<std::uint32_t>(payload.blocks.size()));
+                for (const auto& block : payload.blocks) {
+                    writer.write(block.weak);
+                    writer.write_bytes(std::span<const std::uint8_t>(block.strong.data(), block.strong.size()));
+                }
+            } else if constexpr (std::is_same_v<T, DictionaryMessage>) {
+                writer.write(payload.dict_id);
+                writer.write(static_cast<std::uint32_t>(payload.content.size()));
+                writer.write_bytes(std::span<const std::uint8_t>(payload.content.data(), payload.content.size()));
+            } else if constexpr (std::is_same_v<T, PackIndexMessage>) {
+                writer.write(payload.pack_id);
+                writer.write(static_cast<std::uint32_t>(payload.entries.size()));
+                for (const auto& entry : payload.entries) {
+                    writer.write(static_cast<std::uint32_t>(entry.utf8_name.size()));
+                    writer.write_bytes(std::span<const std::uint8_t>(reinterpret_cast<const std::uint8_t*>(entry.utf8_name.data()), entry.utf8_name.size()));
+                    writer.write(entry.offset);
+                    writer.write(entry.size);
+                    writer.write_bytes(std::span<const std::uint8_t>(entry.sha256.data(), entry.sha256.size()));
+                }
+            } else if constexpr (std::is_same_v<T, PatchAckMessage>) {
+                writer.write(payload.file_id);
+                writer.write(payload.patch_index);
+                const std::uint8_t status_byte = static_cast<std::uint8_t>(payload.status);
+                writer.write_bytes(std::span<const std::uint8_t>(&status_byte, 1));
+            } else if constexpr (std::is_same_v<T, ResumeQueryMessage>) {
+                writer.write(payload.file_id);
+            } else if constexpr (std::is_same_v<T, StoredPatchesMessage>) {
+                writer.write(payload.file_id);
+                writer.write(static_cast<std::uint32_t>(payload.stored.size()));
+                std::vector<std::uint8_t> bits((payload.stored.size() + 7) / 8);
+                for (std::size_t index = 0; index < payload.stored.size(); ++index) {
+                    if (payload.stored[index]) {
+                        bits[index / 8] |= static_cast<std::uint8_t>(1U << (index % 8));
+                    }
+                }
+                writer.write_bytes(std::span<const std::uint8_t>(bits));
             }
         },
         message.payload);
@@ -206,6 +467,98 @@ inline ControlMessage decode_control(ByteReader& reader) {
     return msg;
 }
 
+inline ChunkRecipeMessage decode_chunk_recipe(ByteReader& reader) {
+    ChunkRecipeMessage recipe;
+    recipe.file_id = reader.read<std::uint64_t>();
+    const auto count = reader.read<std::uint32_t>();
+    if (reader.remaining() / ChunkHash{}.size() < count) {
+        throw std::runtime_error("Chunk recipe truncated");
+    }
+    recipe.chunk_hashes.resize(count);
+    for (auto& hash : recipe.chunk_hashes) {
+        const auto bytes = reader.read_bytes(hash.size());
+        std::copy(bytes.begin(), bytes.end(), hash.begin());
+    }
+    return recipe;
+}
+
+inline MissingChunksMessage decode_missing_chunks(ByteReader& reader) {
+    MissingChunksMessage missing;
+    missing.file_id = reader.read<std::uint64_t>();
+    const auto count = reader.read<std::uint32_t>();
+    if (reader.remaining() / sizeof(std::uint32_t) < count) {
+        throw std::runtime_error("Missing chunk list truncated");
+    }
+    missing.indices.resize(count);
+    for (auto& index : missing.indices) {
+        index = reader.read<std::uint32_t>();
+    }
+    return missing;
+}
+
+inline StoredPatchesMessage decode_stored_patches(ByteReader& reader) {
+    StoredPatchesMessage patches;
+    patches.file_id = reader.read<std::uint64_t>();
+    const auto count = reader.read<std::uint32_t>();
+    if (reader.remaining() < (static_cast<std::size_t>(count) + 7) / 8) {
+        throw std::runtime_error("Stored patch bitmap truncated");
+    }
+    const auto bits = reader.read_bytes((static_cast<std::size_t>(count) + 7) / 8);
+    patches.stored.resize(count);
+    for (std::size_t index = 0; index < count; ++index) {
+        patches.stored[index] = (bits[index / 8] >> (index % 8)) & 1U;
+    }
+    return patches;
+}
+
+inline BlockSignaturesMessage decode_block_signatures(ByteReader& reader) {
+    BlockSignaturesMessage signatures;
+    signatures.file_id = reader.read<std::uint64_t>();
+    signatures.block_size = reader.read<std::uint32_t>();
+    signatures.base_size = reader.read<std::uint64_t>();
+    const auto count = reader.read<std::uint32_t>();
+    if (reader.remaining() / (sizeof(std::uint32_t) + BlockSignature{}.strong.size()) < count) {
+        throw std::runtime_error("Block signature list truncated");
+    }
+    signatures.blocks.resize(count);
+    for (auto& block : signatures.blocks) {
+        block.weak = reader.read<std::uint32_t>();
+        const auto strong = reader.read_bytes(block.strong.size());
+        std::copy(strong.begin(), strong.end(), block.strong.begin());
+    }
+    return signatures;
+}
+
+inline DictionaryMessage decode_dictionary(ByteReader& reader) {
+    DictionaryMessage dictionary;
+    dictionary.dict_id = reader.read<std::uint32_t>();
+    const auto size = reader.read<std::uint32_t>();
+    const auto content = reader.read_bytes(size);
+    dictionary.content.assign(content.begin(), content.end());
+    return dictionary;
+}
+
+inline PackIndexMessage decode_pack_index(ByteReader& reader) {
+    PackIndexMessage pack;
+    pack.pack_id = reader.read<std::uint64_t>();
+    const auto count = reader.read<std::uint32_t>();
+    // Every entry takes at least its name length, offset, size and hash.
+    if (reader.remaining() / (sizeof(std::uint32_t) + 2 * sizeof(std::uint64_t) + 32) < count) {
+        throw std::runtime_error("Pack index truncated");
+    }
+    pack.entries.resize(count);
+    for (auto& entry : pack.entries) {
+        const auto name_size = reader.read<std::uint32_t>();
+        const auto name_bytes = reader.read_bytes(name_size);
+        entry.utf8_name.assign(reinterpret_cast<const char*>(name_bytes.data()), name_bytes.size());
+        entry.offset = reader.read<std::uint64_t>();
+        entry.size = reader.read<std::uint64_t>();
+        const auto hash_bytes = reader.read_bytes(entry.sha256.size());
+        std::copy(hash_bytes.begin(), hash_bytes.end(), entry.sha256.begin());
+    }
+    return pack;
+}
+
 inline SystemMessage decode_system_message(std::span<const std::uint8_t> data) {
     ByteReader reader(data);
     SystemMessage message;
@@ -232,11 +585,100 @@ inline SystemMessage decode_system_message(std::span<const std::uint8_t> data) {
             message.payload = decode_control(reader);
             break;
         }
+        case SystemMessageType::ChunkRecipe: {
+            message.payload = decode_chunk_recipe(reader);
+            break;
+        }
+        case SystemMessageType::MissingChunks: {
+            message.payload = decode_missing_chunks(reader);
+            break;
+        }
+        case SystemMessageType::SignatureRequest: {
+            SignatureRequestMessage payload;
+            payload.file_id = reader.read<std::uint64_t>();
+            payload.block_size = reader.read<std::uint32_t>();
+            message.payload = payload;
+            break;
+        }
+        case SystemMessageType::BlockSignatures: {
+            message.payload = decode_block_signatures(reader);
+            break;
+        }
+        case SystemMessageType::Dictionary: {
+            message.payload = decode_dictionary(reader);
+            break;
+        }
+        case SystemMessageType::PackIndex: {
+            message.payload = decode_pack_index(reader);
+            break;
+        }
+        case SystemMessageType::PatchAck: {
+            PatchAckMessage payload;
+            payload.file_id = reader.read<std::uint64_t>();
+            payload.patch_index = reader.read<std::uint32_t>();
+            const auto status = reader.read_bytes(1)[0];
+            if (status > static_cast<std::uint8_t>(PatchStatus::Rejected)) {
+                throw std::runtime_error("Unknown patch status");
+            }
+            payload.status = static_cast<PatchStatus>(status);
+            message.payload = payload;
+            break;
+        }
+        case SystemMessageType::ResumeQuery: {
+            ResumeQueryMessage payload;
+            payload.file_id = reader.read<std::uint64_t>();
+            message.payload = payload;
+            break;
+        }
+        case SystemMessageType::StoredPatches: {
+            message.payload = decode_stored_patches(reader);
+            break;
+        }
         default:
             throw std::runtime_error("Unknown system message type");
     }
     return message;
 }
 
+// System messages carried in-band on the data channel, e.g. the FileMeta that names a file before its
+// first patch on a connection. Layout: magic | u32 body size | encode_system_message() | u32 crc32(body).
+// The magic shares its length with PatchHeader::Magic so a reader can dispatch on the first 4 bytes.
+struct SystemFrame {
+    static constexpr std::array<char, 4> Magic = {'S', 'V', 'M', '1'};
+    static constexpr std::size_t PrefixSize = 8;
+    static constexpr std::size_t TrailerSize = 4;
+    // Large enough for the chunk recipe or block signatures of a multi-gigabyte file.
+    static constexpr std::uint32_t MaxBodySize = 8 * 1024 * 1024;
+
+    static std::vector<std::uint8_t> encode(const SystemMessage& message) {
+        const auto body = encode_system_message(message);
+        if (body.size() > MaxBodySize) {
+            throw std::runtime_error("System frame too large");
+        }
+        std::vector<std::uint8_t> frame(PrefixSize + body.size() + TrailerSize);
+        std::memcpy(frame.data(), Magic.data(), Magic.size());
+        bytes::write_u32_le(static_cast<std::uint32_t>(body.size()), frame.data() + 4);
+        std::copy(body.begin(), body.end(), frame.begin() + PrefixSize);
+        bytes::write_u32_le(bytes::crc32(std::span<const std::uint8_t>(body)), frame.data() + PrefixSize + body.size());
+        return frame;
+    }
+
+    // `body_and_trailer` holds the body followed by its CRC, as read after the prefix.
+    static SystemMessage decode(std::span<const std::uint8_t> body_and_trailer) {
+        if (body_and_trailer.size() < TrailerSize) {
+            throw std::runtime_error("SystemFrame::decode: insufficient data");
+        }
+        const auto body = body_and_trailer.first(body_and_trailer.size() - TrailerSize);
+        if (bytes::crc32(body) != bytes::read_u32_le(body_and_trailer.data() + body.size())) {
+            throw std::runtime_error("System frame CRC mismatch");
+        }
+        return decode_system_message(body);
+    }
+};
+
+inline bool is_magic(std::span<const std::uint8_t> data, const std::array<char, 4>& magic) {
+    return data.size() >= magic.size() && std::equal(magic.begin(), magic.end(), data.begin());
+}
+
 }  // namespace sv::common::protocol
 